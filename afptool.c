@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -6,37 +9,453 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <ftw.h>
+#include <inttypes.h>
+
+#include <poll.h>
+#include <pthread.h>
 
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <zlib.h>
+
 #include "rkcrc.h"
 #include "rkafp.h"
+#include "rkbuild.h"
+#include "rkcache.h"
+#include "rkhash.h"
+#include "rkrom.h"
+#include "rksparse.h"
+#include "rkdelta.h"
+#include "rkio.h"
+#include "rkmanifest.h"
+#include "rkstats.h"
+#include "rkz.h"
+
+static int write_full(int fd, const void *buf, size_t len, off_t pos)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = pwrite(fd, p, len, pos);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+		pos += n;
+	}
+
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// sparse functions
+
+/*
+ * Holes (SEEK_DATA/SEEK_HOLE) become DONT_CARE chunks without being read.
+ * Data is streamed through rkio; a block that repeats one 32-bit word,
+ * zeros included, becomes a FILL chunk and everything else is merged into
+ * RAW chunks.  A RAW chunk's header is written once its run has ended.
+ */
+
+#define SPARSE_MAX_RUN		0xFFFFF	/* keeps a RAW chunk's total_sz in 32 bits */
+
+struct sparse_out {
+	int fd;
+	uint64_t pos;
+	uint64_t hdr;		/* of the open RAW chunk */
+	uint16_t type;
+	uint32_t run;
+	uint32_t fill;
+	uint32_t chunks;
+	unsigned char carry[SPARSE_BLOCK];
+	size_t carried;
+};
+
+static int unpack_sparse;
 
-unsigned int filestream_crc(FILE *fs, size_t stream_len)
+static int sparse_flush(struct sparse_out *o)
 {
-	char buffer[1024];
-	unsigned int crc = 0;
+	unsigned char buf[sizeof(struct sparse_chunk) + sizeof(uint32_t)];
+	struct sparse_chunk chunk;
+	size_t len = sizeof(chunk);
+	uint64_t pos = o->pos;
+
+	if (!o->run)
+		return 0;
+
+	chunk.chunk_type = o->type;
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = o->run;
+	chunk.total_sz = sizeof(chunk);
+	if (o->type == SPARSE_RAW) {
+		chunk.total_sz += o->run * SPARSE_BLOCK;
+		pos = o->hdr;
+	} else if (o->type == SPARSE_FILL) {
+		chunk.total_sz += sizeof(o->fill);
+		memcpy(buf + len, &o->fill, sizeof(o->fill));
+		len += sizeof(o->fill);
+	}
+	memcpy(buf, &chunk, sizeof(chunk));
 
-	while (stream_len)
-	{
-		int read_len = stream_len < sizeof(buffer) ? stream_len : sizeof(buffer);
-		read_len = fread(buffer, 1, read_len, fs);
-		if (!read_len)
+	if (write_full(o->fd, buf, len, pos) != 0)
+		return -1;
+	if (o->type != SPARSE_RAW)
+		o->pos += len;
+	o->chunks++;
+	o->run = 0;
+
+	return 0;
+}
+
+/* Append count blocks of one type; RAW blocks come with their data */
+static int sparse_add(struct sparse_out *o, uint16_t type, uint32_t fill,
+		const unsigned char *data, uint64_t count)
+{
+	while (count) {
+		uint32_t n;
+
+		if (o->run && (o->type != type || o->fill != fill
+				|| o->run == SPARSE_MAX_RUN) && sparse_flush(o) != 0)
+			return -1;
+
+		if (!o->run) {
+			o->type = type;
+			o->fill = fill;
+			if (type == SPARSE_RAW) {
+				o->hdr = o->pos;
+				o->pos += sizeof(struct sparse_chunk);
+			}
+		}
+
+		n = count < SPARSE_MAX_RUN - o->run ? count : SPARSE_MAX_RUN - o->run;
+		if (type == SPARSE_RAW) {
+			if (write_full(o->fd, data, (size_t)n * SPARSE_BLOCK, o->pos) != 0)
+				return -1;
+			rkio_written(o->fd, o->pos, (uint64_t)n * SPARSE_BLOCK);
+			o->pos += (uint64_t)n * SPARSE_BLOCK;
+			data += (size_t)n * SPARSE_BLOCK;
+		}
+		o->run += n;
+		count -= n;
+	}
+
+	return 0;
+}
+
+/* A block made of one repeated 32-bit word, zeros included */
+static int block_fill(const unsigned char *p, uint32_t *fill)
+{
+	memcpy(fill, p, sizeof(*fill));
+	return memcmp(p, p + sizeof(*fill), SPARSE_BLOCK - sizeof(*fill)) == 0;
+}
+
+static int sparse_blocks(struct sparse_out *o, const unsigned char *p,
+		size_t count)
+{
+	size_t i, raw = 0;
+	uint32_t fill;
+
+	for (i = 0; i < count; i++) {
+		if (!block_fill(p + i * SPARSE_BLOCK, &fill))
+			continue;
+		if (i > raw && sparse_add(o, SPARSE_RAW, 0, p + raw * SPARSE_BLOCK,
+				i - raw) != 0)
+			return -1;
+		if (sparse_add(o, SPARSE_FILL, fill, NULL, 1) != 0)
+			return -1;
+		raw = i + 1;
+	}
+
+	if (count > raw)
+		return sparse_add(o, SPARSE_RAW, 0, p + raw * SPARSE_BLOCK,
+				count - raw);
+	return 0;
+}
+
+static int sparse_chunk_data(void *arg, const unsigned char *buf, size_t len)
+{
+	struct sparse_out *o = arg;
+	size_t n;
+
+	if (o->carried) {
+		n = SPARSE_BLOCK - o->carried < len ? SPARSE_BLOCK - o->carried : len;
+		memcpy(o->carry + o->carried, buf, n);
+		o->carried += n;
+		buf += n;
+		len -= n;
+		if (o->carried < SPARSE_BLOCK)
+			return 0;
+		o->carried = 0;
+		if (sparse_blocks(o, o->carry, 1) != 0)
+			return -1;
+	}
+
+	n = len / SPARSE_BLOCK;
+	if (n && sparse_blocks(o, buf, n) != 0)
+		return -1;
+	o->carried = len - n * SPARSE_BLOCK;
+	memcpy(o->carry, buf + n * SPARSE_BLOCK, o->carried);
+
+	return 0;
+}
+
+/* Write len bytes of fd at off to out_fd as a sparse image of whole blocks */
+static int sparse_encode(int fd, uint64_t off, uint64_t len, int out_fd)
+{
+	struct sparse_header header;
+	struct sparse_out *o;
+	uint64_t blocks = (len + SPARSE_BLOCK - 1) / SPARSE_BLOCK, cur = 0;
+	int ret = -1;
+
+	if (blocks > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+	if ((o = calloc(1, sizeof(*o))) == NULL)
+		return -1;
+	o->fd = out_fd;
+	o->pos = sizeof(header);
+
+	while (cur < blocks) {
+		uint64_t data = cur, end = blocks;
+		off_t d = lseek(fd, off + cur * SPARSE_BLOCK, SEEK_DATA), h;
+
+		if (d < 0 && errno == ENXIO) {
+			data = blocks;
+		} else if (d >= 0) {
+			/* a block is only skipped when it is a hole as a whole */
+			data = ((uint64_t)d - off) / SPARSE_BLOCK;
+			if ((h = lseek(fd, d, SEEK_HOLE)) >= 0)
+				end = ((uint64_t)h - off + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+		}
+		if (data > blocks)
+			data = blocks;
+		if (end > blocks)
+			end = blocks;
+
+		if (data > cur && sparse_add(o, SPARSE_DONT_CARE, 0, NULL,
+				data - cur) != 0)
+			goto out;
+
+		if (end > data) {
+			uint64_t from = data * SPARSE_BLOCK;
+			uint64_t to = end * SPARSE_BLOCK < len ? end * SPARSE_BLOCK : len;
+
+			if (rkio_stream(fd, off + from, to - from, -1, 0,
+					sparse_chunk_data, o) != 0)
+				goto out;
+			if (o->carried) {
+				memset(o->carry + o->carried, 0, SPARSE_BLOCK - o->carried);
+				o->carried = 0;
+				if (sparse_blocks(o, o->carry, 1) != 0)
+					goto out;
+			}
+		}
+		cur = end > data ? end : data;
+	}
+
+	if (sparse_flush(o) != 0)
+		goto out;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SPARSE_MAGIC;
+	header.major_version = SPARSE_MAJOR;
+	header.file_hdr_sz = sizeof(header);
+	header.chunk_hdr_sz = sizeof(struct sparse_chunk);
+	header.blk_sz = SPARSE_BLOCK;
+	header.total_blks = blocks;
+	header.total_chunks = o->chunks;
+	ret = write_full(out_fd, &header, sizeof(header), 0);
+
+out:
+	free(o);
+	return ret;
+}
+
+/* ext2/3/4 or f2fs superblock at 1024: worth writing sparse */
+static int is_fs_image(int fd, uint64_t off, uint64_t len)
+{
+	unsigned char sb[0x3a];
+	uint32_t f2fs;
+
+	if (len < 4 * SPARSE_BLOCK || pread(fd, sb, sizeof(sb), off + 1024)
+			!= (ssize_t)sizeof(sb))
+		return 0;
+
+	memcpy(&f2fs, sb, sizeof(f2fs));
+	return (sb[0x38] == 0x53 && sb[0x39] == 0xEF) || f2fs == 0xF2F52010;
+}
+
+int sparse_image(const char *srcfile, const char *dstfile)
+{
+	struct stat st;
+	int fd, out, ret = -1;
+
+	if ((fd = open(srcfile, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", srcfile,
+				strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	if ((out = open(dstfile, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		fprintf(stderr, "can't create file \"%s\": %s\n", dstfile,
+				strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	rkstats_begin("sparse");
+	ret = sparse_encode(fd, 0, st.st_size, out);
+	if (ret == 0)
+		ret = rkio_flush(out);
+	rkstats_end(st.st_size);
+	if (ret == 0 && fstat(out, &st) == 0)
+		printf("%s: %" PRIu64 " bytes\n", dstfile, (uint64_t)st.st_size);
+	if (close(out) != 0)
+		ret = -1;
+	if (ret != 0) {
+		fprintf(stderr, "Can't write %s: %s\n", dstfile, strerror(errno));
+		unlink(dstfile);
+	}
+	close(fd);
+
+	return ret;
+}
+
+static int fill_range(int fd, uint64_t off, uint64_t len, uint32_t fill)
+{
+	static uint32_t buf[16384];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(buf) / sizeof(buf[0]); i++)
+		buf[i] = fill;
+
+	while (len) {
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
+
+		if (write_full(fd, buf, n, off) != 0)
+			return -1;
+		rkio_written(fd, off, n);
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Expand a sparse image; DONT_CARE and zero FILL chunks stay holes */
+int unsparse_image(const char *srcfile, const char *dstfile)
+{
+	struct sparse_header header;
+	struct sparse_chunk chunk;
+	uint64_t pos, blocks = 0;
+	uint32_t fill, i;
+	int fd, out = -1, ret = -1;
+
+	if ((fd = open(srcfile, O_RDONLY)) < 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", srcfile,
+				strerror(errno));
+		return -1;
+	}
+
+	if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+			|| header.magic != SPARSE_MAGIC
+			|| header.major_version != SPARSE_MAJOR
+			|| header.file_hdr_sz < sizeof(header)
+			|| header.chunk_hdr_sz < sizeof(chunk)
+			|| header.blk_sz == 0 || header.blk_sz % 4 != 0) {
+		fprintf(stderr, "%s: not a sparse image\n", srcfile);
+		goto out;
+	}
+
+	if ((out = open(dstfile, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		fprintf(stderr, "can't create file \"%s\": %s\n", dstfile,
+				strerror(errno));
+		goto out;
+	}
+
+	rkstats_begin("unsparse");
+	if (ftruncate(out, (uint64_t)header.total_blks * header.blk_sz) != 0)
+		goto fail;
+
+	pos = header.file_hdr_sz;
+	for (i = 0; i < header.total_chunks; i++) {
+		uint64_t data = pos + header.chunk_hdr_sz, size;
+		uint64_t len, dst = blocks * header.blk_sz;
+
+		if (pread(fd, &chunk, sizeof(chunk), pos) != (ssize_t)sizeof(chunk)
+				|| chunk.total_sz < header.chunk_hdr_sz)
+			goto bad;
+
+		size = chunk.total_sz - header.chunk_hdr_sz;
+		len = (uint64_t)chunk.chunk_sz * header.blk_sz;
+		if (chunk.chunk_type != SPARSE_CRC32
+				&& chunk.chunk_sz > header.total_blks - blocks)
+			goto bad;
+
+		switch (chunk.chunk_type) {
+		case SPARSE_RAW:
+			if (size != len || rkio_stream(fd, data, len, out, dst,
+					NULL, NULL) != 0)
+				goto bad;
+			break;
+		case SPARSE_FILL:
+			if (size != sizeof(fill) || pread(fd, &fill, sizeof(fill), data)
+					!= (ssize_t)sizeof(fill))
+				goto bad;
+			if (fill && fill_range(out, dst, len, fill) != 0)
+				goto fail;
+			break;
+		case SPARSE_DONT_CARE:
+			if (size != 0)
+				goto bad;
 			break;
+		case SPARSE_CRC32:
+			if (size != sizeof(uint32_t))
+				goto bad;
+			break;
+		default:
+			goto bad;
+		}
 
-		RKCRC(crc, buffer, read_len);
-		stream_len -= read_len;
+		if (chunk.chunk_type != SPARSE_CRC32)
+			blocks += chunk.chunk_sz;
+		pos += chunk.total_sz;
 	}
 
-	return crc;
+	if (blocks != header.total_blks)
+		goto bad;
+	if (rkio_flush(out) != 0)
+		goto fail;
+	rkstats_end(blocks * header.blk_sz);
+	ret = 0;
+	goto out;
+
+bad:
+	fprintf(stderr, "%s: corrupt sparse chunk %u\n", srcfile, i);
+	goto out;
+fail:
+	fprintf(stderr, "Can't write %s: %s\n", dstfile, strerror(errno));
+out:
+	if (out >= 0 && close(out) != 0)
+		ret = -1;
+	if (out >= 0 && ret != 0)
+		unlink(dstfile);
+	close(fd);
+	return ret;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // unpack functions
 
 int create_dir(char *dir) {
-	char *sep = dir;
+	char *sep = dir + (*dir == '/');
 	while ((sep = strchr(sep, '/')) != NULL) {
 		*sep = '\0';
 		if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
@@ -51,152 +470,1153 @@ int create_dir(char *dir) {
 	return 0;
 }
 
-int extract_file(FILE *fp, off_t ofst, size_t len, const char *path) {
-	FILE *ofp;
-	char buffer[1024];
+int extract_file(int fd, off_t ofst, uint64_t len, const char *path) {
+	int ofd, ret;
 
-	if ((ofp = fopen(path, "wb")) == NULL) {
+	if ((ofd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
 		printf("Can't open/create file: %s\n", path);
 		return -1;
 	}
 
-	fseeko(fp, ofst, SEEK_SET);
-	while (len)
-	{
-		size_t read_len = len < sizeof(buffer) ? len : sizeof(buffer);
-		read_len = fread(buffer, 1, read_len, fp);
-		if (!read_len)
-			break;
-		fwrite(buffer, read_len, 1, ofp);
-		len -= read_len;
+	if (unpack_sparse && is_fs_image(fd, ofst, len))
+		ret = sparse_encode(fd, ofst, len, ofd);
+	else
+		ret = rkio_stream(fd, ofst, len, ofd, 0, NULL, NULL);
+	if (ret == 0)
+		ret = rkio_flush(ofd);
+	if (close(ofd) != 0)
+		ret = -1;
+	if (ret != 0)
+		printf("Can't extract file: %s: %s\n", path, strerror(errno));
+
+	return ret;
+}
+
+/*
+ * -unpack reads the image once.  Every chunk feeds the RKCRC and is written
+ * to the parts it overlaps, in a staging directory next to dstdir.  The
+ * staging directory becomes dstdir only if the trailer matches and is
+ * removed otherwise, so nothing from an image that fails the check ever
+ * appears in dstdir.  If dstdir already has files, the parts are renamed
+ * into it one by one.  --sparse parts are encoded from the image once the
+ * check has passed.
+ */
+struct unpack_part {
+	uint64_t pos;
+	uint64_t size;
+	int fd;			/* -1: not written by the pass */
+	int sparse;
+	const char *name;
+	const char *filename;
+};
+
+struct unpack_ctx {
+	struct unpack_part parts[16];
+	unsigned int num_parts;
+	uint64_t pos;
+	unsigned int crc;
+	int check;
+	int phase;		/* part whose --stats phase is open, or -1 */
+};
+
+/* --stats=json: one extract:<name> phase per part, as the pass reaches it */
+static void unpack_phase(struct unpack_ctx *ctx, int i)
+{
+	if (ctx->phase == i)
+		return;
+	if (ctx->phase >= 0)
+		rkstats_end(ctx->parts[ctx->phase].size);
+	if (i >= 0)
+		rkstats_begin("extract:%.32s", ctx->parts[i].name);
+	ctx->phase = i;
+}
+
+static int unpack_chunk(void *arg, const unsigned char *buf, size_t len)
+{
+	struct unpack_ctx *ctx = arg;
+	unsigned int i;
+	uint64_t a, b;
+
+	if (ctx->check)
+		RKCRC(ctx->crc, buf, len);
+
+	for (i = 0; i < ctx->num_parts; i++) {
+		struct unpack_part *part = &ctx->parts[i];
+
+		if (part->fd < 0)
+			continue;
+		a = part->pos > ctx->pos ? part->pos : ctx->pos;
+		b = part->pos + part->size < ctx->pos + len ?
+				part->pos + part->size : ctx->pos + len;
+		if (a >= b)
+			continue;
+		unpack_phase(ctx, i);
+		if (write_full(part->fd, buf + (a - ctx->pos), b - a,
+				a - part->pos) != 0) {
+			printf("Can't extract file: %s: %s\n", part->filename,
+					strerror(errno));
+			return -1;
+		}
+		rkio_written(part->fd, a - part->pos, b - a);
+	}
+
+	ctx->pos += len;
+	return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type,
+		struct FTW *ftw)
+{
+	(void)st;
+	(void)type;
+	(void)ftw;
+	remove(path);
+	return 0;
+}
+
+static void remove_tree(const char *dir)
+{
+	nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int part_path(char *path, const char *dir, const char *filename)
+{
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, filename) >= PATH_MAX) {
+		fprintf(stderr, "Path too long: %s/%s\n", dir, filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Create the staging directory for dstdir: next to it, so that the commit
+ * is a rename, and with the mode mkdir() would have given dstdir.  dst
+ * receives dstdir without trailing slashes.
+ */
+static int unpack_stage(const char *dstdir, char *dst, char *stage)
+{
+	mode_t mask;
+	size_t n;
+
+	snprintf(dst, PATH_MAX, "%s", dstdir);
+	for (n = strlen(dst); n > 1 && dst[n - 1] == '/'; n--)
+		dst[n - 1] = '\0';
+	if (snprintf(stage, PATH_MAX, "%s.unpack.XXXXXX", dst) >= PATH_MAX) {
+		fprintf(stderr, "Path too long: %s\n", dstdir);
+		return -1;
 	}
-	fclose(ofp);
+	if (create_dir(stage) != 0 || mkdtemp(stage) == NULL) {
+		fprintf(stderr, "Can't create %s: %s\n", stage, strerror(errno));
+		return -1;
+	}
+
+	/* mkdtemp() makes it 0700 */
+	mask = umask(0);
+	umask(mask);
+	if (chmod(stage, 0777 & ~mask) != 0) {
+		fprintf(stderr, "Can't chmod %s: %s\n", stage, strerror(errno));
+		remove_tree(stage);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Move the staged files to dstdir: the whole directory if possible */
+static int unpack_commit(const char *stage, const char *dstdir,
+		const char **files, unsigned int num_files)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	unsigned int i, j;
+
+	if (rename(stage, dstdir) == 0)
+		return 0;
+	if (errno != ENOTEMPTY && errno != EEXIST) {
+		fprintf(stderr, "Can't rename %s to %s: %s\n", stage, dstdir,
+				strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < num_files; i++) {
+		for (j = i + 1; j < num_files; j++)
+			if (strcmp(files[i], files[j]) == 0)
+				break;
+		if (j < num_files)
+			continue;	/* moved with the last file of that name */
+
+		if (part_path(from, stage, files[i]) != 0
+				|| part_path(to, dstdir, files[i]) != 0)
+			return -1;
+		if (create_dir(to) != 0 || rename(from, to) != 0) {
+			fprintf(stderr, "Can't move %s to %s: %s\n", from, to,
+					strerror(errno));
+			return -1;
+		}
+	}
+	remove_tree(stage);
 
 	return 0;
 }
 
 int unpack_update(const char* srcfile, const char* dstdir) {
-	FILE *fp = NULL;
+	struct unpack_ctx ctx;
 	struct update_header header;
-	unsigned int crc = 0;
-
-	fp = fopen(srcfile, "rb");
-	if (!fp) {
+	struct update_ext ext;
+	char dst[PATH_MAX], stage[PATH_MAX], path[PATH_MAX];
+	uint64_t length;
+	const char *files[16];
+	unsigned int crc = 0, i, j;
+	int fd, err, staged = 0, ret = -1;
+
+	memset(&ctx, 0, sizeof(ctx));
+	for (i = 0; i < 16; i++)
+		ctx.parts[i].fd = -1;
+	ctx.phase = -1;
+
+	fd = open(srcfile, O_RDONLY);
+	if (fd < 0) {
 		fprintf(stderr, "can't open file \"%s\": %s\n", srcfile,
 				strerror(errno));
-		goto unpack_fail;
+		return -1;
 	}
 
-	fseek(fp, 0, SEEK_SET);
-	if (sizeof(header) != fread(&header, 1, sizeof(header), fp)) {
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
 		fprintf(stderr, "Can't read image header\n");
-		goto unpack_fail;
+		goto out;
 	}
 
 	if (strncmp(header.magic, RKAFP_MAGIC, sizeof(header.magic)) != 0) {
 		fprintf(stderr, "Invalid header magic\n");
-		goto unpack_fail;
+		goto out;
 	}
 
-	fseek(fp, header.length, SEEK_SET);
-	if (sizeof(crc) != fread(&crc, 1, sizeof(crc), fp))
-	{
-		fprintf(stderr, "Can't read crc checksum\n");
-		goto unpack_fail;
+	if (rkafp_get_ext(&header, &ext) > RKAFP_EXT_VERSION) {
+		fprintf(stderr, "Unsupported large image extension version %u\n",
+				ext.version);
+		goto out;
 	}
 
-	
-	printf("Check file...");
-	fflush(stdout);
-	fseek(fp, 0, SEEK_SET);
-	if (crc != filestream_crc(fp, header.length)) {
-		printf("Fail\n");
-		goto unpack_fail;
+	if (header.num_parts > 16) {
+		fprintf(stderr, "Invalid number of parts: %u\n", header.num_parts);
+		goto out;
+	}
+
+	length = rkafp_get_length(&header);
+	if (pread(fd, &crc, sizeof(crc), length) != sizeof(crc)) {
+		fprintf(stderr, "Can't read crc checksum\n");
+		goto out;
 	}
-	printf("OK\n");
+
+	if (unpack_stage(dstdir, dst, stage) != 0)
+		goto out;
+	staged = 1;
 
 	printf("------- UNPACK -------\n");
-	if (header.num_parts) {
-		unsigned i;
-		char dir[PATH_MAX];
+	for (i = 0; i < header.num_parts; i++) {
+		struct update_part *part = &header.parts[i];
+		struct unpack_part *up = &ctx.parts[ctx.num_parts];
+		struct update_extent extent;
 
-		for (i = 0; i < header.num_parts; i++) {
-			struct update_part *part = &header.parts[i];
-			printf("%s\t0x%08X\t0x%08X\n", part->filename, part->pos,
-					part->size);
+		rkafp_get_extent(&header, i, &extent);
+		printf("%s\t0x%08" PRIX64 "\t0x%08" PRIX64 "\n", part->filename,
+				extent.pos, extent.size);
 
-			if (strcmp(part->filename, "SELF") == 0) {
-				printf("Skip SELF file.\n");
-				continue;
-			}
+		if (strcmp(part->filename, "SELF") == 0) {
+			printf("Skip SELF file.\n");
+			continue;
+		}
 
-			// parameter 多出文件头8个字节,文件尾4个字节
-			if (memcmp(part->name, "parameter", 9) == 0) {
-				part->pos += 8;
-				part->size -= 12;
+		// parameter 多出文件头8个字节,文件尾4个字节
+		if (memcmp(part->name, "parameter", 9) == 0) {
+			if (extent.size < 12) {
+				fprintf(stderr, "Invalid part: %s\n", part->name);
+				continue;
 			}
+			extent.pos += 8;
+			extent.size -= 12;
+		}
 
-			snprintf(dir, sizeof(dir), "%s/%s", dstdir, part->filename);
+		if (part_path(path, stage, part->filename) != 0
+				|| -1 == create_dir(path))
+			continue;
 
-			if (-1 == create_dir(dir))
-				continue;
+		if (extent.pos > length || extent.size > length - extent.pos) {
+			fprintf(stderr, "Invalid part: %s\n", part->name);
+			continue;
+		}
 
-			if (part->pos + part->size > header.length) {
-				fprintf(stderr, "Invalid part: %s\n", part->name);
-				continue;
+		/* a later part of the same name replaces the earlier one */
+		for (j = 0; j < ctx.num_parts; j++)
+			if (strcmp(ctx.parts[j].filename, part->filename) == 0
+					&& ctx.parts[j].fd >= 0) {
+				close(ctx.parts[j].fd);
+				ctx.parts[j].fd = -1;
+				ctx.parts[j].sparse = 0;
 			}
 
-			extract_file(fp, part->pos, part->size, dir);
+		if ((up->fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+			printf("Can't open/create file: %s\n", path);
+			continue;
+		}
+		up->pos = extent.pos;
+		up->size = extent.size;
+		up->name = part->name;
+		up->filename = part->filename;
+		if (unpack_sparse && is_fs_image(fd, extent.pos, extent.size)) {
+			close(up->fd);
+			up->fd = -1;
+			up->sparse = 1;
 		}
+		ctx.num_parts++;
 	}
 
-	fclose(fp);
+	printf("Check file...");
+	fflush(stdout);
+	ctx.check = !rkcache_get(fd, RKCACHE_RKCRC, length, &ctx.crc,
+			sizeof(ctx.crc));
+	rkstats_begin("unpack");
+	err = rkio_stream(fd, 0, length, -1, 0, unpack_chunk, &ctx);
+	unpack_phase(&ctx, -1);
+	rkstats_end(length);
+	if (err != 0) {
+		printf("Fail\n");
+		fprintf(stderr, "Read error: %s\n", strerror(errno));
+		goto out;
+	}
+	if (crc != ctx.crc) {
+		printf("Fail\n");
+		goto out;
+	}
+	rkcache_put(fd, RKCACHE_RKCRC, length, &crc, sizeof(crc));
+	printf("OK\n");
 
-	return 0;
+	for (i = 0; i < ctx.num_parts; i++) {
+		struct unpack_part *up = &ctx.parts[i];
 
-unpack_fail:
-	if (fp) {
-		fclose(fp);
+		if (up->fd >= 0) {
+			err = rkio_flush(up->fd);
+			if (close(up->fd) != 0 || err != 0) {
+				up->fd = -1;
+				printf("Can't extract file: %s: %s\n", up->filename,
+						strerror(errno));
+				goto out;
+			}
+			up->fd = -1;
+		} else if (up->sparse) {
+			if (part_path(path, stage, up->filename) != 0)
+				goto out;
+			rkstats_begin("extract:%.32s", up->name);
+			if (extract_file(fd, up->pos, up->size, path) != 0)
+				goto out;
+			rkstats_end(up->size);
+		}
 	}
 
-	return -1;
+	for (i = 0; i < ctx.num_parts; i++)
+		files[i] = ctx.parts[i].filename;
+	if (unpack_commit(stage, dst, files, ctx.num_parts) != 0)
+		goto out;
+	staged = 0;
+	ret = 0;
+
+out:
+	for (i = 0; i < ctx.num_parts; i++)
+		if (ctx.parts[i].fd >= 0)
+			close(ctx.parts[i].fd);
+	if (staged)
+		remove_tree(stage);
+	close(fd);
+
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// pack functions
-
-struct pack_part {
+// block map functions
+
+/*
+ * --blockmap=<file> makes -pack write a SHA-256 per flash block of every
+ * partition that has a nand_addr.  Blocks are BLOCKMAP_BLOCK bytes aligned
+ * to device addresses (nand_addr is in 512-byte sectors), so a partition
+ * that does not start on a block boundary begins with a short block, and
+ * they cover the image data only.  The blocks are hashed from the input
+ * chunks while packing: whole blocks in parallel, blocks that straddle two
+ * chunks by the packing thread.  -blockdiff compares the map of what is on
+ * a device with the map of a new image and prints the sector ranges that
+ * have to be rewritten.
+ */
+
+#define BLOCKMAP_MAGIC		"RKBLOCKMAP 1"
+#define BLOCKMAP_BLOCK		(64 << 10)
+#define BLOCKMAP_SECTOR		512
+
+struct blockmap_part {
 	char name[32];
-	char filename[60];
-	unsigned int nand_addr;
-	unsigned int nand_size;
+	int input;
+	uint64_t start;		/* device byte address */
+	uint64_t size;
+	uint64_t num_blocks;
+	unsigned char (*hash)[RKSHA256_DIGEST_LENGTH];
+	struct rksha256 carry;	/* block continued from the previous chunk */
 };
 
-struct partition {
-	char name[32];
-	unsigned int start;
-	unsigned int size;
-};
+static struct {
+	const char *path;
+	struct blockmap_part parts[16];
+	unsigned int num_parts;
+
+	/* fork-join pool hashing the whole blocks of one chunk */
+	pthread_t threads[64];
+	unsigned int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long gen;
+	int stop;
+	const unsigned char *buf;
+	unsigned char (*hash)[RKSHA256_DIGEST_LENGTH];
+	unsigned int count;
+	unsigned int next;
+	unsigned int finished;
+} blockmap;
+
+static uint64_t block_index(const struct blockmap_part *p, uint64_t addr)
+{
+	return addr / BLOCKMAP_BLOCK - p->start / BLOCKMAP_BLOCK;
+}
 
-typedef struct {
-	unsigned int version;
+/* Hash whole blocks of the current round until none are left */
+static void blockmap_run(void)
+{
+	unsigned int k;
 
-	char machine_model[0x22];
-	char machine_id[0x1e];
-	char manufacturer[0x38];
+	for (;;) {
+		pthread_mutex_lock(&blockmap.lock);
+		k = blockmap.next < blockmap.count ? blockmap.next++ : ~0U;
+		pthread_mutex_unlock(&blockmap.lock);
+		if (k == ~0U)
+			break;
 
-	unsigned int num_package;
-	struct pack_part packages[16];
+		rksha256(blockmap.buf + (size_t)k * BLOCKMAP_BLOCK, BLOCKMAP_BLOCK,
+				blockmap.hash[k]);
 
-	unsigned int num_partition;
-	struct partition partitions[16];
-} PackImage;
+		pthread_mutex_lock(&blockmap.lock);
+		if (++blockmap.finished == blockmap.count)
+			pthread_cond_broadcast(&blockmap.cond);
+		pthread_mutex_unlock(&blockmap.lock);
+	}
+}
 
-static PackImage package_image;
+static void *blockmap_worker(void *arg)
+{
+	unsigned long gen = 0;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&blockmap.lock);
+		while (blockmap.gen == gen && !blockmap.stop)
+			pthread_cond_wait(&blockmap.cond, &blockmap.lock);
+		gen = blockmap.gen;
+		if (blockmap.stop) {
+			pthread_mutex_unlock(&blockmap.lock);
+			break;
+		}
+		pthread_mutex_unlock(&blockmap.lock);
 
-int parse_partitions(char *str) {
-	char *parts;
-	char *part, *token1 = NULL, *ptr;
+		blockmap_run();
+	}
+
+	return NULL;
+}
+
+/* Record the flashed partitions of a planned image; call before importing */
+static int blockmap_plan(const struct update_header *header,
+		const struct update_extent *extents, const int *input)
+{
+	unsigned int i;
+	long n;
+
+	for (i = 0; i < header->num_parts; i++) {
+		struct blockmap_part *p = &blockmap.parts[blockmap.num_parts];
+
+		if (input[i] < 0 || header->parts[i].nand_addr == (unsigned int)-1
+				|| extents[i].size == 0)
+			continue;
+
+		memset(p, 0, sizeof(*p));
+		snprintf(p->name, sizeof(p->name), "%s", header->parts[i].name);
+		p->input = input[i];
+		p->start = (uint64_t)header->parts[i].nand_addr * BLOCKMAP_SECTOR;
+		p->size = extents[i].size;
+		p->num_blocks = block_index(p, p->start + p->size - 1) + 1;
+		p->hash = calloc(p->num_blocks, sizeof(*p->hash));
+		if (!p->hash)
+			return -1;
+		blockmap.num_parts++;
+	}
+
+	/* the packing thread hashes too */
+	n = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	if (n > 64)
+		n = 64;
+	pthread_mutex_init(&blockmap.lock, NULL);
+	pthread_cond_init(&blockmap.cond, NULL);
+	for (i = 0; (long)i < n; i++)
+		if (pthread_create(&blockmap.threads[i], NULL, blockmap_worker,
+				NULL) == 0)
+			blockmap.num_threads++;
+
+	return 0;
+}
+
+static void blockmap_part_update(struct blockmap_part *p, uint64_t off,
+		const unsigned char *buf, size_t len)
+{
+	uint64_t addr = p->start + off, end = addr + len;
+
+	while (addr < end) {
+		uint64_t k = block_index(p, addr);
+		uint64_t block_end = (addr / BLOCKMAP_BLOCK + 1) * BLOCKMAP_BLOCK;
+		uint64_t last = p->start + p->size < block_end ?
+				p->start + p->size : block_end;
+		size_t whole;
+
+		if (addr % BLOCKMAP_BLOCK == 0 && end >= block_end) {
+			/* a run of whole blocks: hash them in parallel */
+			whole = (end - addr) / BLOCKMAP_BLOCK;
+			pthread_mutex_lock(&blockmap.lock);
+			blockmap.buf = buf + (addr - p->start - off);
+			blockmap.hash = &p->hash[k];
+			blockmap.count = whole;
+			blockmap.next = blockmap.finished = 0;
+			blockmap.gen++;
+			pthread_cond_broadcast(&blockmap.cond);
+			pthread_mutex_unlock(&blockmap.lock);
+
+			blockmap_run();
+
+			pthread_mutex_lock(&blockmap.lock);
+			while (blockmap.finished < blockmap.count)
+				pthread_cond_wait(&blockmap.cond, &blockmap.lock);
+			pthread_mutex_unlock(&blockmap.lock);
+
+			addr += whole * BLOCKMAP_BLOCK;
+			continue;
+		}
+
+		/* a short block, or one split across chunks */
+		if (addr == p->start || addr % BLOCKMAP_BLOCK == 0)
+			rksha256_init(&p->carry);
+		whole = (end < last ? end : last) - addr;
+		rksha256_update(&p->carry, buf + (addr - p->start - off), whole);
+		addr += whole;
+		if (addr == last)
+			rksha256_final(p->hash[k], &p->carry);
+	}
+}
+
+/* len bytes of input idx at offset off were read */
+static void blockmap_update(unsigned int idx, uint64_t off,
+		const unsigned char *buf, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < blockmap.num_parts; i++)
+		if (blockmap.parts[i].input == (int)idx)
+			blockmap_part_update(&blockmap.parts[i], off, buf, len);
+}
+
+static void blockmap_release(void)
+{
+	unsigned int i;
+
+	if (blockmap.num_threads) {
+		pthread_mutex_lock(&blockmap.lock);
+		blockmap.stop = 1;
+		pthread_cond_broadcast(&blockmap.cond);
+		pthread_mutex_unlock(&blockmap.lock);
+		for (i = 0; i < blockmap.num_threads; i++)
+			pthread_join(blockmap.threads[i], NULL);
+		blockmap.num_threads = 0;
+	}
+
+	for (i = 0; i < blockmap.num_parts; i++)
+		free(blockmap.parts[i].hash);
+	blockmap.num_parts = 0;
+}
+
+static int blockmap_write(const char *path)
+{
+	char tmp[PATH_MAX + 8], hex[2 * RKSHA256_DIGEST_LENGTH + 1];
+	unsigned int i, j;
+	uint64_t k;
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "Can't create block map %s\n", path);
+		return -1;
+	}
+
+	fprintf(fp, "%s\nblock_size %d\n", BLOCKMAP_MAGIC, BLOCKMAP_BLOCK);
+	for (i = 0; i < blockmap.num_parts; i++) {
+		struct blockmap_part *p = &blockmap.parts[i];
+
+		fprintf(fp, "part %s %" PRIu64 " %" PRIu64 "\n", p->name, p->start,
+				p->size);
+		for (k = 0; k < p->num_blocks; k++) {
+			for (j = 0; j < RKSHA256_DIGEST_LENGTH; j++)
+				sprintf(hex + 2 * j, "%02x", p->hash[k][j]);
+			fprintf(fp, "%s\n", hex);
+		}
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		fprintf(stderr, "Can't write block map %s\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Load a block map written by blockmap_write(); hashes stay hex */
+static int blockmap_load(const char *path, struct blockmap_part *parts,
+		unsigned int *num_parts)
+{
+	char line[256], name[32];
+	uint64_t start, size, k;
+	unsigned int block_size;
+	FILE *fp;
+	int ret = -1;
+
+	*num_parts = 0;
+	if ((fp = fopen(path, "r")) == NULL || fgets(line, sizeof(line), fp) == NULL
+			|| strncmp(line, BLOCKMAP_MAGIC "\n", sizeof(BLOCKMAP_MAGIC)) != 0
+			|| fscanf(fp, "block_size %u\n", &block_size) != 1
+			|| block_size != BLOCKMAP_BLOCK) {
+		fprintf(stderr, "%s: not a block map\n", path);
+		goto out;
+	}
+
+	while (fscanf(fp, "part %31s %" SCNu64 " %" SCNu64 "\n", name, &start,
+			&size) == 3) {
+		struct blockmap_part *p = &parts[*num_parts];
+
+		if (*num_parts == 16 || size == 0) {
+			fprintf(stderr, "%s: invalid part %s\n", path, name);
+			goto out;
+		}
+
+		memset(p, 0, sizeof(*p));
+		snprintf(p->name, sizeof(p->name), "%s", name);
+		p->start = start;
+		p->size = size;
+		p->num_blocks = block_index(p, start + size - 1) + 1;
+		if ((p->hash = calloc(p->num_blocks, sizeof(*p->hash))) == NULL)
+			goto out;
+		(*num_parts)++;
+
+		for (k = 0; k < p->num_blocks; k++) {
+			char hex[2 * RKSHA256_DIGEST_LENGTH + 1];
+			unsigned int j;
+
+			if (fscanf(fp, "%64s\n", hex) != 1 || strlen(hex) != sizeof(hex) - 1) {
+				fprintf(stderr, "%s: %s: truncated\n", path, name);
+				goto out;
+			}
+			for (j = 0; j < RKSHA256_DIGEST_LENGTH; j++)
+				sscanf(hex + 2 * j, "%2hhx", &p->hash[k][j]);
+		}
+	}
+
+	if (!feof(fp)) {
+		fprintf(stderr, "%s: trailing garbage\n", path);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	if (fp)
+		fclose(fp);
+	return ret;
+}
+
+static void print_range(const struct blockmap_part *p, uint64_t a, uint64_t b,
+		uint64_t *bytes)
+{
+	uint64_t from = (p->start / BLOCKMAP_BLOCK + a) * BLOCKMAP_BLOCK;
+	uint64_t to = (p->start / BLOCKMAP_BLOCK + b) * BLOCKMAP_BLOCK;
+
+	if (from < p->start)
+		from = p->start;
+	if (to > p->start + p->size)
+		to = p->start + p->size;
+
+	/* same notation as mtdparts in parameter: sectors@start(name) */
+	printf("0x%08" PRIX64 "@0x%08" PRIX64 "(%s)\n",
+			(to - from + BLOCKMAP_SECTOR - 1) / BLOCKMAP_SECTOR,
+			from / BLOCKMAP_SECTOR, p->name);
+	*bytes += to - from;
+}
+
+/* Print the block ranges of newmap that differ from devmap */
+int blockmap_diff(const char *devmap, const char *newmap)
+{
+	struct blockmap_part dev[16], img[16];
+	unsigned int num_dev = 0, num_img = 0, i, j;
+	uint64_t k, run, changed = 0, total = 0, bytes = 0;
+	int ret = -1;
+
+	if (blockmap_load(devmap, dev, &num_dev) != 0
+			|| blockmap_load(newmap, img, &num_img) != 0)
+		goto out;
+
+	for (i = 0; i < num_img; i++) {
+		struct blockmap_part *p = &img[i], *d = NULL;
+
+		for (j = 0; j < num_dev; j++)
+			if (strcmp(dev[j].name, p->name) == 0 && dev[j].start == p->start)
+				d = &dev[j];
+
+		total += p->num_blocks;
+		for (k = 0; k < p->num_blocks; k = run) {
+			for (run = k; run < p->num_blocks && (!d || run >= d->num_blocks
+					|| memcmp(d->hash[run], p->hash[run],
+						RKSHA256_DIGEST_LENGTH) != 0); run++)
+				;
+			if (run > k) {
+				print_range(p, k, run, &bytes);
+				changed += run - k;
+			} else {
+				run++;
+			}
+		}
+	}
+
+	fprintf(stderr, "%" PRIu64 " of %" PRIu64 " blocks changed, %" PRIu64
+			" bytes to write\n", changed, total, bytes);
+	ret = 0;
+
+out:
+	for (i = 0; i < num_dev; i++)
+		free(dev[i].hash);
+	for (i = 0; i < num_img; i++)
+		free(img[i].hash);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// tar functions
+
+/*
+ * -pack takes an uncompressed tar archive, or "-" for one on stdin, in
+ * place of the source directory.  The archive is indexed from its member
+ * headers (ustar, GNU long names and pax records, hard links) and every
+ * input is then read and copied straight from its data offset, so nothing
+ * is extracted.  A tar arriving on a pipe is spooled to an unlinked
+ * temporary file first.  Paths in package-file are relative to the
+ * directory holding parameter, which may be a top-level directory of the
+ * archive.
+ */
+
+#define TAR_BLOCK		512
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+struct tar_member {
+	char *name;
+	uint64_t off;
+	uint64_t size;
+};
+
+static struct {
+	int fd;			/* the archive while a job is planned, or -1 */
+	char prefix[PATH_MAX];
+	struct tar_member *members;
+	unsigned int num_members;
+} pack_tar = { -1, "", NULL, 0 };
+
+/* Octal, or base-256 when the top bit is set (GNU, for sizes >= 8 GiB) */
+static uint64_t tar_number(const char *p, size_t len)
+{
+	uint64_t v = 0;
+	size_t i;
+
+	if (*p & 0x80) {
+		v = *p & 0x3f;
+		for (i = 1; i < len; i++)
+			v = (v << 8) | (unsigned char)p[i];
+		return v;
+	}
+
+	for (i = 0; i < len && (p[i] == ' ' || p[i] == '0'); i++)
+		;
+	for (; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+		v = (v << 3) | (p[i] - '0');
+	return v;
+}
+
+static int tar_checksum_ok(const struct tar_header *h)
+{
+	const unsigned char *p = (const unsigned char *)h;
+	unsigned int sum = 0, i;
+
+	for (i = 0; i < sizeof(*h); i++)
+		sum += i >= offsetof(struct tar_header, chksum)
+				&& i < offsetof(struct tar_header, typeflag) ? ' ' : p[i];
+
+	return sum == tar_number(h->chksum, sizeof(h->chksum));
+}
+
+static const char *tar_path(const char *name)
+{
+	for (;;) {
+		if (*name == '/')
+			name++;
+		else if (name[0] == '.' && name[1] == '/')
+			name += 2;
+		else
+			return name;
+	}
+}
+
+static struct tar_member *tar_lookup(const char *name)
+{
+	unsigned int i;
+
+	/* a later member replaces an earlier one of the same name */
+	for (i = pack_tar.num_members; i-- > 0; )
+		if (strcmp(pack_tar.members[i].name, name) == 0)
+			return &pack_tar.members[i];
+
+	return NULL;
+}
+
+static int tar_add(const char *name, uint64_t off, uint64_t size)
+{
+	struct tar_member *m;
+
+	m = realloc(pack_tar.members, (pack_tar.num_members + 1) * sizeof(*m));
+	if (!m)
+		return -1;
+	pack_tar.members = m;
+
+	m = &pack_tar.members[pack_tar.num_members];
+	if ((m->name = strdup(tar_path(name))) == NULL)
+		return -1;
+	m->off = off;
+	m->size = size;
+	pack_tar.num_members++;
+
+	return 0;
+}
+
+/* Read a GNU long name or pax extended header; size is bounded by PATH_MAX */
+static int tar_read_ext(uint64_t off, uint64_t size, char *buf)
+{
+	if (size >= PATH_MAX || pread(pack_tar.fd, buf, size, off) != (ssize_t)size)
+		return -1;
+	buf[size] = '\0';
+	return 0;
+}
+
+/* Apply the path=, linkpath= and size= records of a pax header */
+static void tar_pax(char *rec, char *path, char *link, uint64_t *size)
+{
+	char *end = rec + strlen(rec), *key, *value;
+	unsigned long len;
+
+	while (rec < end && (len = strtoul(rec, &key, 10)) > 0
+			&& len <= (unsigned long)(end - rec) && *key == ' ') {
+		key++;
+		rec[len - 1] = '\0';
+		if ((value = strchr(key, '=')) != NULL) {
+			*value++ = '\0';
+			if (strcmp(key, "path") == 0)
+				snprintf(path, PATH_MAX, "%s", value);
+			else if (strcmp(key, "linkpath") == 0)
+				snprintf(link, PATH_MAX, "%s", value);
+			else if (strcmp(key, "size") == 0)
+				*size = strtoull(value, NULL, 10);
+		}
+		rec += len;
+	}
+}
+
+static int tar_index(const char *src)
+{
+	char name[PATH_MAX], link[PATH_MAX], ext[PATH_MAX];
+	struct tar_header h;
+	uint64_t pos = 0, pax_size = UINT64_MAX;
+	struct tar_member *m;
+
+	name[0] = link[0] = '\0';
+	for (;;) {
+		static const struct tar_header zero;
+		uint64_t size;
+
+		if (pread(pack_tar.fd, &h, sizeof(h), pos) != (ssize_t)sizeof(h)) {
+			fprintf(stderr, "%s: truncated tar archive\n", src);
+			return -1;
+		}
+		if (memcmp(&h, &zero, sizeof(h)) == 0)
+			return 0;
+		if (!tar_checksum_ok(&h)) {
+			fprintf(stderr, "%s: %s at offset %" PRIu64 "\n", src, pos ?
+					"corrupt tar header" : "not an uncompressed tar archive",
+					pos);
+			return -1;
+		}
+
+		size = pax_size != UINT64_MAX ? pax_size : tar_number(h.size,
+				sizeof(h.size));
+		pos += TAR_BLOCK;
+
+		switch (h.typeflag) {
+		case 'L':
+			if (tar_read_ext(pos, size, name) != 0)
+				goto bad;
+			break;
+		case 'K':
+			if (tar_read_ext(pos, size, link) != 0)
+				goto bad;
+			break;
+		case 'x':
+			if (tar_read_ext(pos, size, ext) != 0)
+				goto bad;
+			tar_pax(ext, name, link, &pax_size);
+			break;
+		case 'g':
+			break;
+		default:
+			if (!name[0])
+				snprintf(name, sizeof(name), "%.*s%s%.*s",
+						(int)strnlen(h.prefix, sizeof(h.prefix)), h.prefix,
+						h.prefix[0] ? "/" : "",
+						(int)strnlen(h.name, sizeof(h.name)), h.name);
+
+			if (h.typeflag == '0' || h.typeflag == '\0' || h.typeflag == '7') {
+				if (tar_add(name, pos, size) != 0)
+					return -1;
+			} else if (h.typeflag == '1') {
+				if (!link[0])
+					snprintf(link, sizeof(link), "%.*s",
+							(int)strnlen(h.linkname, sizeof(h.linkname)),
+							h.linkname);
+				if ((m = tar_lookup(tar_path(link))) != NULL
+						&& tar_add(name, m->off, m->size) != 0)
+					return -1;
+				size = 0;
+			}
+			name[0] = link[0] = '\0';
+			pax_size = UINT64_MAX;
+			break;
+		}
+
+		pos += (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	}
+
+bad:
+	fprintf(stderr, "%s: invalid extended tar header at offset %" PRIu64 "\n",
+			src, pos - TAR_BLOCK);
+	return -1;
+}
+
+/* Copy a tar on a pipe to an unlinked file, so it can be indexed */
+static int tar_spool(int in)
+{
+	const char *dir = getenv("TMPDIR");
+	unsigned char buf[1 << 16];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(dir ? dir : "/tmp", O_TMPFILE | O_RDWR, 0600)) < 0)
+		return -1;
+
+	while ((n = splice(in, NULL, fd, NULL, 1 << 20, SPLICE_F_MOVE)) > 0)
+		;
+	if (n < 0 && errno == EINVAL) {
+		while ((n = read(in, buf, sizeof(buf))) > 0)
+			if (write_full(fd, buf, n, lseek(fd, 0, SEEK_END)) != 0)
+				break;
+	}
+
+	if (n != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void tar_release(void)
+{
+	unsigned int i;
+
+	if (pack_tar.fd >= 0)
+		close(pack_tar.fd);
+	for (i = 0; i < pack_tar.num_members; i++)
+		free(pack_tar.members[i].name);
+	free(pack_tar.members);
+
+	pack_tar.fd = -1;
+	pack_tar.prefix[0] = '\0';
+	pack_tar.members = NULL;
+	pack_tar.num_members = 0;
+}
+
+/* Index the archive src ("-" for stdin) and find the directory of parameter */
+static int tar_load(const char *src)
+{
+	struct stat st;
+	unsigned int i, depth = UINT_MAX;
+
+	if (strcmp(src, "-") != 0)
+		pack_tar.fd = open(src, O_RDONLY);
+	else if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+		pack_tar.fd = dup(STDIN_FILENO);
+	else
+		pack_tar.fd = tar_spool(STDIN_FILENO);
+
+	if (pack_tar.fd < 0) {
+		printf("Can't open archive: %s\n", src);
+		return -1;
+	}
+
+	if (tar_index(src) != 0) {
+		tar_release();
+		return -1;
+	}
+
+	for (i = 0; i < pack_tar.num_members; i++) {
+		const char *name = pack_tar.members[i].name, *base = strrchr(name, '/');
+		unsigned int d = 0;
+		const char *p;
+
+		if (strcmp(base ? base + 1 : name, "parameter") != 0)
+			continue;
+		for (p = name; *p; p++)
+			d += *p == '/';
+		if (d < depth) {
+			depth = d;
+			snprintf(pack_tar.prefix, sizeof(pack_tar.prefix), "%.*s",
+					(int)(base ? base + 1 - name : 0), name);
+		}
+	}
+
+	return 0;
+}
+
+/* The member holding path, relative to the directory of parameter */
+static struct tar_member *tar_find(const char *path)
+{
+	char name[2 * PATH_MAX];
+
+	snprintf(name, sizeof(name), "%s%s", pack_tar.prefix, tar_path(path));
+	return tar_lookup(name);
+}
+
+static FILE *tar_fopen(const char *path)
+{
+	struct tar_member *m = tar_find(path);
+	char *buf;
+	FILE *fp;
+
+	if (!m || m->size > (1 << 20) || (buf = malloc(m->size + 1)) == NULL)
+		return NULL;
+
+	if (pread(pack_tar.fd, buf, m->size, m->off) != (ssize_t)m->size
+			|| (fp = fmemopen(NULL, m->size + 1, "w+")) == NULL) {
+		free(buf);
+		return NULL;
+	}
+
+	fwrite(buf, 1, m->size, fp);
+	rewind(fp);
+	free(buf);
+
+	return fp;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// pack functions
+
+struct pack_part {
+	char name[32];
+	char filename[60];
+	unsigned int nand_addr;
+	unsigned int nand_size;
+};
+
+struct partition {
+	char name[32];
+	unsigned int start;
+	unsigned int size;
+};
+
+typedef struct {
+	unsigned int version;
+
+	char machine_model[0x22];
+	char machine_id[0x1e];
+	char manufacturer[0x38];
+
+	unsigned int num_package;
+	struct pack_part packages[16];
+
+	unsigned int num_partition;
+	struct partition partitions[64];
+
+	/* entries that did not fit the arrays above */
+	unsigned int extra_packages;
+	unsigned int extra_partitions;
+} PackImage;
+
+#define MAX_PACKAGES \
+	(sizeof(package_image.packages) / sizeof(package_image.packages[0]))
+#define MAX_PARTITIONS \
+	(sizeof(package_image.partitions) / sizeof(package_image.partitions[0]))
+
+static PackImage package_image;
+
+static FILE *fopen_at(int dirfd, const char *path)
+{
+	int fd;
+	FILE *fp;
+
+	if (pack_tar.fd >= 0)
+		return tar_fopen(path);
+
+	if ((fd = openat(dirfd, path, O_RDONLY)) < 0)
+		return NULL;
+
+	if ((fp = fdopen(fd, "r")) == NULL)
+		close(fd);
+
+	return fp;
+}
+
+int parse_partitions(char *str) {
+	char *parts;
+	char *part, *token1 = NULL, *ptr;
 	struct partition *p_part;
 	unsigned int i;
 
@@ -208,6 +1628,10 @@ int parse_partitions(char *str) {
 		part = strtok_r(parts, ",", &token1);
 
 		for (; part; part = strtok_r(NULL, ",", &token1)) {
+			if (package_image.num_partition >= MAX_PARTITIONS) {
+				package_image.extra_partitions++;
+				continue;
+			}
 			p_part = &(package_image.partitions[package_image.num_partition]);
 
 			p_part->size = strtol(part, &ptr, 16);
@@ -291,12 +1715,12 @@ int action_parse_key(char *key, char *value) {
 	return 0;
 }
 
-int parse_parameter(const char *fname) {
+int parse_parameter(int dirfd, const char *fname) {
 	char line[512], *startp, *endp;
 	char *key, *value;
 	FILE *fp;
 
-	if ((fp = fopen(fname, "r")) == NULL) {
+	if ((fp = fopen_at(dirfd, fname)) == NULL) {
 		printf("Can't open file: %s\n", fname);
 		return -1;
 	}
@@ -315,289 +1739,3291 @@ int parse_parameter(const char *fname) {
 			--endp;
 		endp[1] = 0;
 
-		if (*startp == '#' || *startp == 0)
-			continue;
+		if (*startp == '#' || *startp == 0)
+			continue;
+
+		key = startp;
+		value = strchr(startp, ':');
+
+		if (!value)
+			continue;
+
+		*value = '\0';
+		value++;
+
+		action_parse_key(key, value);
+	}
+
+	if (!feof(fp)) {
+		printf("File read failed!\n");
+		fclose(fp);
+		return -3;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static struct partition first_partition =
+{
+		"parameter",
+		0,
+		0x2000
+};
+
+struct partition* find_partition_byname(const char *name)
+{
+	int i;
+	struct partition *p_part;
+
+	for (i = package_image.num_partition - 1; i >= 0; i--)
+	{
+		p_part = &package_image.partitions[i];
+		if (strcmp(p_part->name, name) == 0)
+			return p_part;
+	}
+
+	if (strcmp(name, first_partition.name) == 0)
+	{
+		return &first_partition;
+	}
+
+	return NULL;
+}
+
+struct pack_part* find_package_byname(const char *name)
+{
+	int i;
+	struct pack_part *p_pack;
+
+	for (i = package_image.num_package - 1; i >= 0; i--)
+	{
+		p_pack = &package_image.packages[i];
+		if (strcmp(p_pack->name, name) == 0)
+			return p_pack;
+	}
+
+	return NULL;
+}
+
+void append_package(const char *name, const char *path)
+{
+	struct partition *p_part;
+	struct pack_part *p_pack;
+
+	/* an RKAF header has room for 16 parts */
+	if (package_image.num_package >= MAX_PACKAGES) {
+		package_image.extra_packages++;
+		return;
+	}
+	p_pack = &package_image.packages[package_image.num_package];
+
+	strncpy(p_pack->name, name, sizeof(p_pack->name));
+	strncpy(p_pack->filename, path, sizeof(p_pack->filename));
+
+	p_part = find_partition_byname(name);
+	if (p_part)
+	{
+		p_pack->nand_addr = p_part->start;
+		p_pack->nand_size = p_part->size;
+	} else {
+		p_pack->nand_addr = (unsigned int)-1;
+		p_pack->nand_size = 0;
+	}
+
+	package_image.num_package++;
+}
+
+int get_packages(int dirfd, const char *fname)
+{
+	char line[512], *startp, *endp;
+	char *name, *path;
+	FILE *fp;
+
+	if ((fp = fopen_at(dirfd, fname)) == NULL) {
+		printf("Can't open file: %s\n", fname);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		startp = line;
+		endp = line + strlen(line) - 1;
+		if (*endp != '\n' && *endp != '\r' && !feof(fp))
+			break;
+
+		// trim line
+		while (isspace(*startp))
+			++startp;
+
+		while (isspace(*endp))
+			--endp;
+		endp[1] = 0;
+
+		// skip UTF-8 BOM
+		if (startp[0] == (char)0xEF && startp[1] == (char)0xBB
+		 && startp[2] == (char)0xBF)
+			startp += 3;
+
+		if (*startp == '#' || *startp == 0)
+			continue;
+
+		name = startp;
+
+		while (*startp && *startp != ' ' && *startp != '\t')
+			startp++;
+
+		while (*startp == ' ' || *startp == '\t')
+		{
+			*startp = '\0';
+			startp++;
+		}
+
+		path = startp;
+
+		append_package(name, path);
+	}
+
+	if (!feof(fp)) {
+		printf("File read failed!\n");
+		fclose(fp);
+		return -3;
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+/*
+ * Packing is done in two steps.  plan_job() works out the complete layout
+ * from the parsed parameter/package-file and the input sizes, so the header
+ * is final before any payload is copied.  Every distinct input file is then
+ * read exactly once: its crc is computed on the way and the data is copied
+ * into every output slot that uses it.  The image crc is assembled from the
+ * per-slot crcs with rkcrc_combine(), so outputs are never read back.
+ * Inputs are read through rkio_stream(), so --io=uring keeps several reads
+ * in flight while the crc of the previous chunk is computed.
+ */
+
+#define PACK_SLOT_ALIGN		2048
+
+struct pack_input {
+	dev_t dev;
+	ino_t ino;
+	int fd;
+	uint64_t off;		/* of the data in a tar archive */
+	uint64_t size;
+	unsigned int crc;
+	char path[PATH_MAX];
+};
+
+struct pack_job {
+	char dstfile[PATH_MAX];
+	int fd;
+	struct update_header header;
+	struct update_extent extents[16];
+	int input[16];
+	uint64_t length;
+	unsigned int crc;
+	unsigned char param[PACK_SLOT_ALIGN];
+};
+
+static struct pack_input *pack_inputs;
+static unsigned int num_pack_inputs;
+static int copy_range_broken;
+static int plan_only;
+
+/* Wrap the parameter file: "PARM", length, data, crc, zero padded */
+static int load_parameter_slot(int dirfd, const char *path,
+		unsigned char *slot, uint64_t *size)
+{
+	struct param_header *header = (struct param_header *)slot;
+	unsigned int crc = 0;
+	size_t readlen;
+	FILE *fp;
+
+	if ((fp = fopen_at(dirfd, path)) == NULL)
+		return -1;
+
+	memset(slot, 0, PACK_SLOT_ALIGN);
+	memcpy(header->magic, "PARM", sizeof(header->magic));
+	readlen = fread(slot + sizeof(*header), 1, PACK_SLOT_ALIGN - 12, fp);
+	fclose(fp);
+
+	header->length = readlen;
+	RKCRC(crc, slot + sizeof(*header), readlen);
+	memcpy(slot + sizeof(*header) + readlen, &crc, sizeof(crc));
+	*size = readlen + 12;
+
+	return 0;
+}
+
+static int add_input(int dirfd, const char *path, uint64_t *size)
+{
+	struct tar_member *m = NULL;
+	struct pack_input *in;
+	struct stat st;
+	unsigned int i;
+	int fd;
+
+	if (pack_tar.fd >= 0) {
+		if ((m = tar_find(path)) == NULL || (fd = dup(pack_tar.fd)) < 0)
+			return -1;
+	} else if ((fd = openat(dirfd, path, O_RDONLY)) < 0) {
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return -1;
+	}
+
+	*size = m ? m->size : (uint64_t)st.st_size;
+	for (i = 0; i < num_pack_inputs; i++) {
+		if (pack_inputs[i].dev == st.st_dev && pack_inputs[i].ino == st.st_ino
+				&& pack_inputs[i].off == (m ? m->off : 0)) {
+			close(fd);
+			return i;
+		}
+	}
+
+	in = realloc(pack_inputs, (num_pack_inputs + 1) * sizeof(*in));
+	if (!in) {
+		close(fd);
+		return -1;
+	}
+	pack_inputs = in;
+
+	in = &pack_inputs[num_pack_inputs];
+	memset(in, 0, sizeof(*in));
+	in->dev = st.st_dev;
+	in->ino = st.st_ino;
+	in->fd = fd;
+	in->off = m ? m->off : 0;
+	in->size = *size;
+	snprintf(in->path, sizeof(in->path), "%s", path);
+
+	return num_pack_inputs++;
+}
+
+static void release_inputs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_pack_inputs; i++)
+		close(pack_inputs[i].fd);
+
+	free(pack_inputs);
+	pack_inputs = NULL;
+	num_pack_inputs = 0;
+}
+
+/*
+ * Legacy RKAF headers only hold 32-bit offsets.  Unless the large image
+ * extension was requested, refuse to write an image whose layout would be
+ * truncated, naming the first field that does not fit.
+ */
+static int check_legacy_layout(const struct update_header *header,
+		uint64_t length, const struct update_extent *extents)
+{
+	unsigned int i;
+
+	for (i = 0; i < header->num_parts; i++) {
+		if (!rkafp_extent_fits_legacy(&extents[i])) {
+			fprintf(stderr, "%s: pos 0x%" PRIx64 " size 0x%" PRIx64
+					" padded 0x%" PRIx64 " exceeds the 32-bit RKAF"
+					" header, use --large\n",
+					header->parts[i].name, extents[i].pos,
+					extents[i].size, extents[i].padded_size);
+			return -1;
+		}
+	}
+
+	if (length > RKAFP_LEGACY_MAX) {
+		fprintf(stderr, "image length 0x%" PRIx64 " exceeds the 32-bit RKAF"
+				" header, use --large\n", length);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Problems that only show at flash time: more entries than the RKAF header
+ * holds, images larger than their partition (nand_size is in 512-byte
+ * sectors, 0 for a partition that grows to the end of the device) and
+ * partitions that overlap.  Returns the number of problems; -pack only
+ * refuses the first kind, -plan all of them.
+ */
+static unsigned int check_fit(const struct pack_job *job, const char *level)
+{
+	const struct update_header *header = &job->header;
+	const struct partition *a, *b;
+	uint64_t a_end, b_end;
+	unsigned int i, j, problems = 0;
+
+	if (package_image.extra_packages) {
+		fprintf(stderr, "Error: package-file has %u entries, an RKAF"
+				" image holds %u\n", package_image.num_package
+				+ package_image.extra_packages, (unsigned int)MAX_PACKAGES);
+		problems++;
+	}
+
+	if (package_image.extra_partitions) {
+		fprintf(stderr, "%s: mtdparts has %u partitions, only the first"
+				" %u are used\n", level, package_image.num_partition
+				+ package_image.extra_partitions,
+				(unsigned int)MAX_PARTITIONS);
+		problems++;
+	}
+
+	for (i = 0; i < header->num_parts; i++) {
+		const struct update_part *part = &header->parts[i];
+
+		if (part->nand_addr == (unsigned int)-1 || part->nand_size == 0
+				|| strcmp(part->filename, "SELF") == 0)
+			continue;
+		if (job->extents[i].size > (uint64_t)part->nand_size * 512) {
+			fprintf(stderr, "%s: %s is 0x%" PRIX64 " bytes, partition"
+					" %s holds 0x%" PRIX64 "\n", level, part->filename,
+					job->extents[i].size, part->name,
+					(uint64_t)part->nand_size * 512);
+			problems++;
+		}
+	}
+
+	for (i = 0; i < package_image.num_partition; i++) {
+		a = &package_image.partitions[i];
+		a_end = a->size ? (uint64_t)a->start + a->size : UINT64_MAX;
+		for (j = i + 1; j < package_image.num_partition; j++) {
+			b = &package_image.partitions[j];
+			b_end = b->size ? (uint64_t)b->start + b->size : UINT64_MAX;
+			if (a->start < b_end && b->start < a_end) {
+				fprintf(stderr, "%s: partitions %s (0x%08X@0x%08X) and"
+						" %s (0x%08X@0x%08X) overlap\n", level,
+						a->name, a->size, a->start, b->name, b->size,
+						b->start);
+				problems++;
+			}
+		}
+	}
+
+	return problems;
+}
+
+/* Parse srcdir's parameter and package-file and lay out the image */
+static int plan_job(struct pack_job *job, const char *srcdir, int large)
+{
+	struct update_header *header = &job->header;
+	uint64_t pos = sizeof(*header);
+	unsigned int i;
+	int dirfd = -1, ret = -1;
+	struct stat st;
+
+	if (strcmp(srcdir, "-") == 0 || (stat(srcdir, &st) == 0
+			&& S_ISREG(st.st_mode))) {
+		if (tar_load(srcdir) != 0)
+			return -1;
+	} else if ((dirfd = open(srcdir, O_RDONLY | O_DIRECTORY)) < 0) {
+		printf("Can't open directory: %s\n", srcdir);
+		return -1;
+	}
+
+	memset(&package_image, 0, sizeof(package_image));
+
+	rkstats_begin("parse_parameter");
+	if (parse_parameter(dirfd, "parameter"))
+		goto out;
+	rkstats_end(0);
+
+	rkstats_begin("get_packages");
+	if (get_packages(dirfd, "package-file"))
+		goto out;
+	rkstats_end(0);
+
+	memset(header, 0, sizeof(*header));
+	memset(job->extents, 0, sizeof(job->extents));
+
+	for (i = 0; i < package_image.num_package; ++i) {
+		struct update_extent *extent = &job->extents[i];
+		struct pack_part *pack = &package_image.packages[i];
+
+		strcpy(header->parts[i].name, pack->name);
+		strcpy(header->parts[i].filename, pack->filename);
+		header->parts[i].nand_addr = pack->nand_addr;
+		header->parts[i].nand_size = pack->nand_size;
+		job->input[i] = -1;
+
+		if (strcmp(pack->filename, "SELF") == 0)
+			continue;
+
+		extent->pos = pos;
+		if (strcmp(pack->name, "parameter") == 0) {
+			if (load_parameter_slot(dirfd, pack->filename, job->param,
+					&extent->size) != 0)
+				continue;
+			extent->padded_size = PACK_SLOT_ALIGN;
+		} else {
+			/* missing files (e.g. RESERVED entries) get an empty slot */
+			job->input[i] = add_input(dirfd, pack->filename, &extent->size);
+			if (job->input[i] < 0)
+				continue;
+			extent->padded_size = (extent->size + PACK_SLOT_ALIGN - 1)
+					/ PACK_SLOT_ALIGN * PACK_SLOT_ALIGN;
+		}
+
+		if (extent->padded_size > RKAFP_MAX_LENGTH - pos) {
+			fprintf(stderr, "%s: image would exceed %" PRIu64 " bytes\n",
+					pack->filename, (uint64_t)RKAFP_MAX_LENGTH);
+			goto out;
+		}
+
+		if (!large && pos + extent->padded_size > RKAFP_LEGACY_MAX) {
+			fprintf(stderr, "%s: %" PRIu64 " bytes at offset 0x%" PRIx64
+					" exceed the 32-bit RKAF header, use --large\n",
+					pack->filename, extent->size, pos);
+			goto out;
+		}
+
+		pos += extent->padded_size;
+	}
+
+	memcpy(header->magic, RKAFP_MAGIC, sizeof(header->magic));
+	strcpy(header->manufacturer, package_image.manufacturer);
+	strcpy(header->model, package_image.machine_model);
+	strcpy(header->id, package_image.machine_id);
+	header->num_parts = package_image.num_package;
+	header->version = package_image.version;
+	job->length = pos;
+
+	for (i = 0; i < header->num_parts; i++)
+	{
+		if (strcmp(header->parts[i].filename, "SELF") == 0)
+		{
+			job->extents[i].size = job->length + 4;
+			job->extents[i].padded_size = (job->extents[i].size + 511) / 512 *512;
+		}
+	}
+
+	if (!large && check_legacy_layout(header, job->length, job->extents) != 0)
+		goto out;
+
+	rkafp_set_layout(header, job->length, job->extents, header->num_parts);
+
+	/* -plan reports these itself */
+	if (!plan_only && check_fit(job, "Warning") != 0
+			&& package_image.extra_packages)
+		goto out;
+	ret = 0;
+
+out:
+	if (dirfd >= 0)
+		close(dirfd);
+	tar_release();
+	return ret;
+}
+
+/*
+ * Put len bytes of in at offset off into a job's slot.  Data that has been
+ * read (buf) is written from that buffer, so the output is exactly what
+ * was hashed and the input is read once.  Only inputs that are not read at
+ * all (buf == NULL, crc from the rkd cache) are copied by the kernel,
+ * which can share the extents.
+ */
+static int copy_chunk(struct pack_input *in, const unsigned char *buf,
+		off_t off, size_t len, struct pack_job *job, off_t pos)
+{
+	if (buf) {
+		if (write_full(job->fd, buf, len, pos) != 0)
+			return -1;
+		rkio_written(job->fd, pos, len);
+		return 0;
+	}
+
+	while (len && !copy_range_broken) {
+		loff_t ioff = in->off + off, ooff = pos;
+		ssize_t n = copy_file_range(in->fd, &ioff, job->fd, &ooff, len, 0);
+
+		if (n > 0) {
+			rkio_written(job->fd, pos, n);
+			off += n;
+			pos += n;
+			len -= n;
+			continue;
+		}
+
+		if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+				|| errno == EOPNOTSUPP || errno == EBADF))
+			copy_range_broken = 1;
+		else
+			return -1;
+	}
+
+	if (len) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return 0;
+}
+
+struct import_ctx {
+	unsigned int idx;
+	struct pack_job *jobs;
+	unsigned int num_jobs;
+	uint64_t done;
+};
+
+static int import_chunk(void *arg, const unsigned char *buf, size_t n)
+{
+	struct import_ctx *ctx = arg;
+	struct pack_input *in = &pack_inputs[ctx->idx];
+	struct pack_job *jobs = ctx->jobs;
+	unsigned int j, i;
+
+	RKCRC(in->crc, buf, n);
+	rkmanifest_update(buf, n);
+	blockmap_update(ctx->idx, ctx->done, buf, n);
+
+	for (j = 0; j < ctx->num_jobs; j++) {
+		for (i = 0; i < jobs[j].header.num_parts; i++) {
+			if (jobs[j].input[i] != (int)ctx->idx)
+				continue;
+			if (copy_chunk(in, buf, ctx->done, n, &jobs[j],
+					jobs[j].extents[i].pos + ctx->done) != 0) {
+				fprintf(stderr, "Can't write %s: %s\n",
+						jobs[j].dstfile, strerror(errno));
+				return -1;
+			}
+		}
+	}
+
+	ctx->done += n;
+	return 0;
+}
+
+/*
+ * With a crc cached by rkd the input is not read at all: every slot is
+ * filled with copy_file_range alone.  Returns 0 when that worked.
+ */
+static int import_cached(unsigned int idx, struct pack_job *jobs,
+		unsigned int num_jobs)
+{
+	struct pack_input *in = &pack_inputs[idx];
+	unsigned int j, i;
+
+	if (copy_range_broken || rkmanifest.cur || blockmap.num_parts || in->off
+			|| !rkcache_get(in->fd, RKCACHE_RKCRC, in->size,
+			&in->crc, sizeof(in->crc)))
+		return -1;
+
+	for (j = 0; j < num_jobs; j++)
+		for (i = 0; i < jobs[j].header.num_parts; i++)
+			if (jobs[j].input[i] == (int)idx && copy_chunk(in, NULL, 0,
+					in->size, &jobs[j], jobs[j].extents[i].pos) != 0)
+				return -1;
+
+	return 0;
+}
+
+/* Read an input once, hashing it and filling every slot that uses it */
+static int import_input(unsigned int idx, struct pack_job *jobs,
+		unsigned int num_jobs)
+{
+	struct pack_input *in = &pack_inputs[idx];
+	struct import_ctx ctx = { idx, jobs, num_jobs, 0 };
+
+	if (import_cached(idx, jobs, num_jobs) == 0)
+		return 0;
+
+	in->crc = 0;
+	posix_fadvise(in->fd, in->off, in->size, POSIX_FADV_SEQUENTIAL);
+
+	if (rkio_stream(in->fd, in->off, in->size, -1, 0, import_chunk, &ctx) != 0) {
+		if (ctx.done < in->size && errno == EIO)
+			fprintf(stderr, "%s: file changed while packing\n", in->path);
+		return -1;
+	}
+
+	/* the cache is keyed by file, not by tar member */
+	if (!in->off)
+		rkcache_put(in->fd, RKCACHE_RKCRC, in->size, &in->crc, sizeof(in->crc));
+	return 0;
+}
+
+/* Padding, header and crc trailer once all inputs have been imported */
+static int finish_job(struct pack_job *job)
+{
+	static const unsigned char zero[PACK_SLOT_ALIGN];
+	unsigned int crc = 0;
+	unsigned int i;
+
+	rkstats_begin("header");
+	RKCRC(crc, &job->header, sizeof(job->header));
+	if (write_full(job->fd, &job->header, sizeof(job->header), 0) != 0)
+		return -1;
+	rkstats_end(sizeof(job->header));
+
+	for (i = 0; i < job->header.num_parts; i++) {
+		struct update_extent *extent = &job->extents[i];
+		unsigned int part_crc = 0;
+		uint64_t pad;
+
+		if (strcmp(job->header.parts[i].filename, "SELF") == 0
+				|| extent->padded_size == 0)
+			continue;
+
+		pad = extent->padded_size - extent->size;
+		if (job->input[i] >= 0) {
+			part_crc = pack_inputs[job->input[i]].crc;
+			if (write_full(job->fd, zero, pad, extent->pos + extent->size) != 0)
+				return -1;
+		} else {
+			RKCRC(part_crc, job->param, extent->size);
+			if (write_full(job->fd, job->param, PACK_SLOT_ALIGN, extent->pos) != 0)
+				return -1;
+		}
+
+		crc = rkcrc_combine(crc, rkcrc_shift(part_crc, pad), extent->padded_size);
+	}
+
+	printf("Add CRC...\n");
+	job->crc = crc;
+	return write_full(job->fd, &crc, sizeof(crc), job->length);
+}
+
+static int manifest_chunk(void *ctx, const unsigned char *buf, size_t len)
+{
+	(void)ctx;
+	rkmanifest_update(buf, len);
+	return 0;
+}
+
+/*
+ * With --manifest the inputs of a single job are imported in slot order,
+ * so the manifest sees the image in file order as it is written.  Only a
+ * second slot filled from the same input reads that input again.
+ */
+static int manifest_inputs(struct pack_job *job)
+{
+	unsigned int i, next = 0;
+
+	if (rkmanifest_begin(job->dstfile) != 0)
+		return -1;
+
+	for (i = 0; i < job->header.num_parts; i++)
+		if (strcmp(job->header.parts[i].filename, "SELF") != 0
+				&& job->extents[i].padded_size != 0)
+			rkmanifest_section(job->header.parts[i].name,
+					job->extents[i].pos, job->extents[i].size);
+
+	rkmanifest_update(&job->header, sizeof(job->header));
+	for (i = 0; i < job->header.num_parts; i++) {
+		struct update_extent *extent = &job->extents[i];
+		struct pack_input *in;
+
+		if (strcmp(job->header.parts[i].filename, "SELF") == 0
+				|| extent->padded_size == 0)
+			continue;
+
+		if (job->input[i] < 0) {
+			rkmanifest_update(job->param, PACK_SLOT_ALIGN);
+			continue;
+		}
+
+		in = &pack_inputs[job->input[i]];
+		if (job->input[i] == (int)next) {
+			printf("Add file: %s\n", in->path);
+			rkstats_begin("import:%s", in->path);
+			if (import_input(next++, job, 1) != 0)
+				return -1;
+			rkstats_end(in->size);
+		} else if (rkio_stream(in->fd, in->off, in->size, -1, 0,
+				manifest_chunk, NULL) != 0) {
+			return -1;
+		}
+		rkmanifest_zero(extent->padded_size - extent->size);
+	}
+
+	return 0;
+}
+
+static int pack_jobs(struct pack_job *jobs, unsigned int num_jobs)
+{
+	unsigned int i, j;
+	int ret = -1;
+
+	for (j = 0; j < num_jobs; j++) {
+		jobs[j].fd = open(jobs[j].dstfile, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+		if (jobs[j].fd < 0) {
+			printf("Can't open destination file \"%s\": %s\n",
+					jobs[j].dstfile, strerror(errno));
+			goto out;
+		}
+	}
+
+	if (rkmanifest.path && num_jobs == 1) {
+		if (manifest_inputs(jobs) != 0)
+			goto out;
+	} else {
+		for (i = 0; i < num_pack_inputs; i++) {
+			printf("Add file: %s\n", pack_inputs[i].path);
+			rkstats_begin("import:%s", pack_inputs[i].path);
+			if (import_input(i, jobs, num_jobs) != 0)
+				goto out;
+			rkstats_end(pack_inputs[i].size);
+		}
+	}
+
+	for (j = 0; j < num_jobs; j++)
+		if (finish_job(&jobs[j]) != 0) {
+			fprintf(stderr, "Can't write %s: %s\n", jobs[j].dstfile,
+					strerror(errno));
+			goto out;
+		}
+
+	if (rkmanifest.cur) {
+		rkmanifest_update(&jobs[0].crc, sizeof(jobs[0].crc));
+		if (rkmanifest_finish() != 0)
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	for (j = 0; j < num_jobs; j++) {
+		if (jobs[j].fd >= 0 && ret == 0 && rkio_flush(jobs[j].fd) != 0)
+			ret = -1;
+		if (jobs[j].fd >= 0 && close(jobs[j].fd) != 0)
+			ret = -1;
+	}
+	for (j = 0; j < num_jobs; j++) {
+		if (ret != 0 && jobs[j].fd >= 0)
+			unlink(jobs[j].dstfile);
+	}
+
+	return ret;
+}
+
+int pack_update(const char* srcdir, const char* dstfile, int large) {
+	struct pack_job job;
+	int ret;
+
+	printf("------ PACKAGE ------\n");
+	memset(&job, 0, sizeof(job));
+	job.fd = -1;
+	snprintf(job.dstfile, sizeof(job.dstfile), "%s", dstfile);
+
+	if (plan_job(&job, srcdir, large) != 0 || (blockmap.path
+			&& blockmap_plan(&job.header, job.extents, job.input) != 0)) {
+		blockmap_release();
+		release_inputs();
+		return -1;
+	}
+
+	/* the side outputs are only produced by a real pack */
+	if (!rkmanifest.path && !blockmap.path) {
+		unsigned int i;
+
+		rkbuild_begin("afptool -pack");
+		rkbuild_add(&job.header, sizeof(job.header));
+		rkbuild_add(job.extents, sizeof(job.extents));
+		rkbuild_add(job.input, sizeof(job.input));
+		rkbuild_add(job.param, sizeof(job.param));
+		rkbuild_add(&job.length, sizeof(job.length));
+		for (i = 0; i < num_pack_inputs; i++)
+			rkbuild_add_fd(pack_inputs[i].fd, pack_inputs[i].off,
+					pack_inputs[i].size);
+		if (rkbuild_fetch(dstfile) == 0) {
+			release_inputs();
+			printf("------ OK ------\n");
+			return 0;
+		}
+	}
+
+	ret = pack_jobs(&job, 1);
+	if (ret == 0 && blockmap.path)
+		ret = blockmap_write(blockmap.path);
+	if (ret == 0)
+		rkbuild_store(dstfile);
+	blockmap_release();
+	release_inputs();
+
+	if (ret == 0)
+		printf("------ OK ------\n");
+
+	return ret;
+}
+
+/*
+ * -plan lays the image out like -pack, from the parameter, the package-file
+ * and the sizes of the inputs, and reports what -pack would do without
+ * reading any payload: the layout, the problems check_fit() finds and the
+ * bytes that would be read, written and checksummed.
+ */
+int plan_update(const char *srcdir, int large)
+{
+	struct pack_job job;
+	uint64_t read = 0, hash;
+	unsigned int i, slots = 0, files = 0, problems;
+
+	printf("------ PLAN ------\n");
+	memset(&job, 0, sizeof(job));
+	job.fd = -1;
+	plan_only = 1;
+
+	if (plan_job(&job, srcdir, large) != 0) {
+		release_inputs();
+		return -1;
+	}
+
+	for (i = 0; i < job.header.num_parts; i++) {
+		const struct update_part *part = &job.header.parts[i];
+
+		printf("%s\t%s\t0x%08" PRIX64 "\t0x%08" PRIX64, part->name,
+				part->filename, job.extents[i].pos, job.extents[i].size);
+		if (part->nand_addr != (unsigned int)-1)
+			printf("\t0x%08X@0x%08X", part->nand_size, part->nand_addr);
+		if (job.input[i] >= 0) {
+			slots++;
+		} else if (strcmp(part->name, "parameter") == 0
+				&& job.extents[i].size >= 12) {
+			read += job.extents[i].size - 12;
+			files++;
+		} else if (strcmp(part->filename, "SELF") != 0) {
+			printf("\t(missing, empty slot)");
+		}
+		printf("\n");
+	}
+
+	for (i = 0; i < num_pack_inputs; i++)
+		read += pack_inputs[i].size;
+	hash = read + sizeof(job.header);
+
+	printf("read:  %" PRIu64 " bytes from %u files", read,
+			num_pack_inputs + files);
+	if (slots > num_pack_inputs)
+		printf(" (%u slots share them)", slots);
+	printf("\nwrite: %" PRIu64 " bytes (image)\n", job.length + 4);
+	printf("hash:  %" PRIu64 " bytes (rkcrc)\n", hash);
+
+	problems = check_fit(&job, "Error");
+	release_inputs();
+
+	if (problems) {
+		printf("------ %u problem%s ------\n", problems,
+				problems > 1 ? "s" : "");
+		return -1;
+	}
+
+	printf("------ OK ------\n");
+	return 0;
+}
+
+/*
+ * Pack several variants listed in a manifest ("<srcdir> <output>" per
+ * line).  Inputs shared between variants (same device and inode) are read
+ * and checksummed once for all outputs.
+ */
+int pack_batch(const char *manifest, int large) {
+	struct pack_job *jobs = NULL, *tmp;
+	unsigned int num_jobs = 0;
+	char line[2 * PATH_MAX], srcdir[PATH_MAX];
+	int ret = -1;
+	FILE *fp;
+
+	printf("------ PACKAGE BATCH ------\n");
+
+	if ((fp = fopen(manifest, "r")) == NULL) {
+		printf("Can't open file: %s\n", manifest);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char dst[PATH_MAX];
+
+		if (sscanf(line, "%4095s %4095s", srcdir, dst) != 2 || srcdir[0] == '#')
+			continue;
+
+		if ((tmp = realloc(jobs, (num_jobs + 1) * sizeof(*jobs))) == NULL)
+			goto out;
+		jobs = tmp;
+
+		memset(&jobs[num_jobs], 0, sizeof(*jobs));
+		jobs[num_jobs].fd = -1;
+		snprintf(jobs[num_jobs].dstfile, sizeof(jobs->dstfile), "%s", dst);
+
+		printf("Plan: %s -> %s\n", srcdir, dst);
+		if (plan_job(&jobs[num_jobs], srcdir, large) != 0)
+			goto out;
+		num_jobs++;
+	}
+
+	printf("%u outputs, %u distinct inputs\n", num_jobs, num_pack_inputs);
+	ret = pack_jobs(jobs, num_jobs);
+
+	if (ret == 0)
+		printf("------ OK ------\n");
+
+out:
+	fclose(fp);
+	release_inputs();
+	free(jobs);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// watch functions
+
+/*
+ * -watch packs once, then rebuilds the image whenever parameter,
+ * package-file or one of the inputs changes.  Slots whose input kept its
+ * identity (inode, size, mtime, ctime) keep their bytes and crc.  A changed
+ * input is rewritten in place while it fits its padded_size, otherwise it
+ * moves to the end of the image and its old slot is zeroed.  The crc is
+ * recombined from the per-slot crcs, so a rebuild costs about as much I/O
+ * as the changed inputs.  A new package-file layout means a full repack.
+ */
+
+#define WATCH_DEBOUNCE_MS	200
+#define WATCH_MAX_NAMES		(16 + 2)
+
+struct watch_slot {
+	int has_input;
+	struct stat st;		/* input identity when the slot was written */
+	unsigned int crc;	/* crc of the slot's size bytes */
+};
+
+struct watch_name {
+	int wd;
+	char name[NAME_MAX + 1];
+};
+
+struct watch_state {
+	const char *srcdir;
+	const char *dstfile;
+	int large;
+	int valid;		/* dstfile holds job's layout */
+	struct stat dst;
+	struct pack_job job;
+	struct watch_slot slots[16];
+	int ifd;
+	unsigned int num_names;
+	struct watch_name names[WATCH_MAX_NAMES];
+};
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+			&& a->st_size == b->st_size
+			&& a->st_mtim.tv_sec == b->st_mtim.tv_sec
+			&& a->st_mtim.tv_nsec == b->st_mtim.tv_nsec
+			&& a->st_ctim.tv_sec == b->st_ctim.tv_sec
+			&& a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+static int zero_range(int fd, uint64_t off, uint64_t len)
+{
+	static const unsigned char zero[PACK_SLOT_ALIGN];
+
+	if (len == 0 || fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			off, len) == 0)
+		return 0;
+
+	while (len) {
+		size_t n = len < sizeof(zero) ? len : sizeof(zero);
+
+		if (write_full(fd, zero, n, off) != 0)
+			return -1;
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Image crc from the header and per-slot crcs; gaps between slots are zero */
+static unsigned int layout_crc(const struct pack_job *job,
+		const struct watch_slot *slots)
+{
+	const struct update_header *header = &job->header;
+	unsigned int crc = 0, order[16], i, j, n = 0;
+	uint64_t cur = sizeof(*header);
+
+	RKCRC(crc, header, sizeof(*header));
+
+	for (i = 0; i < header->num_parts; i++) {
+		if (strcmp(header->parts[i].filename, "SELF") == 0
+				|| job->extents[i].padded_size == 0)
+			continue;
+		for (j = n++; j > 0 && job->extents[order[j - 1]].pos >
+				job->extents[i].pos; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for (i = 0; i < n; i++) {
+		const struct update_extent *e = &job->extents[order[i]];
+
+		crc = rkcrc_shift(crc, e->pos - cur);
+		crc = rkcrc_combine(crc, rkcrc_shift(slots[order[i]].crc,
+				e->padded_size - e->size), e->padded_size);
+		cur = e->pos + e->padded_size;
+	}
+
+	return rkcrc_shift(crc, job->length - cur);
+}
+
+/* Slot crcs of job; with changed set, only those slots are recomputed */
+static void slot_crcs(const struct pack_job *job, struct watch_slot *slots,
+		const int *changed)
+{
+	unsigned int i;
+
+	for (i = 0; i < job->header.num_parts; i++) {
+		if (changed && !changed[i])
+			continue;
+
+		slots[i].crc = 0;
+		if (job->input[i] >= 0)
+			slots[i].crc = pack_inputs[job->input[i]].crc;
+		else if (job->extents[i].padded_size == PACK_SLOT_ALIGN)
+			RKCRC(slots[i].crc, job->param, job->extents[i].size);
+	}
+}
+
+static void watch_record(struct watch_state *w, const struct pack_job *job,
+		const struct watch_slot *slots)
+{
+	unsigned int i;
+
+	for (i = 0; i < job->header.num_parts; i++) {
+		w->slots[i].crc = slots[i].crc;
+		w->slots[i].has_input = job->input[i] >= 0;
+		if (w->slots[i].has_input)
+			fstat(pack_inputs[job->input[i]].fd, &w->slots[i].st);
+	}
+
+	w->job = *job;
+	w->valid = stat(w->dstfile, &w->dst) == 0;
+}
+
+/* Returns 1 when the layout can't be updated in place and needs a repack */
+static int watch_incremental(struct watch_state *w, struct pack_job *job)
+{
+	const struct pack_job *old = &w->job;
+	struct watch_slot slots[16];
+	uint64_t length = old->length, written = 0;
+	int changed[16], ret = -1;
+	unsigned int crc, i, j;
+	struct stat st;
+
+	if (!w->valid || stat(w->dstfile, &st) != 0 || !same_file(&st, &w->dst)
+			|| job->header.num_parts != old->header.num_parts)
+		return 1;
+
+	for (i = 0; i < job->header.num_parts; i++)
+		if (strcmp(job->header.parts[i].name, old->header.parts[i].name) != 0
+				|| strcmp(job->header.parts[i].filename,
+					old->header.parts[i].filename) != 0)
+			return 1;
+
+	/* keep every slot where it is unless it changed and outgrew it */
+	for (i = 0; i < job->header.num_parts; i++) {
+		struct update_extent *e = &job->extents[i];
+		const struct update_extent *o = &old->extents[i];
+
+		if (strcmp(job->header.parts[i].filename, "SELF") == 0) {
+			changed[i] = 0;
+			continue;
+		}
+
+		if (job->input[i] >= 0) {
+			fstat(pack_inputs[job->input[i]].fd, &st);
+			changed[i] = !w->slots[i].has_input
+					|| !same_file(&st, &w->slots[i].st);
+		} else {
+			changed[i] = e->size != o->size || e->padded_size != o->padded_size
+					|| memcmp(job->param, old->param, PACK_SLOT_ALIGN) != 0;
+		}
+
+		if (!changed[i]) {
+			*e = *o;
+		} else if (e->size <= o->padded_size) {
+			e->pos = o->pos;
+			e->padded_size = o->padded_size;
+		} else {
+			e->pos = length;
+			length += e->padded_size;
+		}
+	}
+
+	if (length > RKAFP_MAX_LENGTH) {
+		fprintf(stderr, "image would exceed %" PRIu64 " bytes\n",
+				(uint64_t)RKAFP_MAX_LENGTH);
+		return -1;
+	}
+
+	job->length = length;
+	for (i = 0; i < job->header.num_parts; i++) {
+		if (strcmp(job->header.parts[i].filename, "SELF") == 0) {
+			job->extents[i].size = length + 4;
+			job->extents[i].padded_size = (length + 4 + 511) / 512 * 512;
+		}
+	}
+
+	if (!w->large && check_legacy_layout(&job->header, length, job->extents) != 0)
+		return -1;
+	rkafp_set_layout(&job->header, length, job->extents, job->header.num_parts);
+
+	if ((job->fd = open(w->dstfile, O_RDWR)) < 0
+			|| ftruncate(job->fd, length + 4) != 0)
+		goto out;
+
+	for (i = 0; i < job->header.num_parts; i++) {
+		struct update_extent *e = &job->extents[i];
+		const struct update_extent *o = &old->extents[i];
+
+		if (!changed[i])
+			continue;
+
+		printf("Update: %s (%" PRIu64 " bytes)\n", job->header.parts[i].filename,
+				e->size);
+
+		if (e->pos != o->pos) {
+			/* moved to the end: clear the old slot and the new padding */
+			if (zero_range(job->fd, o->pos, o->size) != 0
+					|| zero_range(job->fd, e->pos + e->size,
+						e->padded_size - e->size) != 0)
+				goto out;
+		} else if (o->size > e->size) {
+			if (zero_range(job->fd, e->pos + e->size, o->size - e->size) != 0)
+				goto out;
+		}
+
+		if (job->input[i] < 0 && e->size) {
+			if (write_full(job->fd, job->param, PACK_SLOT_ALIGN, e->pos) != 0)
+				goto out;
+			written += PACK_SLOT_ALIGN;
+		}
+	}
+
+	/* an input used by several slots is still read only once */
+	for (i = 0; i < job->header.num_parts; i++) {
+		int idx = job->input[i];
+
+		if (!changed[i] || idx < 0)
+			continue;
+		for (j = 0; j < i; j++)
+			if (changed[j] && job->input[j] == idx)
+				break;
+		if (j < i)
+			continue;
+
+		if (import_input(idx, job, 1) != 0)
+			goto out;
+		written += pack_inputs[idx].size;
+	}
+
+	memcpy(slots, w->slots, sizeof(slots));
+	slot_crcs(job, slots, changed);
+	crc = layout_crc(job, slots);
+	if (write_full(job->fd, &job->header, sizeof(job->header), 0) != 0
+			|| write_full(job->fd, &crc, sizeof(crc), length) != 0
+			|| rkio_flush(job->fd) != 0)
+		goto out;
+
+	printf("Updated %s: %" PRIu64 " of %" PRIu64 " bytes rewritten\n",
+			w->dstfile, written + sizeof(job->header) + 4, length + 4);
+	ret = 0;
+
+out:
+	if (ret != 0)
+		fprintf(stderr, "Can't update %s: %s\n", w->dstfile, strerror(errno));
+	if (job->fd >= 0 && close(job->fd) != 0)
+		ret = -1;
+	job->fd = -1;
+	if (ret == 0)
+		watch_record(w, job, slots);
+	else
+		w->valid = 0;
+
+	return ret;
+}
+
+static int watch_rebuild(struct watch_state *w)
+{
+	static struct pack_job job;
+	double start = rkstats_now();
+	int ret;
+
+	memset(&job, 0, sizeof(job));
+	job.fd = -1;
+	snprintf(job.dstfile, sizeof(job.dstfile), "%s", w->dstfile);
+
+	if (plan_job(&job, w->srcdir, w->large) != 0) {
+		release_inputs();
+		return -1;
+	}
+
+	rkstats_begin("rebuild");
+	ret = watch_incremental(w, &job);
+	if (ret > 0) {
+		printf("------ PACKAGE ------\n");
+		ret = pack_jobs(&job, 1);
+		if (ret == 0) {
+			struct watch_slot slots[16];
+
+			slot_crcs(&job, slots, NULL);
+			watch_record(w, &job, slots);
+		} else {
+			w->valid = 0;
+		}
+	}
+	rkstats_end(job.length);
+	release_inputs();
+
+	if (ret == 0)
+		printf("------ OK (%.3f s) ------\n", rkstats_now() - start);
+	fflush(stdout);
+
+	return ret;
+}
+
+static void watch_add(struct watch_state *w, const char *path)
+{
+	char dir[PATH_MAX], *name;
+	int wd;
+
+	if (w->num_names == WATCH_MAX_NAMES)
+		return;
+
+	snprintf(dir, sizeof(dir), "%s/%s", w->srcdir, path);
+	name = strrchr(dir, '/');
+	*name++ = '\0';
+
+	/* watch the directory: editors and build systems replace files */
+	wd = inotify_add_watch(w->ifd, dir, IN_CLOSE_WRITE | IN_MOVED_TO
+			| IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ATTRIB);
+	if (wd < 0) {
+		fprintf(stderr, "Can't watch %s: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	w->names[w->num_names].wd = wd;
+	snprintf(w->names[w->num_names].name, sizeof(w->names[0].name), "%s", name);
+	w->num_names++;
+}
+
+/* Block until a watched file changed and no event arrived for a while */
+static int watch_wait(struct watch_state *w)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int pending = 0;
+
+	for (;;) {
+		struct pollfd pfd = { w->ifd, POLLIN, 0 };
+		ssize_t len;
+		char *p;
+		int r;
+
+		r = poll(&pfd, 1, pending ? WATCH_DEBOUNCE_MS : -1);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			return 0;
+
+		if ((len = read(w->ifd, buf, sizeof(buf))) <= 0)
+			continue;
+
+		for (p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			unsigned int i;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+				pending = 1;
+			for (i = 0; ev->len && i < w->num_names; i++)
+				if (w->names[i].wd == ev->wd
+						&& strcmp(w->names[i].name, ev->name) == 0)
+					pending = 1;
+
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+int watch_update(const char *srcdir, const char *dstfile, int large)
+{
+	static struct watch_state w;
+	unsigned int i;
+	struct stat st;
+
+	if (stat(srcdir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "-watch needs a source directory\n");
+		return -1;
+	}
+
+	memset(&w, 0, sizeof(w));
+	w.srcdir = srcdir;
+	w.dstfile = dstfile;
+	w.large = large;
+
+	if ((w.ifd = inotify_init1(IN_CLOEXEC)) < 0) {
+		fprintf(stderr, "inotify: %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (;;) {
+		if (watch_rebuild(&w) != 0)
+			printf("------ FAILED, waiting for changes ------\n");
+
+		/* the watch list follows package-file */
+		w.num_names = 0;
+		watch_add(&w, "parameter");
+		watch_add(&w, "package-file");
+		for (i = 0; i < package_image.num_package; i++)
+			if (strcmp(package_image.packages[i].filename, "SELF") != 0)
+				watch_add(&w, package_image.packages[i].filename);
+
+		printf("Watching %s for changes...\n", srcdir);
+		fflush(stdout);
+		if (watch_wait(&w) != 0)
+			return -1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// delta functions
+
+/*
+ * -diff matches the partitions of two images by name.  Identical partitions
+ * become a single COPY; changed ones are diffed against their old version
+ * with a rolling hash over fixed-size blocks of the old data, one thread per
+ * partition.  -apply streams the delta with a fixed-size buffer and only
+ * keeps the result if it matches the RKAF crc.
+ */
+
+#define DELTA_BLOCK		64
+#define DELTA_MAX_BLOCKS	(16 << 20)
+#define DELTA_HASH_MULT		0x01000193
+#define DELTA_BUF_SIZE		(1 << 20)
+
+struct mapped_image {
+	int fd;
+	const unsigned char *data;
+	uint64_t size;
+	struct update_header header;
+	uint64_t length;
+	unsigned int crc;
+};
+
+struct delta_region {
+	uint64_t pos;
+	uint64_t len;
+	uint64_t old_pos;
+	uint64_t old_len;
+	struct delta_op *ops;	/* DELTA_DATA offsets point into the new image */
+	size_t num_ops;
+	size_t max_ops;
+	int failed;
+};
+
+struct delta_job {
+	const struct mapped_image *old_img;
+	const struct mapped_image *new_img;
+	struct delta_region *regions;
+	unsigned int num_regions;
+	unsigned int next;
+	pthread_mutex_t lock;
+};
+
+static int map_image(const char *path, struct mapped_image *img)
+{
+	struct stat st;
+	void *data;
+
+	memset(img, 0, sizeof(*img));
+	if ((img->fd = open(path, O_RDONLY)) < 0 || fstat(img->fd, &st) != 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	img->size = st.st_size;
+	if (img->size < sizeof(img->header) + 4) {
+		fprintf(stderr, "%s: file too small\n", path);
+		goto fail;
+	}
+
+	data = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap failed: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	img->data = data;
+
+	memcpy(&img->header, img->data, sizeof(img->header));
+	if (strncmp(img->header.magic, RKAFP_MAGIC, sizeof(img->header.magic)) != 0
+			|| img->header.num_parts > 16) {
+		fprintf(stderr, "%s: Invalid header magic\n", path);
+		goto fail;
+	}
+
+	img->length = rkafp_get_length(&img->header);
+	if (img->length > img->size - 4) {
+		fprintf(stderr, "%s: image truncated\n", path);
+		goto fail;
+	}
+	memcpy(&img->crc, img->data + img->length, sizeof(img->crc));
+
+	return 0;
+
+fail:
+	if (img->data)
+		munmap((void *)img->data, img->size);
+	if (img->fd >= 0)
+		close(img->fd);
+	return -1;
+}
+
+static void unmap_image(struct mapped_image *img)
+{
+	munmap((void *)img->data, img->size);
+	close(img->fd);
+}
+
+static int region_emit(struct delta_region *r, uint32_t type, uint64_t offset,
+		uint64_t length)
+{
+	struct delta_op *op;
+
+	if (length == 0)
+		return 0;
+
+	/* merge with the previous op when it continues it */
+	if (r->num_ops) {
+		op = &r->ops[r->num_ops - 1];
+		if (op->type == type && op->offset + op->length == offset) {
+			op->length += length;
+			return 0;
+		}
+	}
+
+	if (r->num_ops == r->max_ops) {
+		size_t max = r->max_ops ? 2 * r->max_ops : 64;
+		if ((op = realloc(r->ops, max * sizeof(*op))) == NULL) {
+			r->failed = 1;
+			return -1;
+		}
+		r->ops = op;
+		r->max_ops = max;
+	}
+
+	op = &r->ops[r->num_ops++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->offset = offset;
+	op->length = length;
+
+	return 0;
+}
+
+static inline uint32_t block_hash(const unsigned char *p, size_t len)
+{
+	uint32_t h = 0;
+
+	while (len--)
+		h = h * DELTA_HASH_MULT + *p++;
+
+	return h;
+}
+
+static void diff_region(struct delta_region *r, const unsigned char *old,
+		const unsigned char *new)
+{
+	struct { uint32_t hash, block; } *table;
+	uint64_t i, lit, n = r->len, nblocks, mask, j;
+	uint32_t h, pow = 1;
+	size_t block = DELTA_BLOCK;
+	unsigned bits = 1;
+
+	old += r->old_pos;
+	new += r->pos;
+
+	if (r->old_len == n && memcmp(old, new, n) == 0) {
+		region_emit(r, DELTA_COPY, r->old_pos, n);
+		return;
+	}
+
+	while (r->old_len / block > DELTA_MAX_BLOCKS)
+		block *= 2;
+
+	nblocks = r->old_len / block;
+	if (nblocks == 0 || n < block) {
+		region_emit(r, DELTA_DATA, r->pos, n);
+		return;
+	}
+
+	while ((1ULL << bits) < 2 * nblocks)
+		bits++;
+	mask = (1ULL << bits) - 1;
+
+	if ((table = calloc(mask + 1, sizeof(*table))) == NULL) {
+		r->failed = 1;
+		return;
+	}
+
+	/* index old blocks; the first block wins for duplicate hashes */
+	for (j = 0; j < nblocks; j++) {
+		h = block_hash(old + j * block, block);
+		for (i = (h * 0x9E3779B1u) & mask; table[i].block; i = (i + 1) & mask)
+			if (table[i].hash == h)
+				break;
+		if (!table[i].block) {
+			table[i].hash = h;
+			table[i].block = j + 1;
+		}
+	}
+
+	for (j = 1; j < block; j++)
+		pow *= DELTA_HASH_MULT;
+
+	i = lit = 0;
+	h = block_hash(new, block);
+	while (i + block <= n) {
+		uint64_t slot, os, ns, oe, ne;
+
+		for (slot = (h * 0x9E3779B1u) & mask; table[slot].block;
+				slot = (slot + 1) & mask)
+			if (table[slot].hash == h)
+				break;
+
+		os = table[slot].block ? (table[slot].block - 1) * block : 0;
+		if (!table[slot].block || memcmp(new + i, old + os, block) != 0) {
+			if (i + block < n)
+				h = (h - new[i] * pow) * DELTA_HASH_MULT + new[i + block];
+			i++;
+			continue;
+		}
+
+		ns = i;
+		while (ns > lit && os > 0 && new[ns - 1] == old[os - 1])
+			ns--, os--;
+
+		ne = i + block;
+		oe = os + (ne - ns);
+		while (ne + 4096 <= n && oe + 4096 <= r->old_len
+				&& memcmp(new + ne, old + oe, 4096) == 0)
+			ne += 4096, oe += 4096;
+		while (ne < n && oe < r->old_len && new[ne] == old[oe])
+			ne++, oe++;
+
+		region_emit(r, DELTA_DATA, r->pos + lit, ns - lit);
+		region_emit(r, DELTA_COPY, r->old_pos + os, ne - ns);
+
+		i = lit = ne;
+		if (i + block <= n)
+			h = block_hash(new + i, block);
+	}
+
+	region_emit(r, DELTA_DATA, r->pos + lit, n - lit);
+	free(table);
+}
+
+static void *diff_worker(void *arg)
+{
+	struct delta_job *job = arg;
+
+	for (;;) {
+		struct delta_region *r;
+
+		pthread_mutex_lock(&job->lock);
+		r = job->next < job->num_regions ? &job->regions[job->next++] : NULL;
+		pthread_mutex_unlock(&job->lock);
+
+		if (!r)
+			break;
+
+		diff_region(r, job->old_img->data, job->new_img->data);
+	}
+
+	return NULL;
+}
+
+static int add_region(struct delta_job *job, uint64_t pos, uint64_t len,
+		uint64_t old_pos, uint64_t old_len)
+{
+	struct delta_region *r;
+
+	if (len == 0)
+		return 0;
+
+	r = &job->regions[job->num_regions++];
+	memset(r, 0, sizeof(*r));
+	r->pos = pos;
+	r->len = len;
+	r->old_pos = old_pos;
+	r->old_len = old_len;
+
+	return 0;
+}
+
+/*
+ * Cover the new image with regions: header, partitions (sorted), trailer.
+ * Only [0, length + 4) of either image is used; bytes after the crc
+ * trailer are not part of the image.
+ */
+static void plan_regions(struct delta_job *job)
+{
+	const struct mapped_image *o = job->old_img, *n = job->new_img;
+	struct update_extent ext[16];
+	unsigned int order[16], num = 0, i, j;
+	uint64_t cur = 0, old_end = o->length + 4;
+
+	for (i = 0; i < n->header.num_parts; i++) {
+		rkafp_get_extent(&n->header, i, &ext[i]);
+		if (strcmp(n->header.parts[i].filename, "SELF") == 0
+				|| ext[i].padded_size == 0 || ext[i].pos > n->length
+				|| ext[i].padded_size > n->length - ext[i].pos)
+			continue;
+
+		for (j = num; j > 0 && ext[order[j - 1]].pos > ext[i].pos; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+		num++;
+	}
+
+	for (j = 0; j < num; j++) {
+		const struct update_extent *e = &ext[order[j]];
+		uint64_t old_pos = 0, old_len = 0;
+
+		if (e->pos < cur)
+			continue;
+
+		/* the gap before the partition, usually the header */
+		add_region(job, cur, e->pos - cur, cur, cur < old_end ?
+				(e->pos < old_end ? e->pos : old_end) - cur : 0);
+
+		for (i = 0; i < o->header.num_parts; i++) {
+			struct update_extent oe;
+
+			if (strcmp(o->header.parts[i].name,
+					n->header.parts[order[j]].name) != 0)
+				continue;
+
+			rkafp_get_extent(&o->header, i, &oe);
+			if (oe.pos <= o->length && oe.padded_size <= o->length - oe.pos) {
+				old_pos = oe.pos;
+				old_len = oe.padded_size;
+			}
+			break;
+		}
+
+		add_region(job, e->pos, e->padded_size, old_pos, old_len);
+		cur = e->pos + e->padded_size;
+	}
+
+	add_region(job, cur, n->length + 4 - cur, 0, 0);
+}
+
+int diff_update(const char *oldfile, const char *newfile, const char *deltafile)
+{
+	struct mapped_image old_img, new_img;
+	struct delta_region regions[2 * 16 + 1];
+	struct delta_header header;
+	struct delta_job job;
+	pthread_t threads[16];
+	struct delta_op end;
+	long nthreads;
+	uint64_t copied = 0, literal = 0;
+	unsigned int i;
+	size_t k;
+	FILE *fp = NULL;
+	int ret = -1;
+
+	if (map_image(oldfile, &old_img) != 0)
+		return -1;
+	if (map_image(newfile, &new_img) != 0) {
+		unmap_image(&old_img);
+		return -1;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.old_img = &old_img;
+	job.new_img = &new_img;
+	job.regions = regions;
+	pthread_mutex_init(&job.lock, NULL);
+	plan_regions(&job);
+
+	printf("------ DIFF ------\n");
+	rkstats_begin("diff");
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > 16)
+		nthreads = 16;
+	if (nthreads > (long)job.num_regions)
+		nthreads = job.num_regions;
+
+	/* run with the threads we get, or on this one */
+	for (i = 0; i < (unsigned int)nthreads; i++)
+		if (pthread_create(&threads[i], NULL, diff_worker, &job) != 0)
+			break;
+	nthreads = i;
+	if (nthreads == 0)
+		diff_worker(&job);
+	for (i = 0; i < (unsigned int)nthreads; i++)
+		pthread_join(threads[i], NULL);
+	rkstats_end(new_img.length + 4);
+
+	for (i = 0; i < job.num_regions; i++)
+		if (regions[i].failed) {
+			fprintf(stderr, "Out of memory\n");
+			goto out;
+		}
+
+	if ((fp = fopen(deltafile, "wb")) == NULL) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", deltafile,
+				strerror(errno));
+		goto out;
+	}
+
+	rkstats_begin("write");
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RKDELTA_MAGIC, sizeof(header.magic));
+	header.version = RKDELTA_VERSION;
+	header.old_length = old_img.length + 4;
+	header.new_length = new_img.length + 4;
+	header.old_crc = old_img.crc;
+	header.new_crc = new_img.crc;
+	fwrite(&header, sizeof(header), 1, fp);
+
+	for (i = 0; i < job.num_regions; i++) {
+		struct delta_region *r = &regions[i];
+		uint64_t part_copied = 0;
+
+		for (k = 0; k < r->num_ops; k++) {
+			struct delta_op op = r->ops[k];
+
+			if (op.type == DELTA_DATA) {
+				op.offset = 0;
+				fwrite(&op, sizeof(op), 1, fp);
+				fwrite(new_img.data + r->ops[k].offset, 1, op.length, fp);
+				literal += op.length;
+			} else {
+				fwrite(&op, sizeof(op), 1, fp);
+				part_copied += op.length;
+			}
+		}
+		copied += part_copied;
+
+		printf("0x%08" PRIX64 "\t0x%08" PRIX64 "\t%3d%% reused\n", r->pos,
+				r->len, (int)(r->len ? part_copied * 100 / r->len : 0));
+	}
+
+	memset(&end, 0, sizeof(end));
+	end.type = DELTA_END;
+	fwrite(&end, sizeof(end), 1, fp);
+
+	if (fflush(fp) != 0 || ferror(fp)) {
+		fprintf(stderr, "Can't write %s: %s\n", deltafile, strerror(errno));
+		goto out;
+	}
+	rkstats_end(literal);
+
+	printf("copied %" PRIu64 " bytes, %" PRIu64 " literal bytes\n",
+			copied, literal);
+	ret = 0;
+
+out:
+	if (fp && fclose(fp) != 0)
+		ret = -1;
+	if (fp && ret != 0)
+		unlink(deltafile);
+	for (i = 0; i < job.num_regions; i++)
+		free(regions[i].ops);
+	pthread_mutex_destroy(&job.lock);
+	unmap_image(&new_img);
+	unmap_image(&old_img);
+
+	return ret;
+}
+
+struct apply_state {
+	int fd;
+	uint64_t written;
+	uint64_t crc_len;
+	unsigned int crc;
+	unsigned char trailer[4];
+};
+
+static int apply_write(struct apply_state *st, const unsigned char *buf, size_t len)
+{
+	uint64_t end = st->written + len, i;
+
+	if (write_full(st->fd, buf, len, st->written) != 0)
+		return -1;
+
+	if (st->written < st->crc_len) {
+		size_t n = st->crc_len - st->written < len ?
+				st->crc_len - st->written : len;
+		RKCRC(st->crc, buf, n);
+	}
+
+	for (i = st->crc_len; i < st->crc_len + 4; i++)
+		if (i >= st->written && i < end)
+			st->trailer[i - st->crc_len] = buf[i - st->written];
+
+	st->written = end;
+
+	return 0;
+}
+
+int apply_delta(const char *oldfile, const char *deltafile, const char *newfile)
+{
+	struct delta_header header;
+	struct apply_state st;
+	struct delta_op op;
+	unsigned char *buf = NULL;
+	unsigned int old_crc;
+	struct stat sb;
+	FILE *dfp = NULL;
+	int ofd = -1;
+	int ended = 0;
+	int ret = -1;
+
+	memset(&st, 0, sizeof(st));
+	st.fd = -1;
+
+	if ((dfp = fopen(deltafile, "rb")) == NULL
+			|| fread(&header, sizeof(header), 1, dfp) != 1
+			|| memcmp(header.magic, RKDELTA_MAGIC, sizeof(header.magic)) != 0
+			|| header.version != RKDELTA_VERSION || header.new_length < 4) {
+		fprintf(stderr, "%s: not a delta file\n", deltafile);
+		goto out;
+	}
+
+	/* check that the delta was made against this image */
+	if ((ofd = open(oldfile, O_RDONLY)) < 0 || fstat(ofd, &sb) != 0
+			|| (uint64_t)sb.st_size < header.old_length || header.old_length < 4
+			|| pread(ofd, &old_crc, 4, header.old_length - 4) != 4
+			|| old_crc != header.old_crc) {
+		fprintf(stderr, "%s: does not match the delta's base image\n", oldfile);
+		goto out;
+	}
+	posix_fadvise(ofd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if ((buf = malloc(DELTA_BUF_SIZE)) == NULL)
+		goto out;
+
+	if ((st.fd = open(newfile, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", newfile, strerror(errno));
+		goto out;
+	}
+	st.crc_len = header.new_length - 4;
+
+	printf("------ APPLY ------\n");
+	rkstats_begin("apply");
+	while (fread(&op, sizeof(op), 1, dfp) == 1) {
+		uint64_t done = 0;
+
+		if (op.type == DELTA_END) {
+			ended = 1;
+			break;
+		}
+
+		if ((op.type != DELTA_COPY && op.type != DELTA_DATA)
+				|| op.length > header.new_length - st.written
+				|| (op.type == DELTA_COPY && (op.offset > header.old_length
+				|| op.length > header.old_length - op.offset))) {
+			fprintf(stderr, "%s: corrupted delta\n", deltafile);
+			goto out;
+		}
+
+		while (done < op.length) {
+			size_t len = op.length - done < DELTA_BUF_SIZE ?
+					op.length - done : DELTA_BUF_SIZE;
+
+			if (op.type == DELTA_COPY) {
+				if (pread(ofd, buf, len, op.offset + done) != (ssize_t)len)
+					goto io_fail;
+			} else if (fread(buf, 1, len, dfp) != len) {
+				goto io_fail;
+			}
+
+			if (apply_write(&st, buf, len) != 0)
+				goto io_fail;
+			done += len;
+		}
+	}
+	rkstats_end(st.written);
+
+	printf("Check file...");
+	if (!ended || st.written != header.new_length
+			|| memcmp(st.trailer, &st.crc, 4) != 0
+			|| st.crc != header.new_crc) {
+		printf("Fail\n");
+		goto out;
+	}
+	printf("OK\n");
+	ret = 0;
+	goto out;
+
+io_fail:
+	fprintf(stderr, "I/O error: %s\n", strerror(errno));
+out:
+	if (st.fd >= 0) {
+		if (close(st.fd) != 0)
+			ret = -1;
+		if (ret != 0)
+			unlink(newfile);
+	}
+	if (ofd >= 0)
+		close(ofd);
+	if (dfp)
+		fclose(dfp);
+	free(buf);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// archive functions
+
+/*
+ * -archive stores an image in a content-addressed chunk store:
+ *
+ *   <store>/chunks/ab/ab01...	chunk data, named by its SHA-256
+ *   <store>/recipes/<name>	"RKCHUNK 1", size, sha256, then "<hash> <len>"
+ *
+ * The image is first cut at its RKAF part boundaries (also inside RKFW
+ * files), then each region is split into content-defined chunks with a gear
+ * rolling hash, so an insertion only changes the chunks around it.  Regions
+ * are chunked and hashed on all CPUs.  -restore concatenates the chunks
+ * with copy_file_range.
+ */
+
+#define CDC_MIN			(16 << 10)
+#define CDC_AVG			(64 << 10)
+#define CDC_MAX			(256 << 10)
+/*
+ * Normalized chunking around CDC_AVG = 2^16: two bits harder below it, two
+ * bits easier above.  The bits are spread over the upper word, where each
+ * one depends on a long window of input, and MASK_L is a subset of MASK_S.
+ */
+#define CDC_MASK_S		0x0a952a54a9500000ULL	/* 18 bits, below CDC_AVG */
+#define CDC_MASK_L		0x0891225489500000ULL	/* 14 bits, above CDC_AVG */
+#define CDC_REGION_MAX		(256ULL << 20)
+#define CHUNK_HEX		(2 * RKSHA256_DIGEST_LENGTH + 1)
+
+typedef char cdc_mask_s_has_18_bits[
+		__builtin_popcountll(CDC_MASK_S) == 18 ? 1 : -1];
+typedef char cdc_mask_l_has_14_bits[
+		__builtin_popcountll(CDC_MASK_L) == 14 ? 1 : -1];
+typedef char cdc_mask_l_within_s[(CDC_MASK_L & ~CDC_MASK_S) == 0 ? 1 : -1];
+
+struct chunk_ref {
+	char hash[CHUNK_HEX];
+	uint32_t len;
+};
+
+struct chunk_region {
+	uint64_t pos;
+	uint64_t len;
+	struct chunk_ref *chunks;
+	size_t num_chunks;
+	uint64_t new_bytes;
+	size_t new_chunks;
+	int failed;
+};
+
+struct chunk_job {
+	const unsigned char *data;
+	const char *store;
+	struct chunk_region *regions;
+	unsigned int num_regions;
+	unsigned int next;
+	pthread_mutex_t lock;
+};
+
+static uint64_t gear[256];
+
+static void gear_init(void)
+{
+	uint64_t x = 0x52b7a1f3c8e94d06ULL;
+	int i;
+
+	/* splitmix64; the table must never change or chunking changes */
+	for (i = 0; i < 256; i++) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+static size_t cdc_cut(const unsigned char *p, size_t n)
+{
+	size_t i, normal;
+	uint64_t h = 0;
+
+	if (n <= CDC_MIN)
+		return n;
+	if (n > CDC_MAX)
+		n = CDC_MAX;
+	normal = n < CDC_AVG ? n : CDC_AVG;
+
+	for (i = CDC_MIN; i < normal; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & CDC_MASK_S))
+			return i + 1;
+	}
+	for (; i < n; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & CDC_MASK_L))
+			return i + 1;
+	}
+
+	return n;
+}
+
+static void hex_digest(char *out, const unsigned char *md, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(out + 2 * i, "%02x", md[i]);
+}
+
+static void chunk_path(char *path, size_t size, const char *store,
+		const char *hash)
+{
+	snprintf(path, size, "%s/chunks/%.2s/%s", store, hash, hash);
+}
+
+/* Store a chunk unless it is already present; returns 1 if it was new */
+static int store_chunk(const char *store, const char *hash,
+		const unsigned char *data, size_t len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX + 32];
+	static unsigned long seq;
+	struct stat st;
+	int fd;
+
+	chunk_path(path, sizeof(path), store, hash);
+	if (stat(path, &st) == 0 && (uint64_t)st.st_size == len)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.%lu.tmp", path, (int)getpid(),
+			__sync_fetch_and_add(&seq, 1));
+	if (create_dir(tmp) != 0)
+		return -1;
+	if ((fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0444)) < 0)
+		return -1;
+
+	if (write_full(fd, data, len, 0) != 0 || close(fd) != 0
+			|| rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 1;
+}
+
+static void chunk_region(struct chunk_region *r, const unsigned char *data,
+		const char *store)
+{
+	unsigned char md[RKSHA256_DIGEST_LENGTH];
+	uint64_t off = 0;
+	size_t max = 0;
+
+	data += r->pos;
+	while (off < r->len) {
+		uint64_t left = r->len - off;
+		size_t len = cdc_cut(data + off, left < CDC_MAX ? left : CDC_MAX);
+		struct chunk_ref *c;
+		int stored;
+
+		if (r->num_chunks == max) {
+			max = max ? 2 * max : 256;
+			if ((c = realloc(r->chunks, max * sizeof(*c))) == NULL) {
+				r->failed = 1;
+				return;
+			}
+			r->chunks = c;
+		}
+
+		c = &r->chunks[r->num_chunks++];
+		rksha256(data + off, len, md);
+		hex_digest(c->hash, md, sizeof(md));
+		c->len = len;
+
+		if ((stored = store_chunk(store, c->hash, data + off, len)) < 0) {
+			fprintf(stderr, "Can't store chunk %s: %s\n", c->hash,
+					strerror(errno));
+			r->failed = 1;
+			return;
+		}
+		if (stored) {
+			r->new_chunks++;
+			r->new_bytes += len;
+		}
+
+		off += len;
+	}
+}
+
+static void *chunk_worker(void *arg)
+{
+	struct chunk_job *job = arg;
+
+	for (;;) {
+		struct chunk_region *r;
+
+		pthread_mutex_lock(&job->lock);
+		r = job->next < job->num_regions ? &job->regions[job->next++] : NULL;
+		pthread_mutex_unlock(&job->lock);
+
+		if (!r)
+			break;
+
+		chunk_region(r, job->data, job->store);
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void add_rkaf_bounds(const unsigned char *data, uint64_t size,
+		uint64_t base, uint64_t *bounds, unsigned int *num)
+{
+	struct update_header header;
+	unsigned int i;
+
+	if (base > size || size - base < sizeof(header))
+		return;
+
+	memcpy(&header, data + base, sizeof(header));
+	if (memcmp(header.magic, RKAFP_MAGIC, sizeof(header.magic)) != 0
+			|| header.num_parts > 16)
+		return;
+
+	bounds[(*num)++] = base + sizeof(header);
+	for (i = 0; i < header.num_parts; i++) {
+		struct update_extent e;
+
+		rkafp_get_extent(&header, i, &e);
+		if (strcmp(header.parts[i].filename, "SELF") == 0 || e.pos > size - base
+				|| e.padded_size > size - base - e.pos)
+			continue;
+
+		bounds[(*num)++] = base + e.pos;
+		bounds[(*num)++] = base + e.pos + e.padded_size;
+	}
+}
+
+/* Region boundaries: RKFW loader/image, RKAF parts, then size limits */
+static unsigned int archive_bounds(const unsigned char *data, uint64_t size,
+		uint64_t *bounds)
+{
+	struct rkfw_header fw;
+	unsigned int num = 0, i, out;
+
+	bounds[num++] = 0;
+	bounds[num++] = size;
+
+	if (size >= sizeof(fw))
+		memcpy(&fw, data, sizeof(fw));
+	if (size >= sizeof(fw) && memcmp(fw.head_code, "RKFW", 4) == 0) {
+		uint64_t img = fw.image_offset, img_len = fw.image_length;
+
+		bounds[num++] = fw.loader_offset;
+		bounds[num++] = (uint64_t)fw.loader_offset + fw.loader_length;
+		if (img <= size && img_len <= size - img) {
+			bounds[num++] = img;
+			bounds[num++] = img + img_len;
+			add_rkaf_bounds(data, size, img, bounds, &num);
+		}
+	} else {
+		add_rkaf_bounds(data, size, 0, bounds, &num);
+	}
+
+	qsort(bounds, num, sizeof(*bounds), cmp_u64);
+	for (i = out = 1; i < num; i++)
+		if (bounds[i] != bounds[out - 1] && bounds[i] <= size)
+			bounds[out++] = bounds[i];
+
+	return out;
+}
+
+/* The sha256 line of an existing recipe */
+static int recipe_sha256(const char *path, char *hash)
+{
+	char line[256];
+	long long size;
+	FILE *fp;
+	int ret = -1;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	if (fgets(line, sizeof(line), fp) && strcmp(line, "RKCHUNK 1\n") == 0
+			&& fscanf(fp, "size %lld\nsha256 %64s\n", &size, hash) == 2)
+		ret = 0;
+	fclose(fp);
+
+	return ret;
+}
+
+/*
+ * The recipe is named after the image unless a name is given, and an
+ * existing recipe is only ever replaced by the same image.
+ */
+int archive_image(const char *imgfile, const char *store, const char *name)
+{
+	unsigned char md[RKSHA256_DIGEST_LENGTH];
+	char hash[CHUNK_HEX], old[CHUNK_HEX], recipe[PATH_MAX], tmp[PATH_MAX + 8];
+	mode_t mask;
+	int tfd;
+	uint64_t bounds[2 * 16 + 8], new_bytes = 0;
+	struct chunk_region *regions = NULL;
+	struct chunk_job job;
+	pthread_t threads[64];
+	size_t new_chunks = 0, total_chunks = 0, k;
+	unsigned int nbounds, i;
+	unsigned char *data = MAP_FAILED;
+	struct stat st;
+	long nthreads;
+	FILE *fp = NULL;
+	int fd, ret = -1;
+
+	if ((fd = open(imgfile, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", imgfile, strerror(errno));
+		goto out;
+	}
+
+	if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "%s: mmap failed: %s\n", imgfile, strerror(errno));
+			goto out;
+		}
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+	}
+
+	gear_init();
+	nbounds = archive_bounds(data, st.st_size, bounds);
+
+	/* split huge regions so a single system image still uses every CPU */
+	memset(&job, 0, sizeof(job));
+	for (i = 0; i + 1 < nbounds; i++) {
+		uint64_t pos;
+
+		for (pos = bounds[i]; pos < bounds[i + 1]; pos += CDC_REGION_MAX) {
+			struct chunk_region *r = realloc(regions,
+					(job.num_regions + 1) * sizeof(*r));
+			if (!r)
+				goto out;
+			regions = r;
+
+			r = &regions[job.num_regions++];
+			memset(r, 0, sizeof(*r));
+			r->pos = pos;
+			r->len = bounds[i + 1] - pos < CDC_REGION_MAX ?
+					bounds[i + 1] - pos : CDC_REGION_MAX;
+		}
+	}
+
+	job.data = data;
+	job.store = store;
+	job.regions = regions;
+	pthread_mutex_init(&job.lock, NULL);
+
+	printf("------ ARCHIVE ------\n");
+	rkstats_begin("chunk");
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > 64)
+		nthreads = 64;
+	if (nthreads > (long)job.num_regions)
+		nthreads = job.num_regions;
+
+	for (i = 0; i < (unsigned int)nthreads; i++)
+		pthread_create(&threads[i], NULL, chunk_worker, &job);
+	for (i = 0; i < (unsigned int)nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+	rkstats_end(st.st_size);
+
+	for (i = 0; i < job.num_regions; i++) {
+		if (regions[i].failed)
+			goto out;
+		total_chunks += regions[i].num_chunks;
+		new_chunks += regions[i].new_chunks;
+		new_bytes += regions[i].new_bytes;
+	}
+
+	rkstats_begin("sha256");
+	rksha256(data == MAP_FAILED ? (unsigned char *)"" : data, st.st_size, md);
+	hex_digest(hash, md, sizeof(md));
+	rkstats_end(st.st_size);
+
+	if (!name) {
+		name = strrchr(imgfile, '/');
+		name = name ? name + 1 : imgfile;
+	}
+	snprintf(recipe, sizeof(recipe), "%s/recipes/%s", store, name);
+	/* a private temporary: archives into one store may run concurrently */
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", recipe);
+	if (create_dir(tmp) != 0 || (tfd = mkstemp(tmp)) < 0) {
+		fprintf(stderr, "Can't create recipe %s\n", recipe);
+		goto out;
+	}
+	mask = umask(0);
+	umask(mask);
+	if (fchmod(tfd, 0666 & ~mask) != 0 || (fp = fdopen(tfd, "w")) == NULL) {
+		close(tfd);
+		unlink(tmp);
+		fprintf(stderr, "Can't create recipe %s\n", recipe);
+		goto out;
+	}
+
+	fprintf(fp, "RKCHUNK 1\nsize %lld\nsha256 %s\n", (long long)st.st_size, hash);
+	for (i = 0; i < job.num_regions; i++)
+		for (k = 0; k < regions[i].num_chunks; k++)
+			fprintf(fp, "%s %u\n", regions[i].chunks[k].hash,
+					regions[i].chunks[k].len);
+
+	if (fclose(fp) != 0) {
+		fp = NULL;
+		unlink(tmp);
+		fprintf(stderr, "Can't write recipe %s\n", recipe);
+		goto out;
+	}
+	fp = NULL;
+
+	/* link() rather than rename(): never replace another image's recipe */
+	if (link(tmp, recipe) != 0) {
+		int err = errno;
+
+		unlink(tmp);
+		if (err != EEXIST) {
+			fprintf(stderr, "Can't write recipe %s: %s\n", recipe,
+					strerror(err));
+			goto out;
+		}
+		if (recipe_sha256(recipe, old) != 0 || strcmp(old, hash) != 0) {
+			fprintf(stderr, "Error: recipe %s exists for another image,"
+					" give the new one a name\n", recipe);
+			goto out;
+		}
+	}
+	unlink(tmp);
+
+	printf("%s: %zu chunks, %zu new (%" PRIu64 " of %lld bytes stored)\n",
+			recipe, total_chunks, new_chunks, new_bytes, (long long)st.st_size);
+	ret = 0;
+
+out:
+	for (i = 0; regions && i < job.num_regions; i++)
+		free(regions[i].chunks);
+	free(regions);
+	if (data != MAP_FAILED)
+		munmap(data, st.st_size);
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+/*
+ * Every chunk is checked against its name and the output against the
+ * recipe's sha256 while it is written, so a damaged store never restores
+ * as "OK".  The data is still copied with copy_file_range, which can
+ * share extents with the store.
+ */
+int restore_image(const char *store, const char *name, const char *outfile)
+{
+	unsigned char md[RKSHA256_DIGEST_LENGTH];
+	char line[256], path[PATH_MAX], hash[CHUNK_HEX], want[CHUNK_HEX];
+	char got[CHUNK_HEX];
+	long long size = -1;
+	uint64_t written = 0;
+	struct rksha256 ctx;
+	unsigned int len;
+	FILE *fp;
+	int ofd, ret = -1;
+
+	snprintf(path, sizeof(path), "%s/recipes/%s", store, name);
+	if ((fp = fopen(path, "r")) == NULL || fgets(line, sizeof(line), fp) == NULL
+			|| strcmp(line, "RKCHUNK 1\n") != 0
+			|| fscanf(fp, "size %lld\nsha256 %64s\n", &size, want) != 2) {
+		fprintf(stderr, "%s: not a chunk recipe\n", path);
+		if (fp)
+			fclose(fp);
+		return -1;
+	}
+
+	if ((ofd = open(outfile, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", outfile, strerror(errno));
+		fclose(fp);
+		return -1;
+	}
+
+	printf("------ RESTORE ------\n");
+	rkstats_begin("restore");
+	rksha256_init(&ctx);
+	while (fscanf(fp, "%64s %u\n", hash, &len) == 2) {
+		unsigned char *data = MAP_FAILED;
+		loff_t ioff = 0, ooff = written;
+		struct stat st;
+		int cfd;
+
+		chunk_path(path, sizeof(path), store, hash);
+		if ((cfd = open(path, O_RDONLY)) >= 0 && fstat(cfd, &st) == 0
+				&& st.st_size == len && len > 0)
+			data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, cfd, 0);
+		if (data != MAP_FAILED) {
+			rksha256(data, len, md);
+			hex_digest(got, md, sizeof(md));
+		}
+		if (data == MAP_FAILED || strcmp(got, hash) != 0) {
+			fprintf(stderr, "missing or damaged chunk %s\n", hash);
+			if (data != MAP_FAILED)
+				munmap(data, len);
+			if (cfd >= 0)
+				close(cfd);
+			goto out;
+		}
+		rksha256_update(&ctx, data, len);
+
+		while (ioff < (loff_t)len) {
+			ssize_t n = copy_file_range(cfd, &ioff, ofd, &ooff,
+					len - ioff, 0);
+			if (n > 0)
+				continue;
+
+			/* no in-kernel copy: write the rest from the mapping */
+			if (write_full(ofd, data + ioff, len - ioff, ooff) != 0) {
+				munmap(data, len);
+				close(cfd);
+				goto out;
+			}
+			ooff += len - ioff;
+			ioff = len;
+		}
+
+		munmap(data, len);
+		close(cfd);
+		written += len;
+	}
+	rkstats_end(written);
+
+	if ((long long)written != size) {
+		fprintf(stderr, "recipe incomplete: %" PRIu64 " of %lld bytes\n",
+				written, size);
+		goto out;
+	}
+
+	rksha256_final(md, &ctx);
+	hex_digest(got, md, sizeof(md));
+	if (strcmp(got, want) != 0) {
+		fprintf(stderr, "%s: sha256 %s, recipe expects %s\n", outfile,
+				got, want);
+		goto out;
+	}
+
+	printf("%s: %" PRIu64 " bytes, sha256 %s\n", outfile, written, got);
+	ret = 0;
+
+out:
+	fclose(fp);
+	if (close(ofd) != 0)
+		ret = -1;
+	if (ret != 0)
+		unlink(outfile);
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// container functions
+
+#define RKZ_BATCH		64	/* frames compressed per round */
+#define RKZ_MAX_FRAMES		(1U << 24)
+
+struct rkz_out {
+	struct rkz_frame frame;
+	unsigned char *buf;	/* deflated data, NULL unless RKZ_DEFLATE */
+};
+
+struct rkz_job {
+	const unsigned char *data;
+	struct rkz_out *frames;
+	unsigned int next;
+	unsigned int end;
+	pthread_mutex_t lock;
+};
+
+/* An RKAF image, either plain or wrapped in an RKZ1 container */
+struct rkz_image {
+	int fd;
+	int compressed;
+	struct rkz_header header;
+	struct rkz_frame *frames;
+	struct update_header rkaf;
+	uint64_t length;	/* RKAF length, crc trailer excluded */
+	uint64_t size;		/* of the raw image */
+	unsigned int *frame_crc;	/* RKCRC of each frame up to length */
+	unsigned char *frame_seen;	/* or NULL when not tracked */
+};
+
+struct rkz_unpack {
+	struct rkz_image *z;
+	const char *dstdir;
+	unsigned int next;
+	int failed;
+	pthread_mutex_t lock;
+};
+
+static int all_zero(const unsigned char *p, size_t len)
+{
+	return len == 0 || (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0);
+}
+
+static void compress_frame(const unsigned char *data, struct rkz_out *o)
+{
+	const unsigned char *p = data + o->frame.raw_offset;
+	uLongf len = compressBound(o->frame.raw_length);
+
+	o->frame.crc32 = crc32(0, p, o->frame.raw_length);
+	if (all_zero(p, o->frame.raw_length)) {
+		o->frame.type = RKZ_ZERO;
+		o->frame.length = 0;
+		return;
+	}
+
+	if ((o->buf = malloc(len)) != NULL && compress2(o->buf, &len, p,
+			o->frame.raw_length, Z_DEFAULT_COMPRESSION) == Z_OK
+			&& len < o->frame.raw_length) {
+		o->frame.type = RKZ_DEFLATE;
+		o->frame.length = len;
+		return;
+	}
+
+	/* incompressible (or out of memory): keep the raw bytes */
+	free(o->buf);
+	o->buf = NULL;
+	o->frame.type = RKZ_STORED;
+	o->frame.length = o->frame.raw_length;
+}
+
+static void *compress_worker(void *arg)
+{
+	struct rkz_job *job = arg;
+
+	for (;;) {
+		struct rkz_out *o;
+
+		pthread_mutex_lock(&job->lock);
+		o = job->next < job->end ? &job->frames[job->next++] : NULL;
+		pthread_mutex_unlock(&job->lock);
+
+		if (!o)
+			break;
+
+		compress_frame(job->data, o);
+	}
+
+	return NULL;
+}
+
+static long worker_count(unsigned int jobs)
+{
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > 64)
+		nthreads = 64;
+	if (nthreads > (long)jobs)
+		nthreads = jobs;
+
+	return nthreads;
+}
+
+int compress_image(const char *imgfile, const char *outfile)
+{
+	struct mapped_image img;
+	struct rkz_header header;
+	struct rkz_out *frames = NULL;
+	struct rkz_frame *table = NULL;
+	struct rkz_job job;
+	uint64_t bounds[2 * 16 + 8], pos, offset;
+	pthread_t threads[64];
+	unsigned int nbounds, num = 0, max, i, k;
+	long nthreads;
+	int ofd = -1, ret = -1;
+
+	if (map_image(imgfile, &img) != 0)
+		return -1;
+
+	if ((ofd = open(outfile, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", outfile, strerror(errno));
+		goto out;
+	}
+
+	/* frames never straddle a part boundary, so a part inflates alone */
+	nbounds = archive_bounds(img.data, img.size, bounds);
+	max = nbounds + img.size / RKZ_FRAME_SIZE;
+	if ((frames = calloc(max, sizeof(*frames))) == NULL
+			|| (table = calloc(max, sizeof(*table))) == NULL)
+		goto out;
+	for (i = 0; i + 1 < nbounds; i++) {
+		for (pos = bounds[i]; pos < bounds[i + 1]; pos += RKZ_FRAME_SIZE) {
+			frames[num].frame.raw_offset = pos;
+			frames[num].frame.raw_length = bounds[i + 1] - pos < RKZ_FRAME_SIZE ?
+					bounds[i + 1] - pos : RKZ_FRAME_SIZE;
+			num++;
+		}
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.data = img.data;
+	job.frames = frames;
+	pthread_mutex_init(&job.lock, NULL);
+
+	printf("------ COMPRESS ------\n");
+	rkstats_begin("compress");
+	offset = sizeof(header);
+	for (k = 0; k < num; k = job.end) {
+		job.end = num - k < RKZ_BATCH ? num : k + RKZ_BATCH;
+		nthreads = worker_count(job.end - k);
+		for (i = 0; i < (unsigned int)nthreads; i++)
+			pthread_create(&threads[i], NULL, compress_worker, &job);
+		for (i = 0; i < (unsigned int)nthreads; i++)
+			pthread_join(threads[i], NULL);
+
+		/* frames are written in order, so the table stays sorted */
+		for (i = k; i < job.end; i++) {
+			struct rkz_frame *f = &frames[i].frame;
+			const void *p = f->type == RKZ_DEFLATE ? frames[i].buf :
+					img.data + f->raw_offset;
+
+			f->offset = offset;
+			if (f->length && write_full(ofd, p, f->length, offset) != 0) {
+				fprintf(stderr, "Can't write %s: %s\n", outfile,
+						strerror(errno));
+				goto out_lock;
+			}
+			rkio_written(ofd, offset, f->length);
+			offset += f->length;
+			table[i] = *f;
+			free(frames[i].buf);
+			frames[i].buf = NULL;
+		}
+	}
+	rkstats_end(img.size);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RKZ_MAGIC, sizeof(header.magic));
+	header.version = RKZ_VERSION;
+	header.raw_length = img.size;
+	header.table_offset = offset;
+	header.num_frames = num;
+	header.frame_size = RKZ_FRAME_SIZE;
+	header.raw_crc = img.crc;
+
+	if (write_full(ofd, table, num * sizeof(*table), offset) != 0
+			|| write_full(ofd, &header, sizeof(header), 0) != 0
+			|| rkio_flush(ofd) != 0) {
+		fprintf(stderr, "Can't write %s: %s\n", outfile, strerror(errno));
+		goto out_lock;
+	}
+
+	offset += num * sizeof(*table);
+	printf("%s: %u frames, %" PRIu64 " of %" PRIu64 " bytes (%.1f%%)\n",
+			outfile, num, offset, img.size,
+			img.size ? 100.0 * offset / img.size : 0.0);
+	ret = 0;
+
+out_lock:
+	pthread_mutex_destroy(&job.lock);
+out:
+	for (i = 0; frames && i < num; i++)
+		free(frames[i].buf);
+	free(frames);
+	free(table);
+	if (ofd >= 0 && close(ofd) != 0)
+		ret = -1;
+	if (ret != 0 && ofd >= 0)
+		unlink(outfile);
+	unmap_image(&img);
+
+	return ret;
+}
+
+static int rkz_probe(const char *path)
+{
+	char magic[4];
+	int fd, ret = 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic))
+		ret = memcmp(magic, RKZ_MAGIC, sizeof(magic)) == 0;
+	close(fd);
+
+	return ret;
+}
+
+/* Inflate frame i into out (frame_size bytes) and check its crc32 */
+static int rkz_read_frame(const struct rkz_image *z, unsigned int i,
+		unsigned char *out, unsigned char *cbuf)
+{
+	const struct rkz_frame *f = &z->frames[i];
+	uLongf len = f->raw_length;
+
+	switch (f->type) {
+	case RKZ_ZERO:
+		memset(out, 0, f->raw_length);
+		break;
+	case RKZ_STORED:
+		if (pread(z->fd, out, f->length, f->offset) != (ssize_t)f->length)
+			goto fail;
+		break;
+	default:
+		if (pread(z->fd, cbuf, f->length, f->offset) != (ssize_t)f->length
+				|| uncompress(out, &len, cbuf, f->length) != Z_OK
+				|| len != f->raw_length)
+			goto fail;
+		break;
+	}
+	rkio_consumed(z->fd, f->offset, f->length);
+
+	if (crc32(0, out, f->raw_length) != f->crc32) {
+		fprintf(stderr, "frame %u (raw offset 0x%08" PRIX64 "): crc mismatch\n",
+				i, f->raw_offset);
+		return -1;
+	}
+
+	/* several workers may inflate the same frame: same value, atomic */
+	if (z->frame_crc && f->raw_offset < z->length) {
+		unsigned int crc = 0;
+
+		RKCRC(crc, out, z->length - f->raw_offset < f->raw_length ?
+				z->length - f->raw_offset : f->raw_length);
+		__atomic_store_n(&z->frame_crc[i], crc, __ATOMIC_RELAXED);
+		__atomic_store_n(&z->frame_seen[i], 1, __ATOMIC_RELAXED);
+	}
+
+	return 0;
+
+fail:
+	fprintf(stderr, "frame %u (raw offset 0x%08" PRIX64 "): damaged\n",
+			i, f->raw_offset);
+	return -1;
+}
+
+/* Feed raw bytes [off, off + len) to fn, inflating only the frames needed */
+static int rkz_stream(const struct rkz_image *z, uint64_t off, uint64_t len,
+		rkio_fn fn, void *ctx)
+{
+	unsigned char *out, *cbuf;
+	unsigned int lo = 0, hi = z->header.num_frames;
+	int ret = 0;
+
+	if (!z->compressed)
+		return rkio_stream(z->fd, off, len, -1, 0, fn, ctx);
+
+	if (off > z->size || len > z->size - off)
+		return -1;
 
-		key = startp;
-		value = strchr(startp, ':');
+	out = malloc(z->header.frame_size);
+	cbuf = malloc(z->header.frame_size);
+	if (!out || !cbuf) {
+		free(out);
+		free(cbuf);
+		return -1;
+	}
 
-		if (!value)
-			continue;
+	/* first frame ending past off */
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		const struct rkz_frame *f = &z->frames[mid];
 
-		*value = '\0';
-		value++;
+		if (f->raw_offset + f->raw_length <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-		action_parse_key(key, value);
+	for (; len && lo < z->header.num_frames; lo++) {
+		const struct rkz_frame *f = &z->frames[lo];
+		uint64_t skip = off - f->raw_offset;
+		uint64_t n = f->raw_length - skip < len ? f->raw_length - skip : len;
+
+		if ((ret = rkz_read_frame(z, lo, out, cbuf)) != 0
+				|| (ret = fn(ctx, out + skip, n)) != 0)
+			break;
+		off += n;
+		len -= n;
 	}
 
-	if (!feof(fp)) {
-		printf("File read failed!\n");
-		fclose(fp);
-		return -3;
+	free(out);
+	free(cbuf);
+	return ret;
+}
+
+static int rkz_load_table(struct rkz_image *z, const char *path)
+{
+	struct rkz_header *h = &z->header;
+	uint64_t raw = 0;
+	struct stat st;
+	unsigned int i;
+
+	if (pread(z->fd, h, sizeof(*h), 0) != sizeof(*h) || fstat(z->fd, &st) != 0
+			|| h->version != RKZ_VERSION || h->frame_size == 0
+			|| h->frame_size > (64 << 20) || h->num_frames > RKZ_MAX_FRAMES
+			|| h->table_offset > (uint64_t)st.st_size
+			|| (uint64_t)st.st_size - h->table_offset
+				< (uint64_t)h->num_frames * sizeof(struct rkz_frame))
+		goto invalid;
+
+	z->frames = malloc((size_t)h->num_frames * sizeof(struct rkz_frame) + 1);
+	if (!z->frames || pread(z->fd, z->frames,
+			(size_t)h->num_frames * sizeof(struct rkz_frame), h->table_offset)
+			!= (ssize_t)(h->num_frames * sizeof(struct rkz_frame)))
+		goto invalid;
+
+	/* frames must tile the raw image and stay inside the data area */
+	for (i = 0; i < h->num_frames; i++) {
+		const struct rkz_frame *f = &z->frames[i];
+
+		if (f->raw_offset != raw || f->raw_length == 0
+				|| f->raw_length > h->frame_size || f->type > RKZ_ZERO
+				|| (f->type == RKZ_STORED && f->length != f->raw_length)
+				|| (f->type == RKZ_DEFLATE && f->length >= f->raw_length)
+				|| f->offset > h->table_offset
+				|| f->length > h->table_offset - f->offset)
+			goto invalid;
+		raw += f->raw_length;
 	}
+	if (raw != h->raw_length)
+		goto invalid;
 
-	fclose(fp);
+	z->size = h->raw_length;
+	return 0;
+
+invalid:
+	fprintf(stderr, "%s: invalid container\n", path);
+	return -1;
+}
+
+static int memcpy_chunk(void *ctx, const unsigned char *buf, size_t len)
+{
+	unsigned char **p = ctx;
 
+	memcpy(*p, buf, len);
+	*p += len;
 	return 0;
 }
 
-static struct partition first_partition =
+static void rkz_close(struct rkz_image *z)
 {
-		"parameter",
-		0,
-		0x2000
-};
+	free(z->frames);
+	free(z->frame_crc);
+	free(z->frame_seen);
+	if (z->fd >= 0)
+		close(z->fd);
+}
 
-struct partition* find_partition_byname(const char *name)
+static int rkz_open(const char *path, struct rkz_image *z)
 {
-	int i;
-	struct partition *p_part;
+	unsigned char *p = (unsigned char *)&z->rkaf;
+	struct update_ext ext;
+	struct stat st;
+
+	memset(z, 0, sizeof(*z));
+	if ((z->fd = open(path, O_RDONLY)) < 0 || fstat(z->fd, &st) != 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", path, strerror(errno));
+		goto fail;
+	}
 
-	for (i = package_image.num_partition - 1; i >= 0; i--)
-	{
-		p_part = &package_image.partitions[i];
-		if (strcmp(p_part->name, name) == 0)
-			return p_part;
+	z->compressed = rkz_probe(path);
+	z->size = st.st_size;
+	if (z->compressed && rkz_load_table(z, path) != 0)
+		goto fail;
+
+	if (z->size < sizeof(z->rkaf) + 4
+			|| rkz_stream(z, 0, sizeof(z->rkaf), memcpy_chunk, &p) != 0
+			|| strncmp(z->rkaf.magic, RKAFP_MAGIC, sizeof(z->rkaf.magic)) != 0
+			|| z->rkaf.num_parts > 16) {
+		fprintf(stderr, "%s: Invalid header magic\n", path);
+		goto fail;
 	}
 
-	if (strcmp(name, first_partition.name) == 0)
-	{
-		return &first_partition;
+	if (rkafp_get_ext(&z->rkaf, &ext) > RKAFP_EXT_VERSION) {
+		fprintf(stderr, "Unsupported large image extension version %u\n",
+				ext.version);
+		goto fail;
 	}
 
-	return NULL;
+	z->length = rkafp_get_length(&z->rkaf);
+	if (z->length > z->size - 4) {
+		fprintf(stderr, "%s: image truncated\n", path);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	rkz_close(z);
+	return -1;
 }
 
-struct pack_part* find_package_byname(const char *name)
+/* Byte range unpack writes for part i; -1 for SELF and invalid parts */
+static int part_payload(const struct rkz_image *z, unsigned int i,
+		struct update_extent *extent)
 {
-	int i;
-	struct pack_part *p_pack;
+	const struct update_part *part = &z->rkaf.parts[i];
 
-	for (i = package_image.num_partition - 1; i >= 0; i--)
-	{
-		p_pack = &package_image.packages[i];
-		if (strcmp(p_pack->name, name) == 0)
-			return p_pack;
+	rkafp_get_extent(&z->rkaf, i, extent);
+	if (strcmp(part->filename, "SELF") == 0)
+		return -1;
+
+	// parameter 多出文件头8个字节,文件尾4个字节
+	if (memcmp(part->name, "parameter", 9) == 0) {
+		if (extent->size < 12)
+			return -1;
+		extent->pos += 8;
+		extent->size -= 12;
 	}
 
-	return NULL;
-}
+	if (extent->pos > z->length || extent->size > z->length - extent->pos)
+		return -1;
 
-void append_package(const char *name, const char *path)
-{
-	struct partition *p_part;
-	struct pack_part *p_pack = &package_image.packages[package_image.num_package];
+	return 0;
+}
 
-	strncpy(p_pack->name, name, sizeof(p_pack->name));
-	strncpy(p_pack->filename, path, sizeof(p_pack->filename));
+struct write_ctx {
+	int fd;
+	uint64_t pos;
+};
 
-	p_part = find_partition_byname(name);
-	if (p_part)
-	{
-		p_pack->nand_addr = p_part->start;
-		p_pack->nand_size = p_part->size;
-	} else {
-		p_pack->nand_addr = (unsigned int)-1;
-		p_pack->nand_size = 0;
-	}
+static int write_chunk(void *arg, const unsigned char *buf, size_t len)
+{
+	struct write_ctx *ctx = arg;
 
-	package_image.num_package++;
+	if (write_full(ctx->fd, buf, len, ctx->pos) != 0)
+		return -1;
+	rkio_written(ctx->fd, ctx->pos, len);
+	ctx->pos += len;
+	return 0;
 }
 
-int get_packages(const char *fname)
+static int rkz_extract(const struct rkz_image *z, uint64_t off, uint64_t len,
+		const char *path)
 {
-	char line[512], *startp, *endp;
-	char *name, *path;
-	FILE *fp;
+	struct write_ctx ctx = { -1, 0 };
+	int ret;
 
-	if ((fp = fopen(fname, "r")) == NULL) {
-		printf("Can't open file: %s\n", fname);
+	if ((ctx.fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0) {
+		printf("Can't open/create file: %s\n", path);
 		return -1;
 	}
 
-	while (fgets(line, sizeof(line), fp) != NULL) {
-		startp = line;
-		endp = line + strlen(line) - 1;
-		if (*endp != '\n' && *endp != '\r' && !feof(fp))
-			break;
+	if (z->compressed)
+		ret = rkz_stream(z, off, len, write_chunk, &ctx);
+	else
+		ret = rkio_stream(z->fd, off, len, ctx.fd, 0, NULL, NULL);
+	if (ret == 0)
+		ret = rkio_flush(ctx.fd);
+	if (close(ctx.fd) != 0)
+		ret = -1;
+	if (ret != 0) {
+		printf("Can't extract file: %s\n", path);
+		unlink(path);
+	}
 
-		// trim line
-		while (isspace(*startp))
-			++startp;
+	return ret;
+}
 
-		while (isspace(*endp))
-			--endp;
-		endp[1] = 0;
+static void *unpack_worker(void *arg)
+{
+	struct rkz_unpack *job = arg;
+	struct update_extent extent;
+	char dir[PATH_MAX];
+	unsigned int i;
 
-		// skip UTF-8 BOM
-		if (startp[0] == (char)0xEF && startp[1] == (char)0xBB
-		 && startp[2] == (char)0xBF)
-			startp += 3;
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		i = job->next < job->z->rkaf.num_parts ? job->next++ : ~0U;
+		pthread_mutex_unlock(&job->lock);
 
-		if (*startp == '#' || *startp == 0)
+		if (i == ~0U)
+			break;
+		if (part_payload(job->z, i, &extent) != 0)
 			continue;
 
-		name = startp;
+		snprintf(dir, sizeof(dir), "%s/%s", job->dstdir,
+				job->z->rkaf.parts[i].filename);
+		if (create_dir(dir) != 0
+				|| rkz_extract(job->z, extent.pos, extent.size, dir) != 0)
+			job->failed = 1;
+	}
 
-		while (*startp && *startp != ' ' && *startp != '\t')
-			startp++;
+	return NULL;
+}
 
-		while (*startp == ' ' || *startp == '\t')
-		{
-			*startp = '\0';
-			startp++;
-		}
+/*
+ * RKCRC of raw [0, length) from the frames the workers inflated; frames no
+ * part covers (header, gaps, padding) are inflated here.  0 if it matches
+ * both the trailer and the container header.
+ */
+static int rkz_check(struct rkz_image *z)
+{
+	unsigned int crc = 0, trailer, i;
+	unsigned char *out, *cbuf, *p = (unsigned char *)&trailer;
+	int ret = 0;
+
+	out = malloc(z->header.frame_size);
+	cbuf = malloc(z->header.frame_size);
+	if (!out || !cbuf) {
+		free(out);
+		free(cbuf);
+		return -1;
+	}
 
-		path = startp;
+	for (i = 0; i < z->header.num_frames
+			&& z->frames[i].raw_offset < z->length; i++) {
+		const struct rkz_frame *f = &z->frames[i];
+		uint64_t n = z->length - f->raw_offset < f->raw_length ?
+				z->length - f->raw_offset : f->raw_length;
 
-		append_package(name, path);
+		if (!z->frame_seen[i] && (ret = rkz_read_frame(z, i, out, cbuf)) != 0)
+			break;
+		crc = rkcrc_combine(crc, z->frame_crc[i], n);
 	}
 
-	if (!feof(fp)) {
-		printf("File read failed!\n");
-		fclose(fp);
-		return -3;
-	}
+	free(out);
+	free(cbuf);
 
-	fclose(fp);
+	if (ret != 0 || rkz_stream(z, z->length, sizeof(trailer), memcpy_chunk,
+			&p) != 0)
+		return -1;
 
-	return 0;
+	return crc == trailer && crc == z->header.raw_crc ? 0 : -1;
 }
 
-int import_package(FILE *ofp, struct update_part *pack, const char *path)
+/*
+ * Parts are extracted in parallel into a staging directory; it replaces
+ * dstdir only once the RKCRC of the whole image checks out.
+ */
+int unpack_container(const char *srcfile, const char *dstdir)
 {
-	FILE *ifp;
-	char buf[2048];
-	size_t readlen;
-
-	pack->pos = ftell(ofp);
-	ifp = fopen(path, "rb");
-	if (!ifp)
+	struct rkz_unpack job;
+	struct rkz_image z;
+	pthread_t threads[64];
+	char dst[PATH_MAX], stage[PATH_MAX];
+	const char *files[16];
+	uint64_t total = 0;
+	unsigned int i, num_files = 0;
+	long nthreads;
+	int ret = -1;
+
+	if (rkz_open(srcfile, &z) != 0)
 		return -1;
+	if (!z.compressed) {
+		fprintf(stderr, "%s: not a compressed image\n", srcfile);
+		goto out;
+	}
 
-	if (strcmp(pack->name, "parameter") == 0)
-	{
-		unsigned int crc = 0;
-		struct param_header *header = (struct param_header*)buf;
-		memcpy(header->magic, "PARM", sizeof(header->magic));
-
-		readlen = fread(buf + sizeof(*header), 1, sizeof(buf) - 12, ifp);
-		header->length = readlen;
-		RKCRC(crc, buf + sizeof(*header), readlen);
-		readlen += sizeof(*header);
-		memcpy(buf + readlen, &crc, sizeof(crc));
-		readlen += sizeof(crc);
-		memset(buf+readlen, 0, sizeof(buf) - readlen);
-
-		fwrite(buf, 1, sizeof(buf), ofp);
-		pack->size += readlen;
-		pack->padded_size += sizeof(buf);
-	} else {
-		do {
-			readlen = fread(buf, 1, sizeof(buf), ifp);
-			if (readlen == 0)
-				break;
-
-			if (readlen < sizeof(buf))
-				memset(buf + readlen, 0, sizeof(buf) - readlen);
-
-			fwrite(buf, 1, sizeof(buf), ofp);
-			pack->size += readlen;
-			pack->padded_size += sizeof(buf);
-		} while (!feof(ifp));
+	z.frame_crc = calloc(z.header.num_frames + 1, sizeof(*z.frame_crc));
+	z.frame_seen = calloc(z.header.num_frames + 1, 1);
+	if (!z.frame_crc || !z.frame_seen) {
+		fprintf(stderr, "Out of memory\n");
+		goto out;
 	}
 
-	fclose(ifp);
+	if (unpack_stage(dstdir, dst, stage) != 0)
+		goto out;
 
-	return 0;
-}
+	printf("------- UNPACK -------\n");
+	for (i = 0; i < z.rkaf.num_parts; i++) {
+		struct update_extent extent;
+
+		rkafp_get_extent(&z.rkaf, i, &extent);
+		printf("%s\t0x%08" PRIX64 "\t0x%08" PRIX64 "\n",
+				z.rkaf.parts[i].filename, extent.pos, extent.size);
+		if (part_payload(&z, i, &extent) == 0) {
+			total += extent.size;
+			files[num_files++] = z.rkaf.parts[i].filename;
+		} else if (strcmp(z.rkaf.parts[i].filename, "SELF") == 0) {
+			printf("Skip SELF file.\n");
+		} else {
+			fprintf(stderr, "Invalid part: %s\n", z.rkaf.parts[i].name);
+		}
+	}
 
-void append_crc(FILE *fp)
-{
-	unsigned int crc = 0;
-	off_t file_len = 0;
+	memset(&job, 0, sizeof(job));
+	job.z = &z;
+	job.dstdir = stage;
+	pthread_mutex_init(&job.lock, NULL);
 
-	fseeko(fp, 0, SEEK_END);
-	file_len = ftello(fp);
+	rkstats_begin("extract");
+	nthreads = worker_count(z.rkaf.num_parts);
+	for (i = 0; i < (unsigned int)nthreads; i++)
+		if (pthread_create(&threads[i], NULL, unpack_worker, &job) != 0)
+			break;
+	nthreads = i;
+	if (nthreads == 0)
+		unpack_worker(&job);
+	for (i = 0; i < (unsigned int)nthreads; i++)
+		pthread_join(threads[i], NULL);
+	rkstats_end(total);
+	pthread_mutex_destroy(&job.lock);
+
+	if (!job.failed) {
+		printf("Check file...");
+		fflush(stdout);
+		rkstats_begin("check");
+		ret = rkz_check(&z);
+		rkstats_end(z.length);
+		printf(ret == 0 ? "OK\n" : "Fail\n");
+	}
 
-	if (file_len == (off_t) -1)
-		return;
+	if (ret == 0 && unpack_commit(stage, dst, files, num_files) != 0)
+		ret = -1;
+	if (ret != 0)
+		remove_tree(stage);
 
-	fseek(fp, 0, SEEK_SET);
+out:
+	rkz_close(&z);
+	return ret;
+}
 
-	printf("Add CRC...\n");
+struct restore_ctx {
+	struct write_ctx out;
+	uint64_t crc_len;	/* bytes still covered by the RKAF crc */
+	unsigned int crc;
+};
 
-	crc = filestream_crc(fp, file_len);
+static int restore_chunk(void *arg, const unsigned char *buf, size_t len)
+{
+	struct restore_ctx *ctx = arg;
+	size_t n = ctx->crc_len < len ? ctx->crc_len : len;
 
-	fseek(fp, 0, SEEK_END);
-	fwrite(&crc, 1, sizeof(crc), fp);
+	RKCRC(ctx->crc, buf, n);
+	ctx->crc_len -= n;
+	return write_chunk(&ctx->out, buf, len);
 }
 
-int pack_update(const char* srcdir, const char* dstfile) {
-	struct update_header header;
-	FILE *fp = NULL;
-	unsigned int i;
-
-	printf("------ PACKAGE ------\n");
-	memset(&header, 0, sizeof(header));
+int decompress_image(const char *srcfile, const char *outfile)
+{
+	struct restore_ctx ctx;
+	struct rkz_image z;
+	unsigned int trailer;
+	int ret = -1;
 
-	fp = fopen(dstfile, "wb+");
-	if (!fp) {
-		printf("Can't open destination file \"%s\": %s\n", dstfile, strerror(errno));
+	if (rkz_open(srcfile, &z) != 0)
 		return -1;
+	if (!z.compressed) {
+		fprintf(stderr, "%s: not a compressed image\n", srcfile);
+		goto out;
 	}
 
-	if (chdir(srcdir))
-		return -1;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.crc_len = z.length;
+	if ((ctx.out.fd = open(outfile, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", outfile, strerror(errno));
+		goto out;
+	}
 
-	if (parse_parameter("parameter"))
-		return -1;
+	printf("----- DECOMPRESS -----\n");
+	rkstats_begin("decompress");
+	ret = rkz_stream(&z, 0, z.size, restore_chunk, &ctx);
+	rkstats_end(z.size);
+	if (ret == 0 && (pread(ctx.out.fd, &trailer, sizeof(trailer), z.length)
+			!= sizeof(trailer) || rkio_flush(ctx.out.fd) != 0))
+		ret = -1;
 
-	if (get_packages("package-file"))
-		return -1;
+	printf("Check file...");
+	if (ret == 0 && (ctx.crc != trailer || ctx.crc != z.header.raw_crc)) {
+		ret = -1;
+	}
+	printf(ret == 0 ? "OK\n" : "Fail\n");
 
-	fwrite(&header, sizeof(header), 1, fp);
+	if (close(ctx.out.fd) != 0)
+		ret = -1;
+	if (ret != 0)
+		unlink(outfile);
 
-	for (i = 0; i < package_image.num_package; ++i) {
-		strcpy(header.parts[i].name, package_image.packages[i].name);
-		strcpy(header.parts[i].filename, package_image.packages[i].filename);
-		header.parts[i].nand_addr = package_image.packages[i].nand_addr;
-		header.parts[i].nand_size = package_image.packages[i].nand_size;
+out:
+	rkz_close(&z);
+	return ret;
+}
 
-		if (strcmp(package_image.packages[i].filename, "SELF") == 0)
-			continue;
+int list_image(const char *srcfile)
+{
+	struct rkz_image z;
+	unsigned int i;
 
-		printf("Add file: %s\n", header.parts[i].filename);
-		import_package(fp, &header.parts[i], header.parts[i].filename);
-	}
+	if (rkz_open(srcfile, &z) != 0)
+		return -1;
 
-	memcpy(header.magic, RKAFP_MAGIC, sizeof(header.magic));
-	strcpy(header.manufacturer, package_image.manufacturer);
-	strcpy(header.model, package_image.machine_model);
-	strcpy(header.id, package_image.machine_id);
-	header.length = ftell(fp);
-	header.num_parts = package_image.num_package;
-	header.version = package_image.version;
+	if (z.compressed)
+		printf("%s: %u frames, raw size 0x%08" PRIX64 "\n", srcfile,
+				z.header.num_frames, z.size);
+	for (i = 0; i < z.rkaf.num_parts; i++) {
+		struct update_extent extent;
 
-	for (i = 0; i < header.num_parts; i++)
-	{
-		if (strcmp(header.parts[i].filename, "SELF") == 0)
-		{
-			header.parts[i].size = header.length + 4;
-			header.parts[i].padded_size = (header.parts[i].size + 511) / 512 *512;
-		}
+		rkafp_get_extent(&z.rkaf, i, &extent);
+		printf("%-16s %-32s 0x%08" PRIX64 "\t0x%08" PRIX64 "\n",
+				z.rkaf.parts[i].name, z.rkaf.parts[i].filename,
+				extent.pos, extent.size);
 	}
 
-	fseek(fp, 0, SEEK_SET);
-	fwrite(&header, sizeof(header), 1, fp);
+	rkz_close(&z);
+	return 0;
+}
 
-	append_crc(fp);
+int extract_part(const char *srcfile, const char *name, const char *outfile)
+{
+	struct update_extent extent;
+	struct rkz_image z;
+	unsigned int i;
+	int ret = -1;
 
-	fclose(fp);
+	if (rkz_open(srcfile, &z) != 0)
+		return -1;
 
-	printf("------ OK ------\n");
+	for (i = 0; i < z.rkaf.num_parts; i++)
+		if (strcmp(z.rkaf.parts[i].name, name) == 0
+				|| strcmp(z.rkaf.parts[i].filename, name) == 0)
+			break;
 
-	return 0;
+	if (i == z.rkaf.num_parts) {
+		fprintf(stderr, "%s: no part \"%s\"\n", srcfile, name);
+	} else if (part_payload(&z, i, &extent) != 0) {
+		fprintf(stderr, "Invalid part: %s\n", z.rkaf.parts[i].name);
+	} else {
+		rkstats_begin("extract:%s", z.rkaf.parts[i].name);
+		ret = rkz_extract(&z, extent.pos, extent.size, outfile);
+		rkstats_end(extent.size);
+	}
+
+	rkz_close(&z);
+	return ret;
 }
 
 void usage(const char *appname) {
@@ -605,27 +5031,190 @@ void usage(const char *appname) {
 	p = p ? p + 1 : appname;
 
 	printf("USAGE:\n"
-			"\t%s <-pack|-unpack> <Src> <Dest>\n"
+			"\t%s [--stats=json] [--large] [--sparse] <-pack|-unpack> <Src> <Dest>\n"
+			"\t%s [--stats=json] [--large] -pack-batch <manifest>\n"
+			"\t%s [--large] -plan <Src>\n"
+			"\t%s [--stats=json] -diff <old image> <new image> <delta>\n"
+			"\t%s [--stats=json] -apply <old image> <delta> <new image>\n"
+			"\t%s [--stats=json] [--large] -watch <Src> <Dest>\n"
+			"\t%s [--stats=json] -archive <image> <store> [recipe]\n"
+			"\t%s [--stats=json] -restore <store> <recipe> <image>\n"
+			"\t%s [--stats=json] <-compress|-decompress> <image> <Dest>\n"
+			"\t%s -list <image>\n"
+			"\t%s [--stats=json] -extract <image> <part> <Dest>\n"
+			"\t%s -blockdiff <device blockmap> <image blockmap>\n"
+			"\t%s [--stats=json] <-sparse|-unsparse> <image> <Dest>\n"
 			"Example:\n"
 			"\t%s -pack xxx update.img\tPack files\n"
-			"\t%s -unpack update.img xxx\tunpack files\n", p, p, p);
+			"\t%s -pack fw.tar update.img\tPack from a tar archive (- for stdin)\n"
+			"\t%s -plan xxx\tCheck the layout and predict the I/O of -pack\n"
+			"\t%s -unpack update.img xxx\tunpack files\n"
+			"\t%s -pack-batch variants.txt\tPack \"<Src> <Dest>\" lines,"
+			" reading shared files once\n"
+			"\t%s -extract update.rkz boot boot.img\tInflate just one part\n"
+			"\t%s -sparse rootfs.img rootfs.simg\tAndroid sparse image for fastboot\n"
+			"Options:\n"
+			"\t--large\tallow images over 4 GiB (RKAF large image extension v%d)\n"
+			"\t--io=uring\tasynchronous I/O with io_uring (default: --io=sync)\n"
+			"\t--cache=drop\tkeep inputs and outputs out of the page cache\n"
+			"\t--manifest=<file>\twith -pack, write rkcrc/md5/sha256 of the"
+			" image and every part as JSON\n"
+			"\t--manifest-digests=<list>\tdigests to compute"
+			" (default: rkcrc,md5,sha256)\n"
+			"\t--blockmap=<file>\twith -pack, write a sha256 per %d KiB"
+			" flash block of every partition\n"
+			"\t--sparse\twith -unpack, write ext4/f2fs partitions as"
+			" Android sparse images\n"
+			"\t--build-cache=<dir>\twith -pack, reuse the image built"
+			" earlier from identical inputs\n",
+			p, p, p, p, p, p, p, p, p, p, p, p, p, p, p, p, p, p, p, p, RKAFP_EXT_VERSION,
+			BLOCKMAP_BLOCK >> 10);
 }
 
 int main(int argc, char** argv) {
+	int large = 0;
+
+	rkstats_parse_args(&argc, argv);
+	rkio_parse_args(&argc, argv);
+	rkmanifest_parse_args(&argc, argv);
+	rkbuild_parse_args(&argc, argv);
+
+	while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+		if (strcmp(argv[1], "--large") == 0) {
+			large = 1;
+		} else if (strcmp(argv[1], "--sparse") == 0) {
+			unpack_sparse = 1;
+		} else if (strncmp(argv[1], "--blockmap=", 11) == 0) {
+			blockmap.path = argv[1] + 11;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+
 	if (argc < 3) {
 		usage(argv[0]);
 		return 1;
 	}
 
+	if (rkmanifest.path && strcmp(argv[1], "-pack") != 0) {
+		fprintf(stderr, "--manifest only applies to -pack\n");
+		return 1;
+	}
+
+	if (rkbuild.dir && strcmp(argv[1], "-pack") != 0) {
+		fprintf(stderr, "--build-cache only applies to -pack\n");
+		return 1;
+	}
+
+	if (blockmap.path && strcmp(argv[1], "-pack") != 0) {
+		fprintf(stderr, "--blockmap only applies to -pack\n");
+		return 1;
+	}
+
+	if (unpack_sparse && (strcmp(argv[1], "-unpack") != 0 || rkz_probe(argv[2]))) {
+		fprintf(stderr, "--sparse only applies to -unpack of a raw image\n");
+		return 1;
+	}
+
 	if (strcmp(argv[1], "-pack") == 0 && argc == 4) {
-		if (pack_update(argv[2], argv[3]) == 0) {
+		if (pack_update(argv[2], argv[3], large) == 0
+				&& rkmanifest_write() == 0) {
+			printf("Pack OK!\n");
+		} else {
+			printf("Pack failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-plan") == 0 && argc == 3) {
+		if (plan_update(argv[2], large) != 0)
+			return 1;
+	} else if (strcmp(argv[1], "-pack-batch") == 0 && argc == 3) {
+		if (pack_batch(argv[2], large) == 0) {
 			printf("Pack OK!\n");
 		} else {
 			printf("Pack failed\n");
 			return 1;
 		}
+	} else if (strcmp(argv[1], "-watch") == 0 && argc == 4) {
+		if (watch_update(argv[2], argv[3], large) != 0) {
+			printf("Watch failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-diff") == 0 && argc == 5) {
+		if (diff_update(argv[2], argv[3], argv[4]) == 0) {
+			printf("Diff OK!\n");
+		} else {
+			printf("Diff failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-apply") == 0 && argc == 5) {
+		if (apply_delta(argv[2], argv[3], argv[4]) == 0) {
+			printf("Apply OK!\n");
+		} else {
+			printf("Apply failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-archive") == 0 && (argc == 4 || argc == 5)) {
+		if (archive_image(argv[2], argv[3], argc == 5 ? argv[4] : NULL) == 0) {
+			printf("Archive OK!\n");
+		} else {
+			printf("Archive failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-restore") == 0 && argc == 5) {
+		if (restore_image(argv[2], argv[3], argv[4]) == 0) {
+			printf("Restore OK!\n");
+		} else {
+			printf("Restore failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-compress") == 0 && argc == 4) {
+		if (compress_image(argv[2], argv[3]) == 0) {
+			printf("Compress OK!\n");
+		} else {
+			printf("Compress failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-decompress") == 0 && argc == 4) {
+		if (decompress_image(argv[2], argv[3]) == 0) {
+			printf("Decompress OK!\n");
+		} else {
+			printf("Decompress failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-list") == 0 && argc == 3) {
+		if (list_image(argv[2]) != 0)
+			return 1;
+	} else if (strcmp(argv[1], "-extract") == 0 && argc == 5) {
+		if (extract_part(argv[2], argv[3], argv[4]) == 0) {
+			printf("Extract OK!\n");
+		} else {
+			printf("Extract failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-sparse") == 0 && argc == 4) {
+		if (sparse_image(argv[2], argv[3]) == 0) {
+			printf("Sparse OK!\n");
+		} else {
+			printf("Sparse failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-unsparse") == 0 && argc == 4) {
+		if (unsparse_image(argv[2], argv[3]) == 0) {
+			printf("Unsparse OK!\n");
+		} else {
+			printf("Unsparse failed\n");
+			return 1;
+		}
+	} else if (strcmp(argv[1], "-blockdiff") == 0 && argc == 4) {
+		if (blockmap_diff(argv[2], argv[3]) != 0)
+			return 1;
 	} else if (strcmp(argv[1], "-unpack") == 0 && argc == 4) {
-		if (unpack_update(argv[2], argv[3]) == 0) {
+		if ((rkz_probe(argv[2]) ? unpack_container(argv[2], argv[3]) :
+				unpack_update(argv[2], argv[3])) == 0) {
 			printf("UnPack OK!\n");
 		} else {
 			printf("UnPack failed\n");
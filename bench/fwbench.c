@@ -0,0 +1,351 @@
+/*
+ * fwbench - end-to-end benchmark of the firmware tools on a tree made by
+ * bench/mkfwtree.
+ *
+ * Runs afptool -pack/-unpack, img_maker, mkbootimg and unmkbootimg in turn
+ * and records wall time, bytes read/written (/proc/<pid>/io rchar/wchar)
+ * and peak RSS of every step.  With -b the results are compared against a
+ * stored baseline and the run fails when a step regresses beyond the
+ * tolerance; -w stores the current results as the new baseline.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define MAX_ARGS 16
+
+struct step {
+	const char *name;
+	const char *argv[MAX_ARGS];
+};
+
+struct sample {
+	char name[32];
+	double wall;
+	unsigned long long rchar;
+	unsigned long long wchar;
+	long maxrss_kb;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_proc_io(pid_t pid, struct sample *s)
+{
+	char path[64], key[32];
+	unsigned long long val;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+
+	while (fscanf(fp, "%31[^:]: %llu\n", key, &val) == 2) {
+		if (strcmp(key, "rchar") == 0)
+			s->rchar = val;
+		else if (strcmp(key, "wchar") == 0)
+			s->wchar = val;
+	}
+
+	fclose(fp);
+}
+
+static int run_step(const struct step *st, struct sample *s)
+{
+	struct rusage ru;
+	siginfo_t info;
+	double start;
+	int status;
+	pid_t pid;
+
+	memset(s, 0, sizeof(*s));
+	snprintf(s->name, sizeof(s->name), "%s", st->name);
+
+	start = now();
+	pid = fork();
+	if (pid < 0)
+		return -1;
+
+	if (pid == 0) {
+		int fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execv(st->argv[0], (char * const *)st->argv);
+		_exit(127);
+	}
+
+	/* keep the zombie around long enough to read its I/O accounting */
+	if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0)
+		return -1;
+	s->wall = now() - start;
+	read_proc_io(pid, s);
+
+	if (wait4(pid, &status, 0, &ru) != pid)
+		return -1;
+	s->maxrss_kb = ru.ru_maxrss;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s failed (status 0x%x)\n", st->name, status);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int load_baseline(const char *fname, struct sample *base, int max)
+{
+	FILE *fp;
+	int n = 0;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		fprintf(stderr, "Can't open file \"%s\": %s\n", fname,
+				strerror(errno));
+		return -1;
+	}
+
+	while (n < max && fscanf(fp, "%31s %lf %llu %llu %ld", base[n].name,
+			&base[n].wall, &base[n].rchar, &base[n].wchar,
+			&base[n].maxrss_kb) == 5)
+		n++;
+
+	fclose(fp);
+
+	return n;
+}
+
+static int regressed(double cur, double base, double tol)
+{
+	return base > 0 && cur > base * (1.0 + tol);
+}
+
+/*
+ * mkbootimg is fed the first two images of the tree's package-file as
+ * kernel and ramdisk; a tree with a single image uses it for both.
+ */
+static int boot_inputs(const char *tree, char *kernel, char *ramdisk,
+		size_t size)
+{
+	char path[PATH_MAX], line[512], name[64], file[256];
+	int n = 0;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/package-file", tree);
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Can't open file \"%s\": %s\n", path,
+				strerror(errno));
+		return -1;
+	}
+
+	while (n < 2 && fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%63s %255s", name, file) != 2 || name[0] == '#'
+				|| strcmp(name, "package-file") == 0
+				|| strcmp(name, "bootloader") == 0
+				|| strcmp(name, "parameter") == 0
+				|| strcmp(file, "RESERVED") == 0)
+			continue;
+		snprintf(n ? ramdisk : kernel, size, "%s/%s", tree, file);
+		n++;
+	}
+	fclose(fp);
+
+	if (n == 0) {
+		fprintf(stderr, "No images in \"%s\"\n", path);
+		return -1;
+	}
+	if (n == 1)
+		snprintf(ramdisk, size, "%s", kernel);
+
+	return 0;
+}
+
+static void usage(const char *appname)
+{
+	const char *p = strrchr(appname, '/');
+	p = p ? p + 1 : appname;
+
+	printf("USAGE:\n"
+			"\t%s [-p bindir] [-o results.json] [-b baseline] [-w baseline]\n"
+			"\t\t[-t tolerance %%] <firmware tree> <work dir>\n"
+			"Example:\n"
+			"\tbench/mkfwtree /tmp/fw 512 8 50\n"
+			"\t%s -p . -b bench/fwbench.baseline /tmp/fw /tmp/fwwork\n",
+			p, p);
+}
+
+int main(int argc, char **argv)
+{
+	char afptool[PATH_MAX], img_maker[PATH_MAX];
+	char mkbootimg[PATH_MAX], unmkbootimg[PATH_MAX];
+	char update[PATH_MAX], unpacked[PATH_MAX], rkfw[PATH_MAX];
+	char loader[PATH_MAX], kernel[PATH_MAX], ramdisk[PATH_MAX];
+	char bootimg[PATH_MAX], kernel_out[PATH_MAX], ramdisk_out[PATH_MAX];
+	char second_out[PATH_MAX];
+	const char *bindir = ".";
+	const char *outfile = NULL, *basefile = NULL, *savefile = NULL;
+	double tolerance = 10;
+	struct sample samples[8], base[8];
+	int nbase = 0, failed = 0;
+	unsigned i, j;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:o:b:w:t:h")) != -1) {
+		switch (opt) {
+		case 'p':
+			bindir = optarg;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'b':
+			basefile = optarg;
+			break;
+		case 'w':
+			savefile = optarg;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	const char *tree = argv[optind];
+	const char *work = argv[optind + 1];
+
+	if (mkdir(work, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "Can't create directory: %s\n", work);
+		return 1;
+	}
+
+	snprintf(afptool, sizeof(afptool), "%s/afptool", bindir);
+	snprintf(img_maker, sizeof(img_maker), "%s/img_maker", bindir);
+	snprintf(mkbootimg, sizeof(mkbootimg), "%s/mkbootimg", bindir);
+	snprintf(unmkbootimg, sizeof(unmkbootimg), "%s/unmkbootimg", bindir);
+	snprintf(update, sizeof(update), "%s/update.img", work);
+	snprintf(unpacked, sizeof(unpacked), "%s/unpacked", work);
+	snprintf(rkfw, sizeof(rkfw), "%s/rkfw.img", work);
+	snprintf(loader, sizeof(loader), "%s/RK31Loader.bin", tree);
+	if (boot_inputs(tree, kernel, ramdisk, sizeof(kernel)) != 0)
+		return 1;
+	snprintf(bootimg, sizeof(bootimg), "%s/boot.img", work);
+	snprintf(kernel_out, sizeof(kernel_out), "%s/kernel", work);
+	snprintf(ramdisk_out, sizeof(ramdisk_out), "%s/ramdisk", work);
+	snprintf(second_out, sizeof(second_out), "%s/second", work);
+
+	const struct step steps[] = {
+		{ "afptool-pack", { afptool, "-pack", tree, update } },
+		{ "afptool-unpack", { afptool, "-unpack", update, unpacked } },
+		{ "img_maker", { img_maker, "-rk31", loader, "1", "0", "0",
+				update, rkfw } },
+		{ "mkbootimg", { mkbootimg, "--kernel", kernel, "--ramdisk",
+				ramdisk, "-o", bootimg } },
+		{ "unmkbootimg", { unmkbootimg, "--kernel", kernel_out,
+				"--ramdisk", ramdisk_out, "--second", second_out,
+				"-i", bootimg } },
+	};
+	const unsigned nsteps = sizeof(steps) / sizeof(steps[0]);
+
+	if (basefile && (nbase = load_baseline(basefile, base, 8)) < 0)
+		return 1;
+
+	printf("%-16s %10s %14s %14s %10s\n", "step", "wall(s)", "read",
+			"written", "rss(KB)");
+
+	for (i = 0; i < nsteps; i++) {
+		struct sample *s = &samples[i];
+
+		if (run_step(&steps[i], s) != 0)
+			return 1;
+
+		printf("%-16s %10.3f %14llu %14llu %10ld", s->name, s->wall,
+				s->rchar, s->wchar, s->maxrss_kb);
+
+		for (j = 0; j < (unsigned)nbase; j++) {
+			const struct sample *b = &base[j];
+			double tol = tolerance / 100.0;
+
+			if (strcmp(b->name, s->name) != 0)
+				continue;
+
+			if (regressed(s->wall, b->wall, tol)
+					|| regressed(s->rchar, b->rchar, tol)
+					|| regressed(s->wchar, b->wchar, tol)
+					|| regressed(s->maxrss_kb, b->maxrss_kb, tol)) {
+				printf("  REGRESSED (baseline %.3f %llu %llu %ld)",
+						b->wall, b->rchar, b->wchar, b->maxrss_kb);
+				failed = 1;
+			}
+		}
+		printf("\n");
+	}
+
+	if (outfile) {
+		FILE *fp = fopen(outfile, "w");
+
+		if (!fp) {
+			fprintf(stderr, "Can't open file \"%s\": %s\n", outfile,
+					strerror(errno));
+			return 1;
+		}
+
+		fprintf(fp, "{\"tree\":\"%s\",\"steps\":[\n", tree);
+		for (i = 0; i < nsteps; i++)
+			fprintf(fp, "%s{\"step\":\"%s\",\"wall_s\":%.6f,"
+					"\"bytes_read\":%llu,\"bytes_written\":%llu,"
+					"\"peak_rss_kb\":%ld}", i ? ",\n" : "",
+					samples[i].name, samples[i].wall,
+					samples[i].rchar, samples[i].wchar,
+					samples[i].maxrss_kb);
+		fprintf(fp, "\n]}\n");
+		fclose(fp);
+	}
+
+	if (savefile) {
+		FILE *fp = fopen(savefile, "w");
+
+		if (!fp) {
+			fprintf(stderr, "Can't open file \"%s\": %s\n", savefile,
+					strerror(errno));
+			return 1;
+		}
+
+		for (i = 0; i < nsteps; i++)
+			fprintf(fp, "%s %.6f %llu %llu %ld\n", samples[i].name,
+					samples[i].wall, samples[i].rchar,
+					samples[i].wchar, samples[i].maxrss_kb);
+		fclose(fp);
+	}
+
+	if (failed) {
+		fprintf(stderr, "Performance regression beyond %.1f%%\n", tolerance);
+		return 1;
+	}
+
+	return 0;
+}
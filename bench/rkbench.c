@@ -0,0 +1,630 @@
+/*
+ * rkbench - microbenchmarks for the checksum and copy kernels used by
+ * afptool, img_maker and mkbootimg.
+ *
+ * Every kernel is run over a range of buffer sizes, with warm and cold page
+ * cache and with several threads working on private buffers at once.  Each
+ * measurement is repeated and reported as mean/stddev/min/max GB/s, both as
+ * a table on stdout and as JSON (-o) for comparing runs.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+
+#include "../rkcrc.h"
+#include "../rkhash.h"
+
+#define MAX_SIZES	16
+#define MAX_THREADS	64
+#define MAX_REPS	100
+
+/* Hash kernels work in chunks the size the tools use for their stdio loops */
+#define HASH_CHUNK	(64 * 1024)
+
+enum cache_mode { CACHE_WARM, CACHE_COLD };
+
+struct kernel {
+	const char *name;
+	size_t copy_buf;	/* 0 for hash kernels */
+	void (*hash)(const unsigned char *buf, size_t len);
+};
+
+struct worker {
+	pthread_t thread;
+	const struct kernel *kernel;
+	size_t size;
+	enum cache_mode cache;
+	unsigned long iters;
+	unsigned char *buf;
+	char src[256];
+	char dst[256];
+	pthread_barrier_t *start;
+	double elapsed;
+	int failed;
+};
+
+static const char *tmpdir = "/tmp";
+static volatile uint32_t sink;
+
+static void hash_crc(const unsigned char *buf, size_t len)
+{
+	uint32_t crc = 0;
+
+	RKCRC(crc, buf, len);
+	sink ^= crc;
+}
+
+static void hash_md5(const unsigned char *buf, size_t len)
+{
+	unsigned char md[RKMD5_DIGEST_LENGTH];
+	struct rkmd5 ctx;
+
+	rkmd5_init(&ctx);
+	rkmd5_update(&ctx, buf, len);
+	rkmd5_final(md, &ctx);
+	sink ^= md[0];
+}
+
+static void hash_sha1(const unsigned char *buf, size_t len)
+{
+	unsigned char md[RKSHA1_DIGEST_LENGTH];
+	struct rksha1 ctx;
+
+	rksha1_init(&ctx);
+	rksha1_update(&ctx, buf, len);
+	rksha1_final(md, &ctx);
+	sink ^= md[0];
+}
+
+static void hash_sha256(const unsigned char *buf, size_t len)
+{
+	unsigned char md[RKSHA256_DIGEST_LENGTH];
+
+	rksha256(buf, len, md);
+	sink ^= md[0];
+}
+
+static void hash_md5_ossl(const unsigned char *buf, size_t len)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+
+	EVP_Digest(buf, len, md, NULL, EVP_md5(), NULL);
+	sink ^= md[0];
+}
+
+static void hash_sha1_ossl(const unsigned char *buf, size_t len)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+
+	EVP_Digest(buf, len, md, NULL, EVP_sha1(), NULL);
+	sink ^= md[0];
+}
+
+static void hash_sha256_ossl(const unsigned char *buf, size_t len)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+
+	EVP_Digest(buf, len, md, NULL, EVP_sha256(), NULL);
+	sink ^= md[0];
+}
+
+static const struct kernel kernels[] = {
+	/* RKCRC: afptool filestream_crc/import_package */
+	{ "rkcrc", 0, hash_crc },
+	/* MD5: img_maker append_md5sum (rkhash.h) */
+	{ "md5", 0, hash_md5 },
+	/* SHA1: mkbootimg hdr.id (rkhash.h) */
+	{ "sha1", 0, hash_sha1 },
+	/* SHA256: --manifest, --blockmap, -archive (rkhash.h) */
+	{ "sha256", 0, hash_sha256 },
+	/* the same digests from OpenSSL, for comparison */
+	{ "md5-ossl", 0, hash_md5_ossl },
+	{ "sha1-ossl", 0, hash_sha1_ossl },
+	{ "sha256-ossl", 0, hash_sha256_ossl },
+	/* stdio copy loops: extract_file/import_data and import_package */
+	{ "copy1k", 1024, NULL },
+	{ "copy2k", 2048, NULL },
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/*
+ * The tools hash with rkhash.h; check it against OpenSSL, with and
+ * without SHA-NI, for every length around the block and padding
+ * boundaries and for updates split at every offset of a block.
+ */
+static int check_hashes(void)
+{
+	unsigned char buf[4096], a[RKSHA256_DIGEST_LENGTH];
+	unsigned char b[EVP_MAX_MD_SIZE];
+	struct rksha256 sha256;
+	struct rksha1 sha1;
+	struct rkmd5 md5;
+	int accel, failed = 0;
+	size_t len, cut, i;
+
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = i * 2654435761U >> 13;
+
+	for (accel = 0; accel <= rkhash_shani(); accel++) {
+		rkhash_accel = accel;
+		for (len = 0; len <= sizeof(buf); len += len < 320 ? 1 : 61) {
+			cut = len % 67;
+
+			rkmd5_init(&md5);
+			rkmd5_update(&md5, buf, cut);
+			rkmd5_update(&md5, buf + cut, len - cut);
+			rkmd5_final(a, &md5);
+			EVP_Digest(buf, len, b, NULL, EVP_md5(), NULL);
+			if (memcmp(a, b, RKMD5_DIGEST_LENGTH) != 0) {
+				fprintf(stderr, "md5 mismatch: %zu bytes\n", len);
+				failed = 1;
+			}
+
+			rksha1_init(&sha1);
+			rksha1_update(&sha1, buf, cut);
+			rksha1_update(&sha1, buf + cut, len - cut);
+			rksha1_final(a, &sha1);
+			EVP_Digest(buf, len, b, NULL, EVP_sha1(), NULL);
+			if (memcmp(a, b, RKSHA1_DIGEST_LENGTH) != 0) {
+				fprintf(stderr, "sha1%s mismatch: %zu bytes\n",
+						accel ? " (SHA-NI)" : "", len);
+				failed = 1;
+			}
+
+			rksha256_init(&sha256);
+			rksha256_update(&sha256, buf, cut);
+			rksha256_update(&sha256, buf + cut, len - cut);
+			rksha256_final(a, &sha256);
+			EVP_Digest(buf, len, b, NULL, EVP_sha256(), NULL);
+			if (memcmp(a, b, RKSHA256_DIGEST_LENGTH) != 0) {
+				fprintf(stderr, "sha256%s mismatch: %zu bytes\n",
+						accel ? " (SHA-NI)" : "", len);
+				failed = 1;
+			}
+		}
+	}
+	rkhash_accel = -1;
+
+	printf("rkhash check against OpenSSL (%s): %s\n",
+			rkhash_shani() ? "portable, SHA-NI" : "portable",
+			failed ? "FAILED" : "ok");
+
+	return failed ? -1 : 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, const unsigned char *buf, size_t len)
+{
+	int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+
+	if (fd < 0)
+		return -1;
+
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n <= 0) {
+			close(fd);
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+
+	fdatasync(fd);
+	close(fd);
+
+	return 0;
+}
+
+/* Drop a file from the page cache so the next read comes from the device */
+static void drop_cache(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return;
+
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static int run_copy(struct worker *w)
+{
+	FILE *ifp, *ofp;
+	char buffer[2048];
+	size_t buflen = w->kernel->copy_buf;
+	size_t len;
+
+	if ((ifp = fopen(w->src, "rb")) == NULL)
+		return -1;
+
+	if ((ofp = fopen(w->dst, "wb")) == NULL) {
+		fclose(ifp);
+		return -1;
+	}
+
+	while ((len = fread(buffer, 1, buflen, ifp)) != 0)
+		fwrite(buffer, len, 1, ofp);
+
+	fclose(ofp);
+	fclose(ifp);
+
+	return 0;
+}
+
+/* Cold hashing has to pull the data through read(2) first */
+static int run_cold_hash(struct worker *w)
+{
+	size_t done = 0;
+	int fd;
+
+	if ((fd = open(w->src, O_RDONLY)) < 0)
+		return -1;
+
+	while (done < w->size) {
+		ssize_t n = read(fd, w->buf + done, w->size - done);
+		if (n <= 0) {
+			close(fd);
+			return -1;
+		}
+		done += n;
+	}
+	close(fd);
+
+	w->kernel->hash(w->buf, w->size);
+
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned long i;
+	double start;
+
+	pthread_barrier_wait(w->start);
+	start = now();
+
+	for (i = 0; i < w->iters && !w->failed; i++) {
+		if (w->kernel->copy_buf)
+			w->failed = run_copy(w) != 0;
+		else if (w->cache == CACHE_COLD)
+			w->failed = run_cold_hash(w) != 0;
+		else
+			w->kernel->hash(w->buf, w->size);
+	}
+
+	w->elapsed = now() - start;
+
+	return NULL;
+}
+
+struct result {
+	double mean, stddev, min, max;
+	int reps;
+};
+
+static int measure(const struct kernel *k, size_t size, enum cache_mode cache,
+		int nthreads, int reps, struct result *res)
+{
+	struct worker workers[MAX_THREADS];
+	pthread_barrier_t start;
+	double gbps[MAX_REPS];
+	unsigned long iters;
+	int i, r, ret = 0;
+
+	/*
+	 * Keep each warm repetition around 32 MB so small buffers are not
+	 * dominated by timer resolution; cold runs evict between iterations
+	 * and therefore always do a single pass.
+	 */
+	iters = cache == CACHE_COLD ? 1 : (32UL << 20) / size;
+	if (iters == 0)
+		iters = 1;
+
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+		size_t j;
+
+		w->kernel = k;
+		w->size = size;
+		w->cache = cache;
+		w->iters = iters;
+		w->start = &start;
+
+		if ((w->buf = malloc(size)) == NULL) {
+			ret = -1;
+			goto out;
+		}
+		for (j = 0; j < size; j++)
+			w->buf[j] = (unsigned char)(j * 2654435761u >> 13);
+
+		snprintf(w->src, sizeof(w->src), "%s/rkbench.%d.%d.src",
+				tmpdir, (int)getpid(), i);
+		snprintf(w->dst, sizeof(w->dst), "%s/rkbench.%d.%d.dst",
+				tmpdir, (int)getpid(), i);
+
+		if ((k->copy_buf || cache == CACHE_COLD)
+				&& write_file(w->src, w->buf, size) != 0) {
+			fprintf(stderr, "Can't write %s: %s\n", w->src,
+					strerror(errno));
+			ret = -1;
+			goto out;
+		}
+	}
+
+	/* one warm-up pass, not recorded */
+	for (r = -1; r < reps; r++) {
+		double slowest = 0;
+
+		for (i = 0; i < nthreads; i++) {
+			if (cache == CACHE_COLD) {
+				drop_cache(workers[i].src);
+				drop_cache(workers[i].dst);
+			}
+		}
+
+		pthread_barrier_init(&start, NULL, nthreads);
+		for (i = 0; i < nthreads; i++)
+			pthread_create(&workers[i].thread, NULL, worker_main,
+					&workers[i]);
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(workers[i].thread, NULL);
+			if (workers[i].failed)
+				ret = -1;
+			if (workers[i].elapsed > slowest)
+				slowest = workers[i].elapsed;
+		}
+		pthread_barrier_destroy(&start);
+
+		if (ret)
+			goto out;
+
+		if (r >= 0)
+			gbps[r] = (double)size * iters * nthreads / slowest / 1e9;
+	}
+
+	res->reps = reps;
+	res->mean = 0;
+	for (r = 0; r < reps; r++) {
+		res->mean += gbps[r];
+		if (r == 0 || gbps[r] < res->min)
+			res->min = gbps[r];
+		if (r == 0 || gbps[r] > res->max)
+			res->max = gbps[r];
+	}
+	res->mean /= reps;
+
+	res->stddev = 0;
+	for (r = 0; r < reps; r++)
+		res->stddev += (gbps[r] - res->mean) * (gbps[r] - res->mean);
+	res->stddev = reps > 1 ? sqrt(res->stddev / (reps - 1)) : 0;
+
+out:
+	for (i = 0; i < nthreads; i++) {
+		free(workers[i].buf);
+		unlink(workers[i].src);
+		unlink(workers[i].dst);
+	}
+
+	return ret;
+}
+
+/* Is name one of the comma separated entries of list? */
+static int in_list(const char *list, const char *name)
+{
+	size_t l = strlen(name);
+
+	while (*list) {
+		size_t n = strcspn(list, ",");
+
+		if (n == l && strncmp(list, name, l) == 0)
+			return 1;
+		list += n;
+		if (*list == ',')
+			list++;
+	}
+
+	return 0;
+}
+
+static int parse_list(const char *str, size_t *list, int max, int sizes)
+{
+	char *end;
+	int n = 0;
+
+	while (*str && n < max) {
+		size_t v = strtoul(str, &end, 10);
+
+		if (end == str)
+			return -1;
+
+		if (sizes) {
+			if (*end == 'K' || *end == 'k')
+				v <<= 10, end++;
+			else if (*end == 'M' || *end == 'm')
+				v <<= 20, end++;
+			else if (*end == 'G' || *end == 'g')
+				v <<= 30, end++;
+		}
+
+		if (v == 0)
+			return -1;
+
+		list[n++] = v;
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -1;
+		str = end;
+	}
+
+	return n;
+}
+
+static void usage(const char *appname)
+{
+	const char *p = strrchr(appname, '/');
+	p = p ? p + 1 : appname;
+
+	printf("USAGE:\n"
+			"\t%s [-k kernels] [-s sizes] [-t threads] [-c warm|cold|both]\n"
+			"\t\t[-r reps] [-d tmpdir] [-o results.json]\n"
+			"\t%s -x\tonly check the built-in hashes against OpenSSL\n"
+			"Defaults:\n"
+			"\t-k rkcrc,md5,sha1,sha256,md5-ossl,sha1-ossl,sha256-ossl,"
+			"copy1k,copy2k\n"
+			"\t-s 4K,64K,1M,16M,64M\n"
+			"\t-t 1,<online cpus>\n"
+			"\t-c both -r 5 -d /tmp\n", p, p);
+}
+
+int main(int argc, char **argv)
+{
+	size_t sizes[MAX_SIZES] = { 4 << 10, 64 << 10, 1 << 20, 16 << 20, 64 << 20 };
+	size_t threads[MAX_SIZES] = { 1 };
+	int nsizes = 5, nthreads = 1;
+	const char *kernel_list = NULL;
+	const char *outfile = NULL;
+	int warm = 1, cold = 1;
+	int reps = 5;
+	FILE *json = NULL;
+	int first = 1, ret = 0;
+	unsigned k;
+	int opt, s, t, c;
+	long cpus;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 1)
+		threads[nthreads++] = cpus > MAX_THREADS ? MAX_THREADS : cpus;
+
+	while ((opt = getopt(argc, argv, "k:s:t:c:r:d:o:xh")) != -1) {
+		switch (opt) {
+		case 'x':
+			return check_hashes() == 0 ? 0 : 1;
+		case 'k':
+			kernel_list = optarg;
+			break;
+		case 's':
+			nsizes = parse_list(optarg, sizes, MAX_SIZES, 1);
+			break;
+		case 't':
+			nthreads = parse_list(optarg, threads, MAX_SIZES, 0);
+			for (t = 0; t < nthreads; t++)
+				if (threads[t] > MAX_THREADS)
+					nthreads = -1;
+			break;
+		case 'c':
+			warm = strcmp(optarg, "cold") != 0;
+			cold = strcmp(optarg, "warm") != 0;
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'd':
+			tmpdir = optarg;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (nsizes <= 0 || nthreads <= 0 || reps < 1 || reps > MAX_REPS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* don't time kernels that compute the wrong thing */
+	if (check_hashes() != 0)
+		return 1;
+
+	if (outfile && (json = fopen(outfile, "w")) == NULL) {
+		fprintf(stderr, "Can't open file \"%s\": %s\n", outfile,
+				strerror(errno));
+		return 1;
+	}
+
+	if (json)
+		fprintf(json, "{\"unit\":\"GB/s\",\"reps\":%d,\"results\":[\n", reps);
+
+	printf("%-11s %10s %5s %7s %9s %9s %9s %9s\n", "kernel", "size",
+			"cache", "threads", "mean", "stddev", "min", "max");
+
+	for (k = 0; k < NUM_KERNELS; k++) {
+		const struct kernel *kern = &kernels[k];
+
+		if (kernel_list && !in_list(kernel_list, kern->name))
+			continue;
+
+		for (c = CACHE_WARM; c <= CACHE_COLD; c++) {
+			if ((c == CACHE_WARM && !warm) || (c == CACHE_COLD && !cold))
+				continue;
+
+			for (s = 0; s < nsizes; s++) {
+				for (t = 0; t < nthreads; t++) {
+					struct result res;
+					const char *cache = c == CACHE_WARM ? "warm" : "cold";
+
+					if (measure(kern, sizes[s], c, threads[t], reps,
+							&res) != 0) {
+						fprintf(stderr, "%s/%zu/%s/%zu failed\n",
+								kern->name, sizes[s], cache,
+								threads[t]);
+						ret = 1;
+						continue;
+					}
+
+					printf("%-11s %10zu %5s %7zu %9.3f %9.3f %9.3f %9.3f\n",
+							kern->name, sizes[s], cache, threads[t],
+							res.mean, res.stddev, res.min, res.max);
+					fflush(stdout);
+
+					if (json) {
+						fprintf(json, "%s{\"kernel\":\"%s\",\"size\":%zu,"
+								"\"cache\":\"%s\",\"threads\":%zu,"
+								"\"mean\":%.6f,\"stddev\":%.6f,"
+								"\"min\":%.6f,\"max\":%.6f}",
+								first ? "" : ",\n", kern->name,
+								sizes[s], cache, threads[t], res.mean,
+								res.stddev, res.min, res.max);
+						first = 0;
+					}
+				}
+			}
+		}
+	}
+
+	if (json) {
+		fprintf(json, "\n]}\n");
+		fclose(json);
+	}
+
+	return ret;
+}
@@ -1,85 +1,143 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <time.h>
-#include <openssl/md5.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include "rkrom.h"
 #include "rkafp.h"
+#include "rkbuild.h"
+#include "rkhash.h"
+#include "rkio.h"
+#include "rkmanifest.h"
+#include "rkstats.h"
+
+/* Size of infile, with its first head_len bytes copied to head */
+uint64_t probe_data(const char* infile, void *head, size_t head_len)
+{
+	struct stat st;
+	ssize_t n = -1;
+	int fd;
+
+	memset(head, 0, head_len);
+	fd = open(infile, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) == 0)
+		n = pread(fd, head, head_len, 0);
+	close(fd);
 
-unsigned int import_data(const char* infile, void *head, size_t head_len, FILE *fp)
+	return n < 0 ? 0 : (uint64_t)st.st_size;
+}
+
+static int md5_chunk(void *ctx, const unsigned char *buf, size_t len)
 {
-	FILE *in_fp = NULL;
-	unsigned readlen = 0;
-	unsigned char buffer[1024];
+	rkmd5_update(ctx, buf, len);
+	rkmanifest_update(buf, len);
+	return 0;
+}
 
-	in_fp = fopen(infile, "rb");
+/* Copy len bytes of infile to the current position of fp, hashing them */
+int import_data(const char* infile, uint64_t len, FILE *fp, struct rkmd5 *md5_ctx)
+{
+	struct stat st;
+	off_t pos;
+	int fd, ret = -1;
 
-	if (!in_fp)
+	fd = open(infile, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0)
 		goto import_end;
 
-	readlen = fread(head, 1, head_len, in_fp);
-	if (readlen)
+	if ((uint64_t)st.st_size != len)
 	{
-		fwrite(head, 1, readlen, fp);
+		fprintf(stderr, "%s changed while packing\n", infile);
+		goto import_end;
 	}
 
-	while (1)
+	fflush(fp);
+	pos = ftello(fp);
+	if (rkio_stream(fd, 0, len, fileno(fp), pos, md5_chunk, md5_ctx) != 0)
 	{
-		int len = fread(buffer, 1, sizeof(buffer), in_fp);
-
-		if (len)
-		{
-			fwrite(buffer, 1, len, fp);
-			readlen += len;
-		}
-
-		if (len != sizeof(buffer))
-			break;
+		fprintf(stderr, "Can't import %s: %s\n", infile, strerror(errno));
+		goto import_end;
 	}
+	fseeko(fp, pos + len, SEEK_SET);
+	ret = 0;
 
 import_end:
-	if (in_fp)
-		fclose(in_fp);
+	if (fd >= 0)
+		close(fd);
 
-	return readlen;
+	return ret;
 }
 
-void append_md5sum(FILE *fp)
+void append_md5sum(FILE *fp, struct rkmd5 *md5_ctx)
 {
-	MD5_CTX md5_ctx;
-	unsigned char buffer[1024];
+	unsigned char buffer[16];
+	char hex[33];
 	int i;
 
-	MD5_Init(&md5_ctx);
-	fseek(fp, 0, SEEK_SET);
+	rkmd5_final(buffer, md5_ctx);
 
-	while (1)
+	for (i = 0; i < 16; ++i)
 	{
-		int len = fread(buffer, 1, sizeof(buffer), fp);
-		if (len)
-		{
-			MD5_Update(&md5_ctx, buffer, len);
-		}
-
-		if (len != sizeof(buffer))
-			break;
+		sprintf(hex + 2 * i, "%02x", buffer[i]);
 	}
+	fputs(hex, fp);
+	rkmanifest_update(hex, 32);
+}
 
-	MD5_Final(buffer, &md5_ctx);
+/* Manifest sections: loader, image and the parts of the RKAF image */
+void manifest_sections(const struct rkfw_header *rom_header,
+		const struct update_header *rkaf_header)
+{
+	struct update_extent extent;
+	unsigned int i;
 
-	for (i = 0; i < 16; ++i)
+	rkmanifest_section("loader", rom_header->loader_offset,
+			rom_header->loader_length);
+	rkmanifest_section("image", rom_header->image_offset,
+			rom_header->image_length);
+
+	if (strncmp(rkaf_header->magic, RKAFP_MAGIC, sizeof(rkaf_header->magic)) != 0)
+		return;
+
+	for (i = 0; i < rkaf_header->num_parts && i < 16; ++i)
 	{
-		fprintf(fp, "%02x", buffer[i]);
+		rkafp_get_extent(rkaf_header, i, &extent);
+		if (strcmp(rkaf_header->parts[i].filename, "SELF") == 0
+				|| extent.pos > rom_header->image_length
+				|| extent.size > rom_header->image_length - extent.pos)
+			continue;
+		rkmanifest_section(rkaf_header->parts[i].name,
+				rom_header->image_offset + extent.pos, extent.size);
 	}
 }
 
+/*
+ * The RKFW header only depends on the input sizes and their first bytes,
+ * so it is written first and the md5 is computed while the loader and the
+ * image are copied; the output is never read back.
+ */
 int pack_rom(unsigned int chiptype, const char *loader_filename, int majver, int minver, int subver, const char *image_filename, const char *outfile)
 {
 	time_t nowtime;
 	struct tm local_time;
+	const char *epoch;
+	char *end;
+	uint64_t loader_length, image_length;
 	unsigned int i;
+	struct rkmd5 md5_ctx;
+	FILE *fp = NULL;
 
 	struct rkfw_header rom_header = {
 		.head_code = "RKFW",
@@ -101,8 +159,29 @@ int pack_rom(unsigned int chiptype, const char *loader_filename, int majver, int
 	}else if(chiptype == 0x33313241) {
 		rom_header.code = 0x01030000;
 	}
-	nowtime = time(NULL);
-	localtime_r(&nowtime, &local_time);
+	/* reproducible builds: SOURCE_DATE_EPOCH, in UTC, instead of now */
+	if ((epoch = getenv("SOURCE_DATE_EPOCH")) != NULL && *epoch)
+	{
+		nowtime = strtoll(epoch, &end, 10);
+		if (*end != '\0' || nowtime < 0)
+		{
+			fprintf(stderr, "invalid SOURCE_DATE_EPOCH: \"%s\"\n", epoch);
+			return -1;
+		}
+		gmtime_r(&nowtime, &local_time);
+	}
+	else
+	{
+		nowtime = time(NULL);
+		localtime_r(&nowtime, &local_time);
+
+		/* the build time is in the key: every run would store a new object */
+		if (rkbuild.dir)
+		{
+			fprintf(stderr, "warning: --build-cache needs SOURCE_DATE_EPOCH, ignored\n");
+			rkbuild.dir = NULL;
+		}
+	}
 
 	rom_header.year = local_time.tm_year + 1900;
 	rom_header.month = local_time.tm_mon + 1;
@@ -111,18 +190,6 @@ int pack_rom(unsigned int chiptype, const char *loader_filename, int majver, int
 	rom_header.minute = local_time.tm_min;
 	rom_header.second = local_time.tm_sec;
 
-	FILE *fp = fopen(outfile, "wb+");
-	if (!fp)
-	{
-		fprintf(stderr, "Can't open file %s\n, reason: %s\n", outfile, strerror(errno));
-		goto pack_fail;
-	}
-
-	unsigned char buffer[0x66];
-	if (1 != fwrite(buffer, 0x66, 1, fp))
-		goto pack_fail;
-
-
 	printf("rom version: %x.%x.%x\n",
 		(rom_header.version >> 24) & 0xFF,
 		(rom_header.version >> 16) & 0xFF,
@@ -134,61 +201,342 @@ int pack_rom(unsigned int chiptype, const char *loader_filename, int majver, int
 
 	printf("chip: %x\n", rom_header.chip);
 
-	fseek(fp, rom_header.loader_offset, SEEK_SET);
-	fprintf(stderr, "generate image...\n");
-	rom_header.loader_length = import_data(loader_filename, &loader_header, sizeof(loader_header), fp);
-
-	if (rom_header.loader_length <  sizeof(loader_header))
+	loader_length = probe_data(loader_filename, &loader_header, sizeof(loader_header));
+	if (loader_length <  sizeof(loader_header))
 	{
 		fprintf(stderr, "invalid loader :\"\%s\"\n",  loader_filename);
 		goto pack_fail;
 	}
 
-	rom_header.image_offset = rom_header.loader_offset + rom_header.loader_length;
-	rom_header.image_length = import_data(image_filename, &rkaf_header, sizeof(rkaf_header), fp);
-	if (rom_header.image_length < sizeof(rkaf_header))
+	image_length = probe_data(image_filename, &rkaf_header, sizeof(rkaf_header));
+	if (image_length < sizeof(rkaf_header))
 	{
 		fprintf(stderr, "invalid rom :\"\%s\"\n",  image_filename);
 		goto pack_fail;
 	}
 
+	/* rkfw_header only has 32-bit offsets, don't write a truncated one */
+	if (rom_header.loader_offset + loader_length + image_length > 0xFFFFFFFFULL)
+	{
+		fprintf(stderr, "image too large for RKFW header: loader %" PRIu64
+				" + image %" PRIu64 " bytes exceeds 4 GiB\n",
+				loader_length, image_length);
+		goto pack_fail;
+	}
+
+	rom_header.loader_length = loader_length;
+	rom_header.image_offset = rom_header.loader_offset + rom_header.loader_length;
+	rom_header.image_length = image_length;
+
 	rom_header.unknown2 = 1;
 
 	rom_header.system_fstype = 0;
 
-	for (i = 0; i < rkaf_header.num_parts; ++i)
+	for (i = 0; i < rkaf_header.num_parts && i < 16; ++i)
 	{
 		if (strcmp(rkaf_header.parts[i].name, "backup") == 0)
 			break;
 	}
 
-	if (i < rkaf_header.num_parts)
+	if (i < rkaf_header.num_parts && i < 16)
 		rom_header.backup_endpos = (rkaf_header.parts[i].nand_addr + rkaf_header.parts[i].nand_size) / 0x800;
 	else
 		rom_header.backup_endpos = 0;
 
-	fseek(fp, 0, SEEK_SET);
+	if (!rkmanifest.path)
+	{
+		rkbuild_begin("img_maker");
+		rkbuild_add(&rom_header, sizeof(rom_header));
+		rkbuild_add_path(loader_filename);
+		rkbuild_add_path(image_filename);
+		if (rkbuild_fetch(outfile) == 0)
+		{
+			fprintf(stderr, "success!\n");
+			return 0;
+		}
+	}
+
+	fp = fopen(outfile, "wb+");
+	if (!fp)
+	{
+		fprintf(stderr, "Can't open file %s\n, reason: %s\n", outfile, strerror(errno));
+		goto pack_fail;
+	}
+
+	if (rkmanifest.path)
+	{
+		if (rkmanifest_begin(outfile) != 0)
+			goto pack_fail;
+		manifest_sections(&rom_header, &rkaf_header);
+	}
+
+	rkstats_begin("header");
+	rkmanifest_update(&rom_header, sizeof(rom_header));
+	rkmd5_init(&md5_ctx);
+	rkmd5_update(&md5_ctx, &rom_header, sizeof(rom_header));
 	if (1 != fwrite(&rom_header, sizeof(rom_header), 1, fp))
 		goto pack_fail;
+	rkstats_end(sizeof(rom_header));
+
+	fprintf(stderr, "generate image...\n");
+	rkstats_begin("import:loader");
+	if (import_data(loader_filename, loader_length, fp, &md5_ctx) != 0)
+		goto pack_fail;
+	rkstats_end(loader_length);
+
+	rkstats_begin("import:image");
+	if (import_data(image_filename, image_length, fp, &md5_ctx) != 0)
+		goto pack_fail;
+	rkstats_end(image_length);
 
 	fprintf(stderr, "append md5sum...\n");
-	append_md5sum(fp);
-	fclose(fp);
+	rkstats_begin("md5");
+	append_md5sum(fp, &md5_ctx);
+	rkstats_end((uint64_t)rom_header.image_offset + rom_header.image_length);
+
+	fflush(fp);
+	if (rkio_flush(fileno(fp)) != 0 || fclose(fp) != 0)
+	{
+		fp = NULL;
+		fprintf(stderr, "Can't write %s: %s\n", outfile, strerror(errno));
+		unlink(outfile);
+		goto pack_fail;
+	}
+	if (rkmanifest.cur && (rkmanifest_finish() != 0 || rkmanifest_write() != 0))
+		return -1;
+	rkbuild_store(outfile);
 	fprintf(stderr, "success!\n");
 
 	return 0;
 pack_fail:
 	if (fp)
+	{
 		fclose(fp);
+		unlink(outfile);
+	}
 	return -1;
 }
 
+/*
+ * -verify checks an RKFW file in a single read pass: the outer md5 and the
+ * RKAF crc of the inner image are computed from the same stream.  Only the
+ * two headers are read up front, to know where the inner image lies.
+ */
+struct verify_ctx {
+	struct rkmd5 md5_ctx;
+	uint64_t pos;
+	uint64_t md5_len;
+	uint64_t crc_start;
+	uint64_t crc_len;	/* 0 when the inner header is unusable */
+	unsigned int crc;
+	unsigned int image_crc;
+	char md5sum[33];
+};
+
+/* Intersect [off, off + size) with the chunk [pos, pos + len) */
+static int overlap(uint64_t off, uint64_t size, uint64_t pos, size_t len,
+		uint64_t *a, uint64_t *b)
+{
+	*a = off > pos ? off : pos;
+	*b = off + size < pos + len ? off + size : pos + len;
+	return *a < *b;
+}
+
+static int verify_chunk(void *arg, const unsigned char *buf, size_t len)
+{
+	struct verify_ctx *ctx = arg;
+	uint64_t a, b;
+
+	if (overlap(0, ctx->md5_len, ctx->pos, len, &a, &b))
+		rkmd5_update(&ctx->md5_ctx, buf + a - ctx->pos, b - a);
+	if (overlap(ctx->md5_len, 32, ctx->pos, len, &a, &b))
+		memcpy(ctx->md5sum + a - ctx->md5_len, buf + a - ctx->pos, b - a);
+
+	if (ctx->crc_len && overlap(ctx->crc_start, ctx->crc_len, ctx->pos, len,
+			&a, &b))
+		RKCRC(ctx->image_crc, buf + a - ctx->pos, b - a);
+	if (ctx->crc_len && overlap(ctx->crc_start + ctx->crc_len, 4, ctx->pos,
+			len, &a, &b))
+		memcpy((char *)&ctx->crc + a - ctx->crc_start - ctx->crc_len,
+				buf + a - ctx->pos, b - a);
+
+	ctx->pos += len;
+	return 0;
+}
+
+static void verify_layer(int *first, const char *layer, int ok)
+{
+	printf("%s\n {\"layer\":\"%s\",\"ok\":%s", *first ? "" : ",", layer,
+			ok ? "true" : "false");
+	*first = 0;
+}
+
+/* Check the inner header and part bounds; returns the RKAF crc length */
+static uint64_t verify_rkaf(const struct rkfw_header *rom_header,
+		const struct update_header *rkaf_header, int *first, int *ok)
+{
+	struct update_extent extents[16];
+	struct update_ext ext;
+	uint64_t length = 0;
+	unsigned int i, j;
+	const char *error = NULL;
+
+	if (strncmp(rkaf_header->magic, RKAFP_MAGIC, sizeof(rkaf_header->magic)) != 0)
+		error = "bad magic";
+	else if (rkafp_get_ext(rkaf_header, &ext) > RKAFP_EXT_VERSION)
+		error = "unsupported large image extension";
+	else if (rkaf_header->num_parts > 16)
+		error = "too many parts";
+	else if ((length = rkafp_get_length(rkaf_header)) > rom_header->image_length
+			|| rom_header->image_length - length < 4)
+		error = "length past the end of the image";
+
+	verify_layer(first, "rkaf", error == NULL);
+	if (error) {
+		printf(",\"error\":\"%s\"}", error);
+		*ok = 0;
+		return 0;
+	}
+	printf(",\"length\":%" PRIu64 ",\"parts\":%u}", length,
+			rkaf_header->num_parts);
+
+	for (i = 0; i < rkaf_header->num_parts; i++) {
+		struct update_extent *e = &extents[i];
+
+		rkafp_get_extent(rkaf_header, i, e);
+		if (strcmp(rkaf_header->parts[i].filename, "SELF") == 0)
+			continue;
+
+		error = NULL;
+		if (e->size > e->padded_size)
+			error = "size exceeds padded size";
+		else if (e->size && (e->pos < sizeof(*rkaf_header) || e->pos > length
+				|| e->size > length - e->pos))
+			error = "out of bounds";
+		for (j = 0; j < i && !error; j++) {
+			if (strcmp(rkaf_header->parts[j].filename, "SELF") == 0)
+				continue;
+			if (e->size && extents[j].size && e->pos < extents[j].pos +
+					extents[j].size && extents[j].pos < e->pos + e->size)
+				error = "overlaps another part";
+		}
+
+		verify_layer(first, "part", error == NULL);
+		printf(",\"name\":");
+		rkstats_json_string(stdout, rkaf_header->parts[i].name);
+		printf(",\"pos\":%" PRIu64 ",\"size\":%" PRIu64, e->pos, e->size);
+		if (error) {
+			printf(",\"error\":\"%s\"", error);
+			*ok = 0;
+		}
+		putchar('}');
+	}
+
+	return length;
+}
+
+int verify_rom(const char *infile)
+{
+	struct rkfw_header rom_header;
+	struct update_header rkaf_header;
+	struct verify_ctx ctx;
+	unsigned char digest[16];
+	char md5sum[33];
+	struct stat st;
+	const char *error = NULL;
+	int fd, i, first = 1, ok = 1;
+
+	fd = open(infile, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Can't open file %s: %s\n", infile, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	memset(&rom_header, 0, sizeof(rom_header));
+	memset(&rkaf_header, 0, sizeof(rkaf_header));
+
+	printf("{\"file\":");
+	rkstats_json_string(stdout, infile);
+	printf(",\"layers\":[");
+
+	if ((uint64_t)st.st_size < sizeof(rom_header) + 32
+			|| pread(fd, &rom_header, sizeof(rom_header), 0) != sizeof(rom_header)
+			|| memcmp(rom_header.head_code, "RKFW", 4) != 0)
+		error = "bad magic";
+	else if ((uint64_t)rom_header.loader_offset + rom_header.loader_length
+			> (uint64_t)st.st_size - 32)
+		error = "loader out of bounds";
+	else if ((uint64_t)rom_header.image_offset + rom_header.image_length
+			> (uint64_t)st.st_size - 32)
+		error = "image out of bounds";
+
+	verify_layer(&first, "rkfw", error == NULL);
+	if (error)
+	{
+		printf(",\"error\":\"%s\"}]", error);
+		ok = 0;
+		goto out;
+	}
+	printf(",\"size\":%" PRIu64 ",\"loader_length\":%u,\"image_length\":%u}",
+			(uint64_t)st.st_size, rom_header.loader_length,
+			rom_header.image_length);
+
+	if (rom_header.image_length >= sizeof(rkaf_header)
+			&& pread(fd, &rkaf_header, sizeof(rkaf_header),
+				rom_header.image_offset) != sizeof(rkaf_header))
+		memset(&rkaf_header, 0, sizeof(rkaf_header));
+	ctx.crc_start = rom_header.image_offset;
+	ctx.crc_len = verify_rkaf(&rom_header, &rkaf_header, &first, &ok);
+
+	rkstats_begin("verify");
+	ctx.md5_len = st.st_size - 32;
+	rkmd5_init(&ctx.md5_ctx);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (rkio_stream(fd, 0, st.st_size, -1, 0, verify_chunk, &ctx) != 0)
+	{
+		fprintf(stderr, "Read error: %s\n", strerror(errno));
+		ok = 0;
+	}
+	rkstats_end(st.st_size);
+
+	rkmd5_final(digest, &ctx.md5_ctx);
+	for (i = 0; i < 16; ++i)
+		sprintf(md5sum + 2 * i, "%02x", digest[i]);
+	if (strncasecmp(md5sum, ctx.md5sum, 32) != 0)
+		ok = 0;
+	verify_layer(&first, "md5", strncasecmp(md5sum, ctx.md5sum, 32) == 0);
+	printf(",\"expected\":");
+	rkstats_json_string(stdout, ctx.md5sum);
+	printf(",\"actual\":\"%s\"}", md5sum);
+
+	if (ctx.crc_len)
+	{
+		if (ctx.crc != ctx.image_crc)
+			ok = 0;
+		verify_layer(&first, "rkaf_crc", ctx.crc == ctx.image_crc);
+		printf(",\"expected\":\"%08x\",\"actual\":\"%08x\"}", ctx.crc,
+				ctx.image_crc);
+	}
+	printf("]");
+
+out:
+	printf(",\"ok\":%s}\n", ok ? "true" : "false");
+	close(fd);
+
+	return ok ? 0 : -1;
+}
+
 void usage(const char *appname) {
 	const char *p = strrchr(appname, '/');
 	p = p ? p + 1 : appname;
 
 	printf("USAGE:\n"
-			"%s [chiptype] [loader] [major ver] [minor ver] [subver] [old image] [out image]\n\n"
+			"%s [--stats=json] [--io=uring] [--cache=drop] [--manifest=<file>] [--build-cache=<dir>] [chiptype] [loader] [major ver] [minor ver] [subver] [old image] [out image]\n"
+			"%s [--stats=json] [--io=uring] -verify [rkfw image]\n\n"
 			"Example:\n"
 			"%s -rk30 Loader.bin 1 0 23 rawimage.img rkimage.img \tRK30 board\n"
 			"%s -rk31 Loader.bin 4 0 4 rawimage.img rkimage.img \tRK31 board\n"
@@ -197,12 +545,23 @@ void usage(const char *appname) {
 			"%s -rk3368 Loader.bin 5 0 0 rawimage.img rkimage.img \tRK3368 board\n"
 			"\n\n"
 			"Options:\n"
-			"[chiptype]:\n\t-rk29\n\t-rk30\n\t-rk31\n\t-rk3128\n\t-rk32\n\t-rk3368\n", p, p, p, p, p, p);
+			"[chiptype]:\n\t-rk29\n\t-rk30\n\t-rk31\n\t-rk3128\n\t-rk32\n\t-rk3368\n", p, p, p, p, p, p, p);
 }
 
 int main(int argc, char **argv)
 {
 	int ret = 0;
+
+	rkstats_parse_args(&argc, argv);
+	rkio_parse_args(&argc, argv);
+	rkmanifest_parse_args(&argc, argv);
+	rkbuild_parse_args(&argc, argv);
+
+	if (argc == 3 && strcmp(argv[1], "-verify") == 0)
+	{
+		return verify_rom(argv[2]) == 0 ? 0 : 1;
+	}
+
 	// loader, majorver, minorver, subver, oldimage, newimage
 	if (argc == 8)
 	{
@@ -15,20 +15,32 @@
 ** limitations under the License.
 */
 
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
-#include <openssl/sha.h>
+#include <zlib.h>
 #include "bootimg.h"
+#include "rkhash.h"
+#include "rkmanifest.h"
+#include "rkstats.h"
 
 static void *load_file(const char *fn, unsigned *_sz)
 {
     char *data;
-    int sz;
+    off_t sz, done;
+    ssize_t n;
     int fd;
 
     data = 0;
@@ -38,12 +50,22 @@ static void *load_file(const char *fn, unsigned *_sz)
     sz = lseek(fd, 0, SEEK_END);
     if(sz < 0) goto oops;
 
+    /* boot_img_hdr sizes are 32-bit */
+    if(sz > UINT_MAX) {
+        fprintf(stderr,"error: '%s' is %lld bytes, boot images are limited to %u\n",
+                fn, (long long)sz, UINT_MAX);
+        goto oops;
+    }
+
     if(lseek(fd, 0, SEEK_SET) != 0) goto oops;
 
     data = (char*) malloc(sz);
     if(data == 0) goto oops;
 
-    if(read(fd, data, sz) != sz) goto oops;
+    for(done = 0; done < sz; done += n) {
+        n = read(fd, data + done, sz - done);
+        if(n <= 0) goto oops;
+    }
     close(fd);
 
     if(_sz) *_sz = sz;
@@ -71,6 +93,10 @@ int usage(void)
             "       [ --tags_offset <address> ]\n"
             "       [ --ramdiskaddr <address> ]\n"
             "       -o|--output <filename>\n"
+            "       [ --stats=json ]\n"
+            "       [ --manifest=<filename> ]\n"
+            "       [ --batch <filename> ]\n"
+            "       [ --input <boot.img> --overlay <directory> ]\n"
             );
     return 1;
 }
@@ -79,6 +105,22 @@ int usage(void)
 
 static unsigned char padding[16384] = { 0, };
 
+/* write(2) transfers at most ~2 GB per call */
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while(len) {
+        ssize_t n = write(fd, p, len);
+        if(n <= 0) return -1;
+        rkmanifest_update(p, n);
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
 int write_padding(int fd, unsigned pagesize, unsigned itemsize)
 {
     unsigned pagemask = pagesize - 1;
@@ -90,184 +132,892 @@ int write_padding(int fd, unsigned pagesize, unsigned itemsize)
 
     count = pagesize - (itemsize & pagemask);
 
-    if(write(fd, padding, count) != count) {
+    if(write_all(fd, padding, count)) {
         return -1;
     } else {
         return 0;
     }
 }
 
-int main(int argc, char **argv)
-{
+struct bootimg {
     boot_img_hdr hdr;
+    char *kernel_fn;
+    void *kernel_data;
+    char *ramdisk_fn;
+    void *ramdisk_data;
+    char *second_fn;
+    void *second_data;
+    char *cmdline;
+    char *bootimg;
+    char *board;
+    unsigned pagesize;
+    int ret;
+};
+
+/* Inputs shared by several --batch outputs are loaded once */
+struct loaded_file {
+    dev_t dev;
+    ino_t ino;
+    void *data;
+    unsigned size;
+    int have_sha;
+    struct rksha1 sha;    /* hdr.id state after data and size */
+};
+
+#define MAX_LOADED  (3 * MAX_OUTPUTS)
+#define MAX_OUTPUTS 64
+
+static struct loaded_file loaded[MAX_LOADED];
+static int num_loaded;
+
+static struct loaded_file *load_shared(const char *fn, const char *what)
+{
+    struct loaded_file *lf;
+    struct stat st;
+    int i;
+
+    if(stat(fn, &st) == 0) {
+        for(i = 0; i < num_loaded; i++) {
+            if(loaded[i].dev == st.st_dev && loaded[i].ino == st.st_ino)
+                return &loaded[i];
+        }
+    }
+    if(num_loaded == MAX_LOADED) return 0;
+
+    lf = &loaded[num_loaded];
+    memset(lf, 0, sizeof(*lf));
+    rkstats_begin("load:%s", what);
+    lf->data = load_file(fn, &lf->size);
+    rkstats_end(lf->size);
+    if(lf->data == 0) return 0;
+
+    lf->dev = st.st_dev;
+    lf->ino = st.st_ino;
+    num_loaded++;
+    return lf;
+}
 
-    char *kernel_fn = 0;
-    void *kernel_data = 0;
-    char *ramdisk_fn = 0;
-    void *ramdisk_data = 0;
-    char *second_fn = 0;
-    void *second_data = 0;
-    char *cmdline = "";
-    char *bootimg = 0;
-    char *board = "";
-    unsigned pagesize = 16384;
-    int fd;
-    SHA_CTX ctx;
-    unsigned char sha[SHA_DIGEST_LENGTH];
-
-    argc--;
-    argv++;
-
-    memset(&hdr, 0, sizeof(hdr));
+static void init_bootimg(struct bootimg *img)
+{
+    memset(img, 0, sizeof(*img));
+    img->cmdline = "";
+    img->board = "";
+    img->pagesize = 16384;
 
         /* default load addresses */
-    hdr.kernel_addr =  0x60408000;
-    hdr.ramdisk_addr = 0x62000000;
-    hdr.second_addr =  0x60F00000;
-    hdr.tags_addr =    0x60088000;
+    img->hdr.kernel_addr =  0x60408000;
+    img->hdr.ramdisk_addr = 0x62000000;
+    img->hdr.second_addr =  0x60F00000;
+    img->hdr.tags_addr =    0x60088000;
+}
 
-    while(argc > 0){
-        char *arg = argv[0];
-        char *val = argv[1];
-        if(argc < 2) {
-            return usage();
-        }
-        argc -= 2;
-        argv += 2;
-        if(!strcmp(arg, "--output") || !strcmp(arg, "-o")) {
-            bootimg = val;
-        } else if(!strcmp(arg, "--kernel")) {
-            kernel_fn = val;
-        } else if(!strcmp(arg, "--ramdisk")) {
-            ramdisk_fn = val;
-        } else if(!strcmp(arg, "--second")) {
-            second_fn = val;
-        } else if(!strcmp(arg, "--cmdline")) {
-            cmdline = val;
-        } else if(!strcmp(arg, "--base")) {
-            unsigned base = strtoul(val, 0, 16);
-            /* Offsets match stock Android mkbootimg, but differ from defaults above */
-            hdr.kernel_addr =  base + 0x00008000;
-            hdr.ramdisk_addr = base + 0x01000000;
-            hdr.second_addr =  base + 0x00F00000;
-            hdr.tags_addr =    base + 0x00000100;
-	} else if(!strcmp(arg, "--kernel_offset")) {
-	    hdr.kernel_addr = strtoul(val, 0, 16);
-	} else if(!strcmp(arg, "--ramdisk_offset")) {
-	    hdr.ramdisk_addr = strtoul(val, 0, 16);
-	} else if(!strcmp(arg, "--second_offset")) {
-	    hdr.second_addr = strtoul(val, 0, 16);
-	} else if(!strcmp(arg, "--tags_offset")) {
-	    hdr.tags_addr = strtoul(val, 0, 16);
-        } else if(!strcmp(arg, "--ramdiskaddr")) {
-            hdr.ramdisk_addr = strtoul(val, 0, 16);
-        } else if(!strcmp(arg, "--board")) {
-            board = val;
-        } else if(!strcmp(arg,"--pagesize")) {
-            pagesize = strtoul(val, 0, 10);
-            if ((pagesize != 2048) && (pagesize != 4096) && (pagesize != 8192) && (pagesize != 16384)) {
-                fprintf(stderr,"error: unsupported page size %d\n", pagesize);
-                return -1;
-            }
-        } else {
-            return usage();
+/* 0 on success, 1 for an unknown option, -1 for a bad value */
+static int parse_option(struct bootimg *img, const char *arg, char *val)
+{
+    boot_img_hdr *hdr = &img->hdr;
+
+    if(!strcmp(arg, "--output") || !strcmp(arg, "-o")) {
+        img->bootimg = val;
+    } else if(!strcmp(arg, "--kernel")) {
+        img->kernel_fn = val;
+    } else if(!strcmp(arg, "--ramdisk")) {
+        img->ramdisk_fn = val;
+    } else if(!strcmp(arg, "--second")) {
+        img->second_fn = val;
+    } else if(!strcmp(arg, "--cmdline")) {
+        img->cmdline = val;
+    } else if(!strcmp(arg, "--base")) {
+        unsigned base = strtoul(val, 0, 16);
+        /* Offsets match stock Android mkbootimg, but differ from defaults above */
+        hdr->kernel_addr =  base + 0x00008000;
+        hdr->ramdisk_addr = base + 0x01000000;
+        hdr->second_addr =  base + 0x00F00000;
+        hdr->tags_addr =    base + 0x00000100;
+    } else if(!strcmp(arg, "--kernel_offset")) {
+        hdr->kernel_addr = strtoul(val, 0, 16);
+    } else if(!strcmp(arg, "--ramdisk_offset")) {
+        hdr->ramdisk_addr = strtoul(val, 0, 16);
+    } else if(!strcmp(arg, "--second_offset")) {
+        hdr->second_addr = strtoul(val, 0, 16);
+    } else if(!strcmp(arg, "--tags_offset")) {
+        hdr->tags_addr = strtoul(val, 0, 16);
+    } else if(!strcmp(arg, "--ramdiskaddr")) {
+        hdr->ramdisk_addr = strtoul(val, 0, 16);
+    } else if(!strcmp(arg, "--board")) {
+        img->board = val;
+    } else if(!strcmp(arg,"--pagesize")) {
+        img->pagesize = strtoul(val, 0, 10);
+        if ((img->pagesize != 2048) && (img->pagesize != 4096) && (img->pagesize != 8192) && (img->pagesize != 16384)) {
+            fprintf(stderr,"error: unsupported page size %d\n", img->pagesize);
+            return -1;
         }
+    } else {
+        return 1;
     }
-    hdr.page_size = pagesize;
 
+    return 0;
+}
+
+/* put a hash of the contents in the header so boot images can be
+ * differentiated based on their first 2k.
+ */
+static void hash_bootimg(struct bootimg *img, struct loaded_file *kernel)
+{
+    boot_img_hdr *hdr = &img->hdr;
+    struct rksha1 ctx;
+    unsigned char sha[RKSHA1_DIGEST_LENGTH];
+
+    rkstats_begin("sha1");
+    if(!kernel->have_sha) {
+        /* the kernel prefix is hashed once and forked for every output */
+        rksha1_init(&kernel->sha);
+        rksha1_update(&kernel->sha, img->kernel_data, hdr->kernel_size);
+        rksha1_update(&kernel->sha, &hdr->kernel_size, sizeof(hdr->kernel_size));
+        kernel->have_sha = 1;
+    }
+    ctx = kernel->sha;
+    rksha1_update(&ctx, img->ramdisk_data, hdr->ramdisk_size);
+    rksha1_update(&ctx, &hdr->ramdisk_size, sizeof(hdr->ramdisk_size));
+    rksha1_update(&ctx, img->second_data, hdr->second_size);
+    rksha1_update(&ctx, &hdr->second_size, sizeof(hdr->second_size));
+    /* tags_addr, page_size, unused[2], name[], and cmdline[] */
+    rksha1_update(&ctx, &hdr->tags_addr, 4 + 4 + 4 + 4 + 16 + 512);
+    rksha1_final(sha, &ctx);
+    rkstats_end((unsigned long long)hdr->ramdisk_size + hdr->second_size);
+    memcpy(hdr->id, sha,
+           RKSHA1_DIGEST_LENGTH > sizeof(hdr->id) ? sizeof(hdr->id) : RKSHA1_DIGEST_LENGTH);
+}
+
+/* Check the options, load the inputs and fill in the header */
+static int prepare_bootimg(struct bootimg *img)
+{
+    boot_img_hdr *hdr = &img->hdr;
+    struct loaded_file *kernel, *ramdisk = 0, *second = 0;
+
+    hdr->page_size = img->pagesize;
 
-    if(bootimg == 0) {
+    if(img->bootimg == 0) {
         fprintf(stderr,"error: no output filename specified\n");
         return usage();
     }
 
-    if(kernel_fn == 0) {
+    if(img->kernel_fn == 0) {
         fprintf(stderr,"error: no kernel image specified\n");
         return usage();
     }
 
-    if(strlen(board) >= BOOT_NAME_SIZE) {
+    if(strlen(img->board) >= BOOT_NAME_SIZE) {
         fprintf(stderr,"error: board name too large\n");
         return usage();
     }
 
-    strcpy((char*)hdr.name, board);
+    strcpy((char*)hdr->name, img->board);
 
-    memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    memcpy(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
 
-    if(strlen(cmdline) > (BOOT_ARGS_SIZE - 1)) {
+    if(strlen(img->cmdline) > (BOOT_ARGS_SIZE - 1)) {
         fprintf(stderr,"error: kernel commandline too large\n");
         return 1;
     }
-    strcpy((char*)hdr.cmdline, cmdline);
+    strcpy((char*)hdr->cmdline, img->cmdline);
 
-    kernel_data = load_file(kernel_fn, &hdr.kernel_size);
-    if(kernel_data == 0) {
-        fprintf(stderr,"error: could not load kernel '%s'\n", kernel_fn);
+    kernel = load_shared(img->kernel_fn, "kernel");
+    if(kernel == 0) {
+        fprintf(stderr,"error: could not load kernel '%s'\n", img->kernel_fn);
         return 1;
     }
+    img->kernel_data = kernel->data;
+    hdr->kernel_size = kernel->size;
 
-    if(ramdisk_fn == 0 || !strcmp(ramdisk_fn,"NONE")) {
-        ramdisk_data = 0;
-        hdr.ramdisk_size = 0;
+    if(img->ramdisk_fn == 0 || !strcmp(img->ramdisk_fn,"NONE")) {
+        img->ramdisk_data = 0;
+        hdr->ramdisk_size = 0;
     } else {
-        ramdisk_data = load_file(ramdisk_fn, &hdr.ramdisk_size);
-        if(ramdisk_data == 0) {
-            fprintf(stderr,"error: could not load ramdisk '%s'\n", ramdisk_fn);
+        ramdisk = load_shared(img->ramdisk_fn, "ramdisk");
+        if(ramdisk == 0) {
+            fprintf(stderr,"error: could not load ramdisk '%s'\n", img->ramdisk_fn);
             return 1;
         }
+        img->ramdisk_data = ramdisk->data;
+        hdr->ramdisk_size = ramdisk->size;
     }
 
-    if(second_fn) {
-        second_data = load_file(second_fn, &hdr.second_size);
-        if(second_data == 0) {
-            fprintf(stderr,"error: could not load secondstage '%s'\n", second_fn);
+    if(img->second_fn) {
+        second = load_shared(img->second_fn, "second");
+        if(second == 0) {
+            fprintf(stderr,"error: could not load secondstage '%s'\n", img->second_fn);
             return 1;
         }
+        img->second_data = second->data;
+        hdr->second_size = second->size;
     }
 
-    /* put a hash of the contents in the header so boot images can be
-     * differentiated based on their first 2k.
-     */
-    SHA1_Init(&ctx);
-    SHA1_Update(&ctx, kernel_data, hdr.kernel_size);
-    SHA1_Update(&ctx, &hdr.kernel_size, sizeof(hdr.kernel_size));
-    SHA1_Update(&ctx, ramdisk_data, hdr.ramdisk_size);
-    SHA1_Update(&ctx, &hdr.ramdisk_size, sizeof(hdr.ramdisk_size));
-    SHA1_Update(&ctx, second_data, hdr.second_size);
-    SHA1_Update(&ctx, &hdr.second_size, sizeof(hdr.second_size));
-    /* tags_addr, page_size, unused[2], name[], and cmdline[] */
-    SHA1_Update(&ctx, &hdr.tags_addr, 4 + 4 + 4 + 4 + 16 + 512);
-    SHA1_Final(sha, &ctx);
-    memcpy(hdr.id, sha,
-           SHA_DIGEST_LENGTH > sizeof(hdr.id) ? sizeof(hdr.id) : SHA_DIGEST_LENGTH);
+    hash_bootimg(img, kernel);
+    return 0;
+}
+
+/*
+ * --overlay <dir> --input <boot.img> rebuilds a boot image whose ramdisk
+ * gains a second gzip'ed cpio archive holding only what differs between
+ * <dir> and the existing ramdisk.  The kernel unpacks concatenated
+ * archives in order and later entries replace earlier ones, so the result
+ * boots like a ramdisk made from <dir> with mkcpiogz.  Entries are
+ * compared by type, permissions, owner and content (mtime is ignored).
+ * Files gone from <dir> are replaced by empty mode 000 files, since cpio
+ * has no way to delete; removed directories are only reported.
+ */
+
+struct cpio_entry {
+    char *name;
+    unsigned mode, uid, gid, nlink, mtime;
+    unsigned rmajor, rminor;
+    const unsigned char *data;
+    unsigned size;
+    unsigned seq;
+};
+
+struct cpio_list {
+    struct cpio_entry *e;
+    unsigned num, max;
+};
+
+struct membuf {
+    unsigned char *data;
+    size_t len, max;
+};
+
+static int membuf_add(struct membuf *b, const void *p, size_t len)
+{
+    if(b->len + len > b->max) {
+        size_t max = b->max ? b->max : 65536;
+        unsigned char *data;
+
+        while(max < b->len + len) max *= 2;
+        data = realloc(b->data, max);
+        if(data == 0) return -1;
+        b->data = data;
+        b->max = max;
+    }
+    if(p) memcpy(b->data + b->len, p, len);
+    else memset(b->data + b->len, 0, len);
+    b->len += len;
+    return 0;
+}
+
+static struct cpio_entry *cpio_add(struct cpio_list *l)
+{
+    if(l->num == l->max) {
+        unsigned max = l->max ? l->max * 2 : 256;
+        struct cpio_entry *e = realloc(l->e, max * sizeof(*e));
+        if(e == 0) return 0;
+        l->e = e;
+        l->max = max;
+    }
+    memset(&l->e[l->num], 0, sizeof(l->e[0]));
+    l->e[l->num].seq = l->num;
+    return &l->e[l->num++];
+}
+
+/* "./bin/sh" and "/bin/sh" both name bin/sh */
+static char *cpio_path(char *name)
+{
+    for(;;) {
+        if(name[0] == '/') name++;
+        else if(name[0] == '.' && name[1] == '/') name += 2;
+        else if(name[0] == '.' && name[1] == 0) return name + 1;
+        else return name;
+    }
+}
+
+static int cpio_cmp(const void *a, const void *b)
+{
+    const struct cpio_entry *x = a, *y = b;
+    int r = strcmp(x->name, y->name);
+
+    if(r) return r;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Sort by name, keeping only the last entry of every name */
+static void cpio_sort(struct cpio_list *l)
+{
+    unsigned i, n = 0;
+
+    qsort(l->e, l->num, sizeof(l->e[0]), cpio_cmp);
+    for(i = 0; i < l->num; i++) {
+        if(i + 1 < l->num && !strcmp(l->e[i].name, l->e[i + 1].name)) continue;
+        l->e[n++] = l->e[i];
+    }
+    l->num = n;
+}
+
+static struct cpio_entry *cpio_find(const struct cpio_list *l, const char *name)
+{
+    unsigned lo = 0, hi = l->num;
+
+    while(lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        int r = strcmp(l->e[mid].name, name);
+        if(r == 0) return &l->e[mid];
+        if(r < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return 0;
+}
+
+static unsigned hex8(const unsigned char *p)
+{
+    char tmp[9];
+
+    memcpy(tmp, p, 8);
+    tmp[8] = 0;
+    return strtoul(tmp, 0, 16);
+}
+
+/* Gunzip every member of the ramdisk; plain cpio data is taken as is */
+static int unpack_ramdisk(const unsigned char *p, unsigned len, struct membuf *out)
+{
+    unsigned char buf[65536];
+    z_stream zs;
+    unsigned pos = 0;
+    int ret;
+
+    while(pos < len) {
+        if(p[pos] == 0) {
+            pos++;
+            continue;
+        }
+        if(len - pos >= 6 && !memcmp(p + pos, "0707", 4)) {
+            return membuf_add(out, p + pos, len - pos);
+        }
+        if(len - pos < 2 || p[pos] != 0x1f || p[pos + 1] != 0x8b) {
+            fprintf(stderr,"error: ramdisk is neither gzip nor cpio at offset %u\n", pos);
+            return -1;
+        }
+
+        memset(&zs, 0, sizeof(zs));
+        if(inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) return -1;
+        zs.next_in = (unsigned char *)p + pos;
+        zs.avail_in = len - pos;
+        do {
+            zs.next_out = buf;
+            zs.avail_out = sizeof(buf);
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if((ret != Z_OK && ret != Z_STREAM_END)
+                    || membuf_add(out, buf, sizeof(buf) - zs.avail_out)) {
+                fprintf(stderr,"error: corrupt gzip data in ramdisk\n");
+                inflateEnd(&zs);
+                return -1;
+            }
+        } while(ret != Z_STREAM_END);
+        pos = len - zs.avail_in;
+        inflateEnd(&zs);
+    }
+
+    return 0;
+}
+
+/* List the newc entries of all archives in data, which must stay around */
+static int parse_cpio(unsigned char *data, size_t len, struct cpio_list *l)
+{
+    size_t pos = 0;
+
+    while(pos < len) {
+        struct cpio_entry *e;
+        unsigned namesize;
+
+        if(data[pos] == 0) {
+            pos += 4;
+            continue;
+        }
+        if(len - pos < 110 || (memcmp(data + pos, "070701", 6)
+                && memcmp(data + pos, "070702", 6))) {
+            fprintf(stderr,"error: ramdisk is not a newc cpio archive\n");
+            return -1;
+        }
+        if((e = cpio_add(l)) == 0) return -1;
+
+        e->mode = hex8(data + pos + 14);
+        e->uid = hex8(data + pos + 22);
+        e->gid = hex8(data + pos + 30);
+        e->nlink = hex8(data + pos + 38);
+        e->mtime = hex8(data + pos + 46);
+        e->size = hex8(data + pos + 54);
+        e->rmajor = hex8(data + pos + 78);
+        e->rminor = hex8(data + pos + 86);
+        namesize = hex8(data + pos + 94);
+        if(namesize == 0 || namesize > len - pos - 110
+                || data[pos + 110 + namesize - 1] != 0) {
+            fprintf(stderr,"error: corrupt cpio header in ramdisk\n");
+            return -1;
+        }
+
+        e->name = (char *)data + pos + 110;
+        pos = (pos + 110 + namesize + 3) & ~3;
+        if(e->size > len - pos) {
+            fprintf(stderr,"error: truncated cpio entry '%s'\n", e->name);
+            return -1;
+        }
+        e->data = data + pos;
+        pos = (pos + e->size + 3) & ~(size_t)3;
+
+        if(!strcmp(e->name, "TRAILER!!!")) {
+            l->num--;
+            continue;
+        }
+        e->name = cpio_path(e->name);
+        if(!*e->name) l->num--;
+    }
+
+    return 0;
+}
+
+static struct cpio_list walk_list;
+static size_t walk_root;        /* length of the walked directory, no trailing '/' */
+
+static int walk_entry(const char *path, const struct stat *st, int flag,
+        struct FTW *ftw)
+{
+    struct cpio_entry *e;
+    const char *name = path + walk_root;
+
+    (void)flag;
+    if(ftw->level == 0) return 0;
+    while(*name == '/') name++;
+    if((e = cpio_add(&walk_list)) == 0) return -1;
+    if((e->name = strdup(name)) == 0) return -1;
+
+    e->mode = st->st_mode;
+    e->uid = st->st_uid;
+    e->gid = st->st_gid;
+    e->nlink = S_ISDIR(st->st_mode) ? 2 : 1;
+    e->mtime = st->st_mtime;
+    e->rmajor = major(st->st_rdev);
+    e->rminor = minor(st->st_rdev);
+    e->size = S_ISREG(st->st_mode) || S_ISLNK(st->st_mode) ? st->st_size : 0;
+    return 0;
+}
+
+/* Load what a new entry holds: file contents or symlink target */
+static int load_entry(const char *dir, struct cpio_entry *e)
+{
+    char path[PATH_MAX];
+    unsigned size;
+
+    if(!S_ISREG(e->mode) && !S_ISLNK(e->mode)) return 0;
+    snprintf(path, sizeof(path), "%s/%s", dir, e->name);
+
+    if(S_ISLNK(e->mode)) {
+        char *target = malloc(e->size + 1);
+        ssize_t n;
+
+        if(target == 0 || (n = readlink(path, target, e->size + 1)) < 0
+                || (unsigned)n != e->size) {
+            fprintf(stderr,"error: could not read link '%s'\n", path);
+            free(target);
+            return -1;
+        }
+        e->data = (unsigned char *)target;
+        return 0;
+    }
+
+    if(e->size == 0) return 0;
+    if((e->data = load_file(path, &size)) == 0 || size != e->size) {
+        fprintf(stderr,"error: could not load '%s'\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int same_entry(const struct cpio_entry *n, const struct cpio_entry *o)
+{
+    if(n->mode != o->mode || n->uid != o->uid || n->gid != o->gid) return 0;
+    if(S_ISCHR(n->mode) || S_ISBLK(n->mode))
+        return n->rmajor == o->rmajor && n->rminor == o->rminor;
+    if(S_ISREG(n->mode) || S_ISLNK(n->mode))
+        return n->size == o->size && (n->size == 0 || !memcmp(n->data, o->data, n->size));
+    return 1;
+}
+
+static int cpio_write(struct membuf *b, const struct cpio_entry *e, unsigned ino)
+{
+    char hdr[111];
+    size_t namesize = strlen(e->name) + 1;
+
+    snprintf(hdr, sizeof(hdr), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+            ino, e->mode, e->uid, e->gid, e->nlink, e->mtime, e->size,
+            0, 0, e->rmajor, e->rminor, (unsigned)namesize, 0);
+    if(membuf_add(b, hdr, 110) || membuf_add(b, e->name, namesize)) return -1;
+    if(membuf_add(b, 0, (4 - b->len % 4) % 4)) return -1;
+    if(e->size && membuf_add(b, e->data, e->size)) return -1;
+    return membuf_add(b, 0, (4 - b->len % 4) % 4);
+}
+
+/* Compare dir with the ramdisk and gzip a cpio archive of the difference */
+static int make_overlay(const unsigned char *ramdisk, unsigned ramdisk_size,
+        const char *dir, struct membuf *gz)
+{
+    static const struct cpio_entry trailer = { "TRAILER!!!", 0, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+    struct membuf raw = { 0, 0, 0 }, cpio = { 0, 0, 0 };
+    struct cpio_list old = { 0, 0, 0 };
+    unsigned i, ino = 1, changed = 0, added = 0, removed = 0;
+    char root[PATH_MAX];
+    z_stream zs;
+    int ret = -1;
+
+    rkstats_begin("overlay:unpack");
+    if(unpack_ramdisk(ramdisk, ramdisk_size, &raw)) goto out;
+    if(parse_cpio(raw.data, raw.len, &old)) goto out;
+    cpio_sort(&old);
+    rkstats_end(raw.len);
+
+    rkstats_begin("overlay:diff");
+    snprintf(root, sizeof(root), "%s", dir);
+    for(walk_root = strlen(root); walk_root > 1 && root[walk_root - 1] == '/'; walk_root--)
+        root[walk_root - 1] = 0;
+    if(nftw(root, walk_entry, 16, FTW_PHYS)) {
+        fprintf(stderr,"error: could not walk '%s': %s\n", dir, strerror(errno));
+        goto out;
+    }
+    cpio_sort(&walk_list);
 
-    fd = open(bootimg, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    for(i = 0; i < walk_list.num; i++) {
+        struct cpio_entry *n = &walk_list.e[i], *o = cpio_find(&old, n->name);
+
+        if(load_entry(dir, n)) goto out;
+        if(o && same_entry(n, o)) continue;
+        if(o) changed++;
+        else added++;
+        if(cpio_write(&cpio, n, ino++)) goto out;
+    }
+
+    for(i = 0; i < old.num; i++) {
+        struct cpio_entry *o = &old.e[i], whiteout;
+
+        if(cpio_find(&walk_list, o->name)) continue;
+        if(S_ISDIR(o->mode)) {
+            fprintf(stderr,"warning: directory '%s' stays in the ramdisk\n", o->name);
+            continue;
+        }
+        if(S_ISREG(o->mode) && (o->mode & 07777) == 0 && o->size == 0) continue;
+
+        memset(&whiteout, 0, sizeof(whiteout));
+        whiteout.name = o->name;
+        whiteout.mode = S_IFREG;
+        whiteout.nlink = 1;
+        if(cpio_write(&cpio, &whiteout, ino++)) goto out;
+        removed++;
+    }
+    rkstats_end(0);
+
+    printf("overlay: %u changed, %u added, %u removed\n", changed, added, removed);
+    if(changed + added + removed == 0) {
+        ret = 0;
+        goto out;
+    }
+
+    /* the kernel expects the same 512 byte padding as cpio(1) */
+    if(cpio_write(&cpio, &trailer, 0) || membuf_add(&cpio, 0, (512 - cpio.len % 512) % 512))
+        goto out;
+
+    rkstats_begin("overlay:gzip");
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, 9, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        goto out;
+    if(membuf_add(gz, 0, deflateBound(&zs, cpio.len))) {
+        deflateEnd(&zs);
+        goto out;
+    }
+    zs.next_in = cpio.data;
+    zs.avail_in = cpio.len;
+    zs.next_out = gz->data;
+    zs.avail_out = gz->len;
+    if(deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+        gz->len = zs.total_out;
+        ret = 0;
+    }
+    deflateEnd(&zs);
+    rkstats_end(cpio.len);
+
+out:
+    for(i = 0; i < walk_list.num; i++) {
+        if(S_ISREG(walk_list.e[i].mode) || S_ISLNK(walk_list.e[i].mode))
+            free((void *)walk_list.e[i].data);
+        free(walk_list.e[i].name);
+    }
+    free(walk_list.e);
+    memset(&walk_list, 0, sizeof(walk_list));
+    free(old.e);
+    free(raw.data);
+    free(cpio.data);
+    return ret;
+}
+
+/* Take everything from an existing boot image and append an overlay */
+static int prepare_overlay(struct bootimg *img, const char *input, const char *dir)
+{
+    boot_img_hdr *hdr = &img->hdr;
+    struct loaded_file kernel;
+    struct membuf gz = { 0, 0, 0 };
+    unsigned char *data, *ramdisk;
+    unsigned size, pagesize;
+    unsigned long long off;
+
+    if(img->bootimg == 0) {
+        fprintf(stderr,"error: no output filename specified\n");
+        return usage();
+    }
+    if(img->kernel_fn || img->ramdisk_fn || img->second_fn) {
+        fprintf(stderr,"error: --overlay takes kernel, ramdisk and second from --input\n");
+        return usage();
+    }
+
+    rkstats_begin("load:input");
+    data = load_file(input, &size);
+    rkstats_end(size);
+    if(data == 0 || size < sizeof(*hdr) || memcmp(data, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+        fprintf(stderr,"error: '%s' is not a boot image\n", input);
+        return 1;
+    }
+
+    memcpy(hdr, data, sizeof(*hdr));
+    pagesize = hdr->page_size;
+    if(pagesize == 0 || (pagesize & (pagesize - 1))) {
+        fprintf(stderr,"error: '%s' has an invalid page size\n", input);
+        return 1;
+    }
+    off = pagesize;
+    img->kernel_data = data + off;
+    off += ((unsigned long long)hdr->kernel_size + pagesize - 1) / pagesize * pagesize;
+    ramdisk = data + off;
+    off += ((unsigned long long)hdr->ramdisk_size + pagesize - 1) / pagesize * pagesize;
+    img->second_data = hdr->second_size ? data + off : 0;
+    if(off + hdr->second_size > size || pagesize + (unsigned long long)hdr->kernel_size > size) {
+        fprintf(stderr,"error: '%s' is truncated\n", input);
+        return 1;
+    }
+    img->pagesize = pagesize;
+
+    if(make_overlay(ramdisk, hdr->ramdisk_size, dir, &gz)) return 1;
+    if(gz.len > UINT_MAX - hdr->ramdisk_size) {
+        fprintf(stderr,"error: ramdisk too large\n");
+        return 1;
+    }
+
+    img->ramdisk_data = malloc((size_t)hdr->ramdisk_size + gz.len);
+    if(img->ramdisk_data == 0) return 1;
+    memcpy(img->ramdisk_data, ramdisk, hdr->ramdisk_size);
+    if(gz.len) memcpy((unsigned char *)img->ramdisk_data + hdr->ramdisk_size, gz.data, gz.len);
+    hdr->ramdisk_size += gz.len;
+    free(gz.data);
+
+    memset(&kernel, 0, sizeof(kernel));
+    hash_bootimg(img, &kernel);
+    return 0;
+}
+
+static int write_bootimg(struct bootimg *img)
+{
+    boot_img_hdr *hdr = &img->hdr;
+    unsigned pagesize = img->pagesize;
+    int fd;
+
+    fd = open(img->bootimg, O_CREAT | O_TRUNC | O_WRONLY, 0644);
     if(fd < 0) {
-        fprintf(stderr,"error: could not create '%s'\n", bootimg);
+        fprintf(stderr,"error: could not create '%s'\n", img->bootimg);
         return 1;
     }
 
-    if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto fail;
-    if(write_padding(fd, pagesize, sizeof(hdr))) goto fail;
+    if(write_all(fd, hdr, sizeof(*hdr))) goto fail;
+    if(write_padding(fd, pagesize, sizeof(*hdr))) goto fail;
 
-    if(write(fd, kernel_data, hdr.kernel_size) != (ssize_t) hdr.kernel_size) goto fail;
-    if(write_padding(fd, pagesize, hdr.kernel_size)) goto fail;
+    if(write_all(fd, img->kernel_data, hdr->kernel_size)) goto fail;
+    if(write_padding(fd, pagesize, hdr->kernel_size)) goto fail;
 
-    if(write(fd, ramdisk_data, hdr.ramdisk_size) != (ssize_t) hdr.ramdisk_size) goto fail;
-    if(write_padding(fd, pagesize, hdr.ramdisk_size)) goto fail;
+    if(write_all(fd, img->ramdisk_data, hdr->ramdisk_size)) goto fail;
+    if(write_padding(fd, pagesize, hdr->ramdisk_size)) goto fail;
 
-    if(second_data) {
-        if(write(fd, second_data, hdr.second_size) != (ssize_t) hdr.second_size) goto fail;
-        if(write_padding(fd, pagesize, hdr.ramdisk_size)) goto fail;
+    if(img->second_data) {
+        if(write_all(fd, img->second_data, hdr->second_size)) goto fail;
+        if(write_padding(fd, pagesize, hdr->ramdisk_size)) goto fail;
     }
 
+    if(close(fd)) {
+        fd = -1;
+        goto fail;
+    }
     return 0;
 
 fail:
-    unlink(bootimg);
-    close(fd);
-    fprintf(stderr,"error: failed writing '%s': %s\n", bootimg,
+    unlink(img->bootimg);
+    if(fd >= 0) close(fd);
+    fprintf(stderr,"error: failed writing '%s': %s\n", img->bootimg,
             strerror(errno));
     return 1;
 }
+
+static void *write_worker(void *arg)
+{
+    struct bootimg *img = arg;
+
+    img->ret = write_bootimg(img);
+    return 0;
+}
+
+/* Split a --batch line into words; "double quotes" keep spaces */
+static int split_line(char *p, char **words, int max)
+{
+    int n = 0;
+
+    for(;;) {
+        while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
+        if(*p == 0 || *p == '#') return n;
+        if(n == max) return -1;
+
+        if(*p == '"') {
+            words[n++] = ++p;
+            while(*p && *p != '"') p++;
+            if(*p == 0) return -1;
+        } else {
+            words[n++] = p;
+            while(*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+        }
+        if(*p == 0) return n;
+        *p++ = 0;
+    }
+}
+
+/*
+ * --batch builds one image per line of the file.  Every line holds
+ * mkbootimg options (at least -o) applied on top of those given on the
+ * command line.  Inputs shared between images are loaded and hashed once
+ * and all images are written concurrently.
+ */
+static int build_batch(const struct bootimg *base, const char *batch)
+{
+    static struct bootimg imgs[MAX_OUTPUTS];
+    static char lines[MAX_OUTPUTS][4096];
+    pthread_t threads[MAX_OUTPUTS];
+    char *words[64];
+    int num = 0, n, i, ret = 0;
+    FILE *fp;
+
+    fp = fopen(batch, "r");
+    if(fp == 0) {
+        fprintf(stderr,"error: could not open '%s'\n", batch);
+        return 1;
+    }
+
+    while(num < MAX_OUTPUTS && fgets(lines[num], sizeof(lines[num]), fp)) {
+        n = split_line(lines[num], words, 64);
+        if(n == 0) continue;
+        if(n < 0 || (n & 1)) {
+            fprintf(stderr,"error: %s: bad line for output %d\n", batch, num + 1);
+            fclose(fp);
+            return 1;
+        }
+
+        imgs[num] = *base;
+        for(i = 0; i < n; i += 2) {
+            int r = parse_option(&imgs[num], words[i], words[i + 1]);
+            if(r) {
+                fclose(fp);
+                return r < 0 ? -1 : usage();
+            }
+        }
+        if((ret = prepare_bootimg(&imgs[num])) != 0) {
+            fclose(fp);
+            return ret;
+        }
+        num++;
+    }
+    if(!feof(fp)) {
+        fprintf(stderr,"error: %s: more than %d outputs\n", batch, MAX_OUTPUTS);
+        ret = 1;
+    }
+    fclose(fp);
+    if(ret) return ret;
+
+    rkstats_begin("write");
+    for(i = 0; i < num; i++)
+        pthread_create(&threads[i], 0, write_worker, &imgs[i]);
+    for(i = 0; i < num; i++) {
+        pthread_join(threads[i], 0);
+        if(imgs[i].ret) ret = 1;
+    }
+    rkstats_end(0);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    struct bootimg img;
+    boot_img_hdr *hdr = &img.hdr;
+    char *batch = 0, *input = 0, *overlay = 0;
+    int ret;
+
+    rkstats_parse_args(&argc, argv);
+    rkmanifest_parse_args(&argc, argv);
+
+    argc--;
+    argv++;
+
+    init_bootimg(&img);
+
+    while(argc > 0){
+        char *arg = argv[0];
+        char *val = argv[1];
+        if(argc < 2) {
+            return usage();
+        }
+        argc -= 2;
+        argv += 2;
+        if(!strcmp(arg, "--batch")) {
+            batch = val;
+        } else if(!strcmp(arg, "--input") || !strcmp(arg, "-i")) {
+            input = val;
+        } else if(!strcmp(arg, "--overlay")) {
+            overlay = val;
+        } else if((ret = parse_option(&img, arg, val)) != 0) {
+            return ret < 0 ? -1 : usage();
+        }
+    }
+
+    if(!input != !overlay || (overlay && batch)) {
+        fprintf(stderr,"error: --overlay needs --input and no --batch\n");
+        return usage();
+    }
+
+    if(batch) {
+        if(rkmanifest.path) {
+            fprintf(stderr,"error: --manifest does not apply to --batch\n");
+            return 1;
+        }
+        return build_batch(&img, batch);
+    }
+
+    if(overlay) ret = prepare_overlay(&img, input, overlay);
+    else ret = prepare_bootimg(&img);
+    if(ret != 0) return ret;
+
+    if(rkmanifest.path) {
+        unsigned pagesize = img.pagesize;
+        unsigned long long off = pagesize;
+
+        if(rkmanifest_begin(img.bootimg)) return 1;
+        rkmanifest_section("kernel", off, hdr->kernel_size);
+        off += ((unsigned long long)hdr->kernel_size + pagesize - 1) / pagesize * pagesize;
+        rkmanifest_section("ramdisk", off, hdr->ramdisk_size);
+        off += ((unsigned long long)hdr->ramdisk_size + pagesize - 1) / pagesize * pagesize;
+        if(img.second_data) rkmanifest_section("second", off, hdr->second_size);
+    }
+
+    rkstats_begin("write");
+    if((ret = write_bootimg(&img)) != 0) return ret;
+    rkstats_end((unsigned long long)hdr->kernel_size + hdr->ramdisk_size + hdr->second_size);
+
+    if(rkmanifest.cur && (rkmanifest_finish() || rkmanifest_write())) return 1;
+
+    return 0;
+}
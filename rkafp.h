@@ -1,6 +1,9 @@
 #ifndef _RKAFP_H
 #define _RKAFP_H
 
+#include <stdint.h>
+#include <string.h>
+
 struct update_part {
 	char name[32];
 	char filename[60];
@@ -27,9 +30,121 @@ struct update_header {
 	unsigned char reserved[0x74];
 };
 
+/*
+ * Large image extension (version 1), stored in update_header.reserved.
+ *
+ * The legacy header only has 32-bit offsets and sizes.  Images that do not
+ * fit carry bits 32..47 of length and of every part's pos/size/padded_size
+ * here.  Readers that don't know the extension look for the CRC at the
+ * truncated length and reject the image instead of mis-extracting it.
+ */
+#define RKAFP_EXT_MAGIC "RKX1"
+#define RKAFP_EXT_VERSION 1
+
+struct update_ext {
+	char magic[4];
+	unsigned int version;
+	unsigned short length_hi;
+	unsigned short pos_hi[16];
+	unsigned short size_hi[16];
+	unsigned short padded_size_hi[16];
+};
+
+#define RKAFP_MAX_LENGTH	((1ULL << 48) - 1)
+#define RKAFP_LEGACY_MAX	0xFFFFFFFFULL
+
+/* 64-bit view of a part, see rkafp_get_extent() */
+struct update_extent {
+	uint64_t pos;
+	uint64_t size;
+	uint64_t padded_size;
+};
+
+static inline int rkafp_get_ext(const struct update_header *header,
+		struct update_ext *ext)
+{
+	memcpy(ext, header->reserved, sizeof(*ext));
+	if (memcmp(ext->magic, RKAFP_EXT_MAGIC, sizeof(ext->magic)) != 0) {
+		memset(ext, 0, sizeof(*ext));
+		return 0;
+	}
+
+	return ext->version;
+}
+
+static inline uint64_t rkafp_get_length(const struct update_header *header)
+{
+	struct update_ext ext;
+
+	rkafp_get_ext(header, &ext);
+	return ((uint64_t)ext.length_hi << 32) | header->length;
+}
+
+static inline void rkafp_get_extent(const struct update_header *header,
+		unsigned i, struct update_extent *extent)
+{
+	const struct update_part *part = &header->parts[i];
+	struct update_ext ext;
+
+	rkafp_get_ext(header, &ext);
+	extent->pos = ((uint64_t)ext.pos_hi[i] << 32) | part->pos;
+	extent->size = ((uint64_t)ext.size_hi[i] << 32) | part->size;
+	extent->padded_size = ((uint64_t)ext.padded_size_hi[i] << 32)
+			| part->padded_size;
+}
+
+static inline int rkafp_extent_fits_legacy(const struct update_extent *extent)
+{
+	return extent->pos <= RKAFP_LEGACY_MAX
+			&& extent->size <= RKAFP_LEGACY_MAX
+			&& extent->padded_size <= RKAFP_LEGACY_MAX;
+}
+
+/*
+ * Store length and the part extents in the header, adding the extension
+ * only when some value does not fit the legacy 32-bit fields; otherwise
+ * the extension area is cleared.  Callers
+ * must have range checked against RKAFP_MAX_LENGTH beforehand.
+ */
+static inline void rkafp_set_layout(struct update_header *header,
+		uint64_t length, const struct update_extent *extents,
+		unsigned num_parts)
+{
+	struct update_ext ext;
+	int large = length > RKAFP_LEGACY_MAX;
+	unsigned i;
+
+	memset(&ext, 0, sizeof(ext));
+	header->length = (unsigned int)length;
+	ext.length_hi = length >> 32;
+
+	for (i = 0; i < num_parts; i++) {
+		header->parts[i].pos = (unsigned int)extents[i].pos;
+		header->parts[i].size = (unsigned int)extents[i].size;
+		header->parts[i].padded_size = (unsigned int)extents[i].padded_size;
+		ext.pos_hi[i] = extents[i].pos >> 32;
+		ext.size_hi[i] = extents[i].size >> 32;
+		ext.padded_size_hi[i] = extents[i].padded_size >> 32;
+		if (!rkafp_extent_fits_legacy(&extents[i]))
+			large = 1;
+	}
+
+	if (large) {
+		memcpy(ext.magic, RKAFP_EXT_MAGIC, sizeof(ext.magic));
+		ext.version = RKAFP_EXT_VERSION;
+	}
+
+	/* a relayout that fits again must not keep a stale extension */
+	memcpy(header->reserved, &ext, sizeof(ext));
+}
+
 struct param_header {
 	char magic[4];
 	unsigned int length;
 };
 
+typedef char rkafp_ext_fits_reserved[
+		sizeof(struct update_ext) <= sizeof(((struct update_header *)0)->reserved)
+		? 1 : -1];
+
 #endif // _RKAFP_H
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * rkbox is afptool, img_maker, mkbootimg and unmkbootimg in one static
+ * binary (make rkbox).  It runs the tool it is invoked as, so symlinks
+ * named after the tools replace the separate binaries; "rkbox <tool> ..."
+ * works as well.  Without a dynamic loader there is nothing to map or
+ * relocate before main(), which matters for scripts that run the tools
+ * thousands of times on small images.
+ */
+
+int afptool_main(int argc, char **argv);
+int img_maker_main(int argc, char **argv);
+int mkbootimg_main(int argc, char **argv);
+int unmkbootimg_main(int argc, char **argv);
+
+static const struct rkbox_tool {
+	const char *name;
+	int (*main)(int argc, char **argv);
+} rkbox_tools[] = {
+	{ "afptool", afptool_main },
+	{ "img_maker", img_maker_main },
+	{ "mkbootimg", mkbootimg_main },
+	{ "unmkbootimg", unmkbootimg_main },
+};
+
+#define NUM_TOOLS (sizeof(rkbox_tools) / sizeof(rkbox_tools[0]))
+
+static const struct rkbox_tool *find_tool(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	unsigned int i;
+
+	name = name ? name + 1 : path;
+	for (i = 0; i < NUM_TOOLS; i++)
+		if (strcmp(name, rkbox_tools[i].name) == 0)
+			return &rkbox_tools[i];
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const struct rkbox_tool *tool;
+	unsigned int i;
+
+	if ((tool = find_tool(argv[0])) != NULL)
+		return tool->main(argc, argv);
+
+	if (argc > 1 && (tool = find_tool(argv[1])) != NULL)
+		return tool->main(argc - 1, argv + 1);
+
+	fprintf(stderr, "USAGE:\n\t%s <tool> [args...]\n"
+			"\tor run it through a symlink named after the tool\n"
+			"Tools:\n", argv[0]);
+	for (i = 0; i < NUM_TOOLS; i++)
+		fprintf(stderr, "\t%s\n", rkbox_tools[i].name);
+
+	return 1;
+}
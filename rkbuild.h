@@ -0,0 +1,310 @@
+#ifndef _RKBUILD_H
+#define _RKBUILD_H
+
+/*
+ * Whole-artifact build cache, enabled with --build-cache=<dir>.
+ *
+ * A tool feeds everything its output depends on to rkbuild_add() (headers
+ * it is about to write, versions, chip) and rkbuild_add_fd() (input
+ * files); the sha256 of all that is the key.  rkbuild_fetch() puts a
+ * stored artifact in place of the output, rkbuild_store() keeps a new one.
+ *
+ * Layout of the cache directory:
+ *   files/<sha256 of dev, ino, size, mtime, ctime, range>  sha256 of data
+ *   objects/<key>                                          artifact
+ *
+ * Input digests are remembered by file identity, so unchanged inputs are
+ * not read again and a hit costs a few stat() calls.  Artifacts are
+ * returned by reflink when the filesystem supports it and copied
+ * otherwise, never hard linked: an output is an ordinary file that any
+ * program may overwrite without reaching into the cache.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "rkhash.h"
+
+#define RKBUILD_VERSION	1
+#define RKBUILD_CHUNK	(1 << 20)
+
+static struct {
+	const char *dir;
+	int active;
+	struct rksha256 ctx;
+	char key[2 * RKSHA256_DIGEST_LENGTH + 1];
+} rkbuild;
+
+static inline void rkbuild_hex(const unsigned char *md, char *hex)
+{
+	int i;
+
+	for (i = 0; i < RKSHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + 2 * i, "%02x", md[i]);
+}
+
+static inline void rkbuild_begin(const char *tool)
+{
+	unsigned int version = RKBUILD_VERSION;
+
+	if (!rkbuild.dir)
+		return;
+
+	rksha256_init(&rkbuild.ctx);
+	rksha256_update(&rkbuild.ctx, tool, strlen(tool) + 1);
+	rksha256_update(&rkbuild.ctx, &version, sizeof(version));
+	rkbuild.active = 1;
+}
+
+static inline void rkbuild_add(const void *buf, size_t len)
+{
+	if (rkbuild.active)
+		rksha256_update(&rkbuild.ctx, buf, len);
+}
+
+/* sha256 of [off, off + size) of fd, looked up by identity first */
+static inline int rkbuild_digest(int fd, uint64_t off, uint64_t size,
+		char *hex)
+{
+	struct {
+		uint64_t dev, ino, size;
+		int64_t mtime, mtime_ns, ctime, ctime_ns;
+		uint64_t off, len;
+	} id;
+	unsigned char md[RKSHA256_DIGEST_LENGTH];
+	char path[PATH_MAX], idhex[2 * RKSHA256_DIGEST_LENGTH + 1];
+	unsigned char *buf;
+	struct rksha256 ctx;
+	struct stat st;
+	uint64_t pos;
+	ssize_t n;
+	FILE *fp;
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+
+	memset(&id, 0, sizeof(id));
+	id.dev = st.st_dev;
+	id.ino = st.st_ino;
+	id.size = st.st_size;
+	id.mtime = st.st_mtim.tv_sec;
+	id.mtime_ns = st.st_mtim.tv_nsec;
+	id.ctime = st.st_ctim.tv_sec;
+	id.ctime_ns = st.st_ctim.tv_nsec;
+	id.off = off;
+	id.len = size;
+	rksha256(&id, sizeof(id), md);
+	rkbuild_hex(md, idhex);
+	snprintf(path, sizeof(path), "%s/files/%s", rkbuild.dir, idhex);
+
+	if ((fp = fopen(path, "r")) != NULL) {
+		n = fread(hex, 1, 2 * RKSHA256_DIGEST_LENGTH, fp);
+		fclose(fp);
+		if (n == 2 * RKSHA256_DIGEST_LENGTH) {
+			hex[n] = '\0';
+			return 0;
+		}
+	}
+
+	if ((buf = malloc(RKBUILD_CHUNK)) == NULL)
+		return -1;
+	rksha256_init(&ctx);
+	for (pos = 0; pos < size; pos += n) {
+		n = pread(fd, buf, size - pos < RKBUILD_CHUNK ?
+				size - pos : RKBUILD_CHUNK, off + pos);
+		if (n <= 0) {
+			free(buf);
+			return -1;
+		}
+		rksha256_update(&ctx, buf, n);
+	}
+	free(buf);
+	rksha256_final(md, &ctx);
+	rkbuild_hex(md, hex);
+
+	/* a lost entry only means reading the input again next time */
+	if ((fp = fopen(path, "w")) != NULL) {
+		fprintf(fp, "%s\n", hex);
+		fclose(fp);
+	}
+
+	return 0;
+}
+
+static inline int rkbuild_add_fd(int fd, uint64_t off, uint64_t size)
+{
+	char hex[2 * RKSHA256_DIGEST_LENGTH + 1];
+
+	if (!rkbuild.active)
+		return 0;
+
+	if (rkbuild_digest(fd, off, size, hex) != 0) {
+		fprintf(stderr, "build cache: can't read input: %s\n",
+				strerror(errno));
+		rkbuild.active = 0;
+		return -1;
+	}
+	rksha256_update(&rkbuild.ctx, &size, sizeof(size));
+	rksha256_update(&rkbuild.ctx, hex, strlen(hex));
+
+	return 0;
+}
+
+static inline int rkbuild_add_path(const char *path)
+{
+	struct stat st;
+	int fd, ret;
+
+	if (!rkbuild.active)
+		return 0;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0)
+			close(fd);
+		rkbuild.active = 0;
+		return -1;
+	}
+	ret = rkbuild_add_fd(fd, 0, st.st_size);
+	close(fd);
+
+	return ret;
+}
+
+/* Copy the rest of in to out where copy_file_range() can't */
+static inline int rkbuild_copy(int in, int out, loff_t off)
+{
+	unsigned char *buf;
+	ssize_t n;
+
+	if ((buf = malloc(RKBUILD_CHUNK)) == NULL)
+		return -1;
+	while ((n = pread(in, buf, RKBUILD_CHUNK, off)) > 0) {
+		ssize_t w, done;
+
+		for (done = 0; done < n; done += w)
+			if ((w = pwrite(out, buf + done, n - done, off + done)) <= 0) {
+				free(buf);
+				return -1;
+			}
+		off += n;
+	}
+	free(buf);
+
+	return n < 0 ? -1 : 0;
+}
+
+/* Make dst a reflink or copy of src with the given mode, atomically */
+static inline int rkbuild_place(const char *src, const char *dst, mode_t mode)
+{
+	char tmp[PATH_MAX];
+	int in, out = -1, ret = -1;
+	loff_t ioff = 0, ooff = 0;
+	ssize_t n;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.rkbuild.%d", dst,
+			(int)getpid()) >= (int)sizeof(tmp))
+		return -1;
+	unlink(tmp);
+
+	if ((in = open(src, O_RDONLY)) < 0)
+		return -1;
+	if ((out = open(tmp, O_CREAT | O_EXCL | O_WRONLY, mode)) < 0)
+		goto out;
+
+	if (ioctl(out, FICLONE, in) != 0) {
+		while ((n = copy_file_range(in, &ioff, out, &ooff,
+				RKBUILD_CHUNK, 0)) > 0)
+			;
+		if (n < 0 && rkbuild_copy(in, out, ioff) != 0)
+			goto out;
+	}
+
+	if (rename(tmp, dst) != 0)
+		goto out;
+	ret = 0;
+
+out:
+	if (out >= 0 && close(out) != 0)
+		ret = -1;
+	close(in);
+	if (ret != 0)
+		unlink(tmp);
+
+	return ret;
+}
+
+/*
+ * Returns 0 when the artifact for the inputs added so far was put at
+ * outfile.
+ */
+static inline int rkbuild_fetch(const char *outfile)
+{
+	unsigned char md[RKSHA256_DIGEST_LENGTH];
+	char path[PATH_MAX];
+
+	if (!rkbuild.active)
+		return -1;
+
+	rksha256_final(md, &rkbuild.ctx);
+	rkbuild_hex(md, rkbuild.key);
+	snprintf(path, sizeof(path), "%s/objects/%s", rkbuild.dir, rkbuild.key);
+
+	if (rkbuild_place(path, outfile, 0644) == 0) {
+		printf("build cache hit: %s\n", rkbuild.key);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Keep outfile as the artifact for the current key */
+static inline void rkbuild_store(const char *outfile)
+{
+	char path[PATH_MAX];
+
+	if (!rkbuild.active)
+		return;
+
+	rkbuild.active = 0;
+	snprintf(path, sizeof(path), "%s/objects/%s", rkbuild.dir, rkbuild.key);
+	if (rkbuild_place(outfile, path, 0444) != 0)
+		fprintf(stderr, "build cache: can't store %s: %s\n", path,
+				strerror(errno));
+}
+
+static inline void rkbuild_parse_args(int *argc, char **argv)
+{
+	char path[PATH_MAX];
+	int i, j;
+
+	for (i = j = 1; i < *argc; i++) {
+		if (strncmp(argv[i], "--build-cache=", 14) == 0)
+			rkbuild.dir = argv[i] + 14;
+		else
+			argv[j++] = argv[i];
+	}
+	argv[j] = NULL;
+	*argc = j;
+
+	if (rkbuild.dir && *rkbuild.dir == '\0')
+		rkbuild.dir = NULL;
+	if (!rkbuild.dir)
+		return;
+
+	mkdir(rkbuild.dir, 0755);
+	snprintf(path, sizeof(path), "%s/files", rkbuild.dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof(path), "%s/objects", rkbuild.dir);
+	mkdir(path, 0755);
+}
+
+#endif // _RKBUILD_H
@@ -0,0 +1,219 @@
+#ifndef _RKCACHE_H
+#define _RKCACHE_H
+
+/*
+ * Checksum cache shared by all jobs of an rkd daemon.
+ *
+ * The daemon creates the table in a memfd and exports its descriptor as
+ * RKCACHE_FD; tools attach on first use, so outside the daemon every lookup
+ * simply misses.  Entries are keyed by file identity (device, inode, size,
+ * mtime and ctime in nanoseconds) plus the checksum kind and the length of
+ * the checksummed prefix.  Any write to a file changes its ctime, so stale
+ * entries are never matched.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RKCACHE_MAGIC		"RKC1"
+#define RKCACHE_ENTRIES		65536
+#define RKCACHE_PROBE		8
+#define RKCACHE_VALUE		32
+
+enum {
+	RKCACHE_RKCRC = 1,
+};
+
+struct rkcache_entry {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t len;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t ctime_sec;
+	int64_t ctime_nsec;
+	uint32_t kind;
+	uint32_t valid;
+	unsigned char value[RKCACHE_VALUE];
+};
+
+struct rkcache_map {
+	char magic[4];
+	uint32_t entries;
+	pthread_mutex_t lock;
+	unsigned long long hits;
+	unsigned long long misses;
+	struct rkcache_entry e[RKCACHE_ENTRIES];
+};
+
+static struct rkcache_map *rkcache_map;
+static int rkcache_attached;
+
+static inline struct rkcache_map *rkcache_attach(void)
+{
+	const char *env;
+	void *map;
+
+	if (rkcache_attached)
+		return rkcache_map;
+	rkcache_attached = 1;
+
+	if ((env = getenv("RKCACHE_FD")) == NULL)
+		return NULL;
+
+	map = mmap(NULL, sizeof(struct rkcache_map), PROT_READ | PROT_WRITE,
+			MAP_SHARED, atoi(env), 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	rkcache_map = map;
+	if (memcmp(rkcache_map->magic, RKCACHE_MAGIC, 4) != 0) {
+		munmap(map, sizeof(struct rkcache_map));
+		rkcache_map = NULL;
+	}
+
+	return rkcache_map;
+}
+
+/* Daemon side: create the table and export it to every job */
+static inline int rkcache_create(void)
+{
+	pthread_mutexattr_t attr;
+	char fdstr[16];
+	int fd;
+
+	fd = memfd_create("rkcache", 0);
+	if (fd < 0 || ftruncate(fd, sizeof(struct rkcache_map)) != 0)
+		return -1;
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	setenv("RKCACHE_FD", fdstr, 1);
+
+	rkcache_map = mmap(NULL, sizeof(struct rkcache_map),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (rkcache_map == MAP_FAILED) {
+		rkcache_map = NULL;
+		return -1;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&rkcache_map->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	rkcache_map->entries = RKCACHE_ENTRIES;
+	memcpy(rkcache_map->magic, RKCACHE_MAGIC, 4);
+	rkcache_attached = 1;
+
+	return 0;
+}
+
+static inline void rkcache_lock(struct rkcache_map *map)
+{
+	/* a job killed while holding the lock leaves at worst one torn entry */
+	if (pthread_mutex_lock(&map->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&map->lock);
+}
+
+static inline void rkcache_key(struct rkcache_entry *key, const struct stat *st,
+		uint32_t kind, uint64_t len)
+{
+	memset(key, 0, sizeof(*key));
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->len = len;
+	key->mtime_sec = st->st_mtim.tv_sec;
+	key->mtime_nsec = st->st_mtim.tv_nsec;
+	key->ctime_sec = st->st_ctim.tv_sec;
+	key->ctime_nsec = st->st_ctim.tv_nsec;
+	key->kind = kind;
+	key->valid = 1;
+}
+
+static inline unsigned int rkcache_slot(const struct rkcache_entry *key)
+{
+	uint64_t h = key->ino * 0x9e3779b97f4a7c15ULL ^ key->dev ^
+			((uint64_t)key->kind << 56) ^ key->len;
+
+	return (h ^ (h >> 29)) % RKCACHE_ENTRIES;
+}
+
+static inline int rkcache_match(const struct rkcache_entry *e,
+		const struct rkcache_entry *key)
+{
+	return memcmp(e, key, offsetof(struct rkcache_entry, value)) == 0;
+}
+
+/* Look up the kind checksum of the first len bytes of fd; 1 on a hit */
+static inline int rkcache_get(int fd, uint32_t kind, uint64_t len,
+		void *value, size_t size)
+{
+	struct rkcache_map *map = rkcache_attach();
+	struct rkcache_entry key;
+	struct stat st;
+	unsigned int i, slot;
+	int hit = 0;
+
+	if (!map || size > RKCACHE_VALUE || fstat(fd, &st) != 0)
+		return 0;
+
+	rkcache_key(&key, &st, kind, len);
+	slot = rkcache_slot(&key);
+
+	rkcache_lock(map);
+	for (i = 0; i < RKCACHE_PROBE && !hit; i++) {
+		struct rkcache_entry *e = &map->e[(slot + i) % RKCACHE_ENTRIES];
+
+		if (rkcache_match(e, &key)) {
+			memcpy(value, e->value, size);
+			hit = 1;
+		}
+	}
+	if (hit)
+		map->hits++;
+	else
+		map->misses++;
+	pthread_mutex_unlock(&map->lock);
+
+	return hit;
+}
+
+static inline void rkcache_put(int fd, uint32_t kind, uint64_t len,
+		const void *value, size_t size)
+{
+	struct rkcache_map *map = rkcache_attach();
+	struct rkcache_entry key, *e = NULL;
+	struct stat st;
+	unsigned int i, slot;
+
+	if (!map || size > RKCACHE_VALUE || fstat(fd, &st) != 0)
+		return;
+
+	rkcache_key(&key, &st, kind, len);
+	memcpy(key.value, value, size);
+	slot = rkcache_slot(&key);
+
+	rkcache_lock(map);
+	for (i = 0; i < RKCACHE_PROBE; i++) {
+		e = &map->e[(slot + i) % RKCACHE_ENTRIES];
+		if (!e->valid || rkcache_match(e, &key))
+			break;
+	}
+	/* probe window full: evict its last entry */
+	*e = key;
+	pthread_mutex_unlock(&map->lock);
+}
+
+#endif // _RKCACHE_H
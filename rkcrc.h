@@ -103,4 +103,46 @@ do {									\
 		(crc) = ((crc) << 8) ^ _t[((crc) >> 24) ^ *_b++];	\
 } while (/* CONSTCOND */0)
 
+/*
+ * RKCRC is a plain MSB-first CRC-32 (polynomial 0x04c10db7, no initial value
+ * or final xor), so crc(A || B) = crc(A) * x^(8 * len(B)) ^ crc(B) over
+ * GF(2).  This lets checksums of separately hashed pieces be combined
+ * without touching their data again; zero padding only shifts the crc.
+ */
+#define RKCRC_POLY 0x04c10db7
+
+static inline uint32_t rkcrc_multmod(uint32_t a, uint32_t b)
+{
+	uint32_t r = 0;
+	int i;
+
+	for (i = 31; i >= 0; i--) {
+		r = (r << 1) ^ ((r & 0x80000000) ? RKCRC_POLY : 0);
+		if (a & (1U << i))
+			r ^= b;
+	}
+
+	return r;
+}
+
+/* crc of (data || len zero bytes) from crc of data */
+static inline uint32_t rkcrc_shift(uint32_t crc, uint64_t len)
+{
+	uint32_t p = 1, sq = 0x100;	/* x^0, x^8 */
+
+	for (; len; len >>= 1) {
+		if (len & 1)
+			p = rkcrc_multmod(p, sq);
+		sq = rkcrc_multmod(sq, sq);
+	}
+
+	return rkcrc_multmod(crc, p);
+}
+
+/* crc of (A || B) from crc(A), crc(B) and len(B) */
+static inline uint32_t rkcrc_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	return rkcrc_shift(crc1, len2) ^ crc2;
+}
+
 #endif //_RKCRC_H
@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "rkcache.h"
+
+/*
+ * rkd keeps afptool, img_maker, mkbootimg and unmkbootimg resident behind a
+ * Unix socket.  The client sends its arguments, working directory and
+ * stdin/stdout/stderr (SCM_RIGHTS) in one SOCK_SEQPACKET message; the daemon
+ * forks a job that runs the tool's main() on those descriptors, so output
+ * streams straight to the client, and replies with the exit status.
+ *
+ * Jobs are forked from the warm daemon (no exec, nothing left to map),
+ * at most -j at a time, share the rkcache.h checksum cache and each get
+ * --io-budget=<-b MB/s>.  A client that disconnects has its job killed.
+ */
+
+int afptool_main(int argc, char **argv);
+int img_maker_main(int argc, char **argv);
+int mkbootimg_main(int argc, char **argv);
+int unmkbootimg_main(int argc, char **argv);
+
+#define RKD_MAGIC		"RKD1"
+#define RKD_MAX_MSG		(64 << 10)
+#define RKD_MAX_ARGS		256
+#define RKD_MAX_JOBS		64
+#define RKD_NUM_FDS		4	/* stdin, stdout, stderr, cwd */
+
+static const struct rkd_tool {
+	const char *name;
+	int (*main)(int argc, char **argv);
+	int rkio;		/* takes --io-budget= */
+} rkd_tools[] = {
+	{ "afptool", afptool_main, 1 },
+	{ "img_maker", img_maker_main, 1 },
+	{ "mkbootimg", mkbootimg_main, 0 },
+	{ "unmkbootimg", unmkbootimg_main, 0 },
+};
+
+struct rkd_request {
+	char magic[4];
+	uint32_t argc;
+};
+
+struct rkd_job {
+	pid_t pid;
+	int sock;
+	unsigned long id;
+	double start;
+	int killed;
+	char tool[16];
+};
+
+static struct rkd_job jobs[RKD_MAX_JOBS];
+static unsigned int num_jobs;
+static int listen_fd = -1;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The default socket lives in $XDG_RUNTIME_DIR, or else in a 0700
+ * directory of our own under /tmp, so nobody else can put one in its
+ * place.
+ */
+static int socket_path(char *path, size_t size, const char *opt)
+{
+	const char *env = getenv("RKD_SOCKET");
+	const char *run = getenv("XDG_RUNTIME_DIR");
+	char dir[64];
+	struct stat st;
+
+	if (opt || env) {
+		snprintf(path, size, "%s", opt ? opt : env);
+		return 0;
+	}
+	if (run && *run) {
+		snprintf(path, size, "%s/rkd.sock", run);
+		return 0;
+	}
+
+	snprintf(dir, sizeof(dir), "/tmp/rkd-%u", (unsigned int)getuid());
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		fprintf(stderr, "can't create %s: %s\n", dir, strerror(errno));
+		return -1;
+	}
+	if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode)
+			|| st.st_uid != getuid() || (st.st_mode & 077)) {
+		fprintf(stderr, "%s is not a private directory of this user\n", dir);
+		return -1;
+	}
+	snprintf(path, size, "%s/rkd.sock", dir);
+
+	return 0;
+}
+
+static int make_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// client
+
+int run_client(const char *path, int argc, char **argv)
+{
+	char msg[RKD_MAX_MSG], cbuf[CMSG_SPACE(RKD_NUM_FDS * sizeof(int))];
+	struct rkd_request req;
+	struct sockaddr_un addr;
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	int fds[RKD_NUM_FDS];
+	size_t len = sizeof(req);
+	int32_t status;
+	int sock, i;
+
+	memcpy(req.magic, RKD_MAGIC, sizeof(req.magic));
+	req.argc = argc;
+	for (i = 0; i < argc; i++) {
+		size_t n = strlen(argv[i]) + 1;
+
+		if (len + n > sizeof(msg)) {
+			fprintf(stderr, "argument list too long\n");
+			return 1;
+		}
+		memcpy(msg + len, argv[i], n);
+		len += n;
+	}
+	memcpy(msg, &req, sizeof(req));
+
+	if (make_addr(&addr, path) != 0)
+		return 1;
+
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0
+			|| connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "can't connect to rkd at %s: %s\n", path,
+				strerror(errno));
+		return 1;
+	}
+
+	/* our descriptors only ever go to a daemon of our own user */
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0
+			|| cred.uid != getuid()) {
+		fprintf(stderr, "rkd at %s is not run by this user\n", path);
+		close(sock);
+		return 1;
+	}
+
+	fds[0] = STDIN_FILENO;
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+	if ((fds[3] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "can't open working directory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = msg;
+	iov.iov_len = len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+	fflush(stdout);
+	if (sendmsg(sock, &mh, 0) != (ssize_t)len) {
+		fprintf(stderr, "can't submit job: %s\n", strerror(errno));
+		return 1;
+	}
+	close(fds[3]);
+
+	/* the job writes to our stdout/stderr; wait for its exit status */
+	if (recv(sock, &status, sizeof(status), 0) != sizeof(status)) {
+		fprintf(stderr, "rkd closed the connection\n");
+		return 1;
+	}
+	close(sock);
+
+	return status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// daemon
+
+static void on_sigchld(int sig)
+{
+	(void)sig;
+}
+
+static void reply(int sock, int32_t status)
+{
+	send(sock, &status, sizeof(status), MSG_NOSIGNAL);
+	close(sock);
+}
+
+static void close_fds(int *fds, unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+}
+
+static void run_job(const struct rkd_tool *tool, int *fds, int argc,
+		char **argv, const sigset_t *mask)
+{
+	unsigned int i;
+
+	close(listen_fd);
+	for (i = 0; i < num_jobs; i++)
+		close(jobs[i].sock);
+
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	sigprocmask(SIG_SETMASK, mask, NULL);
+
+	if (dup2(fds[0], STDIN_FILENO) < 0 || dup2(fds[1], STDOUT_FILENO) < 0
+			|| dup2(fds[2], STDERR_FILENO) < 0 || fchdir(fds[3]) != 0)
+		_exit(126);
+	close_fds(fds, RKD_NUM_FDS);
+
+	exit(tool->main(argc, argv));
+}
+
+static void start_job(int sock, unsigned long id, const char *budget,
+		const sigset_t *mask)
+{
+	char msg[RKD_MAX_MSG + 1], cbuf[CMSG_SPACE(RKD_NUM_FDS * sizeof(int))];
+	char *argv[RKD_MAX_ARGS + 2], *p;
+	const struct rkd_tool *tool = NULL;
+	struct rkd_request req;
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	struct iovec iov;
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	int fds[RKD_NUM_FDS] = { -1, -1, -1, -1 };
+	unsigned int i;
+	ssize_t len;
+	int argc;
+	pid_t pid;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = RKD_MAX_MSG;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	len = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	cm = CMSG_FIRSTHDR(&mh);
+	if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+		size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cm), (n < RKD_NUM_FDS ? n : RKD_NUM_FDS) * sizeof(int));
+		for (i = RKD_NUM_FDS; i < n; i++)
+			close(((int *)CMSG_DATA(cm))[i]);
+	}
+
+	/* jobs run with the daemon's rights: only serve its own user */
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0
+			|| cred.uid != getuid()) {
+		fprintf(stderr, "rkd: job %lu: rejected foreign user\n", id);
+		goto fail;
+	}
+
+	if (len < (ssize_t)sizeof(req) || fds[3] < 0 || (mh.msg_flags & MSG_TRUNC)) {
+		fprintf(stderr, "rkd: job %lu: malformed request\n", id);
+		goto fail;
+	}
+
+	memcpy(&req, msg, sizeof(req));
+	msg[len] = '\0';
+	if (memcmp(req.magic, RKD_MAGIC, sizeof(req.magic)) != 0 || req.argc < 1
+			|| req.argc > RKD_MAX_ARGS) {
+		fprintf(stderr, "rkd: job %lu: malformed request\n", id);
+		goto fail;
+	}
+
+	for (argc = 0, p = msg + sizeof(req); argc < (int)req.argc; argc++) {
+		if (p >= msg + len) {
+			fprintf(stderr, "rkd: job %lu: truncated arguments\n", id);
+			goto fail;
+		}
+		argv[argc] = p;
+		p += strlen(p) + 1;
+	}
+
+	for (i = 0; i < sizeof(rkd_tools) / sizeof(rkd_tools[0]); i++)
+		if (strcmp(argv[0], rkd_tools[i].name) == 0)
+			tool = &rkd_tools[i];
+
+	if (!tool) {
+		dprintf(fds[2], "rkd: unknown tool \"%s\"\n", argv[0]);
+		reply(sock, 127);
+		close_fds(fds, RKD_NUM_FDS);
+		return;
+	}
+
+	/* last one wins, so the daemon's budget overrides the client's */
+	if (budget && tool->rkio)
+		argv[argc++] = (char *)budget;
+	argv[argc] = NULL;
+
+	fflush(stderr);
+	if ((pid = fork()) < 0) {
+		fprintf(stderr, "rkd: fork failed: %s\n", strerror(errno));
+		goto fail;
+	}
+
+	if (pid == 0) {
+		close(sock);
+		run_job(tool, fds, argc, argv, mask);
+	}
+
+	close_fds(fds, RKD_NUM_FDS);
+	jobs[num_jobs].pid = pid;
+	jobs[num_jobs].sock = sock;
+	jobs[num_jobs].id = id;
+	jobs[num_jobs].start = now();
+	jobs[num_jobs].killed = 0;
+	snprintf(jobs[num_jobs].tool, sizeof(jobs[num_jobs].tool), "%s", tool->name);
+	num_jobs++;
+
+	fprintf(stderr, "rkd: job %lu: %s started (pid %d)\n", id, tool->name,
+			(int)pid);
+	return;
+
+fail:
+	close_fds(fds, RKD_NUM_FDS);
+	reply(sock, 1);
+}
+
+static void reap_jobs(void)
+{
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		unsigned int i;
+		int32_t code;
+
+		for (i = 0; i < num_jobs && jobs[i].pid != pid; i++)
+			;
+		if (i == num_jobs)
+			continue;
+
+		code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+		reply(jobs[i].sock, code);
+
+		fprintf(stderr, "rkd: job %lu: %s exited %d after %.3f s", jobs[i].id,
+				jobs[i].tool, code, now() - jobs[i].start);
+		if (rkcache_map)
+			fprintf(stderr, ", cache %llu hits %llu misses",
+					rkcache_map->hits, rkcache_map->misses);
+		fputc('\n', stderr);
+
+		jobs[i] = jobs[--num_jobs];
+	}
+}
+
+int run_daemon(const char *path, unsigned int workers, double budget_mbs)
+{
+	struct pollfd pfd[RKD_MAX_JOBS + 1];
+	char budget[64], *budget_arg = NULL;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	sigset_t block, orig;
+	unsigned long next_id = 1;
+	struct stat st;
+	mode_t mask;
+
+	if (make_addr(&addr, path) != 0)
+		return -1;
+
+	/* replace a stale socket, but never a regular file */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	mask = umask(077);
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+			|| listen(listen_fd, 64) != 0) {
+		umask(mask);
+		fprintf(stderr, "rkd: can't listen on %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	umask(mask);
+
+	if (rkcache_create() != 0)
+		fprintf(stderr, "rkd: checksum cache disabled: %s\n", strerror(errno));
+
+	if (budget_mbs > 0) {
+		snprintf(budget, sizeof(budget), "--io-budget=%g", budget_mbs);
+		budget_arg = budget;
+	}
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &block, &orig);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigchld;
+	sigaction(SIGCHLD, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	fprintf(stderr, "rkd: listening on %s, %u workers", path, workers);
+	if (budget_arg)
+		fprintf(stderr, ", %g MB/s per job", budget_mbs);
+	fputc('\n', stderr);
+
+	for (;;) {
+		unsigned int i, n = 0;
+
+		/* a full pool leaves new clients waiting in the listen backlog */
+		if (num_jobs < workers) {
+			pfd[n].fd = listen_fd;
+			pfd[n++].events = POLLIN;
+		}
+		for (i = 0; i < num_jobs; i++) {
+			if (jobs[i].killed)
+				continue;
+			pfd[n].fd = jobs[i].sock;
+			pfd[n++].events = POLLIN;
+		}
+
+		if (ppoll(pfd, n, NULL, &orig) < 0 && errno != EINTR) {
+			fprintf(stderr, "rkd: poll failed: %s\n", strerror(errno));
+			return -1;
+		}
+
+		reap_jobs();
+
+		for (i = 0; i < n; i++) {
+			unsigned int j;
+
+			if (pfd[i].fd == listen_fd || !pfd[i].revents)
+				continue;
+			/* clients never send twice: readable means it went away */
+			for (j = 0; j < num_jobs; j++)
+				if (jobs[j].sock == pfd[i].fd && !jobs[j].killed) {
+					kill(jobs[j].pid, SIGTERM);
+					jobs[j].killed = 1;
+				}
+		}
+
+		if (num_jobs < workers && n && pfd[0].fd == listen_fd
+				&& (pfd[0].revents & POLLIN)) {
+			int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+			if (sock >= 0)
+				start_job(sock, next_id++, budget_arg, &orig);
+		}
+	}
+}
+
+void usage(const char *appname) {
+	const char *p = strrchr(appname, '/');
+	p = p ? p + 1 : appname;
+
+	printf("USAGE:\n"
+			"\t%s -d [-s socket] [-j workers] [-b MB/s]\n"
+			"\t%s [-s socket] <afptool|img_maker|mkbootimg|unmkbootimg> [args...]\n"
+			"Example:\n"
+			"\t%s -d -j 4 -b 200\tserve 4 jobs at a time, 200 MB/s of I/O each\n"
+			"\t%s afptool -pack xxx update.img\trun afptool in the daemon\n"
+			"Options:\n"
+			"\t-s\tsocket path (default: $RKD_SOCKET, $XDG_RUNTIME_DIR/rkd.sock\n"
+			"\t\tor /tmp/rkd-<uid>/rkd.sock)\n",
+			p, p, p, p);
+}
+
+int main(int argc, char **argv) {
+	const char *sock_opt = NULL;
+	char path[PATH_MAX];
+	unsigned int workers = 0;
+	double budget = 0;
+	int serve = 0, i;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-d") == 0) {
+			serve = 1;
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			sock_opt = argv[++i];
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			workers = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+			budget = atof(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (socket_path(path, sizeof(path), sock_opt) != 0)
+		return 1;
+
+	if (serve) {
+		if (i != argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (workers == 0) {
+			long n = sysconf(_SC_NPROCESSORS_ONLN);
+			workers = n > 0 ? n : 1;
+		}
+		if (workers > RKD_MAX_JOBS)
+			workers = RKD_MAX_JOBS;
+		return run_daemon(path, workers, budget) == 0 ? 0 : 1;
+	}
+
+	if (i == argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	return run_client(path, argc - i, argv + i);
+}
@@ -0,0 +1,42 @@
+#ifndef _RKDELTA_H
+#define _RKDELTA_H
+
+#include <stdint.h>
+
+/*
+ * Delta between two RKAF update images (afptool -diff / -apply).
+ *
+ * A delta_header is followed by delta_ops that rebuild the new image
+ * front to back.  DELTA_COPY takes length bytes at offset from the old
+ * image, DELTA_DATA is followed by length literal bytes; DELTA_END closes
+ * the stream.  old_crc/new_crc are the RKAF crc trailers of both images,
+ * identifying the base and verifying the result.  All fields are
+ * little-endian.
+ */
+
+#define RKDELTA_MAGIC "RKDL"
+#define RKDELTA_VERSION 1
+
+enum {
+	DELTA_END = 0,
+	DELTA_COPY = 1,
+	DELTA_DATA = 2,
+};
+
+struct delta_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t old_length;	/* including crc trailer */
+	uint64_t new_length;	/* including crc trailer */
+	uint32_t old_crc;
+	uint32_t new_crc;
+};
+
+struct delta_op {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t offset;	/* DELTA_COPY: offset in the old image */
+	uint64_t length;
+};
+
+#endif // _RKDELTA_H
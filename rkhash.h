@@ -0,0 +1,616 @@
+#ifndef _RKHASH_H
+#define _RKHASH_H
+
+/*
+ * MD5, SHA-1 and SHA-256, so the tools don't need libcrypto.
+ *
+ * The interface follows OpenSSL's: *_init(), *_update() any number of
+ * times, *_final(md, ctx).  On x86 CPUs with the SHA extensions, SHA-1 and
+ * SHA-256 blocks are processed with SHA-NI; everything else, and MD5
+ * (whose rounds are a single serial dependency chain), is portable C.
+ * bench/rkbench checks both paths against OpenSSL.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RKHASH_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define RKMD5_DIGEST_LENGTH	16
+#define RKSHA1_DIGEST_LENGTH	20
+#define RKSHA256_DIGEST_LENGTH	32
+
+struct rkmd5 {
+	uint32_t h[4];
+	uint64_t len;
+	unsigned char buf[64];
+};
+
+struct rksha1 {
+	uint32_t h[5];
+	uint64_t len;
+	unsigned char buf[64];
+};
+
+struct rksha256 {
+	uint32_t h[8];
+	uint64_t len;
+	unsigned char buf[64];
+};
+
+/* -1: not probed yet, 0: portable C, 1: SHA-NI (rkbench forces 0) */
+static int rkhash_accel = -1;
+
+static inline int rkhash_shani(void)
+{
+#ifdef RKHASH_SHANI
+	unsigned int a, b, c, d;
+
+	if (rkhash_accel < 0) {
+		rkhash_accel = __get_cpuid(1, &a, &b, &c, &d)
+				&& (c & bit_SSSE3) && (c & bit_SSE4_1)
+				&& __get_cpuid_count(7, 0, &a, &b, &c, &d)
+				&& (b & (1U << 29));
+	}
+	return rkhash_accel;
+#else
+	rkhash_accel = 0;
+	return 0;
+#endif
+}
+
+static inline uint32_t rkhash_rol(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t rkhash_ror(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint32_t rkhash_le32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint32_t rkhash_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void rkhash_put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * Common block buffering: feed whole 64-byte blocks from data to
+ * blocks(state, data, n) and keep the tail in buf.
+ */
+static inline void rkhash_update(uint32_t *h, uint64_t *total,
+		unsigned char *buf, const void *data, size_t len,
+		void (*blocks)(uint32_t *, const unsigned char *, size_t))
+{
+	const unsigned char *p = data;
+	size_t fill = *total & 63, n;
+
+	*total += len;
+
+	if (fill) {
+		n = 64 - fill < len ? 64 - fill : len;
+		memcpy(buf + fill, p, n);
+		p += n;
+		len -= n;
+		if (fill + n < 64)
+			return;
+		blocks(h, buf, 1);
+	}
+
+	if (len >= 64) {
+		blocks(h, p, len / 64);
+		p += len & ~(size_t)63;
+		len &= 63;
+	}
+
+	memcpy(buf, p, len);
+}
+
+/* Pad with 0x80, zeros and the bit length, little- or big-endian */
+static inline void rkhash_pad(uint32_t *h, uint64_t total, unsigned char *buf,
+		int big_endian,
+		void (*blocks)(uint32_t *, const unsigned char *, size_t))
+{
+	size_t fill = total & 63;
+	uint64_t bits = total << 3;
+	int i;
+
+	buf[fill++] = 0x80;
+	if (fill > 56) {
+		memset(buf + fill, 0, 64 - fill);
+		blocks(h, buf, 1);
+		fill = 0;
+	}
+	memset(buf + fill, 0, 56 - fill);
+	for (i = 0; i < 8; i++)
+		buf[56 + i] = bits >> (big_endian ? 56 - 8 * i : 8 * i);
+	blocks(h, buf, 1);
+}
+
+/* MD5 (RFC 1321) */
+
+#define RKMD5_F(x, y, z)	((z) ^ ((x) & ((y) ^ (z))))
+#define RKMD5_G(x, y, z)	((y) ^ ((z) & ((x) ^ (y))))
+#define RKMD5_H(x, y, z)	((x) ^ (y) ^ (z))
+#define RKMD5_I(x, y, z)	((y) ^ ((x) | ~(z)))
+#define RKMD5_STEP(f, a, b, c, d, i, t, s) \
+	(a) = rkhash_rol((a) + f((b), (c), (d)) + x[i] + (t), (s)) + (b)
+
+static inline void rkmd5_blocks(uint32_t *h, const unsigned char *p,
+		size_t n)
+{
+	uint32_t a, b, c, d, x[16];
+	int i;
+
+	for (; n; n--, p += 64) {
+		for (i = 0; i < 16; i++)
+			x[i] = rkhash_le32(p + 4 * i);
+		a = h[0];
+		b = h[1];
+		c = h[2];
+		d = h[3];
+
+		RKMD5_STEP(RKMD5_F, a, b, c, d, 0, 0xd76aa478, 7);
+		RKMD5_STEP(RKMD5_F, d, a, b, c, 1, 0xe8c7b756, 12);
+		RKMD5_STEP(RKMD5_F, c, d, a, b, 2, 0x242070db, 17);
+		RKMD5_STEP(RKMD5_F, b, c, d, a, 3, 0xc1bdceee, 22);
+		RKMD5_STEP(RKMD5_F, a, b, c, d, 4, 0xf57c0faf, 7);
+		RKMD5_STEP(RKMD5_F, d, a, b, c, 5, 0x4787c62a, 12);
+		RKMD5_STEP(RKMD5_F, c, d, a, b, 6, 0xa8304613, 17);
+		RKMD5_STEP(RKMD5_F, b, c, d, a, 7, 0xfd469501, 22);
+		RKMD5_STEP(RKMD5_F, a, b, c, d, 8, 0x698098d8, 7);
+		RKMD5_STEP(RKMD5_F, d, a, b, c, 9, 0x8b44f7af, 12);
+		RKMD5_STEP(RKMD5_F, c, d, a, b, 10, 0xffff5bb1, 17);
+		RKMD5_STEP(RKMD5_F, b, c, d, a, 11, 0x895cd7be, 22);
+		RKMD5_STEP(RKMD5_F, a, b, c, d, 12, 0x6b901122, 7);
+		RKMD5_STEP(RKMD5_F, d, a, b, c, 13, 0xfd987193, 12);
+		RKMD5_STEP(RKMD5_F, c, d, a, b, 14, 0xa679438e, 17);
+		RKMD5_STEP(RKMD5_F, b, c, d, a, 15, 0x49b40821, 22);
+
+		RKMD5_STEP(RKMD5_G, a, b, c, d, 1, 0xf61e2562, 5);
+		RKMD5_STEP(RKMD5_G, d, a, b, c, 6, 0xc040b340, 9);
+		RKMD5_STEP(RKMD5_G, c, d, a, b, 11, 0x265e5a51, 14);
+		RKMD5_STEP(RKMD5_G, b, c, d, a, 0, 0xe9b6c7aa, 20);
+		RKMD5_STEP(RKMD5_G, a, b, c, d, 5, 0xd62f105d, 5);
+		RKMD5_STEP(RKMD5_G, d, a, b, c, 10, 0x02441453, 9);
+		RKMD5_STEP(RKMD5_G, c, d, a, b, 15, 0xd8a1e681, 14);
+		RKMD5_STEP(RKMD5_G, b, c, d, a, 4, 0xe7d3fbc8, 20);
+		RKMD5_STEP(RKMD5_G, a, b, c, d, 9, 0x21e1cde6, 5);
+		RKMD5_STEP(RKMD5_G, d, a, b, c, 14, 0xc33707d6, 9);
+		RKMD5_STEP(RKMD5_G, c, d, a, b, 3, 0xf4d50d87, 14);
+		RKMD5_STEP(RKMD5_G, b, c, d, a, 8, 0x455a14ed, 20);
+		RKMD5_STEP(RKMD5_G, a, b, c, d, 13, 0xa9e3e905, 5);
+		RKMD5_STEP(RKMD5_G, d, a, b, c, 2, 0xfcefa3f8, 9);
+		RKMD5_STEP(RKMD5_G, c, d, a, b, 7, 0x676f02d9, 14);
+		RKMD5_STEP(RKMD5_G, b, c, d, a, 12, 0x8d2a4c8a, 20);
+
+		RKMD5_STEP(RKMD5_H, a, b, c, d, 5, 0xfffa3942, 4);
+		RKMD5_STEP(RKMD5_H, d, a, b, c, 8, 0x8771f681, 11);
+		RKMD5_STEP(RKMD5_H, c, d, a, b, 11, 0x6d9d6122, 16);
+		RKMD5_STEP(RKMD5_H, b, c, d, a, 14, 0xfde5380c, 23);
+		RKMD5_STEP(RKMD5_H, a, b, c, d, 1, 0xa4beea44, 4);
+		RKMD5_STEP(RKMD5_H, d, a, b, c, 4, 0x4bdecfa9, 11);
+		RKMD5_STEP(RKMD5_H, c, d, a, b, 7, 0xf6bb4b60, 16);
+		RKMD5_STEP(RKMD5_H, b, c, d, a, 10, 0xbebfbc70, 23);
+		RKMD5_STEP(RKMD5_H, a, b, c, d, 13, 0x289b7ec6, 4);
+		RKMD5_STEP(RKMD5_H, d, a, b, c, 0, 0xeaa127fa, 11);
+		RKMD5_STEP(RKMD5_H, c, d, a, b, 3, 0xd4ef3085, 16);
+		RKMD5_STEP(RKMD5_H, b, c, d, a, 6, 0x04881d05, 23);
+		RKMD5_STEP(RKMD5_H, a, b, c, d, 9, 0xd9d4d039, 4);
+		RKMD5_STEP(RKMD5_H, d, a, b, c, 12, 0xe6db99e5, 11);
+		RKMD5_STEP(RKMD5_H, c, d, a, b, 15, 0x1fa27cf8, 16);
+		RKMD5_STEP(RKMD5_H, b, c, d, a, 2, 0xc4ac5665, 23);
+
+		RKMD5_STEP(RKMD5_I, a, b, c, d, 0, 0xf4292244, 6);
+		RKMD5_STEP(RKMD5_I, d, a, b, c, 7, 0x432aff97, 10);
+		RKMD5_STEP(RKMD5_I, c, d, a, b, 14, 0xab9423a7, 15);
+		RKMD5_STEP(RKMD5_I, b, c, d, a, 5, 0xfc93a039, 21);
+		RKMD5_STEP(RKMD5_I, a, b, c, d, 12, 0x655b59c3, 6);
+		RKMD5_STEP(RKMD5_I, d, a, b, c, 3, 0x8f0ccc92, 10);
+		RKMD5_STEP(RKMD5_I, c, d, a, b, 10, 0xffeff47d, 15);
+		RKMD5_STEP(RKMD5_I, b, c, d, a, 1, 0x85845dd1, 21);
+		RKMD5_STEP(RKMD5_I, a, b, c, d, 8, 0x6fa87e4f, 6);
+		RKMD5_STEP(RKMD5_I, d, a, b, c, 15, 0xfe2ce6e0, 10);
+		RKMD5_STEP(RKMD5_I, c, d, a, b, 6, 0xa3014314, 15);
+		RKMD5_STEP(RKMD5_I, b, c, d, a, 13, 0x4e0811a1, 21);
+		RKMD5_STEP(RKMD5_I, a, b, c, d, 4, 0xf7537e82, 6);
+		RKMD5_STEP(RKMD5_I, d, a, b, c, 11, 0xbd3af235, 10);
+		RKMD5_STEP(RKMD5_I, c, d, a, b, 2, 0x2ad7d2bb, 15);
+		RKMD5_STEP(RKMD5_I, b, c, d, a, 9, 0xeb86d391, 21);
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+	}
+}
+
+static inline void rkmd5_init(struct rkmd5 *ctx)
+{
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xefcdab89;
+	ctx->h[2] = 0x98badcfe;
+	ctx->h[3] = 0x10325476;
+	ctx->len = 0;
+}
+
+static inline void rkmd5_update(struct rkmd5 *ctx, const void *data,
+		size_t len)
+{
+	rkhash_update(ctx->h, &ctx->len, ctx->buf, data, len, rkmd5_blocks);
+}
+
+static inline void rkmd5_final(unsigned char *md, struct rkmd5 *ctx)
+{
+	int i;
+
+	rkhash_pad(ctx->h, ctx->len, ctx->buf, 0, rkmd5_blocks);
+	for (i = 0; i < 16; i++)
+		md[i] = ctx->h[i / 4] >> (8 * (i % 4));
+}
+
+/* SHA-1 (FIPS 180-4) */
+
+static inline void rksha1_blocks_c(uint32_t *h, const unsigned char *p,
+		size_t n)
+{
+	uint32_t a, b, c, d, e, f, k, t, w[16];
+	int i;
+
+	for (; n; n--, p += 64) {
+		a = h[0];
+		b = h[1];
+		c = h[2];
+		d = h[3];
+		e = h[4];
+
+		for (i = 0; i < 80; i++) {
+			if (i < 16) {
+				w[i] = rkhash_be32(p + 4 * i);
+			} else {
+				w[i & 15] = rkhash_rol(w[(i + 13) & 15]
+						^ w[(i + 8) & 15] ^ w[(i + 2) & 15]
+						^ w[i & 15], 1);
+			}
+
+			if (i < 20) {
+				f = d ^ (b & (c ^ d));
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (d & (b | c));
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			t = rkhash_rol(a, 5) + f + e + k + w[i & 15];
+			e = d;
+			d = c;
+			c = rkhash_rol(b, 30);
+			b = a;
+			a = t;
+		}
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+}
+
+#ifdef RKHASH_SHANI
+/*
+ * Four rounds per group g: the message schedule for group g + 1..3 is
+ * computed while the rounds of group g run.
+ */
+#define RKSHA1_GROUP(g) do { \
+	if ((g) == 0) { \
+		e[0] = _mm_add_epi32(e[0], m[0]); \
+	} else { \
+		e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], m[(g) & 3]); \
+	} \
+	e[((g) + 1) & 1] = abcd; \
+	if ((g) >= 3 && (g) <= 18) \
+		m[((g) + 1) & 3] = _mm_sha1msg2_epu32(m[((g) + 1) & 3], \
+				m[(g) & 3]); \
+	abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], (g) / 5); \
+	if ((g) >= 1 && (g) <= 16) \
+		m[((g) - 1) & 3] = _mm_sha1msg1_epu32(m[((g) - 1) & 3], \
+				m[(g) & 3]); \
+	if ((g) >= 2 && (g) <= 17) \
+		m[((g) - 2) & 3] = _mm_xor_si128(m[((g) - 2) & 3], m[(g) & 3]); \
+} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static inline void rksha1_blocks_ni(uint32_t *h, const unsigned char *p,
+		size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+			0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e0_save, e[2], m[4];
+	int i;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0x1b);
+	e[0] = _mm_set_epi32(h[4], 0, 0, 0);
+
+	for (; n; n--, p += 64) {
+		abcd_save = abcd;
+		e0_save = e[0];
+
+		for (i = 0; i < 4; i++)
+			m[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)(p + 16 * i)), mask);
+
+		RKSHA1_GROUP(0);
+		RKSHA1_GROUP(1);
+		RKSHA1_GROUP(2);
+		RKSHA1_GROUP(3);
+		RKSHA1_GROUP(4);
+		RKSHA1_GROUP(5);
+		RKSHA1_GROUP(6);
+		RKSHA1_GROUP(7);
+		RKSHA1_GROUP(8);
+		RKSHA1_GROUP(9);
+		RKSHA1_GROUP(10);
+		RKSHA1_GROUP(11);
+		RKSHA1_GROUP(12);
+		RKSHA1_GROUP(13);
+		RKSHA1_GROUP(14);
+		RKSHA1_GROUP(15);
+		RKSHA1_GROUP(16);
+		RKSHA1_GROUP(17);
+		RKSHA1_GROUP(18);
+		RKSHA1_GROUP(19);
+
+		e[0] = _mm_sha1nexte_epu32(e[0], e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+	h[4] = _mm_extract_epi32(e[0], 3);
+}
+#endif
+
+static inline void rksha1_blocks(uint32_t *h, const unsigned char *p,
+		size_t n)
+{
+#ifdef RKHASH_SHANI
+	if (rkhash_shani()) {
+		rksha1_blocks_ni(h, p, n);
+		return;
+	}
+#endif
+	rksha1_blocks_c(h, p, n);
+}
+
+static inline void rksha1_init(struct rksha1 *ctx)
+{
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xefcdab89;
+	ctx->h[2] = 0x98badcfe;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xc3d2e1f0;
+	ctx->len = 0;
+}
+
+static inline void rksha1_update(struct rksha1 *ctx, const void *data,
+		size_t len)
+{
+	rkhash_update(ctx->h, &ctx->len, ctx->buf, data, len, rksha1_blocks);
+}
+
+static inline void rksha1_final(unsigned char *md, struct rksha1 *ctx)
+{
+	int i;
+
+	rkhash_pad(ctx->h, ctx->len, ctx->buf, 1, rksha1_blocks);
+	for (i = 0; i < 5; i++)
+		rkhash_put_be32(md + 4 * i, ctx->h[i]);
+}
+
+/* SHA-256 (FIPS 180-4) */
+
+static const uint32_t rksha256_k[64] __attribute__((aligned(16))) = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline void rksha256_blocks_c(uint32_t *h, const unsigned char *p,
+		size_t n)
+{
+	uint32_t s[8], w[16], t1, t2;
+	int i;
+
+	for (; n; n--, p += 64) {
+		memcpy(s, h, sizeof(s));
+
+		for (i = 0; i < 64; i++) {
+			if (i < 16) {
+				w[i] = rkhash_be32(p + 4 * i);
+			} else {
+				t1 = w[(i + 1) & 15];
+				t2 = w[(i + 14) & 15];
+				w[i & 15] += w[(i + 9) & 15]
+					+ (rkhash_ror(t1, 7) ^ rkhash_ror(t1, 18) ^ (t1 >> 3))
+					+ (rkhash_ror(t2, 17) ^ rkhash_ror(t2, 19) ^ (t2 >> 10));
+			}
+
+			t1 = s[7] + (rkhash_ror(s[4], 6) ^ rkhash_ror(s[4], 11)
+					^ rkhash_ror(s[4], 25))
+				+ (s[6] ^ (s[4] & (s[5] ^ s[6])))
+				+ rksha256_k[i] + w[i & 15];
+			t2 = (rkhash_ror(s[0], 2) ^ rkhash_ror(s[0], 13)
+					^ rkhash_ror(s[0], 22))
+				+ ((s[0] & s[1]) | (s[2] & (s[0] | s[1])));
+			s[7] = s[6];
+			s[6] = s[5];
+			s[5] = s[4];
+			s[4] = s[3] + t1;
+			s[3] = s[2];
+			s[2] = s[1];
+			s[1] = s[0];
+			s[0] = t1 + t2;
+		}
+
+		for (i = 0; i < 8; i++)
+			h[i] += s[i];
+	}
+}
+
+#ifdef RKHASH_SHANI
+/* Four rounds per group g, scheduling the message for group g + 1..3 */
+#define RKSHA256_GROUP(g) do { \
+	k = _mm_add_epi32(m[(g) & 3], \
+			_mm_load_si128((const __m128i *)(rksha256_k + 4 * (g)))); \
+	cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k); \
+	if ((g) >= 3 && (g) <= 14) { \
+		m[((g) + 1) & 3] = _mm_add_epi32(m[((g) + 1) & 3], \
+				_mm_alignr_epi8(m[(g) & 3], m[((g) - 1) & 3], 4)); \
+		m[((g) + 1) & 3] = _mm_sha256msg2_epu32(m[((g) + 1) & 3], \
+				m[(g) & 3]); \
+	} \
+	abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(k, 0x0e)); \
+	if ((g) >= 1 && (g) <= 12) \
+		m[((g) - 1) & 3] = _mm_sha256msg1_epu32(m[((g) - 1) & 3], \
+				m[(g) & 3]); \
+} while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static inline void rksha256_blocks_ni(uint32_t *h, const unsigned char *p,
+		size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+			0x0405060700010203ULL);
+	__m128i abef, cdgh, abef_save, cdgh_save, k, t, m[4];
+	int i;
+
+	/* h[] is ABCD EFGH; the instructions want ABEF and CDGH */
+	t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h), 0xb1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(h + 4)),
+			0x1b);
+	abef = _mm_alignr_epi8(t, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, t, 0xf0);
+
+	for (; n; n--, p += 64) {
+		abef_save = abef;
+		cdgh_save = cdgh;
+
+		for (i = 0; i < 4; i++)
+			m[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)(p + 16 * i)), mask);
+
+		RKSHA256_GROUP(0);
+		RKSHA256_GROUP(1);
+		RKSHA256_GROUP(2);
+		RKSHA256_GROUP(3);
+		RKSHA256_GROUP(4);
+		RKSHA256_GROUP(5);
+		RKSHA256_GROUP(6);
+		RKSHA256_GROUP(7);
+		RKSHA256_GROUP(8);
+		RKSHA256_GROUP(9);
+		RKSHA256_GROUP(10);
+		RKSHA256_GROUP(11);
+		RKSHA256_GROUP(12);
+		RKSHA256_GROUP(13);
+		RKSHA256_GROUP(14);
+		RKSHA256_GROUP(15);
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	}
+
+	t = _mm_shuffle_epi32(abef, 0x1b);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+	_mm_storeu_si128((__m128i *)h, _mm_blend_epi16(t, cdgh, 0xf0));
+	_mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(cdgh, t, 8));
+}
+#endif
+
+static inline void rksha256_blocks(uint32_t *h, const unsigned char *p,
+		size_t n)
+{
+#ifdef RKHASH_SHANI
+	if (rkhash_shani()) {
+		rksha256_blocks_ni(h, p, n);
+		return;
+	}
+#endif
+	rksha256_blocks_c(h, p, n);
+}
+
+static inline void rksha256_init(struct rksha256 *ctx)
+{
+	ctx->h[0] = 0x6a09e667;
+	ctx->h[1] = 0xbb67ae85;
+	ctx->h[2] = 0x3c6ef372;
+	ctx->h[3] = 0xa54ff53a;
+	ctx->h[4] = 0x510e527f;
+	ctx->h[5] = 0x9b05688c;
+	ctx->h[6] = 0x1f83d9ab;
+	ctx->h[7] = 0x5be0cd19;
+	ctx->len = 0;
+}
+
+static inline void rksha256_update(struct rksha256 *ctx, const void *data,
+		size_t len)
+{
+	rkhash_update(ctx->h, &ctx->len, ctx->buf, data, len, rksha256_blocks);
+}
+
+static inline void rksha256_final(unsigned char *md, struct rksha256 *ctx)
+{
+	int i;
+
+	rkhash_pad(ctx->h, ctx->len, ctx->buf, 1, rksha256_blocks);
+	for (i = 0; i < 8; i++)
+		rkhash_put_be32(md + 4 * i, ctx->h[i]);
+}
+
+static inline void rksha256(const void *data, size_t len, unsigned char *md)
+{
+	struct rksha256 ctx;
+
+	rksha256_init(&ctx);
+	rksha256_update(&ctx, data, len);
+	rksha256_final(md, &ctx);
+}
+
+#endif // _RKHASH_H
@@ -0,0 +1,522 @@
+#ifndef _RKIO_H
+#define _RKIO_H
+
+/*
+ * Streaming read/checksum/write loop, engine selected with --io=:
+ *
+ *   sync	pread/pwrite of RKIO_BLOCK sized chunks (default)
+ *   uring	io_uring with RKIO_DEPTH registered buffers; reads and writes
+ *		stay in flight while the previous chunk is being checksummed
+ *
+ * rkio_stream() reads len bytes at in_off, hands each chunk to fn in file
+ * order and, if out_fd >= 0, writes it at out_off.  io_uring is driven with
+ * raw syscalls; when the kernel refuses it the sync engine is used instead.
+ * There is a single ring per process, so rkio_stream() is not thread safe.
+ *
+ * --cache=drop keeps multi-GB images out of the page cache: inputs are
+ * read with SEQUENTIAL/NOREUSE hints and dropped once consumed, outputs are
+ * pushed to disk with sync_file_range() and dropped RKIO_BEHIND bytes
+ * behind the write front.  Data written outside rkio_stream() is reported
+ * with rkio_written(), and rkio_flush() finishes a file before close.
+ *
+ * --io-budget=<MB/s> caps the bytes read plus written per second; rkd
+ * uses it to give every job its share of the disks.  rkio_consumed() and
+ * rkio_written() may be called from worker threads, so the budget is
+ * shared under rkio_budget_lock.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "rkstats.h"
+
+#define RKIO_BLOCK	(1 << 20)
+#define RKIO_DEPTH	4
+#define RKIO_BEHIND	(8 << 20)
+
+enum {
+	RKIO_SYNC,
+	RKIO_URING,
+};
+
+enum {
+	RKIO_FREE,
+	RKIO_READ,
+	RKIO_READY,
+	RKIO_WRITE,
+};
+
+typedef int (*rkio_fn)(void *ctx, const unsigned char *buf, size_t len);
+
+struct rkio_slot {
+	int state;
+	uint64_t pos;		/* offset of the chunk in the stream */
+	size_t len;
+	size_t done;		/* bytes of the current read/write completed */
+};
+
+static struct {
+	int engine;
+	int requested;
+	int initialized;
+	int drop_cache;
+	double budget;		/* bytes per second, 0 for unlimited */
+	double budget_start;
+	unsigned long long budget_bytes;
+	unsigned char *bufs[RKIO_DEPTH];
+
+	int ring_fd;
+	int fixed;
+	unsigned int pending;
+	unsigned int inflight;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	unsigned long long bytes;
+	unsigned long long ops;
+	unsigned long long depth_sum;
+	unsigned long long depth_samples;
+	unsigned int depth_max;
+	double elapsed;
+} rkio;
+
+static pthread_mutex_t rkio_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline const char *rkio_engine_name(void)
+{
+	return rkio.engine == RKIO_URING ? "uring" : "sync";
+}
+
+static inline double rkio_avg_depth(void)
+{
+	return rkio.depth_samples ?
+			(double)rkio.depth_sum / rkio.depth_samples : 1.0;
+}
+
+static inline void rkio_report_json(FILE *fp)
+{
+	fprintf(fp, "\"io\":{\"engine\":\"%s\",\"ops\":%llu,\"bytes\":%llu,"
+			"\"queue_depth_avg\":%.2f,\"queue_depth_max\":%u,"
+			"\"throughput_mbs\":%.3f},", rkio_engine_name(), rkio.ops,
+			rkio.bytes, rkio_avg_depth(), rkio.depth_max,
+			rkio.elapsed > 0 ? rkio.bytes / rkio.elapsed / 1e6 : 0.0);
+}
+
+static inline void rkio_report(void)
+{
+	if (rkstats.enabled || !rkio.initialized)
+		return;
+
+	fprintf(stderr, "io: %s, %llu ops, queue depth avg %.2f max %u, %.1f MB/s\n",
+			rkio_engine_name(), rkio.ops, rkio_avg_depth(), rkio.depth_max,
+			rkio.elapsed > 0 ? rkio.bytes / rkio.elapsed / 1e6 : 0.0);
+}
+
+/* Sleep whenever the job runs ahead of its --io-budget */
+static inline void rkio_throttle(uint64_t len)
+{
+	struct timespec ts;
+	double ahead;
+
+	if (rkio.budget <= 0)
+		return;
+
+	/* every thread sleeps until the bytes of all of them are paid for */
+	pthread_mutex_lock(&rkio_budget_lock);
+	if (rkio.budget_start == 0)
+		rkio.budget_start = rkstats_now();
+	rkio.budget_bytes += len;
+	ahead = rkio.budget_bytes / rkio.budget - (rkstats_now() - rkio.budget_start);
+	pthread_mutex_unlock(&rkio_budget_lock);
+
+	if (ahead > 0) {
+		ts.tv_sec = ahead;
+		ts.tv_nsec = (ahead - ts.tv_sec) * 1e9;
+		while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+			;
+	}
+}
+
+/* Input chunk consumed: with --cache=drop its pages are not needed again */
+static inline void rkio_consumed(int fd, uint64_t off, uint64_t len)
+{
+	rkio_throttle(len);
+	if (rkio.drop_cache)
+		posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+}
+
+/*
+ * Output range written: start its writeback right away, then wait for the
+ * range RKIO_BEHIND bytes back and drop it, so dirty and cached pages stay
+ * bounded and the disk sees a steady stream instead of one big flush.
+ */
+static inline void rkio_written(int fd, uint64_t off, uint64_t len)
+{
+	rkio_throttle(len);
+	if (!rkio.drop_cache || !len)
+		return;
+
+	sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE);
+	if (off >= RKIO_BEHIND) {
+		sync_file_range(fd, off - RKIO_BEHIND, len,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, off - RKIO_BEHIND, len, POSIX_FADV_DONTNEED);
+	}
+}
+
+/* Write back and drop whatever is left of an output file */
+static inline int rkio_flush(int fd)
+{
+	if (!rkio.drop_cache)
+		return 0;
+
+	if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+		return -1;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	return 0;
+}
+
+static inline int rkio_uring_setup(void)
+{
+	struct io_uring_params p;
+	struct iovec iov[RKIO_DEPTH];
+	size_t sq_len, cq_len;
+	unsigned char *sq, *cq;
+	void *sqes;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	rkio.ring_fd = syscall(__NR_io_uring_setup, 2 * RKIO_DEPTH, &p);
+	if (rkio.ring_fd < 0)
+		return -1;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			rkio.ring_fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, rkio.ring_fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			rkio.ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		goto fail;
+
+	rkio.sq_head = (unsigned int *)(sq + p.sq_off.head);
+	rkio.sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	rkio.sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	rkio.sq_array = (unsigned int *)(sq + p.sq_off.array);
+	rkio.cq_head = (unsigned int *)(cq + p.cq_off.head);
+	rkio.cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	rkio.cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	rkio.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	rkio.sqes = sqes;
+
+	/* registered buffers save the page pinning on every request */
+	for (i = 0; i < RKIO_DEPTH; i++) {
+		iov[i].iov_base = rkio.bufs[i];
+		iov[i].iov_len = RKIO_BLOCK;
+	}
+	rkio.fixed = syscall(__NR_io_uring_register, rkio.ring_fd,
+			IORING_REGISTER_BUFFERS, iov, RKIO_DEPTH) == 0;
+
+	return 0;
+
+fail:
+	close(rkio.ring_fd);
+	rkio.ring_fd = -1;
+	return -1;
+}
+
+static inline int rkio_init(void)
+{
+	int i;
+
+	if (rkio.initialized)
+		return 0;
+
+	for (i = 0; i < RKIO_DEPTH; i++) {
+		if (posix_memalign((void **)&rkio.bufs[i], 4096, RKIO_BLOCK) != 0)
+			return -1;
+		if (rkio.requested != RKIO_URING)
+			break;
+	}
+
+	rkio.engine = RKIO_SYNC;
+	if (rkio.requested == RKIO_URING) {
+		if (rkio_uring_setup() == 0)
+			rkio.engine = RKIO_URING;
+		else
+			fprintf(stderr, "io_uring unavailable (%s), using synchronous I/O\n",
+					strerror(errno));
+	}
+
+	rkio.initialized = 1;
+	return 0;
+}
+
+static inline void rkio_queue(int write, int fd, unsigned int slot,
+		unsigned char *buf, size_t len, uint64_t off)
+{
+	unsigned int tail = *rkio.sq_tail;
+	unsigned int idx = tail & *rkio.sq_mask;
+	struct io_uring_sqe *sqe = &rkio.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (rkio.fixed)
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->buf_index = slot;
+	sqe->user_data = slot;
+
+	rkio.sq_array[idx] = idx;
+	__atomic_store_n(rkio.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	rkio.pending++;
+	rkio.inflight++;
+	rkio.ops++;
+}
+
+/* Submit queued requests and wait for at least one completion */
+static inline int rkio_wait(void)
+{
+	int ret;
+
+	rkio.depth_sum += rkio.inflight;
+	rkio.depth_samples++;
+	if (rkio.inflight > rkio.depth_max)
+		rkio.depth_max = rkio.inflight;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, rkio.ring_fd, rkio.pending, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		return -1;
+
+	rkio.pending -= (unsigned int)ret < rkio.pending ? (unsigned int)ret :
+			rkio.pending;
+	return 0;
+}
+
+static inline int rkio_uring_stream(int in_fd, uint64_t in_off, uint64_t len,
+		int out_fd, uint64_t out_off, rkio_fn fn, void *ctx)
+{
+	struct rkio_slot slots[RKIO_DEPTH];
+	unsigned int head = 0, tail = 0;
+	uint64_t queued = 0;
+	int err = 0;
+
+	memset(slots, 0, sizeof(slots));
+
+	for (;;) {
+		unsigned int h, t;
+
+		/* consume finished reads in stream order */
+		while (!err && slots[head].state == RKIO_READY) {
+			struct rkio_slot *s = &slots[head];
+
+			if (fn && fn(ctx, rkio.bufs[head], s->len) != 0) {
+				err = 1;
+				break;
+			}
+			rkio_consumed(in_fd, in_off + s->pos, s->len);
+
+			if (out_fd >= 0) {
+				s->state = RKIO_WRITE;
+				s->done = 0;
+				rkio_queue(1, out_fd, head, rkio.bufs[head], s->len,
+						out_off + s->pos);
+			} else {
+				s->state = RKIO_FREE;
+			}
+			head = (head + 1) % RKIO_DEPTH;
+		}
+
+		/* refill every free buffer with the next chunk */
+		while (!err && queued < len && slots[tail].state == RKIO_FREE) {
+			struct rkio_slot *s = &slots[tail];
+
+			s->state = RKIO_READ;
+			s->pos = queued;
+			s->len = len - queued < RKIO_BLOCK ? len - queued : RKIO_BLOCK;
+			s->done = 0;
+			rkio_queue(0, in_fd, tail, rkio.bufs[tail], s->len,
+					in_off + queued);
+			queued += s->len;
+			tail = (tail + 1) % RKIO_DEPTH;
+		}
+
+		if (!rkio.inflight)
+			break;
+
+		if (rkio_wait() != 0)
+			return -1;
+
+		h = *rkio.cq_head;
+		t = __atomic_load_n(rkio.cq_tail, __ATOMIC_ACQUIRE);
+		for (; h != t; h++) {
+			struct io_uring_cqe *cqe = &rkio.cqes[h & *rkio.cq_mask];
+			unsigned int slot = cqe->user_data;
+			struct rkio_slot *s = &slots[slot];
+			int write = s->state == RKIO_WRITE;
+
+			rkio.inflight--;
+
+			if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+				cqe->res = 0;
+			} else if (cqe->res <= 0) {
+				errno = cqe->res ? -cqe->res : EIO;
+				err = 1;
+				s->state = RKIO_FREE;
+				continue;
+			}
+
+			s->done += cqe->res;
+			if (s->done < s->len) {
+				/* short transfer: queue the remainder */
+				rkio_queue(write, write ? out_fd : in_fd, slot,
+						rkio.bufs[slot] + s->done, s->len - s->done,
+						(write ? out_off : in_off) + s->pos + s->done);
+				continue;
+			}
+
+			if (write)
+				rkio_written(out_fd, out_off + s->pos, s->len);
+			s->state = write ? RKIO_FREE : RKIO_READY;
+		}
+		__atomic_store_n(rkio.cq_head, h, __ATOMIC_RELEASE);
+	}
+
+	return err ? -1 : 0;
+}
+
+static inline int rkio_sync_stream(int in_fd, uint64_t in_off, uint64_t len,
+		int out_fd, uint64_t out_off, rkio_fn fn, void *ctx)
+{
+	unsigned char *buf = rkio.bufs[0];
+	uint64_t done = 0;
+
+	while (done < len) {
+		size_t n = len - done < RKIO_BLOCK ? len - done : RKIO_BLOCK;
+		ssize_t r = pread(in_fd, buf, n, in_off + done);
+		size_t w;
+
+		rkio.ops++;
+		if (r <= 0) {
+			if (r == 0)
+				errno = EIO;
+			return -1;
+		}
+
+		if (fn && fn(ctx, buf, r) != 0)
+			return -1;
+		rkio_consumed(in_fd, in_off + done, r);
+
+		for (w = 0; out_fd >= 0 && w < (size_t)r; ) {
+			ssize_t k = pwrite(out_fd, buf + w, r - w, out_off + done + w);
+
+			rkio.ops++;
+			if (k <= 0)
+				return -1;
+			w += k;
+		}
+		if (out_fd >= 0)
+			rkio_written(out_fd, out_off + done, r);
+
+		done += r;
+	}
+
+	return 0;
+}
+
+static inline int rkio_stream(int in_fd, uint64_t in_off, uint64_t len,
+		int out_fd, uint64_t out_off, rkio_fn fn, void *ctx)
+{
+	double start;
+	int ret;
+
+	if (rkio_init() != 0)
+		return -1;
+
+	if (rkio.drop_cache) {
+		posix_fadvise(in_fd, in_off, len, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(in_fd, in_off, len, POSIX_FADV_NOREUSE);
+	}
+
+	start = rkstats_now();
+	if (rkio.engine == RKIO_URING)
+		ret = rkio_uring_stream(in_fd, in_off, len, out_fd, out_off, fn, ctx);
+	else
+		ret = rkio_sync_stream(in_fd, in_off, len, out_fd, out_off, fn, ctx);
+	rkio.elapsed += rkstats_now() - start;
+	if (ret == 0)
+		rkio.bytes += len;
+
+	return ret;
+}
+
+/*
+ * Strip --io=<engine>, --io-budget= and --cache=drop from the argument
+ * list; like rkstats_parse_args() it must run before the tools look at
+ * their arguments.
+ */
+static inline void rkio_parse_args(int *argc, char **argv)
+{
+	int i, j;
+
+	for (i = j = 1; i < *argc; i++) {
+		if (strcmp(argv[i], "--io=uring") == 0)
+			rkio.requested = RKIO_URING;
+		else if (strcmp(argv[i], "--io=sync") == 0)
+			rkio.requested = RKIO_SYNC;
+		else if (strcmp(argv[i], "--cache=drop") == 0)
+			rkio.drop_cache = 1;
+		else if (strncmp(argv[i], "--io-budget=", 12) == 0)
+			rkio.budget = atof(argv[i] + 12) * 1e6;
+		else
+			argv[j++] = argv[i];
+	}
+	argv[j] = NULL;
+	*argc = j;
+
+	rkstats.report = rkio_report_json;
+	if (rkio.requested == RKIO_URING)
+		atexit(rkio_report);
+}
+
+#endif // _RKIO_H
@@ -0,0 +1,406 @@
+#ifndef _RKMANIFEST_H
+#define _RKMANIFEST_H
+
+/*
+ * Release manifest, enabled with --manifest=<file>.
+ *
+ * Tools declare the sections of an output (RKAF parts, boot image parts,
+ * ...) with rkmanifest_section(), then pass every byte of the output, in
+ * file order, to rkmanifest_update() as it is written.  The bytes are
+ * copied into a small ring and each digest (rkcrc, md5, sha256, or the
+ * subset given with --manifest-digests=) is computed by its own thread
+ * over the whole file and every section it overlaps, so outputs are never
+ * read back.  rkmanifest_write() stores the results as JSON.
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rkcrc.h"
+#include "rkhash.h"
+#include "rkstats.h"
+
+#define RKMANIFEST_CHUNK	(1 << 20)
+#define RKMANIFEST_SLOTS	4
+#define RKMANIFEST_SECTIONS	64
+#define RKMANIFEST_FILES	16
+
+enum {
+	RKMANIFEST_RKCRC,
+	RKMANIFEST_MD5,
+	RKMANIFEST_SHA256,
+	RKMANIFEST_DIGESTS
+};
+
+static const char *const rkmanifest_names[RKMANIFEST_DIGESTS] = {
+	"rkcrc", "md5", "sha256"
+};
+
+struct rkmanifest_range {
+	char name[64];
+	uint64_t offset;
+	uint64_t size;
+	unsigned int rkcrc;
+	struct rkmd5 md5;
+	struct rksha256 sha256;
+	char hex[RKMANIFEST_DIGESTS][2 * RKSHA256_DIGEST_LENGTH + 1];
+};
+
+struct rkmanifest_file {
+	char path[PATH_MAX];
+	struct rkmanifest_range whole;
+	struct rkmanifest_range sections[RKMANIFEST_SECTIONS];
+	int num_sections;
+};
+
+static struct {
+	const char *path;
+	unsigned int digests;	/* bit mask of RKMANIFEST_* */
+	struct rkmanifest_file files[RKMANIFEST_FILES];
+	int num_files;
+	struct rkmanifest_file *cur;
+
+	/* ring of chunks shared by the digest threads */
+	pthread_t threads[RKMANIFEST_DIGESTS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *buf[RKMANIFEST_SLOTS];
+	size_t len[RKMANIFEST_SLOTS];
+	uint64_t off[RKMANIFEST_SLOTS];
+	unsigned long long published;
+	unsigned long long done[RKMANIFEST_DIGESTS];
+	size_t fill;
+	uint64_t pos;
+	int stop;
+} rkmanifest;
+
+static inline void rkmanifest_digest(int d, struct rkmanifest_range *r,
+		const unsigned char *buf, size_t len)
+{
+	switch (d) {
+	case RKMANIFEST_RKCRC:
+		RKCRC(r->rkcrc, buf, len);
+		break;
+	case RKMANIFEST_MD5:
+		rkmd5_update(&r->md5, buf, len);
+		break;
+	case RKMANIFEST_SHA256:
+		rksha256_update(&r->sha256, buf, len);
+		break;
+	}
+}
+
+static inline void *rkmanifest_worker(void *arg)
+{
+	int d = (int)(intptr_t)arg, i;
+	unsigned long long k;
+
+	for (;;) {
+		pthread_mutex_lock(&rkmanifest.lock);
+		while (rkmanifest.done[d] == rkmanifest.published && !rkmanifest.stop)
+			pthread_cond_wait(&rkmanifest.cond, &rkmanifest.lock);
+		if (rkmanifest.done[d] == rkmanifest.published) {
+			pthread_mutex_unlock(&rkmanifest.lock);
+			break;
+		}
+		k = rkmanifest.done[d] % RKMANIFEST_SLOTS;
+		pthread_mutex_unlock(&rkmanifest.lock);
+
+		/* the slot is not refilled before every thread marked it done */
+		rkmanifest_digest(d, &rkmanifest.cur->whole, rkmanifest.buf[k],
+				rkmanifest.len[k]);
+		for (i = 0; i < rkmanifest.cur->num_sections; i++) {
+			struct rkmanifest_range *r = &rkmanifest.cur->sections[i];
+			uint64_t a = rkmanifest.off[k], b = a + rkmanifest.len[k];
+
+			if (r->offset > a)
+				a = r->offset;
+			if (r->offset + r->size < b)
+				b = r->offset + r->size;
+			if (a < b)
+				rkmanifest_digest(d, r, rkmanifest.buf[k] + a -
+						rkmanifest.off[k], b - a);
+		}
+
+		pthread_mutex_lock(&rkmanifest.lock);
+		rkmanifest.done[d]++;
+		pthread_cond_broadcast(&rkmanifest.cond);
+		pthread_mutex_unlock(&rkmanifest.lock);
+	}
+
+	return NULL;
+}
+
+static inline void rkmanifest_range_init(struct rkmanifest_range *r,
+		const char *name, uint64_t offset, uint64_t size)
+{
+	memset(r, 0, sizeof(*r));
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->offset = offset;
+	r->size = size;
+	rkmd5_init(&r->md5);
+	rksha256_init(&r->sha256);
+}
+
+/* Start collecting digests for the output at path; -1 when disabled */
+static inline int rkmanifest_begin(const char *path)
+{
+	int d;
+
+	if (!rkmanifest.path || rkmanifest.cur
+			|| rkmanifest.num_files >= RKMANIFEST_FILES)
+		return -1;
+
+	for (d = 0; d < RKMANIFEST_SLOTS; d++)
+		if (!rkmanifest.buf[d]
+				&& !(rkmanifest.buf[d] = malloc(RKMANIFEST_CHUNK)))
+			return -1;
+
+	rkmanifest.cur = &rkmanifest.files[rkmanifest.num_files];
+	memset(rkmanifest.cur, 0, sizeof(*rkmanifest.cur));
+	snprintf(rkmanifest.cur->path, sizeof(rkmanifest.cur->path), "%s", path);
+	rkmanifest_range_init(&rkmanifest.cur->whole, "", 0, 0);
+
+	pthread_mutex_init(&rkmanifest.lock, NULL);
+	pthread_cond_init(&rkmanifest.cond, NULL);
+	rkmanifest.published = 0;
+	rkmanifest.fill = 0;
+	rkmanifest.pos = 0;
+	rkmanifest.stop = 0;
+	for (d = 0; d < RKMANIFEST_DIGESTS; d++) {
+		rkmanifest.done[d] = 0;
+		if (rkmanifest.digests & (1U << d))
+			pthread_create(&rkmanifest.threads[d], NULL, rkmanifest_worker,
+					(void *)(intptr_t)d);
+	}
+
+	return 0;
+}
+
+/* Declare a byte range of the current output; before the first update */
+static inline void rkmanifest_section(const char *name, uint64_t offset,
+		uint64_t size)
+{
+	struct rkmanifest_file *f = rkmanifest.cur;
+
+	if (!f || f->num_sections >= RKMANIFEST_SECTIONS)
+		return;
+
+	rkmanifest_range_init(&f->sections[f->num_sections++], name, offset, size);
+}
+
+static inline void rkmanifest_publish(void)
+{
+	unsigned long long oldest;
+	int d;
+
+	if (rkmanifest.fill == 0)
+		return;
+
+	pthread_mutex_lock(&rkmanifest.lock);
+	rkmanifest.len[rkmanifest.published % RKMANIFEST_SLOTS] = rkmanifest.fill;
+	rkmanifest.off[rkmanifest.published % RKMANIFEST_SLOTS] =
+			rkmanifest.pos - rkmanifest.fill;
+	rkmanifest.published++;
+	pthread_cond_broadcast(&rkmanifest.cond);
+
+	/* wait until the next slot has been hashed by every thread */
+	for (;;) {
+		oldest = rkmanifest.published;
+		for (d = 0; d < RKMANIFEST_DIGESTS; d++)
+			if ((rkmanifest.digests & (1U << d)) && rkmanifest.done[d] < oldest)
+				oldest = rkmanifest.done[d];
+		if (rkmanifest.published - oldest < RKMANIFEST_SLOTS)
+			break;
+		pthread_cond_wait(&rkmanifest.cond, &rkmanifest.lock);
+	}
+	pthread_mutex_unlock(&rkmanifest.lock);
+
+	rkmanifest.fill = 0;
+}
+
+/* The next len bytes of the current output */
+static inline void rkmanifest_update(const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	if (!rkmanifest.cur)
+		return;
+
+	while (len) {
+		unsigned char *slot = rkmanifest.buf[rkmanifest.published %
+				RKMANIFEST_SLOTS];
+		size_t n = RKMANIFEST_CHUNK - rkmanifest.fill;
+
+		if (n > len)
+			n = len;
+		if (p)
+			memcpy(slot + rkmanifest.fill, p, n);
+		else
+			memset(slot + rkmanifest.fill, 0, n);
+		rkmanifest.fill += n;
+		rkmanifest.pos += n;
+		len -= n;
+		if (p)
+			p += n;
+
+		if (rkmanifest.fill == RKMANIFEST_CHUNK)
+			rkmanifest_publish();
+	}
+}
+
+/* len zero bytes (padding) */
+static inline void rkmanifest_zero(uint64_t len)
+{
+	while (len) {
+		size_t n = len < RKMANIFEST_CHUNK ? len : RKMANIFEST_CHUNK;
+
+		rkmanifest_update(NULL, n);
+		len -= n;
+	}
+}
+
+static inline void rkmanifest_hex(char *out, const unsigned char *md,
+		size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(out + 2 * i, "%02x", md[i]);
+}
+
+static inline void rkmanifest_final(struct rkmanifest_range *r)
+{
+	unsigned char md[RKSHA256_DIGEST_LENGTH];
+
+	snprintf(r->hex[RKMANIFEST_RKCRC], sizeof(r->hex[0]), "%08x", r->rkcrc);
+	rkmd5_final(md, &r->md5);
+	rkmanifest_hex(r->hex[RKMANIFEST_MD5], md, RKMD5_DIGEST_LENGTH);
+	rksha256_final(md, &r->sha256);
+	rkmanifest_hex(r->hex[RKMANIFEST_SHA256], md, RKSHA256_DIGEST_LENGTH);
+}
+
+/* Drain the digest threads; the output must be complete */
+static inline int rkmanifest_finish(void)
+{
+	struct rkmanifest_file *f = rkmanifest.cur;
+	int d, i, ret = 0;
+
+	if (!f)
+		return -1;
+
+	rkmanifest_publish();
+	pthread_mutex_lock(&rkmanifest.lock);
+	rkmanifest.stop = 1;
+	pthread_cond_broadcast(&rkmanifest.cond);
+	pthread_mutex_unlock(&rkmanifest.lock);
+	for (d = 0; d < RKMANIFEST_DIGESTS; d++)
+		if (rkmanifest.digests & (1U << d))
+			pthread_join(rkmanifest.threads[d], NULL);
+	pthread_cond_destroy(&rkmanifest.cond);
+	pthread_mutex_destroy(&rkmanifest.lock);
+
+	f->whole.size = rkmanifest.pos;
+	rkmanifest_final(&f->whole);
+	for (i = 0; i < f->num_sections; i++) {
+		if (f->sections[i].offset + f->sections[i].size > rkmanifest.pos) {
+			fprintf(stderr, "manifest: section %s past the end of %s\n",
+					f->sections[i].name, f->path);
+			ret = -1;
+		}
+		rkmanifest_final(&f->sections[i]);
+	}
+
+	rkmanifest.cur = NULL;
+	if (ret == 0)
+		rkmanifest.num_files++;
+	return ret;
+}
+
+static inline void rkmanifest_json_range(FILE *fp,
+		const struct rkmanifest_range *r)
+{
+	int d;
+
+	fprintf(fp, "\"offset\":%llu,\"size\":%llu",
+			(unsigned long long)r->offset, (unsigned long long)r->size);
+	for (d = 0; d < RKMANIFEST_DIGESTS; d++)
+		if (rkmanifest.digests & (1U << d))
+			fprintf(fp, ",\"%s\":\"%s\"", rkmanifest_names[d], r->hex[d]);
+}
+
+/* Write every finished output to the manifest file */
+static inline int rkmanifest_write(void)
+{
+	char tmp[PATH_MAX + 8];
+	FILE *fp;
+	int i, j;
+
+	if (!rkmanifest.path)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", rkmanifest.path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "Can't create manifest %s\n", rkmanifest.path);
+		return -1;
+	}
+
+	fprintf(fp, "{\"artifacts\":[");
+	for (i = 0; i < rkmanifest.num_files; i++) {
+		struct rkmanifest_file *f = &rkmanifest.files[i];
+
+		fprintf(fp, "%s\n{\"path\":", i ? "," : "");
+		rkstats_json_string(fp, f->path);
+		fputc(',', fp);
+		rkmanifest_json_range(fp, &f->whole);
+		fprintf(fp, ",\"sections\":[");
+		for (j = 0; j < f->num_sections; j++) {
+			fprintf(fp, "%s\n  {\"name\":", j ? "," : "");
+			rkstats_json_string(fp, f->sections[j].name);
+			fputc(',', fp);
+			rkmanifest_json_range(fp, &f->sections[j]);
+			fputc('}', fp);
+		}
+		fprintf(fp, "]}");
+	}
+	fprintf(fp, "]}\n");
+
+	if (fclose(fp) != 0 || rename(tmp, rkmanifest.path) != 0) {
+		unlink(tmp);
+		fprintf(stderr, "Can't write manifest %s\n", rkmanifest.path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Strip --manifest=<file> and --manifest-digests=<list> from argv */
+static inline void rkmanifest_parse_args(int *argc, char **argv)
+{
+	int i, j, d;
+
+	rkmanifest.digests = (1U << RKMANIFEST_DIGESTS) - 1;
+	for (i = j = 1; i < *argc; i++) {
+		if (strncmp(argv[i], "--manifest=", 11) == 0) {
+			rkmanifest.path = argv[i] + 11;
+		} else if (strncmp(argv[i], "--manifest-digests=", 19) == 0) {
+			rkmanifest.digests = 0;
+			for (d = 0; d < RKMANIFEST_DIGESTS; d++)
+				if (strstr(argv[i] + 19, rkmanifest_names[d]))
+					rkmanifest.digests |= 1U << d;
+		} else {
+			argv[j++] = argv[i];
+		}
+	}
+	argv[j] = NULL;
+	*argc = j;
+
+	if (rkmanifest.path && *rkmanifest.path == '\0')
+		rkmanifest.path = NULL;
+}
+
+#endif // _RKMANIFEST_H
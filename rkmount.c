@@ -0,0 +1,549 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <linux/fuse.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "rkafp.h"
+#include "rkrom.h"
+
+/*
+ * rkmount presents the parts of an RKAF update image, or the loader, the
+ * inner image and its parts of an RKFW firmware, as read-only files under
+ * a mountpoint, so e.g. the system partition can be loop mounted straight
+ * from the packed file.  Every file is a pos/size window of the image; the
+ * parameter header and crc are trimmed the way -unpack does.
+ *
+ * Like rkio's io_uring engine it needs no library: the FUSE protocol is
+ * spoken directly on /dev/fuse, which makes mounting a root-only affair.
+ * Reads are answered by splicing the image range through a pipe into
+ * /dev/fuse, so the data is never copied to user space; when the kernel
+ * refuses, pread() and writev() are used instead.  Several threads serve
+ * requests, and unmounting the mountpoint ends the process.
+ */
+
+#define MOUNT_MAX_FILES		(2 + 2 * 16)
+#define MOUNT_MAX_THREADS	16
+#define MOUNT_MAX_READ		(1 << 20)
+#define MOUNT_BUF_SIZE		(64 << 10)	/* requests carry no data */
+#define MOUNT_TTL		3600		/* the image never changes */
+
+struct mount_file {
+	char name[64];
+	uint64_t pos;
+	uint64_t size;
+};
+
+static struct {
+	int fd;			/* /dev/fuse */
+	int img;
+	const char *mountpoint;
+	struct stat st;
+	struct mount_file files[MOUNT_MAX_FILES];
+	unsigned int num_files;
+	int splice_broken;
+} mnt;
+
+static void add_file(const char *name, uint64_t pos, uint64_t size)
+{
+	struct mount_file *f = &mnt.files[mnt.num_files];
+	unsigned int i;
+	char *p;
+
+	if (mnt.num_files == MOUNT_MAX_FILES || !*name)
+		return;
+
+	snprintf(f->name, sizeof(f->name), "%s", name);
+	for (p = f->name; *p; p++)
+		if (*p == '/')
+			*p = '_';
+
+	for (i = 0; i < mnt.num_files; i++)
+		if (strcmp(mnt.files[i].name, f->name) == 0)
+			return;
+
+	f->pos = pos;
+	f->size = size;
+	mnt.num_files++;
+}
+
+/* Add the parts of the RKAF image at base, len bytes long */
+static int add_rkaf(uint64_t base, uint64_t len)
+{
+	struct update_header header;
+	struct update_ext ext;
+	unsigned int i;
+
+	if (len < sizeof(header) || pread(mnt.img, &header, sizeof(header), base)
+			!= (ssize_t)sizeof(header)
+			|| strncmp(header.magic, RKAFP_MAGIC, sizeof(header.magic)) != 0)
+		return -1;
+
+	if (rkafp_get_ext(&header, &ext) > RKAFP_EXT_VERSION
+			|| header.num_parts > 16) {
+		fprintf(stderr, "Unsupported RKAF header\n");
+		return -1;
+	}
+
+	for (i = 0; i < header.num_parts; i++) {
+		struct update_part *part = &header.parts[i];
+		struct update_extent extent;
+
+		if (strcmp(part->filename, "SELF") == 0)
+			continue;
+
+		rkafp_get_extent(&header, i, &extent);
+		if (memcmp(part->name, "parameter", 9) == 0) {
+			if (extent.size < 12)
+				continue;
+			extent.pos += 8;
+			extent.size -= 12;
+		}
+
+		if (extent.pos > len || extent.size > len - extent.pos) {
+			fprintf(stderr, "Invalid part: %s\n", part->name);
+			continue;
+		}
+
+		part->name[sizeof(part->name) - 1] = '\0';
+		add_file(part->name, base + extent.pos, extent.size);
+	}
+
+	return 0;
+}
+
+static int load_image(const char *path)
+{
+	struct rkfw_header fw;
+	uint64_t size;
+
+	if ((mnt.img = open(path, O_RDONLY)) < 0 || fstat(mnt.img, &mnt.st) != 0) {
+		fprintf(stderr, "can't open file \"%s\": %s\n", path, strerror(errno));
+		return -1;
+	}
+	size = mnt.st.st_size;
+
+	if (size >= sizeof(fw) && pread(mnt.img, &fw, sizeof(fw), 0)
+			== (ssize_t)sizeof(fw)
+			&& memcmp(fw.head_code, RK_ROM_HEADER_CODE, 4) == 0) {
+		if ((uint64_t)fw.loader_offset + fw.loader_length > size
+				|| (uint64_t)fw.image_offset + fw.image_length > size) {
+			fprintf(stderr, "%s: RKFW loader or image out of bounds\n", path);
+			return -1;
+		}
+		add_file("loader", fw.loader_offset, fw.loader_length);
+		add_file("image", fw.image_offset, fw.image_length);
+		add_rkaf(fw.image_offset, fw.image_length);
+		return 0;
+	}
+
+	if (add_rkaf(0, size) != 0) {
+		fprintf(stderr, "%s: neither RKFW nor RKAF\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int reply(uint64_t unique, int error, const void *data, size_t len)
+{
+	struct fuse_out_header out;
+	struct iovec iov[2] = {
+		{ &out, sizeof(out) },
+		{ (void *)data, len },
+	};
+
+	out.len = sizeof(out) + (error ? 0 : len);
+	out.error = -error;
+	out.unique = unique;
+
+	if (writev(mnt.fd, iov, error || !len ? 1 : 2) < 0 && errno != ENOENT)
+		return -1;
+	return 0;
+}
+
+static void fill_attr(struct fuse_attr *attr, uint64_t ino)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = ino;
+	attr->uid = mnt.st.st_uid;
+	attr->gid = mnt.st.st_gid;
+	attr->atime = attr->mtime = attr->ctime = mnt.st.st_mtime;
+	attr->blksize = 4096;
+
+	if (ino == FUSE_ROOT_ID) {
+		attr->mode = S_IFDIR | 0555;
+		attr->nlink = 2;
+	} else {
+		attr->mode = S_IFREG | 0444;
+		attr->nlink = 1;
+		attr->size = mnt.files[ino - 2].size;
+		attr->blocks = (attr->size + 511) / 512;
+	}
+}
+
+static int lookup(struct fuse_in_header *in, const char *name)
+{
+	struct fuse_entry_out entry;
+	unsigned int i;
+
+	if (in->nodeid != FUSE_ROOT_ID)
+		return reply(in->unique, ENOTDIR, NULL, 0);
+
+	for (i = 0; i < mnt.num_files; i++)
+		if (strcmp(mnt.files[i].name, name) == 0)
+			break;
+	if (i == mnt.num_files)
+		return reply(in->unique, ENOENT, NULL, 0);
+
+	memset(&entry, 0, sizeof(entry));
+	entry.nodeid = i + 2;
+	entry.entry_valid = MOUNT_TTL;
+	entry.attr_valid = MOUNT_TTL;
+	fill_attr(&entry.attr, entry.nodeid);
+
+	return reply(in->unique, 0, &entry, sizeof(entry));
+}
+
+static int read_dir(struct fuse_in_header *in, const struct fuse_read_in *arg)
+{
+	char buf[MOUNT_BUF_SIZE];
+	size_t len = 0, max = arg->size < sizeof(buf) ? arg->size : sizeof(buf);
+	uint64_t i;
+
+	for (i = arg->offset; i < mnt.num_files + 2; i++) {
+		struct fuse_dirent *d = (struct fuse_dirent *)(buf + len);
+		const char *name = i == 0 ? "." : i == 1 ? ".." : mnt.files[i - 2].name;
+		size_t size = FUSE_DIRENT_SIZE(&(struct fuse_dirent){
+				.namelen = strlen(name) });
+
+		if (len + size > max)
+			break;
+
+		memset(d, 0, size);
+		d->ino = i < 2 ? FUSE_ROOT_ID : i;
+		d->off = i + 1;
+		d->namelen = strlen(name);
+		d->type = i < 2 ? DT_DIR : DT_REG;
+		memcpy(d->name, name, d->namelen);
+		len += size;
+	}
+
+	return reply(in->unique, 0, buf, len);
+}
+
+/* Move len bytes at off from the image into /dev/fuse through a pipe */
+static int splice_read(int pipefd[2], uint64_t unique, off_t off, size_t len)
+{
+	struct fuse_out_header out = { sizeof(out) + len, 0, unique };
+	struct iovec iov = { &out, sizeof(out) };
+	char sink[4096];
+	size_t done = 0;
+	ssize_t n;
+
+	if (vmsplice(pipefd[1], &iov, 1, 0) != (ssize_t)sizeof(out))
+		return -1;
+
+	while (done < len) {
+		n = splice(mnt.img, &off, pipefd[1], NULL, len - done, SPLICE_F_MOVE);
+		if (n <= 0)
+			goto drain;
+		done += n;
+	}
+
+	for (done = 0; done < sizeof(out) + len; done += n)
+		if ((n = splice(pipefd[0], NULL, mnt.fd, NULL,
+				sizeof(out) + len - done, SPLICE_F_MOVE)) <= 0)
+			goto drain;
+
+	return 0;
+
+drain:
+	/* nothing reached /dev/fuse yet: empty the pipe and fall back */
+	fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+	while (read(pipefd[0], sink, sizeof(sink)) > 0)
+		;
+	fcntl(pipefd[0], F_SETFL, 0);
+	return -1;
+}
+
+static int read_file(struct fuse_in_header *in, const struct fuse_read_in *arg,
+		int pipefd[2], long pipe_size, unsigned char *data)
+{
+	struct mount_file *f;
+	size_t len;
+	ssize_t n;
+
+	if (in->nodeid < 2 || in->nodeid - 2 >= mnt.num_files)
+		return reply(in->unique, EISDIR, NULL, 0);
+
+	f = &mnt.files[in->nodeid - 2];
+	if (arg->offset >= f->size)
+		return reply(in->unique, 0, NULL, 0);
+
+	len = arg->size < MOUNT_MAX_READ ? arg->size : MOUNT_MAX_READ;
+	if (len > f->size - arg->offset)
+		len = f->size - arg->offset;
+
+	/* a reply must fit the pipe, or splicing into it would block */
+	if (!mnt.splice_broken && sizeof(struct fuse_out_header) + len
+			<= (size_t)pipe_size) {
+		if (splice_read(pipefd, in->unique, f->pos + arg->offset, len) == 0)
+			return 0;
+		mnt.splice_broken = 1;
+	}
+
+	if ((n = pread(mnt.img, data, len, f->pos + arg->offset)) < 0)
+		return reply(in->unique, errno, NULL, 0);
+	return reply(in->unique, 0, data, n);
+}
+
+static int init_conn(struct fuse_in_header *in, const struct fuse_init_in *arg)
+{
+	struct fuse_init_out out;
+
+	if (arg->major != FUSE_KERNEL_VERSION) {
+		fprintf(stderr, "Unsupported FUSE protocol %u.%u\n", arg->major,
+				arg->minor);
+		return reply(in->unique, EPROTO, NULL, 0);
+	}
+
+	memset(&out, 0, sizeof(out));
+	out.major = FUSE_KERNEL_VERSION;
+	out.minor = arg->minor < FUSE_KERNEL_MINOR_VERSION ? arg->minor
+			: FUSE_KERNEL_MINOR_VERSION;
+	out.max_readahead = arg->max_readahead;
+	out.flags = arg->flags & (FUSE_ASYNC_READ | FUSE_MAX_PAGES
+			| FUSE_SPLICE_READ);
+	out.max_background = 16;
+	out.congestion_threshold = 12;
+	out.max_write = 4096;
+	out.max_pages = MOUNT_MAX_READ / 4096;
+
+	return reply(in->unique, 0, &out, out.minor < 23 ? 24 : sizeof(out));
+}
+
+static void *mount_worker(void *arg)
+{
+	unsigned char *buf = malloc(MOUNT_BUF_SIZE), *data = NULL;
+	int pipefd[2] = { -1, -1 };
+	long pipe_size = 0;
+
+	(void)arg;
+	if (!buf)
+		return NULL;
+	if (pipe(pipefd) == 0) {
+		pipe_size = fcntl(pipefd[1], F_SETPIPE_SZ, MOUNT_MAX_READ + 4096);
+		if (pipe_size < 0)
+			pipe_size = fcntl(pipefd[1], F_GETPIPE_SZ);
+	}
+
+	for (;;) {
+		struct fuse_in_header *in = (struct fuse_in_header *)buf;
+		void *body = buf + sizeof(*in);
+		ssize_t n = read(mnt.fd, buf, MOUNT_BUF_SIZE);
+		int ret = 0;
+
+		if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == ENOENT))
+			continue;
+		if (n < (ssize_t)sizeof(*in))
+			break;		/* ENODEV: unmounted */
+
+		switch (in->opcode) {
+		case FUSE_INIT:
+			ret = init_conn(in, body);
+			break;
+		case FUSE_LOOKUP:
+			ret = lookup(in, body);
+			break;
+		case FUSE_GETATTR: {
+			struct fuse_attr_out out;
+
+			memset(&out, 0, sizeof(out));
+			out.attr_valid = MOUNT_TTL;
+			if (in->nodeid != FUSE_ROOT_ID
+					&& in->nodeid - 2 >= mnt.num_files) {
+				ret = reply(in->unique, ENOENT, NULL, 0);
+				break;
+			}
+			fill_attr(&out.attr, in->nodeid);
+			ret = reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_OPEN:
+		case FUSE_OPENDIR: {
+			const struct fuse_open_in *open_in = body;
+			struct fuse_open_out out;
+
+			if ((open_in->flags & O_ACCMODE) != O_RDONLY) {
+				ret = reply(in->unique, EROFS, NULL, 0);
+				break;
+			}
+			memset(&out, 0, sizeof(out));
+			out.open_flags = in->opcode == FUSE_OPEN ? FOPEN_KEEP_CACHE
+					: FOPEN_CACHE_DIR;
+			ret = reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_READ:
+			if (!data && (data = malloc(MOUNT_MAX_READ)) == NULL) {
+				ret = reply(in->unique, ENOMEM, NULL, 0);
+				break;
+			}
+			ret = read_file(in, body, pipefd, pipe_size, data);
+			break;
+		case FUSE_READDIR:
+			ret = read_dir(in, body);
+			break;
+		case FUSE_ACCESS:
+			ret = reply(in->unique, ((const struct fuse_access_in *)body)->mask
+					& W_OK ? EROFS : 0, NULL, 0);
+			break;
+		case FUSE_STATFS: {
+			struct fuse_statfs_out out;
+
+			memset(&out, 0, sizeof(out));
+			out.st.bsize = out.st.frsize = 4096;
+			out.st.blocks = (mnt.st.st_size + 4095) / 4096;
+			out.st.files = mnt.num_files;
+			out.st.namelen = sizeof(mnt.files[0].name) - 1;
+			ret = reply(in->unique, 0, &out, sizeof(out));
+			break;
+		}
+		case FUSE_RELEASE:
+		case FUSE_RELEASEDIR:
+		case FUSE_FLUSH:
+		case FUSE_DESTROY:
+			ret = reply(in->unique, 0, NULL, 0);
+			break;
+		case FUSE_FORGET:
+		case FUSE_BATCH_FORGET:
+		case FUSE_INTERRUPT:
+			break;
+		default:
+			ret = reply(in->unique, ENOSYS, NULL, 0);
+			break;
+		}
+
+		if (ret != 0 && errno == ENODEV)
+			break;
+	}
+
+	free(data);
+	free(buf);
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	return NULL;
+}
+
+static void unmount(int sig)
+{
+	(void)sig;
+	umount2(mnt.mountpoint, MNT_DETACH);
+}
+
+void usage(const char *appname) {
+	const char *p = strrchr(appname, '/');
+	p = p ? p + 1 : appname;
+
+	printf("USAGE:\n"
+			"\t%s [-f] [-j threads] <image> <mountpoint>\n"
+			"Example:\n"
+			"\t%s update.img /mnt/fw\tparts as files, read-only\n"
+			"\tmount -o loop,ro /mnt/fw/system /mnt/system\n"
+			"\tumount /mnt/fw\n"
+			"Options:\n"
+			"\t-f\tstay in the foreground\n"
+			"\t-j\tthreads serving requests (default: 4)\n",
+			p, p);
+}
+
+int main(int argc, char **argv) {
+	pthread_t threads[MOUNT_MAX_THREADS];
+	long nthreads = 4;
+	int i, t, foreground = 0;
+	char opts[128];
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-f") == 0) {
+			foreground = 1;
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			nthreads = atol(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - i != 2 || nthreads < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (nthreads > MOUNT_MAX_THREADS)
+		nthreads = MOUNT_MAX_THREADS;
+	mnt.mountpoint = argv[i + 1];
+
+	if (load_image(argv[i]) != 0)
+		return 1;
+
+	if ((mnt.fd = open("/dev/fuse", O_RDWR | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "Can't open /dev/fuse: %s\n", strerror(errno));
+		return 1;
+	}
+
+	snprintf(opts, sizeof(opts), "fd=%d,rootmode=40000,user_id=%u,group_id=%u,"
+			"allow_other", mnt.fd, getuid(), getgid());
+	if (mount("rkmount", mnt.mountpoint, "fuse.rkmount",
+			MS_RDONLY | MS_NOSUID | MS_NODEV, opts) != 0) {
+		fprintf(stderr, "Can't mount %s: %s\n", mnt.mountpoint,
+				strerror(errno));
+		return 1;
+	}
+
+	if (!foreground) {
+		pid_t pid = fork();
+
+		if (pid < 0) {
+			umount2(mnt.mountpoint, MNT_DETACH);
+			return 1;
+		}
+		if (pid > 0)
+			return 0;
+
+		setsid();
+		if (chdir("/") != 0 || !freopen("/dev/null", "r", stdin)
+				|| !freopen("/dev/null", "w", stdout)
+				|| !freopen("/dev/null", "w", stderr))
+			return 1;
+	}
+
+	signal(SIGINT, unmount);
+	signal(SIGTERM, unmount);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (t = 0; t < nthreads; t++)
+		if (pthread_create(&threads[t], NULL, mount_worker, NULL) != 0)
+			break;
+	nthreads = t;
+	for (t = 0; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+
+	return 0;
+}
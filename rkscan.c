@@ -0,0 +1,658 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bootimg.h"
+#include "rkafp.h"
+#include "rkcrc.h"
+#include "rkhash.h"
+#include "rkrom.h"
+#include "rkstats.h"
+
+/*
+ * rkscan walks directory trees and reports what every file is: an RKFW
+ * firmware, an RKAF update image or an Android boot image, told apart by
+ * magic.  The default pass only reads headers and checks every size and
+ * offset against the file length, so terabytes can be triaged quickly; -v
+ * also verifies the RKFW md5 trailer, the RKAF crc (inside RKFW files in
+ * the same read pass) and the boot image sha1 id.  One NDJSON line is
+ * written per file.
+ *
+ * nftw() feeds a work-stealing pool: each worker has its own queue, takes
+ * new files from its back and steals from the front of the others' when it
+ * runs dry.  Open files (-o) and read buffers (-m, in MB) are budgets
+ * shared by all workers, and the walk stalls while the queues are full.
+ */
+
+#define SCAN_MAX_THREADS	64
+#define SCAN_QUEUE_SIZE		256
+#define SCAN_BUF_SIZE		(1 << 20)
+#define SCAN_WALK_FDS		16
+
+struct scan_queue {
+	pthread_mutex_t lock;
+	char *paths[SCAN_QUEUE_SIZE];
+	unsigned int head;	/* thieves take from here */
+	unsigned int tail;	/* the owner pushes and pops here */
+};
+
+struct scan_budget {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	long avail;
+};
+
+struct scan_file {
+	const char *path;
+	uint64_t size;
+	FILE *out;		/* members of the NDJSON line */
+	char *out_buf;
+	size_t out_len;
+	FILE *err;		/* the "errors" array */
+	char *err_buf;
+	size_t err_len;
+	int nerr;
+	unsigned char *buf;	/* SCAN_BUF_SIZE, taken from the memory budget */
+};
+
+static struct {
+	struct scan_queue queues[SCAN_MAX_THREADS];
+	unsigned int num_threads;
+	unsigned int next_queue;
+	unsigned int queued;
+	int walk_done;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct scan_budget files;
+	struct scan_budget memory;
+	pthread_mutex_t output;
+	int deep;
+	unsigned long long scanned;
+	unsigned long long failed;
+} scan;
+
+static void budget_init(struct scan_budget *b, long avail)
+{
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->cond, NULL);
+	b->avail = avail;
+}
+
+static void budget_take(struct scan_budget *b)
+{
+	pthread_mutex_lock(&b->lock);
+	while (b->avail <= 0)
+		pthread_cond_wait(&b->cond, &b->lock);
+	b->avail--;
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void budget_give(struct scan_budget *b)
+{
+	pthread_mutex_lock(&b->lock);
+	b->avail++;
+	pthread_cond_signal(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+}
+
+static void scan_error(struct scan_file *sf, const char *fmt, ...)
+{
+	char msg[256];
+	va_list ap;
+
+	/* messages may quote header bytes: escape them like any field */
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	fprintf(sf->err, "%s", sf->nerr++ ? "," : "");
+	rkstats_json_string(sf->err, msg);
+}
+
+/* Read len bytes at off through the shared buffer, in SCAN_BUF_SIZE pieces */
+static int scan_stream(int fd, uint64_t off, uint64_t len, unsigned char *buf,
+		int (*fn)(void *ctx, const unsigned char *buf, size_t len), void *ctx)
+{
+	while (len) {
+		size_t n = len < SCAN_BUF_SIZE ? len : SCAN_BUF_SIZE;
+		ssize_t r = pread(fd, buf, n, off);
+
+		if (r <= 0)
+			return -1;
+		if (fn(ctx, buf, r) != 0)
+			return -1;
+		off += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// format checks
+
+struct image_sums {
+	struct rkmd5 md5_ctx;
+	uint64_t pos;
+	uint64_t md5_len;
+	uint64_t crc_start;
+	uint64_t crc_len;	/* 0: no RKAF crc to check */
+	unsigned int crc;
+	unsigned int image_crc;
+	char md5sum[33];
+};
+
+static int overlap(uint64_t off, uint64_t size, uint64_t pos, size_t len,
+		uint64_t *a, uint64_t *b)
+{
+	*a = off > pos ? off : pos;
+	*b = off + size < pos + len ? off + size : pos + len;
+	return *a < *b;
+}
+
+static int sums_chunk(void *arg, const unsigned char *buf, size_t len)
+{
+	struct image_sums *s = arg;
+	uint64_t a, b;
+
+	if (overlap(0, s->md5_len, s->pos, len, &a, &b))
+		rkmd5_update(&s->md5_ctx, buf + a - s->pos, b - a);
+	if (overlap(s->md5_len, 32, s->pos, len, &a, &b))
+		memcpy(s->md5sum + a - s->md5_len, buf + a - s->pos, b - a);
+
+	if (s->crc_len && overlap(s->crc_start, s->crc_len, s->pos, len, &a, &b))
+		RKCRC(s->image_crc, buf + a - s->pos, b - a);
+	if (s->crc_len && overlap(s->crc_start + s->crc_len, 4, s->pos, len, &a, &b))
+		memcpy((char *)&s->crc + a - s->crc_start - s->crc_len,
+				buf + a - s->pos, b - a);
+
+	s->pos += len;
+	return 0;
+}
+
+/* Check an RKAF header found at base; returns its crc length or 0 */
+static uint64_t check_rkaf(struct scan_file *sf, const struct update_header *h,
+		uint64_t avail)
+{
+	struct update_extent extents[16];
+	struct update_ext ext;
+	uint64_t length;
+	unsigned int i, j;
+
+	if (rkafp_get_ext(h, &ext) > RKAFP_EXT_VERSION) {
+		scan_error(sf, "rkaf: unsupported large image extension %u",
+				ext.version);
+		return 0;
+	}
+	if (h->num_parts > 16) {
+		scan_error(sf, "rkaf: %u parts", h->num_parts);
+		return 0;
+	}
+
+	length = rkafp_get_length(h);
+	fprintf(sf->out, ",\"rkaf\":{\"length\":%" PRIu64 ",\"model\":", length);
+	rkstats_json_strn(sf->out, h->model, sizeof(h->model));
+	fprintf(sf->out, ",\"parts\":[");
+	for (i = 0; i < h->num_parts; i++) {
+		struct update_extent *e = &extents[i];
+
+		rkafp_get_extent(h, i, e);
+		fprintf(sf->out, "%s{\"name\":", i ? "," : "");
+		rkstats_json_strn(sf->out, h->parts[i].name, sizeof(h->parts[i].name));
+		fprintf(sf->out, ",\"pos\":%" PRIu64 ",\"size\":%" PRIu64 "}",
+				e->pos, e->size);
+
+		if (strcmp(h->parts[i].filename, "SELF") == 0 || e->size == 0)
+			continue;
+		if (e->pos < sizeof(*h) || e->pos > length || e->size > length - e->pos)
+			scan_error(sf, "rkaf: part %.32s out of bounds", h->parts[i].name);
+		for (j = 0; j < i; j++)
+			if (strcmp(h->parts[j].filename, "SELF") != 0 && extents[j].size
+					&& e->pos < extents[j].pos + extents[j].size
+					&& extents[j].pos < e->pos + e->size)
+				scan_error(sf, "rkaf: part %.32s overlaps %.32s",
+						h->parts[i].name, h->parts[j].name);
+	}
+	fprintf(sf->out, "]}");
+
+	if (length > avail || avail - length < 4) {
+		scan_error(sf, "rkaf: length %" PRIu64 " past the end (%" PRIu64 ")",
+				length, avail);
+		return 0;
+	}
+
+	return length;
+}
+
+static void scan_rkaf(struct scan_file *sf, int fd, const unsigned char *head)
+{
+	struct update_header h;
+	struct image_sums s;
+
+	memcpy(&h, head, sizeof(h));
+	memset(&s, 0, sizeof(s));
+	s.crc_len = check_rkaf(sf, &h, sf->size);
+	if (!scan.deep || !s.crc_len)
+		return;
+
+	s.md5_len = 0;
+	if (scan_stream(fd, 0, s.crc_len + 4, sf->buf, sums_chunk, &s) != 0) {
+		scan_error(sf, "read error");
+		return;
+	}
+	fprintf(sf->out, ",\"rkcrc\":\"%08x\"", s.image_crc);
+	if (s.crc != s.image_crc)
+		scan_error(sf, "rkaf: crc %08x, trailer %08x", s.image_crc, s.crc);
+}
+
+static void scan_rkfw(struct scan_file *sf, int fd, const unsigned char *head)
+{
+	struct rkfw_header fw;
+	struct update_header h;
+	struct image_sums s;
+	unsigned char md[RKMD5_DIGEST_LENGTH];
+	char md5sum[33];
+	uint64_t image_end;
+	int i;
+
+	memcpy(&fw, head, sizeof(fw));
+	memset(&s, 0, sizeof(s));
+	fprintf(sf->out, ",\"rkfw\":{\"chip\":\"0x%x\",\"version\":\"%x.%x.%x\","
+			"\"date\":\"%04u-%02u-%02u %02u:%02u:%02u\","
+			"\"loader_length\":%u,\"image_length\":%u}",
+			fw.chip, (fw.version >> 24) & 0xFF, (fw.version >> 16) & 0xFF,
+			fw.version & 0xFFFF, fw.year, fw.month, fw.day, fw.hour,
+			fw.minute, fw.second, fw.loader_length, fw.image_length);
+
+	if ((uint64_t)fw.loader_offset + fw.loader_length > sf->size) {
+		scan_error(sf, "rkfw: loader out of bounds");
+		return;
+	}
+	image_end = (uint64_t)fw.image_offset + fw.image_length;
+	if (image_end > sf->size) {
+		scan_error(sf, "rkfw: image out of bounds");
+		return;
+	}
+	if (sf->size - image_end != 32)
+		scan_error(sf, "rkfw: %" PRIu64 " bytes after the image, expected a"
+				" 32 byte md5", sf->size - image_end);
+
+	if (fw.image_length >= sizeof(h) && pread(fd, &h, sizeof(h),
+			fw.image_offset) == sizeof(h)
+			&& memcmp(h.magic, RKAFP_MAGIC, sizeof(h.magic)) == 0) {
+		s.crc_start = fw.image_offset;
+		s.crc_len = check_rkaf(sf, &h, fw.image_length);
+	} else {
+		scan_error(sf, "rkfw: image is not RKAF");
+	}
+
+	if (!scan.deep || sf->size - image_end != 32)
+		return;
+
+	/* one pass: outer md5 and inner crc from the same reads */
+	s.md5_len = image_end;
+	rkmd5_init(&s.md5_ctx);
+	if (scan_stream(fd, 0, sf->size, sf->buf, sums_chunk, &s) != 0) {
+		scan_error(sf, "read error");
+		return;
+	}
+
+	rkmd5_final(md, &s.md5_ctx);
+	for (i = 0; i < RKMD5_DIGEST_LENGTH; i++)
+		sprintf(md5sum + 2 * i, "%02x", md[i]);
+	fprintf(sf->out, ",\"md5\":\"%s\"", md5sum);
+	if (strncasecmp(md5sum, s.md5sum, 32) != 0)
+		scan_error(sf, "rkfw: md5 mismatch");
+
+	if (s.crc_len) {
+		fprintf(sf->out, ",\"rkcrc\":\"%08x\"", s.image_crc);
+		if (s.crc != s.image_crc)
+			scan_error(sf, "rkaf: crc %08x, trailer %08x", s.image_crc, s.crc);
+	}
+}
+
+static int sha1_chunk(void *ctx, const unsigned char *buf, size_t len)
+{
+	rksha1_update(ctx, buf, len);
+	return 0;
+}
+
+static void scan_boot(struct scan_file *sf, int fd, const unsigned char *head)
+{
+	boot_img_hdr hdr;
+	uint64_t page, off[3], end;
+	unsigned size[3];
+	unsigned char sha[RKSHA1_DIGEST_LENGTH];
+	struct rksha1 ctx;
+	int i;
+
+	memcpy(&hdr, head, sizeof(hdr));
+	fprintf(sf->out, ",\"boot\":{\"kernel_size\":%u,\"ramdisk_size\":%u,"
+			"\"second_size\":%u,\"page_size\":%u,\"name\":",
+			hdr.kernel_size, hdr.ramdisk_size, hdr.second_size, hdr.page_size);
+	rkstats_json_strn(sf->out, (char *)hdr.name, sizeof(hdr.name));
+	fprintf(sf->out, ",\"cmdline\":");
+	rkstats_json_strn(sf->out, (char *)hdr.cmdline, sizeof(hdr.cmdline));
+	fputc('}', sf->out);
+
+	page = hdr.page_size;
+	if (page < 2048 || page > 65536 || (page & (page - 1))) {
+		scan_error(sf, "boot: page size %u", hdr.page_size);
+		return;
+	}
+
+	size[0] = hdr.kernel_size;
+	size[1] = hdr.ramdisk_size;
+	size[2] = hdr.second_size;
+	end = page;
+	for (i = 0; i < 3; i++) {
+		off[i] = end;
+		end += ((uint64_t)size[i] + page - 1) / page * page;
+		if (off[i] + size[i] > sf->size) {
+			scan_error(sf, "boot: %s out of bounds",
+					i == 0 ? "kernel" : i == 1 ? "ramdisk" : "second");
+			return;
+		}
+	}
+	if (hdr.kernel_size == 0)
+		scan_error(sf, "boot: no kernel");
+
+	if (!scan.deep)
+		return;
+
+	/* the id mkbootimg stores: each part followed by its size */
+	rksha1_init(&ctx);
+	for (i = 0; i < 3; i++) {
+		if (scan_stream(fd, off[i], size[i], sf->buf, sha1_chunk, &ctx) != 0) {
+			scan_error(sf, "read error");
+			return;
+		}
+		rksha1_update(&ctx, &size[i], sizeof(size[i]));
+	}
+	rksha1_update(&ctx, &hdr.tags_addr, 4 + 4 + 4 + 4 + 16 + 512);
+	rksha1_final(sha, &ctx);
+
+	fprintf(sf->out, ",\"sha1_ok\":%s",
+			memcmp(sha, hdr.id, sizeof(sha)) == 0 ? "true" : "false");
+	if (memcmp(sha, hdr.id, sizeof(sha)) != 0)
+		scan_error(sf, "boot: sha1 id mismatch");
+}
+
+static void scan_path(const char *path)
+{
+	unsigned char head[sizeof(struct update_header)];
+	struct scan_file sf;
+	const char *format = "unknown";
+	struct stat st;
+	ssize_t n = -1;
+	int fd;
+
+	memset(&sf, 0, sizeof(sf));
+	sf.path = path;
+	sf.out = open_memstream(&sf.out_buf, &sf.out_len);
+	sf.err = open_memstream(&sf.err_buf, &sf.err_len);
+	if (!sf.out || !sf.err)
+		goto out;
+
+	budget_take(&scan.files);
+	fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		scan_error(&sf, "open: %s", strerror(errno));
+	} else {
+		sf.size = st.st_size;
+		memset(head, 0, sizeof(head));
+		n = pread(fd, head, sizeof(head), 0);
+		if (n < 0)
+			scan_error(&sf, "read: %s", strerror(errno));
+	}
+
+	if (scan.deep && n > 0) {
+		budget_take(&scan.memory);
+		sf.buf = malloc(SCAN_BUF_SIZE);
+		if (!sf.buf) {
+			budget_give(&scan.memory);
+			scan_error(&sf, "out of memory");
+			n = -1;
+		}
+	}
+
+	/* the magic decides the format; a short header is a truncated file */
+	if (n >= 4 && memcmp(head, RKAFP_MAGIC, 4) == 0) {
+		format = "rkaf";
+		if (n < (ssize_t)sizeof(struct update_header))
+			scan_error(&sf, "rkaf: truncated header");
+		else
+			scan_rkaf(&sf, fd, head);
+	} else if (n >= 4 && memcmp(head, "RKFW", 4) == 0) {
+		format = "rkfw";
+		if (n < (ssize_t)sizeof(struct rkfw_header))
+			scan_error(&sf, "rkfw: truncated header");
+		else
+			scan_rkfw(&sf, fd, head);
+	} else if (n >= BOOT_MAGIC_SIZE
+			&& memcmp(head, BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0) {
+		format = "boot";
+		if (n < (ssize_t)sizeof(boot_img_hdr))
+			scan_error(&sf, "boot: truncated header");
+		else
+			scan_boot(&sf, fd, head);
+	}
+
+	if (sf.buf) {
+		free(sf.buf);
+		budget_give(&scan.memory);
+	}
+	if (fd >= 0)
+		close(fd);
+	budget_give(&scan.files);
+
+	fclose(sf.out);
+	fclose(sf.err);
+	sf.out = sf.err = NULL;
+
+	pthread_mutex_lock(&scan.output);
+	printf("{\"path\":");
+	rkstats_json_string(stdout, path);
+	printf(",\"size\":%" PRIu64 ",\"format\":\"%s\"%s,\"ok\":%s,\"errors\":[%s]}\n",
+			sf.size, format, sf.out_buf, sf.nerr ? "false" : "true",
+			sf.err_buf);
+	scan.scanned++;
+	if (sf.nerr)
+		scan.failed++;
+	pthread_mutex_unlock(&scan.output);
+
+out:
+	if (sf.out)
+		fclose(sf.out);
+	if (sf.err)
+		fclose(sf.err);
+	free(sf.out_buf);
+	free(sf.err_buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// work-stealing pool
+
+static char *queue_pop(struct scan_queue *q, int steal)
+{
+	char *path = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head != q->tail) {
+		if (steal)
+			path = q->paths[q->head++ % SCAN_QUEUE_SIZE];
+		else
+			path = q->paths[--q->tail % SCAN_QUEUE_SIZE];
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return path;
+}
+
+static void *scan_worker(void *arg)
+{
+	unsigned int self = (uintptr_t)arg, i;
+	char *path;
+
+	for (;;) {
+		path = queue_pop(&scan.queues[self], 0);
+		for (i = 1; !path && i < scan.num_threads; i++)
+			path = queue_pop(&scan.queues[(self + i) % scan.num_threads], 1);
+
+		pthread_mutex_lock(&scan.lock);
+		if (!path) {
+			if (scan.queued == 0 && scan.walk_done) {
+				pthread_mutex_unlock(&scan.lock);
+				break;
+			}
+			/* woken by the walk adding work or finishing */
+			if (scan.queued == 0)
+				pthread_cond_wait(&scan.cond, &scan.lock);
+			pthread_mutex_unlock(&scan.lock);
+			continue;
+		}
+		scan.queued--;
+		pthread_cond_broadcast(&scan.cond);
+		pthread_mutex_unlock(&scan.lock);
+
+		scan_path(path);
+		free(path);
+	}
+
+	return NULL;
+}
+
+static int walk_file(const char *path, const struct stat *st, int type,
+		struct FTW *ftw)
+{
+	struct scan_queue *q;
+	char *copy;
+
+	(void)ftw;
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+	if ((copy = strdup(path)) == NULL)
+		return -1;
+
+	/* bound the queued paths: wait until the workers catch up */
+	pthread_mutex_lock(&scan.lock);
+	while (scan.queued >= scan.num_threads * (SCAN_QUEUE_SIZE - 1))
+		pthread_cond_wait(&scan.cond, &scan.lock);
+
+	for (;;) {
+		q = &scan.queues[scan.next_queue++ % scan.num_threads];
+		pthread_mutex_lock(&q->lock);
+		if (q->tail - q->head < SCAN_QUEUE_SIZE)
+			break;
+		pthread_mutex_unlock(&q->lock);
+	}
+	q->paths[q->tail++ % SCAN_QUEUE_SIZE] = copy;
+	pthread_mutex_unlock(&q->lock);
+
+	scan.queued++;
+	pthread_cond_broadcast(&scan.cond);
+	pthread_mutex_unlock(&scan.lock);
+
+	return 0;
+}
+
+void usage(const char *appname) {
+	const char *p = strrchr(appname, '/');
+	p = p ? p + 1 : appname;
+
+	printf("USAGE:\n"
+			"\t%s [--stats=json] [-v] [-j threads] [-o max open files]"
+			" [-m max MB] <path>...\n"
+			"Example:\n"
+			"\t%s /srv/firmware > scan.ndjson\tidentify and check headers\n"
+			"\t%s -v -j 8 /srv/firmware\talso verify md5, crc and sha1 id\n"
+			"Options:\n"
+			"\t-v\tdeep verification: read every file in full\n"
+			"\t-o\topen files shared by all workers (default: 64)\n"
+			"\t-m\tread buffer memory in MB (default: 64, 1 MB per deep check)\n",
+			p, p, p);
+}
+
+int main(int argc, char **argv) {
+	pthread_t threads[SCAN_MAX_THREADS];
+	long max_open = 64, max_mem = 64, nthreads = 0;
+	unsigned int t;
+	int i, ret = 0;
+
+	rkstats_parse_args(&argc, argv);
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-v") == 0) {
+			scan.deep = 1;
+		} else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			nthreads = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			max_open = atol(argv[++i]);
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			max_mem = atol(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (i == argc || max_open < 1 || max_mem < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > SCAN_MAX_THREADS)
+		nthreads = SCAN_MAX_THREADS;
+	scan.num_threads = nthreads;
+
+	pthread_mutex_init(&scan.lock, NULL);
+	pthread_cond_init(&scan.cond, NULL);
+	pthread_mutex_init(&scan.output, NULL);
+	budget_init(&scan.files, max_open);
+	budget_init(&scan.memory, max_mem * (1 << 20) / SCAN_BUF_SIZE);
+	for (t = 0; t < scan.num_threads; t++)
+		pthread_mutex_init(&scan.queues[t].lock, NULL);
+
+	rkstats_begin("scan");
+	for (t = 0; t < scan.num_threads; t++)
+		pthread_create(&threads[t], NULL, scan_worker, (void *)(uintptr_t)t);
+
+	for (; i < argc; i++) {
+		if (nftw(argv[i], walk_file, SCAN_WALK_FDS, FTW_PHYS) != 0) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			ret = 1;
+		}
+	}
+
+	pthread_mutex_lock(&scan.lock);
+	scan.walk_done = 1;
+	pthread_cond_broadcast(&scan.cond);
+	pthread_mutex_unlock(&scan.lock);
+
+	for (t = 0; t < scan.num_threads; t++)
+		pthread_join(threads[t], NULL);
+	rkstats_end(scan.scanned);
+
+	fflush(stdout);
+	fprintf(stderr, "%llu files, %llu failed\n", scan.scanned, scan.failed);
+
+	return ret || scan.failed ? 1 : 0;
+}
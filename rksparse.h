@@ -0,0 +1,47 @@
+#ifndef _RKSPARSE_H
+#define _RKSPARSE_H
+
+#include <stdint.h>
+
+/*
+ * Android sparse image format (afptool -sparse / -unsparse), as accepted
+ * by fastboot and most flashers.
+ *
+ * A sparse_header is followed by total_chunks chunks, each a sparse_chunk
+ * header plus total_sz - chunk_hdr_sz bytes of payload.  SPARSE_RAW carries
+ * chunk_sz blocks of data, SPARSE_FILL one 32-bit word repeated over
+ * chunk_sz blocks, SPARSE_DONT_CARE nothing; SPARSE_CRC32 holds the crc of
+ * the data so far and covers no blocks.  All fields are little-endian.
+ */
+
+#define SPARSE_MAGIC		0xed26ff3a
+#define SPARSE_MAJOR		1
+#define SPARSE_BLOCK		4096
+
+enum {
+	SPARSE_RAW = 0xCAC1,
+	SPARSE_FILL = 0xCAC2,
+	SPARSE_DONT_CARE = 0xCAC3,
+	SPARSE_CRC32 = 0xCAC4,
+};
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	uint16_t file_hdr_sz;
+	uint16_t chunk_hdr_sz;
+	uint32_t blk_sz;
+	uint32_t total_blks;	/* of the expanded image */
+	uint32_t total_chunks;
+	uint32_t image_checksum;
+};
+
+struct sparse_chunk {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	uint32_t chunk_sz;	/* in blocks */
+	uint32_t total_sz;	/* in bytes, header included */
+};
+
+#endif // _RKSPARSE_H
@@ -0,0 +1,286 @@
+#ifndef _RKSTATS_H
+#define _RKSTATS_H
+
+/*
+ * Per-phase performance statistics, enabled with --stats=json.
+ *
+ * Tools bracket their phases with rkstats_begin()/rkstats_end(); the I/O
+ * counters of every phase are the deltas of /proc/self/io (rchar, wchar,
+ * syscr, syscw) so they cover stdio and raw syscalls alike.  The report is
+ * written to stderr as a single JSON line when the process exits.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#define RKSTATS_MAX_PHASES	128
+#define RKSTATS_MAX_DEPTH	8
+
+struct rkstats_io {
+	unsigned long long rchar;
+	unsigned long long wchar;
+	unsigned long long syscr;
+	unsigned long long syscw;
+};
+
+struct rkstats_phase {
+	char name[64];
+	int depth;
+	double start;
+	double elapsed;
+	unsigned long long bytes;
+	struct rkstats_io io;
+};
+
+static struct {
+	int enabled;
+	const char *tool;
+	double start;
+	struct rkstats_io io;
+	int num_phases;
+	struct rkstats_phase phases[RKSTATS_MAX_PHASES];
+	int depth;
+	int stack[RKSTATS_MAX_DEPTH];
+	int overflow;
+	void (*report)(FILE *fp);	/* extra "key":value, members */
+} rkstats;
+
+static inline double rkstats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void rkstats_read_io(struct rkstats_io *io)
+{
+	char key[32];
+	unsigned long long val;
+	FILE *fp;
+
+	memset(io, 0, sizeof(*io));
+	if ((fp = fopen("/proc/self/io", "r")) == NULL)
+		return;
+
+	while (fscanf(fp, "%31[^:]: %llu\n", key, &val) == 2) {
+		if (strcmp(key, "rchar") == 0)
+			io->rchar = val;
+		else if (strcmp(key, "wchar") == 0)
+			io->wchar = val;
+		else if (strcmp(key, "syscr") == 0)
+			io->syscr = val;
+		else if (strcmp(key, "syscw") == 0)
+			io->syscw = val;
+	}
+
+	fclose(fp);
+}
+
+static inline void rkstats_io_delta(struct rkstats_io *io,
+		const struct rkstats_io *from)
+{
+	struct rkstats_io cur;
+
+	rkstats_read_io(&cur);
+	io->rchar = cur.rchar - from->rchar;
+	io->wchar = cur.wchar - from->wchar;
+	io->syscr = cur.syscr - from->syscr;
+	io->syscw = cur.syscw - from->syscw;
+}
+
+/* Length of the valid UTF-8 sequence at s (at most n bytes), or 0 */
+static inline size_t rkstats_utf8_len(const unsigned char *s, size_t n)
+{
+	size_t len, i;
+
+	if (s[0] < 0x80)
+		return 1;
+	if (s[0] < 0xc2 || s[0] > 0xf4)
+		return 0;
+	len = s[0] < 0xe0 ? 2 : s[0] < 0xf0 ? 3 : 4;
+	if (len > n)
+		return 0;
+	for (i = 1; i < len; i++)
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+
+	/* overlong forms, surrogates and code points past U+10FFFF */
+	if ((s[0] == 0xe0 && s[1] < 0xa0) || (s[0] == 0xed && s[1] >= 0xa0)
+			|| (s[0] == 0xf0 && s[1] < 0x90)
+			|| (s[0] == 0xf4 && s[1] >= 0x90))
+		return 0;
+
+	return len;
+}
+
+/*
+ * Up to max bytes of s, or until its NUL, as a JSON string.  Header fields
+ * are arbitrary bytes: anything that is not valid UTF-8 is written as
+ * \u00XX, so every line still parses.
+ */
+static inline void rkstats_json_strn(FILE *fp, const char *str, size_t max)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	size_t n = 0, len;
+
+	while (n < max && s[n])
+		n++;
+
+	fputc('"', fp);
+	while (n) {
+		unsigned char c = *s;
+
+		if ((len = rkstats_utf8_len(s, n)) == 0 || c < 0x20) {
+			fprintf(fp, "\\u%04x", c);
+			len = 1;
+		} else if (c == '"' || c == '\\') {
+			fprintf(fp, "\\%c", c);
+		} else {
+			fwrite(s, 1, len, fp);
+		}
+		s += len;
+		n -= len;
+	}
+	fputc('"', fp);
+}
+
+static inline void rkstats_json_string(FILE *fp, const char *s)
+{
+	rkstats_json_strn(fp, s, (size_t)-1);
+}
+
+static inline void rkstats_json_io(FILE *fp, const struct rkstats_io *io)
+{
+	fprintf(fp, "\"bytes_read\":%llu,\"bytes_written\":%llu,"
+			"\"read_syscalls\":%llu,\"write_syscalls\":%llu",
+			io->rchar, io->wchar, io->syscr, io->syscw);
+}
+
+static inline void rkstats_begin(const char *fmt, ...)
+{
+	struct rkstats_phase *ph;
+	va_list ap;
+
+	if (!rkstats.enabled)
+		return;
+
+	if (rkstats.depth >= RKSTATS_MAX_DEPTH) {
+		rkstats.overflow++;
+		return;
+	}
+
+	if (rkstats.num_phases >= RKSTATS_MAX_PHASES) {
+		rkstats.stack[rkstats.depth++] = -1;
+		return;
+	}
+
+	ph = &rkstats.phases[rkstats.num_phases];
+	va_start(ap, fmt);
+	vsnprintf(ph->name, sizeof(ph->name), fmt, ap);
+	va_end(ap);
+
+	ph->depth = rkstats.depth;
+	rkstats.stack[rkstats.depth++] = rkstats.num_phases++;
+	rkstats_read_io(&ph->io);
+	ph->start = rkstats_now();
+}
+
+/* Close the innermost phase; bytes is the payload it processed */
+static inline void rkstats_end(unsigned long long bytes)
+{
+	struct rkstats_phase *ph;
+	int idx;
+
+	if (!rkstats.enabled)
+		return;
+
+	if (rkstats.overflow) {
+		rkstats.overflow--;
+		return;
+	}
+
+	if (rkstats.depth == 0 || (idx = rkstats.stack[--rkstats.depth]) < 0)
+		return;
+
+	ph = &rkstats.phases[idx];
+	ph->elapsed = rkstats_now() - ph->start;
+	ph->bytes = bytes;
+	rkstats_io_delta(&ph->io, &ph->io);
+}
+
+static inline void rkstats_report(void)
+{
+	struct rkstats_io total;
+	struct rusage ru;
+	double wall;
+	int i;
+
+	/* close phases left open by an error path, io deltas included */
+	rkstats.overflow = 0;
+	while (rkstats.depth > 0)
+		rkstats_end(0);
+
+	wall = rkstats_now() - rkstats.start;
+	rkstats_io_delta(&total, &rkstats.io);
+	getrusage(RUSAGE_SELF, &ru);
+
+	fflush(stdout);
+	fprintf(stderr, "{\"tool\":");
+	rkstats_json_string(stderr, rkstats.tool);
+	fprintf(stderr, ",\"wall_s\":%.6f,", wall);
+	rkstats_json_io(stderr, &total);
+	fprintf(stderr, ",\"peak_rss_kb\":%ld,", ru.ru_maxrss);
+	if (rkstats.report)
+		rkstats.report(stderr);
+	fprintf(stderr, "\"phases\":[");
+
+	for (i = 0; i < rkstats.num_phases; i++) {
+		struct rkstats_phase *ph = &rkstats.phases[i];
+
+		fprintf(stderr, "%s{\"name\":", i ? "," : "");
+		rkstats_json_string(stderr, ph->name);
+		fprintf(stderr, ",\"depth\":%d,\"wall_s\":%.6f,\"bytes\":%llu,"
+				"\"throughput_mbs\":%.3f,", ph->depth, ph->elapsed,
+				ph->bytes, ph->elapsed > 0 ?
+				ph->bytes / ph->elapsed / 1e6 : 0.0);
+		rkstats_json_io(stderr, &ph->io);
+		fputc('}', stderr);
+	}
+
+	fprintf(stderr, "]}\n");
+}
+
+/*
+ * Strip --stats=json from the argument list so the tools' own parsers
+ * never see it.  Must be called first thing in main().
+ */
+static inline void rkstats_parse_args(int *argc, char **argv)
+{
+	const char *p = strrchr(argv[0], '/');
+	int i, j;
+
+	for (i = j = 1; i < *argc; i++) {
+		if (strcmp(argv[i], "--stats=json") == 0)
+			rkstats.enabled = 1;
+		else
+			argv[j++] = argv[i];
+	}
+	argv[j] = NULL;
+	*argc = j;
+
+	if (!rkstats.enabled)
+		return;
+
+	rkstats.tool = p ? p + 1 : argv[0];
+	rkstats.start = rkstats_now();
+	rkstats_read_io(&rkstats.io);
+	atexit(rkstats_report);
+}
+
+#endif // _RKSTATS_H
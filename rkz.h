@@ -0,0 +1,48 @@
+#ifndef _RKZ_H
+#define _RKZ_H
+
+#include <stdint.h>
+
+/*
+ * Seekable compressed RKAF container (afptool -compress / -decompress).
+ *
+ * The raw image is cut into frames at every part boundary and at least
+ * every frame_size bytes; each frame is deflated on its own (zlib format),
+ * stored as is when that doesn't help, or omitted when it is all zeros.
+ * The rkz_header at offset 0 points to a table of num_frames rkz_frame
+ * entries, sorted by raw_offset, at the end of the file.  Any byte range
+ * can be read by inflating only the frames that overlap it.  raw_crc is
+ * the RKAF crc trailer of the raw image.  All fields are little-endian.
+ */
+
+#define RKZ_MAGIC "RKZ1"
+#define RKZ_VERSION 1
+#define RKZ_FRAME_SIZE (4 << 20)
+
+enum {
+	RKZ_DEFLATE = 0,
+	RKZ_STORED = 1,
+	RKZ_ZERO = 2,
+};
+
+struct rkz_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t raw_length;	/* of the whole raw file */
+	uint64_t table_offset;
+	uint32_t num_frames;
+	uint32_t frame_size;	/* maximum raw_length of a frame */
+	uint32_t raw_crc;
+	uint32_t reserved;
+};
+
+struct rkz_frame {
+	uint64_t raw_offset;
+	uint64_t offset;	/* of the frame data in the container */
+	uint32_t raw_length;
+	uint32_t length;
+	uint32_t type;
+	uint32_t crc32;		/* zlib crc32 of the raw data */
+};
+
+#endif // _RKZ_H
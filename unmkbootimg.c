@@ -15,34 +15,43 @@
 ** limitations under the License.
 */
 
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-
-#include <openssl/sha.h>
+#include <limits.h>
+#include <stdint.h>
 
 #include "bootimg.h"
+#include "rkhash.h"
+#include "rkstats.h"
 
 static void *load_file(const char *fn, unsigned *_sz)
 {
     char *data;
     size_t sz;
-    long offset;
+    off_t offset;
     FILE *fd;
 
     data = 0;
     fd = fopen(fn, "rb");
     if(fd == 0) return 0;
 
-    if(fseek(fd, 0, SEEK_END) != 0) goto oops;
-    offset = ftell(fd);
+    if(fseeko(fd, 0, SEEK_END) != 0) goto oops;
+    offset = ftello(fd);
     if(offset < 0) goto oops;
+    if(offset > UINT_MAX) {
+        fprintf(stderr,"error: '%s' is %lld bytes, boot images are limited to %u\n",
+                fn, (long long)offset, UINT_MAX);
+        goto oops;
+    }
     sz = offset;
 
-    if(fseek(fd, 0, SEEK_SET) != 0) goto oops;
+    if(fseeko(fd, 0, SEEK_SET) != 0) goto oops;
 
     data = (char*) malloc(sz);
     if(data == 0) goto oops;
@@ -80,13 +89,14 @@ int usage(void)
             "       [ --ramdisk <filename> ]\n"
             "       [ --second <2ndbootloader-filename> ]\n"
             "       -i|--input <filename>\n"
+            "       [ --stats=json ]\n"
             );
     return 1;
 }
 
-static inline unsigned align(unsigned x, unsigned page_size)
+static inline uint64_t align(uint64_t x, unsigned page_size)
 {
-    return (x + (page_size - 1)) & ~(page_size - 1);
+    return (x + (page_size - 1)) & ~(uint64_t)(page_size - 1);
 }
 
 int main(int argc, char **argv)
@@ -99,14 +109,16 @@ int main(int argc, char **argv)
     char *ramdisk_fn = "ramdisk.cpio.gz";
     char *second_fn = "second_bootloader";
     char *bootimg = 0;
-    unsigned offset;
+    uint64_t offset;
 
-    SHA_CTX ctx;
-    unsigned char sha[SHA_DIGEST_LENGTH];
+    struct rksha1 ctx;
+    unsigned char sha[RKSHA1_DIGEST_LENGTH];
     void* kernel_data = 0;
     void* ramdisk_data = 0;
     void* second_data = 0;
 
+    rkstats_parse_args(&argc, argv);
+
     argc--;
     argv++;
 
@@ -136,7 +148,9 @@ int main(int argc, char **argv)
         return usage();
     }
 
+    rkstats_begin("load");
     file_data = load_file(bootimg, &file_size);
+    rkstats_end(file_size);
     if(file_data == 0) {
         fprintf(stderr,"error: could not load image '%s'\n", bootimg);
         return 1;
@@ -150,26 +164,41 @@ int main(int argc, char **argv)
         fprintf(stderr,"error: not an Android boot image\n");
         goto fail;
     }
+    if(hdr->page_size == 0 || (hdr->page_size & (hdr->page_size - 1)) != 0) {
+        fprintf(stderr,"error: invalid page size %u\n", hdr->page_size);
+        goto fail;
+    }
+    offset = hdr->page_size + align(hdr->kernel_size, hdr->page_size) +
+            align(hdr->ramdisk_size, hdr->page_size) + hdr->second_size;
+    if(offset > file_size) {
+        fprintf(stderr,"error: image truncated, sections end at %llu but file"
+                " is %u bytes\n", (unsigned long long)offset, file_size);
+        goto fail;
+    }
 
     if(hdr->kernel_size != 0) {
         offset = hdr->page_size;
+        rkstats_begin("extract:kernel");
         if (save_file(kernel_fn, (kernel_data = &((char *)file_data)[offset]),
             hdr->kernel_size) != hdr->kernel_size) {
             fprintf(stderr,"error: could not save kernel '%s'\n", kernel_fn);
             return 1;
         }
+        rkstats_end(hdr->kernel_size);
         printf("kernel written to '%s' (%d bytes)\n", kernel_fn,
             hdr->kernel_size);
     }
 
     if(hdr->ramdisk_size != 0) {
         offset = hdr->page_size + align(hdr->kernel_size, hdr->page_size);
+        rkstats_begin("extract:ramdisk");
         if (save_file(ramdisk_fn, (ramdisk_data = &((char *)file_data)[offset]),
             hdr->ramdisk_size) != hdr->ramdisk_size) {
             fprintf(stderr,"error: could not save ramdisk '%s'\n",
                 ramdisk_fn);
             return 1;
         }
+        rkstats_end(hdr->ramdisk_size);
         printf("ramdisk written to '%s' (%d bytes)\n", ramdisk_fn,
             hdr->ramdisk_size);
     }
@@ -177,39 +206,43 @@ int main(int argc, char **argv)
     if(hdr->second_size != 0) {
         offset = hdr->page_size + align(hdr->kernel_size, hdr->page_size) +
                 align(hdr->ramdisk_size, hdr->page_size);
+        rkstats_begin("extract:second");
         if (save_file(second_fn, (second_data = &((char *)file_data)[offset]),
             hdr->second_size) != hdr->second_size) {
             fprintf(stderr,"error: could not save second bootloader '%s'\n",
                 second_fn);
             return 1;
         }
+        rkstats_end(hdr->second_size);
         printf("second bootloader written to '%s' (%d bytes)\n",
             second_fn, hdr->second_size);
     }
 
     /* Ideally, we'd also check the SHA sums here */
-    SHA1_Init(&ctx);
-    SHA1_Update(&ctx, kernel_data, hdr->kernel_size);
-    SHA1_Update(&ctx, &hdr->kernel_size, sizeof(hdr->kernel_size));
-    SHA1_Update(&ctx, ramdisk_data, hdr->ramdisk_size);
-    SHA1_Update(&ctx, &hdr->ramdisk_size, sizeof(hdr->ramdisk_size));
-    SHA1_Update(&ctx, second_data, hdr->second_size);
-    SHA1_Update(&ctx, &hdr->second_size, sizeof(hdr->second_size));
+    rkstats_begin("sha1");
+    rksha1_init(&ctx);
+    rksha1_update(&ctx, kernel_data, hdr->kernel_size);
+    rksha1_update(&ctx, &hdr->kernel_size, sizeof(hdr->kernel_size));
+    rksha1_update(&ctx, ramdisk_data, hdr->ramdisk_size);
+    rksha1_update(&ctx, &hdr->ramdisk_size, sizeof(hdr->ramdisk_size));
+    rksha1_update(&ctx, second_data, hdr->second_size);
+    rksha1_update(&ctx, &hdr->second_size, sizeof(hdr->second_size));
     /* tags_addr, page_size, unused[2], name[], and cmdline[] */
-    SHA1_Update(&ctx, &hdr->tags_addr, 4 + 4 + 4 + 4 + 16 + 512);
-    SHA1_Final(sha, &ctx);
+    rksha1_update(&ctx, &hdr->tags_addr, 4 + 4 + 4 + 4 + 16 + 512);
+    rksha1_final(sha, &ctx);
+    rkstats_end((unsigned long long)hdr->kernel_size + hdr->ramdisk_size + hdr->second_size);
 
-    int idlen = (SHA_DIGEST_LENGTH > sizeof(hdr->id) ? sizeof(hdr->id) : SHA_DIGEST_LENGTH);
+    int idlen = (RKSHA1_DIGEST_LENGTH > sizeof(hdr->id) ? sizeof(hdr->id) : RKSHA1_DIGEST_LENGTH);
     int res = memcmp(hdr->id, sha, idlen);
 
-    if(res != 0 || idlen != SHA_DIGEST_LENGTH)
+    if(res != 0 || idlen != RKSHA1_DIGEST_LENGTH)
     {
         int i;
 	unsigned char *p = (unsigned char *) hdr->id;
 
     	printf("\nSHA1 HASH MISMATCH!\n");
     	printf("  Expected : ");
-    	for(i=0;i<SHA_DIGEST_LENGTH;++i)
+    	for(i=0;i<RKSHA1_DIGEST_LENGTH;++i)
     	  printf("%02x", sha[i]);
     	printf("\n  Got      : ");
     	for(i=0;i<idlen;++i)